@@ -3,7 +3,7 @@
 /*
 
 This is an implementation of the AES algorithm, specifically ECB and CBC mode.
-Block size can be chosen in aes.h - available choices are AES128, AES192, AES256.
+Only AES128 is supported.
 
 The implementation is verified against the test vectors in:
   National Institute of Standards and Technology Special Publication 800-38A 2001 ED
@@ -29,7 +29,6 @@ ECB-AES128
 
 NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
         You should pad the end of the string with zeros if this is not the case.
-        For AES192/256 the block size is proportionally larger.
 
 */
 
@@ -41,6 +40,12 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 #include <string.h> // CBC mode, for memset
 #include "aes.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAS_AESNI 1
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
 /*****************************************************************************/
 /* Defines:                                                                  */
 /*****************************************************************************/
@@ -48,22 +53,11 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 #define Nb 4
 #define BLOCKLEN 16 //Block length in bytes AES is 128b block only
 
-#if defined(AES256) && (AES256 == 1)
-    #define Nk 8
-    #define KEYLEN 32
-    #define Nr 14
-    #define keyExpSize 240
-#elif defined(AES192) && (AES192 == 1)
-    #define Nk 6
-    #define KEYLEN 24
-    #define Nr 12
-    #define keyExpSize 208
-#else
-    #define Nk 4        // The number of 32 bit words in a key.
-    #define KEYLEN 16   // Key length in bytes
-    #define Nr 10       // The number of rounds in AES Cipher.
-    #define keyExpSize 176
-#endif
+// Only AES128 is used by wmbus.
+#define Nk 4        // The number of 32 bit words in a key.
+#define KEYLEN 16   // Key length in bytes
+#define Nr 10       // The number of rounds in AES Cipher.
+#define keyExpSize AES_keyExpSize
 
 // jcallan@github points out that declaring Multiply as a function
 // reduces code size considerably with the Keil ARM compiler.
@@ -73,24 +67,6 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 #endif
 
 
-/*****************************************************************************/
-/* Private variables:                                                        */
-/*****************************************************************************/
-// state - array holding the intermediate results during decryption.
-typedef uint8_t state_t[4][4];
-static state_t* state;
-
-// The array that stores the round keys.
-static uint8_t RoundKey[keyExpSize];
-
-// The Key input to the AES Program
-static const uint8_t* Key;
-
-#if defined(CBC) && CBC
-  // Initial Vector used only for CBC mode
-  static uint8_t* Iv;
-#endif
-
 // The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
 // The numbers below can be computed dynamically trading ROM for RAM -
 // This can be useful in (embedded) bootloader applications, where ROM is often limited.
@@ -167,6 +143,14 @@ static const uint8_t Rcon[256] = {
   0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d };
 #endif
 
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+// state - array holding the intermediate results during encryption/decryption.
+// There is no global state, the state and round keys are passed along, thus
+// the functions are reentrant.
+typedef uint8_t state_t[4][4];
+
 /*****************************************************************************/
 /* Private functions:                                                        */
 /*****************************************************************************/
@@ -181,7 +165,7 @@ static uint8_t getSBoxInvert(uint8_t num)
 }
 
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states.
-static void KeyExpansion(void)
+static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
 {
   uint32_t i, k;
   uint8_t tempa[4]; // Used for the column/row operations
@@ -233,18 +217,6 @@ static void KeyExpansion(void)
 
       tempa[0] =  tempa[0] ^ Rcon[i/Nk];
     }
-#if defined(AES256) && (AES256 == 1)
-    if (i % Nk == 4)
-    {
-      // Function Subword()
-      {
-        tempa[0] = getSBoxValue(tempa[0]);
-        tempa[1] = getSBoxValue(tempa[1]);
-        tempa[2] = getSBoxValue(tempa[2]);
-        tempa[3] = getSBoxValue(tempa[3]);
-      }
-    }
-#endif
     RoundKey[i * 4 + 0] = RoundKey[(i - Nk) * 4 + 0] ^ tempa[0];
     RoundKey[i * 4 + 1] = RoundKey[(i - Nk) * 4 + 1] ^ tempa[1];
     RoundKey[i * 4 + 2] = RoundKey[(i - Nk) * 4 + 2] ^ tempa[2];
@@ -254,7 +226,7 @@ static void KeyExpansion(void)
 
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
-static void AddRoundKey(uint8_t round)
+static void AddRoundKey(uint8_t round, state_t* state, const uint8_t* RoundKey)
 {
   uint8_t i,j;
   for (i=0;i<4;++i)
@@ -268,7 +240,7 @@ static void AddRoundKey(uint8_t round)
 
 // The SubBytes Function Substitutes the values in the
 // state matrix with values in an S-box.
-static void SubBytes(void)
+static void SubBytes(state_t* state)
 {
   uint8_t i, j;
   for (i = 0; i < 4; ++i)
@@ -283,7 +255,7 @@ static void SubBytes(void)
 // The ShiftRows() function shifts the rows in the state to the left.
 // Each row is shifted with different offset.
 // Offset = Row number. So the first row is not shifted.
-static void ShiftRows(void)
+static void ShiftRows(state_t* state)
 {
   uint8_t temp;
 
@@ -317,7 +289,7 @@ static uint8_t xtime(uint8_t x)
 }
 
 // MixColumns function mixes the columns of the state matrix
-static void MixColumns(void)
+static void MixColumns(state_t* state)
 {
   uint8_t i;
   uint8_t Tmp,Tm,t;
@@ -355,7 +327,7 @@ static uint8_t Multiply(uint8_t x, uint8_t y)
 // MixColumns function mixes the columns of the state matrix.
 // The method used to multiply may be difficult to understand for the inexperienced.
 // Please use the references to gain more information.
-static void InvMixColumns(void)
+static void InvMixColumns(state_t* state)
 {
   int i;
   uint8_t a, b, c, d;
@@ -376,7 +348,7 @@ static void InvMixColumns(void)
 
 // The SubBytes Function Substitutes the values in the
 // state matrix with values in an S-box.
-static void InvSubBytes(void)
+static void InvSubBytes(state_t* state)
 {
   uint8_t i,j;
   for (i = 0; i < 4; ++i)
@@ -388,7 +360,7 @@ static void InvSubBytes(void)
   }
 }
 
-static void InvShiftRows(void)
+static void InvShiftRows(state_t* state)
 {
   uint8_t temp;
 
@@ -418,179 +390,361 @@ static void InvShiftRows(void)
 
 
 // Cipher is the main function that encrypts the PlainText.
-static void Cipher(void)
+static void Cipher(state_t* state, const uint8_t* RoundKey)
 {
   uint8_t round = 0;
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(0);
+  AddRoundKey(0, state, RoundKey);
 
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for (round = 1; round < Nr; ++round)
   {
-    SubBytes();
-    ShiftRows();
-    MixColumns();
-    AddRoundKey(round);
+    SubBytes(state);
+    ShiftRows(state);
+    MixColumns(state);
+    AddRoundKey(round, state, RoundKey);
   }
 
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  SubBytes();
-  ShiftRows();
-  AddRoundKey(Nr);
+  SubBytes(state);
+  ShiftRows(state);
+  AddRoundKey(Nr, state, RoundKey);
 }
 
-static void InvCipher(void)
+static void InvCipher(state_t* state, const uint8_t* RoundKey)
 {
   uint8_t round=0;
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(Nr);
+  AddRoundKey(Nr, state, RoundKey);
 
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for (round = (Nr - 1); round > 0; --round)
   {
-    InvShiftRows();
-    InvSubBytes();
-    AddRoundKey(round);
-    InvMixColumns();
+    InvShiftRows(state);
+    InvSubBytes(state);
+    AddRoundKey(round, state, RoundKey);
+    InvMixColumns(state);
   }
 
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  InvShiftRows();
-  InvSubBytes();
-  AddRoundKey(0);
+  InvShiftRows(state);
+  InvSubBytes(state);
+  AddRoundKey(0, state, RoundKey);
 }
 
-
 /*****************************************************************************/
-/* Public functions:                                                         */
+/* T-table implementation:                                                   */
 /*****************************************************************************/
-#if defined(ECB) && (ECB == 1)
+// Te[x] is the MixColumns column (02,01,01,03)*sbox[x] and Td[x] is the
+// InvMixColumns column (0e,09,0d,0b)*rsbox[x]. The tables for the other three
+// rows are rotations of these, rotating instead of storing four tables each
+// keeps the tables within 2KiB, which is kinder to the small caches on ARM.
 
+struct TTables
+{
+  uint32_t Te[256];
+  uint32_t Td[256];
 
-void AES_ECB_encrypt(const uint8_t* input, const uint8_t* key, uint8_t* output, const uint32_t length)
+  TTables()
+  {
+    for (int x = 0; x < 256; ++x)
+    {
+      uint8_t s = sbox[x];
+      Te[x] = ((uint32_t)xtime(s) << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | (uint32_t)(xtime(s) ^ s);
+      uint8_t r = rsbox[x];
+      Td[x] = ((uint32_t)Multiply(r, 0x0e) << 24) | ((uint32_t)Multiply(r, 0x09) << 16) |
+              ((uint32_t)Multiply(r, 0x0d) << 8) | (uint32_t)Multiply(r, 0x0b);
+    }
+  }
+};
+
+static const TTables ttables;
+
+static inline uint32_t ror32(uint32_t w, int n)
 {
-  // Copy input to output, and work in-memory on output
-  memcpy(output, input, length);
-  state = (state_t*)output;
+  return (w >> n) | (w << (32 - n));
+}
 
-  Key = key;
-  KeyExpansion();
+static inline uint32_t getWord(const uint8_t* p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
 
-  // The next function call encrypts the PlainText with the Key using AES algorithm.
-  Cipher();
+static inline void putWord(uint8_t* p, uint32_t w)
+{
+  p[0] = w >> 24; p[1] = w >> 16; p[2] = w >> 8; p[3] = w;
 }
 
-void AES_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *output, const uint32_t length)
+#define TE(a,b,c,d) (Te[(a) >> 24] ^ ror32(Te[((b) >> 16) & 0xff], 8) ^ \
+                     ror32(Te[((c) >> 8) & 0xff], 16) ^ ror32(Te[(d) & 0xff], 24))
+#define TD(a,b,c,d) (Td[(a) >> 24] ^ ror32(Td[((b) >> 16) & 0xff], 8) ^ \
+                     ror32(Td[((c) >> 8) & 0xff], 16) ^ ror32(Td[(d) & 0xff], 24))
+#define SB(box,a,b,c,d) (((uint32_t)box[(a) >> 24] << 24) ^ ((uint32_t)box[((b) >> 16) & 0xff] << 16) ^ \
+                         ((uint32_t)box[((c) >> 8) & 0xff] << 8) ^ (uint32_t)box[(d) & 0xff])
+
+static void CipherT(uint8_t* buf, const uint8_t* rk)
 {
-  // Copy input to output, and work in-memory on output
-  memcpy(output, input, length);
-  state = (state_t*)output;
+  const uint32_t* Te = ttables.Te;
+  uint32_t s0 = getWord(buf+0) ^ getWord(rk+0);
+  uint32_t s1 = getWord(buf+4) ^ getWord(rk+4);
+  uint32_t s2 = getWord(buf+8) ^ getWord(rk+8);
+  uint32_t s3 = getWord(buf+12) ^ getWord(rk+12);
+  uint32_t t0, t1, t2, t3;
+
+  for (int round = 1; round < Nr; ++round)
+  {
+    rk += 16;
+    t0 = TE(s0, s1, s2, s3) ^ getWord(rk+0);
+    t1 = TE(s1, s2, s3, s0) ^ getWord(rk+4);
+    t2 = TE(s2, s3, s0, s1) ^ getWord(rk+8);
+    t3 = TE(s3, s0, s1, s2) ^ getWord(rk+12);
+    s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+  }
+  rk += 16;
+  putWord(buf+0, SB(sbox, s0, s1, s2, s3) ^ getWord(rk+0));
+  putWord(buf+4, SB(sbox, s1, s2, s3, s0) ^ getWord(rk+4));
+  putWord(buf+8, SB(sbox, s2, s3, s0, s1) ^ getWord(rk+8));
+  putWord(buf+12, SB(sbox, s3, s0, s1, s2) ^ getWord(rk+12));
+}
 
-  // The KeyExpansion routine must be called before encryption.
-  Key = key;
-  KeyExpansion();
+// Uses the equivalent inverse cipher, which has the same structure as the cipher
+// but needs the round keys in reverse order with InvMixColumns applied to them.
+static void InvCipherT(uint8_t* buf, const uint8_t* dk)
+{
+  const uint32_t* Td = ttables.Td;
+  uint32_t s0 = getWord(buf+0) ^ getWord(dk+0);
+  uint32_t s1 = getWord(buf+4) ^ getWord(dk+4);
+  uint32_t s2 = getWord(buf+8) ^ getWord(dk+8);
+  uint32_t s3 = getWord(buf+12) ^ getWord(dk+12);
+  uint32_t t0, t1, t2, t3;
+
+  for (int round = 1; round < Nr; ++round)
+  {
+    dk += 16;
+    t0 = TD(s0, s3, s2, s1) ^ getWord(dk+0);
+    t1 = TD(s1, s0, s3, s2) ^ getWord(dk+4);
+    t2 = TD(s2, s1, s0, s3) ^ getWord(dk+8);
+    t3 = TD(s3, s2, s1, s0) ^ getWord(dk+12);
+    s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+  }
+  dk += 16;
+  putWord(buf+0, SB(rsbox, s0, s3, s2, s1) ^ getWord(dk+0));
+  putWord(buf+4, SB(rsbox, s1, s0, s3, s2) ^ getWord(dk+4));
+  putWord(buf+8, SB(rsbox, s2, s1, s0, s3) ^ getWord(dk+8));
+  putWord(buf+12, SB(rsbox, s3, s2, s1, s0) ^ getWord(dk+12));
+}
 
-  InvCipher();
+static void InvKeyExpansion(uint8_t* InvRoundKey, const uint8_t* RoundKey)
+{
+  const uint32_t* Td = ttables.Td;
+  for (int round = 0; round <= Nr; ++round)
+  {
+    const uint8_t* from = RoundKey + (Nr - round) * 16;
+    uint8_t* to = InvRoundKey + round * 16;
+    for (int c = 0; c < 16; c += 4)
+    {
+      uint32_t w = getWord(from + c);
+      if (round > 0 && round < Nr)
+      {
+        // Td includes rsbox, thus look up sbox first to get a plain InvMixColumns.
+        w = SB(sbox, w, w, w, w);
+        w = TD(w, w, w, w);
+      }
+      putWord(to + c, w);
+    }
+  }
 }
 
+/*****************************************************************************/
+/* AES-NI implementation:                                                    */
+/*****************************************************************************/
+#ifdef HAS_AESNI
 
-#endif // #if defined(ECB) && (ECB == 1)
+__attribute__((target("aes,sse2")))
+static void CipherNI(uint8_t* buf, const uint8_t* rk)
+{
+  __m128i s = _mm_loadu_si128((const __m128i*)buf);
+  s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i*)rk));
+  for (int round = 1; round < Nr; ++round)
+  {
+    s = _mm_aesenc_si128(s, _mm_loadu_si128((const __m128i*)(rk + round * 16)));
+  }
+  s = _mm_aesenclast_si128(s, _mm_loadu_si128((const __m128i*)(rk + Nr * 16)));
+  _mm_storeu_si128((__m128i*)buf, s);
+}
 
+__attribute__((target("aes,sse2")))
+static void InvCipherNI(uint8_t* buf, const uint8_t* dk)
+{
+  __m128i s = _mm_loadu_si128((const __m128i*)buf);
+  s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i*)dk));
+  for (int round = 1; round < Nr; ++round)
+  {
+    s = _mm_aesdec_si128(s, _mm_loadu_si128((const __m128i*)(dk + round * 16)));
+  }
+  s = _mm_aesdeclast_si128(s, _mm_loadu_si128((const __m128i*)(dk + Nr * 16)));
+  _mm_storeu_si128((__m128i*)buf, s);
+}
 
+static int hasAESNI(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("aes");
+}
 
+#else
 
+static int hasAESNI(void)
+{
+  return 0;
+}
 
-#if defined(CBC) && (CBC == 1)
+#endif
+
+static int defaultImplementation(void)
+{
+  if (hasAESNI()) return AES_IMPL_AESNI;
+  return AES_IMPL_TTABLE;
+}
 
+static int implementation = defaultImplementation();
 
-static void XorWithIv(uint8_t* buf)
+static void encryptBlock(const struct AES_ctx* ctx, uint8_t* buf)
 {
-  uint8_t i;
-  for (i = 0; i < BLOCKLEN; ++i) //WAS for(i = 0; i < KEYLEN; ++i) but the block in AES is always 128bit so 16 bytes!
+  switch (ctx->impl)
   {
-    buf[i] ^= Iv[i];
+#ifdef HAS_AESNI
+  case AES_IMPL_AESNI: CipherNI(buf, ctx->RoundKey); break;
+#endif
+  case AES_IMPL_TTABLE: CipherT(buf, ctx->RoundKey); break;
+  default: Cipher((state_t*)buf, ctx->RoundKey);
   }
 }
 
-void AES_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+static void decryptBlock(const struct AES_ctx* ctx, uint8_t* buf)
 {
-  uintptr_t i;
-  uint8_t extra = length % BLOCKLEN; /* Remaining bytes in the last non-full block */
-
-  // Skip the key expansion if key is passed as 0
-  if (0 != key)
+  switch (ctx->impl)
   {
-    Key = key;
-    KeyExpansion();
+#ifdef HAS_AESNI
+  case AES_IMPL_AESNI: InvCipherNI(buf, ctx->InvRoundKey); break;
+#endif
+  case AES_IMPL_TTABLE: InvCipherT(buf, ctx->InvRoundKey); break;
+  default: InvCipher((state_t*)buf, ctx->RoundKey);
   }
+}
 
-  if (iv != 0)
-  {
-    Iv = (uint8_t*)iv;
-  }
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
 
-  for (i = 0; i < length; i += BLOCKLEN)
-  {
-    XorWithIv(input);
-    memcpy(output, input, BLOCKLEN);
-    state = (state_t*)output;
-    Cipher();
-    Iv = output;
-    input += BLOCKLEN;
-    output += BLOCKLEN;
-    //printf("Step %d - %d", i/16, i);
-  }
+void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key)
+{
+  KeyExpansion(ctx->RoundKey, key);
+  InvKeyExpansion(ctx->InvRoundKey, ctx->RoundKey);
+  ctx->impl = implementation;
+}
 
-  if (extra)
-  {
-    memcpy(output, input, extra);
-    state = (state_t*)output;
-    Cipher();
-  }
+int AES_set_implementation(int impl)
+{
+  if (impl == AES_IMPL_AESNI && !hasAESNI()) return 0;
+  if (impl < AES_IMPL_REFERENCE || impl > AES_IMPL_AESNI) return 0;
+  implementation = impl;
+  return 1;
 }
 
-void AES_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+int AES_implementation(void)
 {
-  uintptr_t i;
-  uint8_t extra = length % BLOCKLEN; /* Remaining bytes in the last non-full block */
+  return implementation;
+}
 
-  // Skip the key expansion if key is passed as 0
-  if (0 != key)
+const char *AES_implementation_name(int impl)
+{
+  switch (impl)
   {
-    Key = key;
-    KeyExpansion();
+  case AES_IMPL_REFERENCE: return "reference";
+  case AES_IMPL_TTABLE: return "ttable";
+  case AES_IMPL_AESNI: return "aesni";
   }
+  return "?";
+}
+
+#if defined(ECB) && (ECB == 1)
+
+void AES_ECB_encrypt(const struct AES_ctx* ctx, uint8_t* buf)
+{
+  encryptBlock(ctx, buf);
+}
+
+void AES_ECB_decrypt(const struct AES_ctx* ctx, uint8_t* buf)
+{
+  decryptBlock(ctx, buf);
+}
+
+void AES_ECB_encrypt(const uint8_t* input, const uint8_t* key, uint8_t* output, const uint32_t length)
+{
+  struct AES_ctx ctx;
+  AES_init_ctx(&ctx, key);
+  // Copy input to output, and work in-memory on output
+  memcpy(output, input, length);
+  encryptBlock(&ctx, output);
+}
+
+void AES_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *output, const uint32_t length)
+{
+  struct AES_ctx ctx;
+  AES_init_ctx(&ctx, key);
+  // Copy input to output, and work in-memory on output
+  memcpy(output, input, length);
+  decryptBlock(&ctx, output);
+}
+
+#endif // #if defined(ECB) && (ECB == 1)
+
+
 
-  // If iv is passed as 0, we continue to encrypt without re-setting the Iv
-  if (iv != 0)
+#if defined(CBC) && (CBC == 1)
+
+
+static void XorWithIv(uint8_t* buf, const uint8_t* Iv)
+{
+  uint8_t i;
+  for (i = 0; i < BLOCKLEN; ++i) //WAS for(i = 0; i < KEYLEN; ++i) but the block in AES is always 128bit so 16 bytes!
   {
-    Iv = (uint8_t*)iv;
+    buf[i] ^= Iv[i];
   }
+}
 
-  for (i = 0; i < length; i += BLOCKLEN)
+void AES_CBC_encrypt_buffer(const struct AES_ctx* ctx, uint8_t* iv, uint8_t* buf, uint32_t length)
+{
+  uintptr_t i;
+  for (i = 0; i + BLOCKLEN <= length; i += BLOCKLEN)
   {
-    memcpy(output, input, BLOCKLEN);
-    state = (state_t*)output;
-    InvCipher();
-    XorWithIv(output);
-    Iv = input;
-    input += BLOCKLEN;
-    output += BLOCKLEN;
+    XorWithIv(buf, iv);
+    encryptBlock(ctx, buf);
+    memcpy(iv, buf, BLOCKLEN);
+    buf += BLOCKLEN;
   }
+}
 
-  if (extra)
+void AES_CBC_decrypt_buffer(const struct AES_ctx* ctx, uint8_t* iv, uint8_t* buf, uint32_t length)
+{
+  uintptr_t i;
+  uint8_t storeNextIv[BLOCKLEN];
+  for (i = 0; i + BLOCKLEN <= length; i += BLOCKLEN)
   {
-    memcpy(output, input, extra);
-    state = (state_t*)output;
-    InvCipher();
+    memcpy(storeNextIv, buf, BLOCKLEN);
+    decryptBlock(ctx, buf);
+    XorWithIv(buf, iv);
+    memcpy(iv, storeNextIv, BLOCKLEN);
+    buf += BLOCKLEN;
   }
 }
 
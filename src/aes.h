@@ -21,11 +21,47 @@
 #endif
 
 #define AES128 1
-//#define AES192 1
-//#define AES256 1
+
+#define AES_BLOCKLEN 16 // Block length in bytes, AES is 128b block only.
+#define AES_KEYLEN 16   // Key length in bytes.
+#define AES_keyExpSize 176
+
+// The block cipher implementations. The reference implementation is the
+// original byte oriented tiny-AES code. The T-table implementation merges
+// SubBytes, ShiftRows and MixColumns into table lookups on 32 bit words.
+// AES-NI uses the x86 aes instructions, when the cpu has them.
+#define AES_IMPL_REFERENCE 0
+#define AES_IMPL_TTABLE    1
+#define AES_IMPL_AESNI     2
+
+// An expanded key. Expand the key once with AES_init_ctx and then reuse the context
+// for every block. The context is not modified when encrypting/decrypting, thus
+// the same context can be used from several threads at the same time.
+struct AES_ctx
+{
+  uint8_t RoundKey[AES_keyExpSize];
+  // The equivalent inverse cipher key schedule, used by the fast decryption paths.
+  uint8_t InvRoundKey[AES_keyExpSize];
+  int impl;
+};
+
+void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key);
+
+// The implementation used by contexts initialized from now on. The fastest
+// available implementation is the default. Returns 0 if impl is not available
+// on this cpu, then the implementation is left unchanged.
+int AES_set_implementation(int impl);
+int AES_implementation(void);
+const char *AES_implementation_name(int impl);
 
 #if defined(ECB) && (ECB == 1)
 
+// Encrypt/decrypt a single 16 byte block in place.
+void AES_ECB_encrypt(const struct AES_ctx* ctx, uint8_t* buf);
+void AES_ECB_decrypt(const struct AES_ctx* ctx, uint8_t* buf);
+
+// Expands the key for every call, prefer the context versions above when
+// the same key is used more than once.
 void AES_ECB_encrypt(const uint8_t* input, const uint8_t* key, uint8_t *output, const uint32_t length);
 void AES_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *output, const uint32_t length);
 
@@ -34,8 +70,10 @@ void AES_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *output,
 
 #if defined(CBC) && (CBC == 1)
 
-void AES_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv);
-void AES_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv);
+// Encrypt/decrypt length bytes in place, length must be a multiple of AES_BLOCKLEN.
+// The iv is updated, so consecutive calls with the same iv continue the chain.
+void AES_CBC_encrypt_buffer(const struct AES_ctx* ctx, uint8_t* iv, uint8_t* buf, uint32_t length);
+void AES_CBC_decrypt_buffer(const struct AES_ctx* ctx, uint8_t* iv, uint8_t* buf, uint32_t length);
 
 #endif // #if defined(CBC) && (CBC == 1)
 
@@ -0,0 +1,510 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"capture.h"
+
+#include<algorithm>
+#include<errno.h>
+#include<fcntl.h>
+#include<inttypes.h>
+#include<memory>
+#include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/time.h>
+#include<unistd.h>
+
+using namespace std;
+
+static const char capture_magic_[8] = { 'W','M','B','U','S','C','A','P' };
+
+static void put16(vector<uchar> &b, uint16_t v)
+{
+    b.push_back(v & 0xff);
+    b.push_back(v >> 8);
+}
+
+static void put32(vector<uchar> &b, uint32_t v)
+{
+    put16(b, v & 0xffff);
+    put16(b, v >> 16);
+}
+
+static void put64(vector<uchar> &b, uint64_t v)
+{
+    put32(b, v & 0xffffffff);
+    put32(b, v >> 32);
+}
+
+static uint16_t get16(const uchar *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uchar *p)
+{
+    return get16(p) | ((uint32_t)get16(p+2) << 16);
+}
+
+static uint64_t get64(const uchar *p)
+{
+    return get32(p) | ((uint64_t)get32(p+4) << 32);
+}
+
+// The dll id 12345678 is stored as 78 56 34 12 in the frame, return it as 0x12345678.
+static uint32_t frameId(const uchar *frame, size_t len)
+{
+    if (len < 8) return 0;
+    return get32(frame+4);
+}
+
+// Returns the size of the record at p, or 0 if it is broken or truncated.
+static size_t recordSize(const uchar *p, size_t left)
+{
+    size_t size = 0;
+    if (left < 1) return 0;
+    switch (p[0])
+    {
+    case CAPTURE_RECEIVER:
+        if (left < 4) return 0;
+        size = 4 + p[3];
+        break;
+    case CAPTURE_TELEGRAM:
+        if (left < 16) return 0;
+        size = 16 + get16(p+14);
+        break;
+    case CAPTURE_INDEX:
+        if (left < 37) return 0;
+        size = 37 + 8*(size_t)get32(p+33);
+        break;
+    case CAPTURE_END:
+        size = 9;
+        break;
+    default:
+        return 0;
+    }
+    if (size > left) return 0;
+    return size;
+}
+
+// A capture that was closed properly ends with an END record directly after the last
+// INDEX record. Returns the offset of that index record, or 0 if the capture does not
+// end like that, eg when it was not closed or is being appended to.
+static uint64_t lastIndex(const uchar *data, size_t size)
+{
+    if (size < CAPTURE_HEADER_SIZE+9) return 0;
+    const uchar *end = data+size-9;
+    if (end[0] != CAPTURE_END) return 0;
+
+    uint64_t index = get64(end+1);
+    if (index < CAPTURE_HEADER_SIZE || index >= size-9 || data[index] != CAPTURE_INDEX) return 0;
+    // The index record must end exactly where the end record starts, otherwise
+    // the 4 was just the last byte of a telegram.
+    if (recordSize(data+index, size-9-index) != size-9-index) return 0;
+    return index;
+}
+
+CaptureWriter::CaptureWriter(string file) : file_(file)
+{
+    fd_ = ::open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ == -1)
+    {
+        error("Could not open capture file %s errno=%d\n", file.c_str(), errno);
+    }
+    struct stat st;
+    fstat(fd_, &st);
+    offset_ = st.st_size;
+
+    if (offset_ == 0)
+    {
+        buffer_.insert(buffer_.end(), capture_magic_, capture_magic_+8);
+        put16(buffer_, CAPTURE_VERSION);
+        buffer_.resize(CAPTURE_HEADER_SIZE, 0);
+        block_start_ = CAPTURE_HEADER_SIZE;
+        return;
+    }
+
+    CaptureReader reader;
+    if (!reader.open(file))
+    {
+        error("The file %s exists but is not a capture file.\n", file.c_str());
+    }
+
+    const uchar *data = reader.data();
+    uint64_t last = lastIndex(data, offset_);
+    if (last != 0)
+    {
+        // Closed properly, continue its index chain.
+        prev_index_ = last;
+        block_start_ = offset_;
+        return;
+    }
+
+    // Continue the index chain of the previous capture. If it was not closed properly,
+    // then find the telegrams after its last index, they go into the first index written now.
+    // A truncated last record is cut off.
+    uint64_t pos = CAPTURE_HEADER_SIZE;
+    block_start_ = pos;
+    while (pos < offset_)
+    {
+        size_t size = recordSize(data+pos, offset_-pos);
+        if (size == 0)
+        {
+            warning("(capture) cutting off broken capture %s at offset %" PRIu64 "\n", file.c_str(), pos);
+            if (ftruncate(fd_, pos) != 0)
+            {
+                error("Could not truncate capture file %s errno=%d\n", file.c_str(), errno);
+            }
+            offset_ = pos;
+            break;
+        }
+        const uchar *p = data+pos;
+        if (p[0] == CAPTURE_INDEX || p[0] == CAPTURE_END)
+        {
+            if (p[0] == CAPTURE_INDEX) prev_index_ = pos;
+            block_start_ = pos+size;
+            block_ids_.clear();
+            block_telegrams_ = 0;
+        }
+        else if (p[0] == CAPTURE_TELEGRAM)
+        {
+            uint64_t ts = get64(p+1);
+            if (block_telegrams_ == 0) first_us_ = ts;
+            last_us_ = ts;
+            block_telegrams_++;
+            block_ids_[frameId(p+16, get16(p+14))]++;
+        }
+        pos += size;
+    }
+    // The receivers are named again in the next block.
+    if (block_telegrams_ > 0) writeIndex();
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    close();
+}
+
+void CaptureWriter::write(AboutTelegram &about, int link_modes, vector<uchar> &frame)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    write(about, link_modes, frame, (uint64_t)tv.tv_sec*1000000+tv.tv_usec);
+}
+
+void CaptureWriter::write(AboutTelegram &about, int link_modes, vector<uchar> &frame, uint64_t timestamp_us)
+{
+    LOCK_CAPTURE(write);
+
+    if (fd_ == -1) return;
+    // An empty frame carries nothing to replay, it is not recorded.
+    if (frame.empty()) return;
+
+    uint16_t r;
+    auto i = receivers_.find(about.device);
+    if (i == receivers_.end())
+    {
+        r = receivers_.size();
+        receivers_[about.device] = r;
+        receiver_named_.push_back(false);
+    }
+    else
+    {
+        r = i->second;
+    }
+    if (!receiver_named_[r])
+    {
+        size_t len = min(about.device.length(), (size_t)255);
+        buffer_.push_back(CAPTURE_RECEIVER);
+        put16(buffer_, r);
+        buffer_.push_back(len);
+        buffer_.insert(buffer_.end(), about.device.begin(), about.device.begin()+len);
+        receiver_named_[r] = true;
+    }
+
+    size_t len = min(frame.size(), (size_t)0xffff);
+    int rssi = max(-128, min(127, about.rssi_dbm));
+    buffer_.push_back(CAPTURE_TELEGRAM);
+    put64(buffer_, timestamp_us);
+    put16(buffer_, r);
+    buffer_.push_back((uchar)(int8_t)rssi);
+    put16(buffer_, link_modes);
+    put16(buffer_, len);
+    buffer_.insert(buffer_.end(), frame.begin(), frame.begin()+len);
+
+    if (block_telegrams_ == 0) first_us_ = timestamp_us;
+    last_us_ = timestamp_us;
+    block_telegrams_++;
+    block_ids_[frameId(&frame[0], len)]++;
+
+    if (block_telegrams_ >= CAPTURE_INDEX_BLOCK_SIZE) writeIndex();
+    if (buffer_.size() >= 64*1024) writeBuffer();
+}
+
+void CaptureWriter::writeIndex()
+{
+    if (block_telegrams_ == 0) return;
+
+    uint64_t index = offset_+buffer_.size();
+    buffer_.push_back(CAPTURE_INDEX);
+    put64(buffer_, block_start_);
+    put64(buffer_, prev_index_);
+    put64(buffer_, first_us_);
+    put64(buffer_, last_us_);
+    put32(buffer_, block_ids_.size());
+    for (auto &p : block_ids_)
+    {
+        put32(buffer_, p.first);
+        put32(buffer_, p.second);
+    }
+    prev_index_ = index;
+    block_start_ = offset_+buffer_.size();
+    block_telegrams_ = 0;
+    block_ids_.clear();
+    std::fill(receiver_named_.begin(), receiver_named_.end(), false);
+}
+
+void CaptureWriter::writeBuffer()
+{
+    size_t written = 0;
+    while (written < buffer_.size())
+    {
+        ssize_t n = ::write(fd_, &buffer_[written], buffer_.size()-written);
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+            warning("(capture) could not write to %s errno=%d, %zu bytes lost\n",
+                    file_.c_str(), errno, buffer_.size()-written);
+            break;
+        }
+        written += n;
+    }
+    offset_ += written;
+    buffer_.clear();
+}
+
+void CaptureWriter::flush()
+{
+    LOCK_CAPTURE(flush);
+
+    if (fd_ == -1) return;
+    writeBuffer();
+}
+
+void CaptureWriter::close()
+{
+    LOCK_CAPTURE(close);
+
+    if (fd_ == -1) return;
+
+    bool dirty = buffer_.size() > 0 || block_telegrams_ > 0;
+    writeIndex();
+    if (dirty && prev_index_ != 0)
+    {
+        buffer_.push_back(CAPTURE_END);
+        put64(buffer_, prev_index_);
+    }
+    writeBuffer();
+    ::close(fd_);
+    fd_ = -1;
+}
+
+CaptureReader::~CaptureReader()
+{
+    if (mapped_) munmap((void*)data_, size_);
+}
+
+bool CaptureReader::open(string file)
+{
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= CAPTURE_HEADER_SIZE)
+    {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED)
+        {
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            data_ = (const uchar*)m;
+            size_ = st.st_size;
+            mapped_ = true;
+        }
+    }
+    ::close(fd);
+    return mapped_ && isCapture();
+}
+
+bool CaptureReader::isCapture()
+{
+    return size_ >= CAPTURE_HEADER_SIZE &&
+        !memcmp(data_, capture_magic_, 8) &&
+        get16(data_+8) <= CAPTURE_VERSION;
+}
+
+bool CaptureReader::scan(uint64_t from, uint64_t to, function<bool(CaptureRecord&)> cb)
+{
+    map<uint16_t,string> receivers;
+    CaptureRecord rec;
+    uint64_t pos = from;
+
+    while (pos < to)
+    {
+        const uchar *p = data_+pos;
+        size_t size = recordSize(p, to-pos);
+        if (size == 0) return false;
+
+        if (p[0] == CAPTURE_RECEIVER)
+        {
+            receivers[get16(p+1)] = string((const char*)p+4, p[3]);
+        }
+        else if (p[0] == CAPTURE_TELEGRAM)
+        {
+            rec.offset = pos;
+            rec.timestamp_us = get64(p+1);
+            rec.receiver = receivers[get16(p+9)];
+            rec.rssi_dbm = (int8_t)p[11];
+            rec.link_modes = get16(p+12);
+            rec.len = get16(p+14);
+            rec.frame = p+16;
+            rec.id = frameId(rec.frame, rec.len);
+            if (!cb(rec)) return true;
+        }
+        pos += size;
+    }
+    return true;
+}
+
+bool CaptureReader::forEach(function<bool(CaptureRecord&)> cb)
+{
+    if (!isCapture()) return false;
+    return scan(CAPTURE_HEADER_SIZE, size_, cb);
+}
+
+bool CaptureReader::indexOffsets(vector<uint64_t> *indexes)
+{
+    uint64_t index = lastIndex(data_, size_);
+    if (index == 0) return false;
+
+    while (index != 0)
+    {
+        if (index >= size_ || data_[index] != CAPTURE_INDEX || recordSize(data_+index, size_-index) == 0)
+        {
+            return false;
+        }
+        indexes->push_back(index);
+        uint64_t prev = get64(data_+index+9);
+        if (prev >= index) return false;
+        index = prev;
+    }
+    reverse(indexes->begin(), indexes->end());
+
+    // Every block starts where the previous index, or the end record after it, ends.
+    uint64_t end = CAPTURE_HEADER_SIZE;
+    for (uint64_t index : *indexes)
+    {
+        uint64_t block_start = get64(data_+index+1);
+        if (block_start != end && block_start != end+9) return false;
+        end = index+recordSize(data_+index, size_-index);
+    }
+    return true;
+}
+
+bool CaptureReader::find(uint32_t id, uint64_t from_us, uint64_t to_us, function<bool(CaptureRecord&)> cb)
+{
+    return findBlocks(&id, from_us, to_us, cb);
+}
+
+bool CaptureReader::find(uint64_t from_us, uint64_t to_us, function<bool(CaptureRecord&)> cb)
+{
+    return findBlocks(NULL, from_us, to_us, cb);
+}
+
+bool CaptureReader::findBlocks(const uint32_t *id, uint64_t from_us, uint64_t to_us, function<bool(CaptureRecord&)> cb)
+{
+    if (!isCapture()) return false;
+
+    bool stopped = false;
+    auto filter = [&](CaptureRecord &rec)
+        {
+            if ((id && rec.id != *id) || rec.timestamp_us < from_us || rec.timestamp_us > to_us) return true;
+            stopped = !cb(rec);
+            return !stopped;
+        };
+
+    vector<uint64_t> indexes;
+    if (!indexOffsets(&indexes))
+    {
+        // Not closed properly, read all of it.
+        return scan(CAPTURE_HEADER_SIZE, size_, filter);
+    }
+
+    for (uint64_t index : indexes)
+    {
+        const uchar *p = data_+index;
+        uint64_t block_start = get64(p+1);
+        uint64_t first_us = get64(p+17);
+        uint64_t last_us = get64(p+25);
+        uint32_t n = get32(p+33);
+        if (last_us < from_us || first_us > to_us) continue;
+
+        bool found = id == NULL;
+        for (uint32_t i=0; i<n && !found; ++i)
+        {
+            found = get32(p+37+8*i) == *id;
+        }
+        if (!found) continue;
+
+        if (block_start > index || !scan(block_start, index, filter)) return false;
+        if (stopped) break;
+    }
+    return true;
+}
+
+bool isCaptureFile(const char *file)
+{
+    // Do not open ttys or fifos.
+    struct stat st;
+    if (stat(file, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+    int fd = ::open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    char header[8];
+    ssize_t n = read(fd, header, sizeof(header));
+    ::close(fd);
+    return n == sizeof(header) && !memcmp(header, capture_magic_, sizeof(header));
+}
+
+static unique_ptr<CaptureWriter> capture_writer_;
+
+void setCapture(string file)
+{
+    if (file != "")
+    {
+        capture_writer_ = unique_ptr<CaptureWriter>(new CaptureWriter(file));
+    }
+    else
+    {
+        capture_writer_.reset();
+    }
+}
+
+CaptureWriter *captureWriter()
+{
+    return capture_writer_.get();
+}
@@ -0,0 +1,150 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include"threads.h"
+#include"util.h"
+#include"wmbus.h"
+
+#include<functional>
+#include<map>
+#include<stdint.h>
+#include<string>
+#include<vector>
+
+// A binary append only capture of the received telegrams, written with --capture=<file>.
+//
+// The file starts with a 16 byte header: "WMBUSCAP", a u16 version and 6 reserved bytes.
+// Then follows the records, all numbers are little endian:
+//
+// RECEIVER 1 u16 receiver u8 len name[len]
+//          Names the receiver before its first telegram in every index block.
+// TELEGRAM 2 u64 timestamp_us u16 receiver i8 rssi_dbm u16 link_modes u16 len frame[len]
+//          The timestamp is microseconds since the epoch, link_modes are the LinkModeBits
+//          the receiver listened to.
+// INDEX    3 u64 block_start u64 prev_index u64 first_us u64 last_us u32 n (u32 id u32 count)[n]
+//          Written after every CAPTURE_INDEX_BLOCK_SIZE telegrams and when the capture is closed.
+//          Lists the meter ids of the telegrams between block_start and this index record.
+//          The ids are the dll a-field ids as a number, eg 0x12345678 for id 12345678.
+// END      4 u64 last_index
+//          Written when the capture is closed, directly after the last index record.
+//          A reader can then follow the prev_index chain backwards from the end of the file,
+//          and skip the blocks it does not need.
+
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 16
+#define CAPTURE_INDEX_BLOCK_SIZE 4096
+
+enum CaptureRecordType
+{
+    CAPTURE_RECEIVER = 1,
+    CAPTURE_TELEGRAM = 2,
+    CAPTURE_INDEX = 3,
+    CAPTURE_END = 4
+};
+
+struct CaptureWriter
+{
+    // Appends to the file if it already is a capture.
+    CaptureWriter(std::string file);
+    ~CaptureWriter();
+
+    void write(AboutTelegram &about, int link_modes, std::vector<uchar> &frame);
+    void write(AboutTelegram &about, int link_modes, std::vector<uchar> &frame, uint64_t timestamp_us);
+    // Write the buffered records to the file.
+    void flush();
+    // Write the last index and the end record, then close the file.
+    void close();
+
+private:
+
+    void writeIndex();
+    void writeBuffer();
+
+    std::string file_;
+    int fd_ = -1;
+    uint64_t offset_ {}; // The file offset of the next record.
+    uint64_t block_start_ {};
+    uint64_t prev_index_ {};
+    uint64_t first_us_ {};
+    uint64_t last_us_ {};
+    size_t block_telegrams_ {};
+    std::map<uint32_t,uint32_t> block_ids_;
+    std::map<std::string,uint16_t> receivers_;
+    std::vector<bool> receiver_named_; // Named in this block.
+    std::vector<uchar> buffer_;
+
+    RecursiveMutex mutex_ = { "capture_mutex" };
+#define LOCK_CAPTURE(where) WITH(mutex_, where)
+};
+
+struct CaptureRecord
+{
+    uint64_t offset {}; // The file offset of the record.
+    uint64_t timestamp_us {};
+    std::string receiver;
+    int rssi_dbm {};
+    int link_modes {};
+    uint32_t id {}; // The dll id of the frame, 0 if the frame is too short.
+    const uchar *frame {};
+    size_t len {};
+};
+
+struct CaptureReader
+{
+    // Read a capture already in memory.
+    CaptureReader(const char *data, size_t size) : data_((const uchar*)data), size_(size) {}
+    CaptureReader() {}
+    ~CaptureReader();
+
+    // Memory map the file, returns false if it is not a capture.
+    bool open(std::string file);
+    bool isCapture();
+    const uchar *data() { return data_; }
+    size_t size() { return size_; }
+    // Invoke cb for every telegram in the capture, stop when cb returns false.
+    // Returns false if the capture is truncated or broken.
+    bool forEach(std::function<bool(CaptureRecord&)> cb);
+    // Invoke cb for the telegrams from id received within [from_us,to_us]. The index blocks
+    // are used to skip blocks without the id, when the capture was closed properly.
+    bool find(uint32_t id, uint64_t from_us, uint64_t to_us, std::function<bool(CaptureRecord&)> cb);
+    // Invoke cb for the telegrams from any id received within [from_us,to_us].
+    bool find(uint64_t from_us, uint64_t to_us, std::function<bool(CaptureRecord&)> cb);
+
+private:
+
+    // A NULL id matches all ids.
+    bool findBlocks(const uint32_t *id, uint64_t from_us, uint64_t to_us, std::function<bool(CaptureRecord&)> cb);
+    bool scan(uint64_t from, uint64_t to, std::function<bool(CaptureRecord&)> cb);
+    bool indexOffsets(std::vector<uint64_t> *indexes);
+
+    const uchar *data_ {};
+    size_t size_ {};
+    bool mapped_ {};
+};
+
+// Check if the file starts with the capture header.
+bool isCaptureFile(const char *file);
+
+// Capture all received telegrams into file, an empty file stops the capture.
+void setCapture(std::string file);
+// Returns NULL when not capturing.
+CaptureWriter *captureWriter();
+
+#endif
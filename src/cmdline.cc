@@ -15,6 +15,7 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include"capture.h"
 #include"cmdline.h"
 #include"meters.h"
 #include"util.h"
@@ -184,10 +185,22 @@ shared_ptr<Configuration> parseCommandLine(int argc, char **argv) {
                     i++;
                     continue;
                 }
+                if (c->bulk && isCaptureFile(argv[i]))
+                {
+                    c->bulk_files.push_back(argv[i]);
+                    i++;
+                    continue;
+                }
                 break;
             }
+            if (c->bulk && argv[i]) {
+                error("Not a capture file \"%s\"\n", argv[i]);
+            }
             if (i+1 < argc) {
-                error("Usage error: --useconfig can only be followed by --device= and --listento=\n");
+                error("Usage error: --useconfig can only be followed by --device= and --listento= (or capture files with --bulk)\n");
+            }
+            if (c->bulk && c->bulk_files.size() == 0) {
+                error("You must supply capture files to decode with --bulk\n");
             }
             return shared_ptr<Configuration>(c);
             continue;
@@ -330,6 +343,13 @@ shared_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--flushfiles=", 13)) {
+            if (!parseFlushFiles(argv[i]+13, &c->flushfiles_ms, &c->flushfiles_bytes)) {
+                error("Not a valid flush policy for files \"%s\"\n", argv[i]+13);
+            }
+            i++;
+            continue;
+        }
         if (!strcmp(argv[i], "--meterfiles") ||
             (!strncmp(argv[i], "--meterfiles", 12) &&
              strlen(argv[i]) > 12 &&
@@ -366,8 +386,27 @@ shared_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             i++;
             continue;
         }
-        if (!strncmp(argv[i], "--ignoreduplicates", 18)) {
-            c->ignore_duplicate_telegrams = true;
+        if (!strncmp(argv[i], "--ignoreduplicates=", 19)) {
+            if (strlen(argv[i]) == 19) {
+                error("You must supply a time to ignore duplicates within.\n");
+            }
+            c->ignore_duplicates_window = parseTime(argv[i]+19);
+            if (c->ignore_duplicates_window <= 0) {
+                error("Not a valid time to ignore duplicates within. \"%s\"\n", argv[i]+19);
+            }
+            i++;
+            continue;
+        }
+        if (!strcmp(argv[i], "--ignoreduplicates")) {
+            c->ignore_duplicates_window = DEFAULT_DUPLICATE_WINDOW_SECONDS;
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--duplicatecachesize=", 21) && strlen(argv[i]) > 21) {
+            c->duplicate_cache_size = atoi(argv[i]+21);
+            if (c->duplicate_cache_size <= 0) {
+                error("Not a valid duplicate cache size. \"%s\"\n", argv[i]+21);
+            }
             i++;
             continue;
         }
@@ -385,6 +424,15 @@ shared_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--shellpipe=", 12)) {
+            string cmd = string(argv[i]+12);
+            if (cmd == "") {
+                error("The shell pipe command cannot be empty.\n");
+            }
+            c->telegram_shellpipes.push_back(cmd);
+            i++;
+            continue;
+        }
         if (!strncmp(argv[i], "--alarmshell=", 13)) {
             string cmd = string(argv[i]+13);
             if (cmd == "") {
@@ -457,6 +505,103 @@ shared_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--combinetelegrams=", 19) && strlen(argv[i]) > 19) {
+            c->combine_telegrams_ms = parseTimeMs(argv[i]+19);
+            if (c->combine_telegrams_ms <= 0) {
+                error("Not a valid time to combine telegrams within. \"%s\"\n", argv[i]+19);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--capture=", 10) && strlen(argv[i]) > 10) {
+            c->capture_file = string(argv[i]+10);
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--dumpcapture=", 14) && strlen(argv[i]) > 14) {
+            c->dump_capture = string(argv[i]+14);
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--dumpid=", 9) && strlen(argv[i]) > 9) {
+            c->dump_capture_id = string(argv[i]+9);
+            if (c->dump_capture_id.length() != 8 || !isValidId(c->dump_capture_id, true)) {
+                error("Not a valid meter id to dump \"%s\"\n", argv[i]+9);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--dumpfrom=", 11)) {
+            if (!parseDateTime(argv[i]+11, &c->dump_capture_from)) {
+                error("Not a valid time to dump from \"%s\", use eg 2020-02-08 or 2020-02-08T13:45:00\n", argv[i]+11);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--dumpto=", 9)) {
+            if (!parseDateTime(argv[i]+9, &c->dump_capture_to)) {
+                error("Not a valid time to dump to \"%s\", use eg 2020-02-08 or 2020-02-08T13:45:00\n", argv[i]+9);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--timeseries=", 13) && strlen(argv[i]) > 13) {
+            c->timeseries_dir = string(argv[i]+13);
+            if (!checkIfDirExists(c->timeseries_dir.c_str())) {
+                error("Cannot write time series into dir \"%s\"\n", c->timeseries_dir.c_str());
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--stats=", 8) && strlen(argv[i]) > 8) {
+            c->stats_dir = string(argv[i]+8);
+            if (!checkIfDirExists(c->stats_dir.c_str())) {
+                error("Cannot write statistics into dir \"%s\"\n", c->stats_dir.c_str());
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--dumptimeseries=", 17) && strlen(argv[i]) > 17) {
+            c->dump_timeseries = string(argv[i]+17);
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--bulk=", 7) && strlen(argv[i]) > 7) {
+            c->bulk = true;
+            c->bulk_threads = atoi(argv[i]+7);
+            if (c->bulk_threads <= 0 || c->bulk_threads > 256) {
+                error("Not a valid number of bulk decode threads. \"%s\"\n", argv[i]+7);
+            }
+            i++;
+            continue;
+        }
+        if (!strcmp(argv[i], "--bulk")) {
+            c->bulk = true;
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--replay=", 9) && strlen(argv[i]) > 9) {
+            char *end;
+            c->replay_speed = strtod(argv[i]+9, &end);
+            if (c->replay_speed <= 0 || (*end != 0 && strcmp(end, "x"))) {
+                error("Not a valid replay speed. \"%s\"\n", argv[i]+9);
+            }
+            i++;
+            continue;
+        }
+        if (!strcmp(argv[i], "--replay")) {
+            c->replay_speed = 0;
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--decodethreads=", 16) && strlen(argv[i]) > 16) {
+            c->decodethreads = atoi(argv[i]+16);
+            if (c->decodethreads <= 0 || c->decodethreads > 64) {
+                error("Not a valid number of decode threads. \"%s\"\n", argv[i]+16);
+            }
+            i++;
+            continue;
+        }
         if (!strncmp(argv[i], "--alarmtimeout=", 15)) {
             c->alarm_timeout = parseTime(argv[i]+15);
             if (c->alarm_timeout <= 0) {
@@ -483,7 +628,21 @@ shared_ptr<Configuration> parseCommandLine(int argc, char **argv) {
         error("Unknown option \"%s\"\n", argv[i]);
     }
 
-    while (argv[i])
+    if (c->bulk)
+    {
+        // The capture files to decode replace the devices.
+        while (argv[i] && isCaptureFile(argv[i]))
+        {
+            c->bulk_files.push_back(argv[i]);
+            i++;
+        }
+        if (c->bulk_files.size() == 0)
+        {
+            error("You must supply capture files to decode with --bulk\n");
+        }
+    }
+
+    while (argv[i] && !c->bulk)
     {
         bool ok = handleDevice(c, argv[i]);
         if (!ok)
@@ -505,7 +664,10 @@ shared_ptr<Configuration> parseCommandLine(int argc, char **argv) {
         c->use_auto_device_detect == false &&
         !c->list_shell_envs &&
         !c->list_fields &&
-        !c->list_meters)
+        !c->list_meters &&
+        c->dump_capture == "" &&
+        c->dump_timeseries == "" &&
+        !c->bulk)
     {
         error("You must supply at least one device (eg auto:c1) to receive wmbus telegrams.\n");
     }
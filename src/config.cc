@@ -17,11 +17,18 @@
 
 #include"config.h"
 #include"meters.h"
+#include"sha256.h"
+#include"threads.h"
 #include"units.h"
+#include"version.h"
 
+#include<algorithm>
+#include<fcntl.h>
 #include<vector>
 #include<string>
 #include<string.h>
+#include<sys/stat.h>
+#include<unistd.h>
 
 using namespace std;
 
@@ -46,7 +53,7 @@ pair<string,string> getNextKeyValue(vector<char> &buf, vector<char>::iterator &i
     return { "", "" };
 }
 
-void parseMeterConfig(Configuration *c, vector<char> &buf, string file)
+bool parseMeterConfig(MeterInfo *mi, vector<char> &buf, string file)
 {
     auto i = buf.begin();
     string name;
@@ -73,7 +80,7 @@ void parseMeterConfig(Configuration *c, vector<char> &buf, string file)
             {
                 // Oups, names are not allowed to contain the :
                 warning("Found invalid meter name \"%s\" in meter config file, must not contain a ':', skipping meter.\n", name.c_str());
-                return;
+                return false;
             }
             name = p.second;
         }
@@ -155,10 +162,262 @@ void parseMeterConfig(Configuration *c, vector<char> &buf, string file)
         use = false;
     }
     if (use) {
-        c->meters.push_back(MeterInfo(name, type, id, key, modes, telegram_shells, jsons));
+        *mi = MeterInfo(name, type, id, key, modes, telegram_shells, jsons);
     }
 
-    return;
+    return use;
+}
+
+int startupThreads(size_t num_meters)
+{
+    // The debug output from several threads would be interleaved.
+    if (num_meters < PARALLEL_STARTUP_MIN_METERS || isDebugEnabled()) return 1;
+    int n = sysconf(_SC_NPROCESSORS_ONLN);
+    return max(1, min(n, MAX_STARTUP_THREADS));
+}
+
+#define SNAPSHOT_MAGIC "WMBCSNP1"
+
+struct SnapshotFile
+{
+    string name;
+    uint64_t size {};
+    uint64_t mtime_ns {};
+    uint64_t ino {};
+};
+
+static bool statSnapshotFile(string dir, string name, SnapshotFile *sf)
+{
+    struct stat st;
+    string file = dir+"/"+name;
+    if (stat(file.c_str(), &st) != 0) return false;
+    sf->name = name;
+    sf->size = st.st_size;
+#if defined(__APPLE__) && defined(__MACH__)
+    sf->mtime_ns = st.st_mtimespec.tv_sec*1000000000ULL + st.st_mtimespec.tv_nsec;
+#else
+    sf->mtime_ns = st.st_mtim.tv_sec*1000000000ULL + st.st_mtim.tv_nsec;
+#endif
+    sf->ino = st.st_ino;
+    return true;
+}
+
+static void put32(vector<uchar> &b, uint32_t v)
+{
+    for (int i=0; i<4; ++i) b.push_back(v >> (8*i));
+}
+
+static void put64(vector<uchar> &b, uint64_t v)
+{
+    put32(b, v & 0xffffffff);
+    put32(b, v >> 32);
+}
+
+static void putString(vector<uchar> &b, const string &s)
+{
+    put32(b, s.length());
+    b.insert(b.end(), s.begin(), s.end());
+}
+
+static void putStrings(vector<uchar> &b, const vector<string> &v)
+{
+    put32(b, v.size());
+    for (auto &s : v) putString(b, s);
+}
+
+// Reads from the snapshot, a read beyond the end sets overrun and returns zeroes.
+struct SnapshotReader
+{
+    const uchar *pos;
+    const uchar *end;
+    bool overrun {};
+
+    SnapshotReader(const uchar *p, const uchar *e) : pos(p), end(e) {}
+
+    uint32_t get32()
+    {
+        if (end-pos < 4) { overrun = true; pos = end; return 0; }
+        uint32_t v = pos[0] | pos[1] << 8 | pos[2] << 16 | (uint32_t)pos[3] << 24;
+        pos += 4;
+        return v;
+    }
+
+    uint64_t get64()
+    {
+        uint64_t lo = get32();
+        return lo | ((uint64_t)get32()) << 32;
+    }
+
+    string getString()
+    {
+        uint32_t len = get32();
+        if ((size_t)(end-pos) < len) { overrun = true; pos = end; return ""; }
+        string s((const char*)pos, len);
+        pos += len;
+        return s;
+    }
+
+    vector<string> getStrings()
+    {
+        vector<string> v;
+        uint32_t n = get32();
+        for (uint32_t i=0; i<n && !overrun; ++i) v.push_back(getString());
+        return v;
+    }
+};
+
+// The snapshot is valid for this build of wmbusmeters and this meter dir, as
+// long as the meter files are listed in the same order and have the same size,
+// modification time and inode as when the snapshot was written.
+static string snapshotSignature(string dir)
+{
+    return string(VERSION " " COMMIT " ")+dir;
+}
+
+static bool loadConfigSnapshot(string snapshot, string dir, vector<string> &files, vector<MeterInfo> *meters)
+{
+    vector<char> buf;
+    struct stat st;
+    // Loading warns about a missing file, but there is no snapshot before the first start.
+    if (stat(snapshot.c_str(), &st) != 0 || !loadFile(snapshot, &buf)) return false;
+    size_t header = strlen(SNAPSHOT_MAGIC)+SHA256_HASH_SIZE;
+    if (buf.size() < header || memcmp(&buf[0], SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)))
+    {
+        warning("(config) ignoring invalid config snapshot %s\n", snapshot.c_str());
+        return false;
+    }
+    const uchar *data = (const uchar*)&buf[0];
+    SHA256_HASH hash;
+    Sha256Calculate(data+header, buf.size()-header, &hash);
+    if (memcmp(hash.bytes, data+strlen(SNAPSHOT_MAGIC), SHA256_HASH_SIZE))
+    {
+        warning("(config) ignoring corrupt config snapshot %s\n", snapshot.c_str());
+        return false;
+    }
+
+    SnapshotReader r(data+header, data+buf.size());
+    if (r.getString() != snapshotSignature(dir)) return false;
+    if (r.get32() != files.size()) return false;
+    for (auto &f : files)
+    {
+        SnapshotFile now;
+        if (!statSnapshotFile(dir, f, &now)) return false;
+        if (r.getString() != now.name ||
+            r.get64() != now.size ||
+            r.get64() != now.mtime_ns ||
+            r.get64() != now.ino)
+        {
+            debug("(config) config snapshot is stale, %s has changed\n", f.c_str());
+            return false;
+        }
+    }
+    vector<MeterInfo> loaded;
+    uint32_t n = r.get32();
+    for (uint32_t i=0; i<n && !r.overrun; ++i)
+    {
+        MeterInfo mi;
+        mi.name = r.getString();
+        mi.type = r.getString();
+        mi.id = r.getString();
+        mi.key = r.getString();
+        mi.link_modes = LinkModeSet(r.get32());
+        mi.shells = r.getStrings();
+        mi.jsons = r.getStrings();
+        loaded.push_back(mi);
+    }
+    if (r.overrun || r.pos != r.end) return false;
+    meters->insert(meters->end(), loaded.begin(), loaded.end());
+    return true;
+}
+
+static void writeConfigSnapshot(string snapshot, string dir, vector<SnapshotFile> &files, vector<MeterInfo> &meters)
+{
+    vector<uchar> payload;
+    putString(payload, snapshotSignature(dir));
+    put32(payload, files.size());
+    for (auto &f : files)
+    {
+        putString(payload, f.name);
+        put64(payload, f.size);
+        put64(payload, f.mtime_ns);
+        put64(payload, f.ino);
+    }
+    put32(payload, meters.size());
+    for (auto &mi : meters)
+    {
+        putString(payload, mi.name);
+        putString(payload, mi.type);
+        putString(payload, mi.id);
+        putString(payload, mi.key);
+        put32(payload, mi.link_modes.asBits());
+        putStrings(payload, mi.shells);
+        putStrings(payload, mi.jsons);
+    }
+    SHA256_HASH hash;
+    Sha256Calculate(&payload[0], payload.size(), &hash);
+
+    // The snapshot contains the meter keys, thus only the owner can read it.
+    // Write a new file and rename it into place, a crash never leaves a half written snapshot.
+    string tmp = snapshot+".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    bool ok = fd != -1;
+    if (ok)
+    {
+        ok = write(fd, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) == (ssize_t)strlen(SNAPSHOT_MAGIC) &&
+            write(fd, hash.bytes, SHA256_HASH_SIZE) == SHA256_HASH_SIZE &&
+            write(fd, &payload[0], payload.size()) == (ssize_t)payload.size();
+        ok &= close(fd) == 0;
+    }
+    if (ok) ok = rename(tmp.c_str(), snapshot.c_str()) == 0;
+    if (!ok)
+    {
+        warning("(config) could not write config snapshot %s\n", snapshot.c_str());
+        unlink(tmp.c_str());
+        return;
+    }
+    debug("(config) wrote config snapshot %s with %zu meters\n", snapshot.c_str(), meters.size());
+}
+
+void loadMeterFiles(Configuration *c, string dir, int num_threads)
+{
+    vector<string> files;
+    listFiles(dir, &files);
+    if (num_threads <= 0) num_threads = startupThreads(files.size());
+
+    if (c->config_snapshot != "" && loadConfigSnapshot(c->config_snapshot, dir, files, &c->meters))
+    {
+        verbose("(config) loaded %zu meters from config snapshot %s\n", c->meters.size(), c->config_snapshot.c_str());
+        return;
+    }
+
+    // The files are parsed in parallel, but the meters are added in the order
+    // of the files, as if they were parsed one by one.
+    vector<MeterInfo> meters(files.size());
+    vector<SnapshotFile> stats(files.size());
+    vector<char> used(files.size());
+    vector<char> unchanged(files.size());
+    parallelFor(files.size(), num_threads, [&](size_t i)
+        {
+            vector<char> meter_conf;
+            string file = dir+"/"+files[i];
+            // Stat before loading, a file modified while loading then invalidates the snapshot.
+            unchanged[i] = statSnapshotFile(dir, files[i], &stats[i]);
+            loadFile(file.c_str(), &meter_conf);
+            meter_conf.push_back('\n');
+            used[i] = parseMeterConfig(&meters[i], meter_conf, file);
+        });
+
+    vector<MeterInfo> parsed;
+    for (size_t i=0; i<files.size(); ++i)
+    {
+        if (used[i]) parsed.push_back(meters[i]);
+    }
+    if (c->config_snapshot != "" &&
+        find(unchanged.begin(), unchanged.end(), false) == unchanged.end())
+    {
+        writeConfigSnapshot(c->config_snapshot, dir, stats, parsed);
+    }
+    c->meters.insert(c->meters.end(), parsed.begin(), parsed.end());
 }
 
 void handleLoglevel(Configuration *c, string loglevel)
@@ -202,14 +461,29 @@ void handleIgnoreDuplicateTelegrams(Configuration *c, string value)
 {
     if (value == "true")
     {
-        c->ignore_duplicate_telegrams = true;
+        c->ignore_duplicates_window = DEFAULT_DUPLICATE_WINDOW_SECONDS;
     }
     else if (value == "false")
     {
-        c->ignore_duplicate_telegrams = false;
+        c->ignore_duplicates_window = 0;
     }
     else {
-        warning("ignoreduplicates should be either true or false, not \"%s\"\n", value.c_str());
+        c->ignore_duplicates_window = parseTime(value);
+        if (c->ignore_duplicates_window <= 0)
+        {
+            c->ignore_duplicates_window = 0;
+            warning("ignoreduplicates should be either true, false or a time like 60s, not \"%s\"\n", value.c_str());
+        }
+    }
+}
+
+void handleDuplicateCacheSize(Configuration *c, string s)
+{
+    c->duplicate_cache_size = atoi(s.c_str());
+    if (c->duplicate_cache_size <= 0)
+    {
+        warning("Not a valid duplicate cache size. \"%s\"\n", s.c_str());
+        c->duplicate_cache_size = 0;
     }
 }
 
@@ -229,6 +503,58 @@ void handleResetAfter(Configuration *c, string s)
     }
 }
 
+void handleDecodeThreads(Configuration *c, string s)
+{
+    c->decodethreads = atoi(s.c_str());
+    if (c->decodethreads <= 0 || c->decodethreads > 64)
+    {
+        warning("Not a valid number of decode threads. \"%s\"\n", s.c_str());
+        c->decodethreads = 0;
+    }
+}
+
+void handleCombineTelegrams(Configuration *c, string s)
+{
+    c->combine_telegrams_ms = parseTimeMs(s);
+    if (c->combine_telegrams_ms <= 0)
+    {
+        warning("Not a valid time to combine telegrams within. \"%s\"\n", s.c_str());
+        c->combine_telegrams_ms = 0;
+    }
+}
+
+bool parseFlushFiles(string s, int *ms, int *bytes)
+{
+    *ms = 0;
+    *bytes = 0;
+    if (s == "telegram") return true;
+
+    size_t digits = 0;
+    while (digits < s.length() && isdigit(s[digits])) digits++;
+    if (digits == 0) return false;
+
+    int n = atoi(s.substr(0, digits).c_str());
+    string unit = s.substr(digits);
+    if (n <= 0) return false;
+
+    if (unit == "ms") *ms = n;
+    else if (unit == "s") *ms = n*1000;
+    else if (unit == "b") *bytes = n;
+    else if (unit == "kb") *bytes = n*1024;
+    else return false;
+
+    return true;
+}
+
+void handleFlushFiles(Configuration *c, string s)
+{
+    bool ok = parseFlushFiles(s, &c->flushfiles_ms, &c->flushfiles_bytes);
+    if (!ok)
+    {
+        warning("Not a valid flush policy for files \"%s\"\n", s.c_str());
+    }
+}
+
 bool handleDevice(Configuration *c, string devicefile)
 {
     SpecifiedDevice specified_device;
@@ -409,6 +735,45 @@ void handleLogfile(Configuration *c, string logfile)
     }
 }
 
+void handleCapture(Configuration *c, string file)
+{
+    if (file.length() > 0)
+    {
+        c->capture_file = file;
+    }
+}
+
+void handleTimeSeries(Configuration *c, string dir)
+{
+    if (dir.length() > 0)
+    {
+        if (!checkIfDirExists(dir.c_str()))
+        {
+            warning("Cannot write time series into dir \"%s\"\n", dir.c_str());
+            return;
+        }
+        c->timeseries_dir = dir;
+    }
+}
+
+void handleStats(Configuration *c, string dir)
+{
+    if (dir.length() > 0)
+    {
+        if (!checkIfDirExists(dir.c_str()))
+        {
+            warning("Cannot write statistics into dir \"%s\"\n", dir.c_str());
+            return;
+        }
+        c->stats_dir = dir;
+    }
+}
+
+void handleConfigSnapshot(Configuration *c, string file)
+{
+    c->config_snapshot = file;
+}
+
 void handleFormat(Configuration *c, string format)
 {
     if (format == "hr")
@@ -503,6 +868,11 @@ void handleShell(Configuration *c, string cmdline)
     c->telegram_shells.push_back(cmdline);
 }
 
+void handleShellPipe(Configuration *c, string cmdline)
+{
+    c->telegram_shellpipes.push_back(cmdline);
+}
+
 void handleAlarmShell(Configuration *c, string cmdline)
 {
     c->alarm_shells.push_back(cmdline);
@@ -537,17 +907,24 @@ shared_ptr<Configuration> loadConfiguration(string root, string device_override,
         if (p.first == "") break;
         // If the key starts with # then the line is a comment. Ignore it.
         if (p.first.length() > 0 && p.first[0] == '#') continue;
+        if (p.first != "device") c->settings += p.first+"="+p.second+"\n";
         if (p.first == "loglevel") handleLoglevel(c, p.second);
         else if (p.first == "internaltesting") handleInternalTesting(c, p.second);
         else if (p.first == "ignoreduplicates") handleIgnoreDuplicateTelegrams(c, p.second);
+        else if (p.first == "duplicatecachesize") handleDuplicateCacheSize(c, p.second);
         else if (p.first == "device") handleDevice(c, p.second);
         else if (p.first == "donotprobe") handleDoNotProbe(c, p.second);
         else if (p.first == "listento") handleListenTo(c, p.second);
         else if (p.first == "logtelegrams") handleLogtelegrams(c, p.second);
+        else if (p.first == "capture") handleCapture(c, p.second);
+        else if (p.first == "timeseries") handleTimeSeries(c, p.second);
+        else if (p.first == "stats") handleStats(c, p.second);
+        else if (p.first == "configsnapshot") handleConfigSnapshot(c, p.second);
         else if (p.first == "meterfiles") handleMeterfiles(c, p.second);
         else if (p.first == "meterfilesaction") handleMeterfilesAction(c, p.second);
         else if (p.first == "meterfilesnaming") handleMeterfilesNaming(c, p.second);
         else if (p.first == "meterfilestimestamp") handleMeterfilesTimestamp(c, p.second);
+        else if (p.first == "flushfiles") handleFlushFiles(c, p.second);
         else if (p.first == "logfile") handleLogfile(c, p.second);
         else if (p.first == "format") handleFormat(c, p.second);
         else if (p.first == "alarmtimeout") handleAlarmTimeout(c, p.second);
@@ -556,7 +933,10 @@ shared_ptr<Configuration> loadConfiguration(string root, string device_override,
         else if (p.first == "addconversions") handleConversions(c, p.second);
         else if (p.first == "selectfields") handleSelectedFields(c, p.second);
         else if (p.first == "shell") handleShell(c, p.second);
+        else if (p.first == "shellpipe") handleShellPipe(c, p.second);
         else if (p.first == "resetafter") handleResetAfter(c, p.second);
+        else if (p.first == "decodethreads") handleDecodeThreads(c, p.second);
+        else if (p.first == "combinetelegrams") handleCombineTelegrams(c, p.second);
         else if (p.first == "alarmshell") handleAlarmShell(c, p.second);
         else if (startsWith(p.first, "json_"))
         {
@@ -570,17 +950,7 @@ shared_ptr<Configuration> loadConfiguration(string root, string device_override,
         }
     }
 
-    vector<string> meters;
-    listFiles(root+"/etc/wmbusmeters.d", &meters);
-
-    for (auto& f : meters)
-    {
-        vector<char> meter_conf;
-        string file = root+"/etc/wmbusmeters.d/"+f;
-        loadFile(file.c_str(), &meter_conf);
-        meter_conf.push_back('\n');
-        parseMeterConfig(c, meter_conf, file);
-    }
+    loadMeterFiles(c, root+"/etc/wmbusmeters.d");
 
     if (device_override != "")
     {
@@ -60,19 +60,33 @@ struct Configuration
     bool trace {};
     bool internaltesting {}; // Only for testing! When true, shorten all timeouts.
     bool logtelegrams {};
+    std::string capture_file; // Append all received telegrams to this binary capture file.
+    std::string dump_capture; // Print the telegrams in this capture file as simulation lines, then exit.
+    std::string dump_capture_id; // Only print the telegrams from this meter id, empty prints all ids.
+    time_t dump_capture_from {}; // Only print the telegrams received at or after this time, 0 means from the start.
+    time_t dump_capture_to {}; // Only print the telegrams received at or before this time, 0 means to the end.
+    std::string timeseries_dir; // Store the meter readings as columnar time series files in this dir.
+    std::string dump_timeseries; // Print the readings in this time series file, then exit.
+    std::string stats_dir; // Write the statistics json and prometheus files into this dir.
+    std::string config_snapshot; // Load the meters from this file, when the meter files have not changed since it was written.
+    std::string settings; // The key=value lines in wmbusmeters.conf, except the devices. A reload restarts when they change.
     bool meterfiles {};
     std::string meterfiles_dir;
     MeterFileType meterfiles_action {};
     MeterFileNaming meterfiles_naming {};
     MeterFileTimestamp meterfiles_timestamp {}; // Default is never.
+    int flushfiles_ms {}; // Flush the meter files and the logfile when this many ms have passed since the last flush.
+    int flushfiles_bytes {}; // Or when this many bytes are waiting. Both 0 means flush after every telegram.
     bool use_logfile {};
     bool use_stderr_for_log = true; // Default is to use stderr for logging.
-    bool ignore_duplicate_telegrams = false; // Default is to report all telegrams.
+    int ignore_duplicates_window {}; // Ignore identical telegrams received within this many seconds, 0 reports all telegrams.
+    int duplicate_cache_size {}; // Remember at most this many telegrams for the duplicate check, 0 means the default size.
     std::string logfile;
     bool json {};
     bool fields {};
     char separator { ';' };
     std::vector<std::string> telegram_shells;
+    std::vector<std::string> telegram_shellpipes; // Long lived shells receiving the json on stdin.
     std::vector<std::string> alarm_shells;
     int alarm_timeout {}; // Maximum number of seconds between dongle receiving two telegrams.
     std::string alarm_expected_activity; // Only warn when within these time periods.
@@ -87,6 +101,12 @@ struct Configuration
     int  exitafter {}; // Seconds to exit.
     bool nodeviceexit {}; // If no wmbus receiver device is found, then exit immediately!
     int  resetafter {}; // Reset the wmbus devices regularly.
+    int  combine_telegrams_ms {}; // Combine the copies of a telegram received by several devices within this window.
+    int  decodethreads {}; // Decode telegrams in this many threads, 0 means decode in the event loop thread.
+    bool bulk {}; // Decode the bulk_files in bulk_threads threads, then exit.
+    int bulk_threads {}; // 0 means one thread per cpu.
+    std::vector<std::string> bulk_files;
+    double replay_speed = -1; // Replay simulation files and measure the decoding, 0 ignores the +N offsets, -1 is off.
     std::vector<SpecifiedDevice> supplied_wmbus_devices; // /dev/ttyUSB0, simulation.txt, rtlwmbus, /dev/ttyUSB1:9600
     bool use_auto_device_detect {}; // Set to true if auto was supplied as device.
     std::set<std::string> do_not_probe_ttys; // Do not probe these ttys! all = all of them.
@@ -112,7 +132,20 @@ struct Configuration
 
 shared_ptr<Configuration> loadConfiguration(string root, string device_override, string listento_override);
 
+// Below this number of meters, the startup is fast enough using a single thread.
+#define PARALLEL_STARTUP_MIN_METERS 256
+#define MAX_STARTUP_THREADS 8
+
+// The number of threads to use when loading and creating num_meters meters.
+int startupThreads(size_t num_meters);
+
+// Load the meter files in dir into c->meters, using num_threads threads,
+// 0 means startupThreads. Uses and updates c->config_snapshot if set.
+void loadMeterFiles(Configuration *c, string dir, int num_threads = 0);
+
 void handleConversions(Configuration *c, string s);
+// Parse telegram, 500ms, 10s, 4096b or 64kb.
+bool parseFlushFiles(string s, int *ms, int *bytes);
 void handleSelectedFields(Configuration *c, string s);
 bool handleDevice(Configuration *c, string devicefile);
 
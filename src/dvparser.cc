@@ -16,8 +16,10 @@
 */
 
 #include"dvparser.h"
+#include"threads.h"
 #include"util.h"
 
+#include<algorithm>
 #include<assert.h>
 #include<memory.h>
 
@@ -48,34 +50,288 @@ LIST_OF_VALUETYPES
     return ValueInformation::None;
 }
 
-map<uint16_t,string> hash_to_format_;
+map<uint16_t,vector<uchar>> hash_to_format_;
+// The formats are remembered and loaded by all decode threads.
+RecursiveMutex hash_to_format_mutex_("hash_to_format_mutex");
 
 bool loadFormatBytesFromSignature(uint16_t format_signature, vector<uchar> *format_bytes)
 {
-    if (hash_to_format_.count(format_signature) > 0) {
+    WITH(hash_to_format_mutex_, loadFormatBytesFromSignature);
+    auto i = hash_to_format_.find(format_signature);
+    if (i != hash_to_format_.end()) {
         debug("(dvparser) found remembered format for hash %x\n", format_signature);
         // Return the proper hash!
-        hex2bin(hash_to_format_[format_signature], format_bytes);
+        *format_bytes = i->second;
         return true;
     }
     // Unknown format signature.
     return false;
 }
 
+map<string,unique_ptr<DecodePlans>> decode_plans_;
+RecursiveMutex decode_plans_mutex_("decode_plans_mutex");
+
+DecodePlans *decodePlans(const string &driver)
+{
+    WITH(decode_plans_mutex_, decodePlans);
+    unique_ptr<DecodePlans> &p = decode_plans_[driver];
+    if (!p) p = unique_ptr<DecodePlans>(new DecodePlans());
+    return p.get();
+}
+
+shared_ptr<DecodePlan> DecodePlans::find(Telegram *t, uchar *data, size_t data_len, bool compact)
+{
+    LOCK_DECODE_PLANS(find);
+    for (auto &p : plans_)
+    {
+        if (p->compact != compact || p->data_len != data_len) continue;
+        if (compact && p->format_signature != t->format_signature) continue;
+        const uchar *h = &p->header_bytes[0];
+        bool match = true;
+        for (auto &s : p->headers)
+        {
+            if (memcmp(data+s.first, h, s.second)) { match = false; break; }
+            h += s.second;
+        }
+        if (match) return p;
+    }
+    return NULL;
+}
+
+bool DecodePlans::apply(Telegram *t, vector<uchar>::iterator data, size_t data_len, DVEntries *values, bool compact)
+{
+    // The plan does not know how to explain the telegram.
+    if (t->explaining() || values->size() > 0 || data_len == 0) return false;
+
+    shared_ptr<DecodePlan> plan = find(t, &*data, data_len, compact);
+    if (!plan)
+    {
+        misses_++;
+        return false;
+    }
+    hits_++;
+
+    int start = t->parsed.size();
+    *values = plan->values;
+    for (auto &e : *values)
+    {
+        if (e.value_len > 0) memcpy(values->value(e), &*data+e.offset, e.value_len);
+        e.offset += start;
+    }
+    t->parsed.insert(t->parsed.end(), data, data+data_len);
+    if (plan->mfct_0f_index != -1) t->mfct_0f_index = plan->mfct_0f_index;
+    return true;
+}
+
+void DecodePlans::add(shared_ptr<DecodePlan> plan)
+{
+    LOCK_DECODE_PLANS(add);
+    for (auto &p : plans_)
+    {
+        // Another decode thread might just have added the same plan.
+        if (p->compact == plan->compact && p->format_signature == plan->format_signature &&
+            p->data_len == plan->data_len && p->headers == plan->headers &&
+            p->header_bytes == plan->header_bytes) return;
+    }
+    plans_.push_front(plan);
+    if (plans_.size() > MAX_DECODE_PLANS_PER_DRIVER) plans_.pop_back();
+}
+
+// Parse a hex key like 0C13 or 0C13_2 into difvif bytes and count.
+static bool parseKey(const string &key, uchar *bytes, int max, int *len, int *count)
+{
+    size_t i = 0;
+    *len = 0;
+    *count = 1;
+    while (i+1 < key.length() && key[i] != '_')
+    {
+        int hi = char2int(key[i]);
+        int lo = char2int(key[i+1]);
+        if (hi < 0 || lo < 0 || *len >= max) return false;
+        bytes[(*len)++] = hi << 4 | lo;
+        i += 2;
+    }
+    if (i < key.length())
+    {
+        if (key[i] != '_' || i+1 >= key.length()) return false;
+        *count = atoi(key.c_str()+i+1);
+        if (*count < 1) return false;
+    }
+    return *len > 0;
+}
+
+// Compare as the hex keys would be compared as strings.
+int DVEntries::compare(uchar *a, int alen, int acount, uchar *b, int blen, int bcount)
+{
+    int c = memcmp(a, b, min(alen, blen));
+    if (c != 0) return c;
+    if (alen != blen)
+    {
+        // The shorter key either ends here, or continues with a _
+        // which is sorted after all hex digits.
+        if (alen < blen) return acount == 1 ? -1 : 1;
+        return bcount == 1 ? 1 : -1;
+    }
+    if (acount == bcount) return 0;
+    if (acount == 1) return -1;
+    if (bcount == 1) return 1;
+    return to_string(acount).compare(to_string(bcount));
+}
+
+void DVEntries::sort()
+{
+    sorted_ = true;
+    uchar *b = bytes_.data();
+
+    // Group the records with the same difvif, in the order they were added.
+    // The appended records (count 0) are then numbered after the earlier records.
+    std::stable_sort(entries_.begin(), entries_.end(), [b](const DVEntry &x, const DVEntry &y)
+        {
+            int c = memcmp(b+x.key_start, b+y.key_start, min(x.key_len, y.key_len));
+            if (c != 0) return c < 0;
+            return x.key_len < y.key_len;
+        });
+    for (size_t i = 0; i < entries_.size(); ++i)
+    {
+        DVEntry &e = entries_[i];
+        if (e.count != 0) continue;
+        e.count = 1;
+        if (i > 0)
+        {
+            DVEntry &p = entries_[i-1];
+            if (p.key_len == e.key_len && !memcmp(b+p.key_start, b+e.key_start, e.key_len)) e.count = p.count+1;
+        }
+    }
+
+    std::sort(entries_.begin(), entries_.end(), [this,b](const DVEntry &x, const DVEntry &y)
+        {
+            return compare(b+x.key_start, x.key_len, x.count, b+y.key_start, y.key_len, y.count) < 0;
+        });
+}
+
+void DVEntries::add(uchar *difvif, int difvif_len, uchar *data, int data_len, int offset,
+                    MeasurementType mt, int vi, int storagenr, int tariff, int subunit)
+{
+    DVEntry e;
+    e.type = mt;
+    e.value_information = vi;
+    e.storagenr = storagenr;
+    e.tariff = tariff;
+    e.subunit = subunit;
+    e.offset = offset;
+    e.count = 0; // Numbered by sort.
+    e.key_start = bytes_.size();
+    e.key_len = difvif_len;
+    bytes_.insert(bytes_.end(), difvif, difvif+difvif_len);
+    e.value_start = bytes_.size();
+    e.value_len = data_len;
+    bytes_.insert(bytes_.end(), data, data+data_len);
+    entries_.push_back(e);
+    sorted_ = false;
+}
+
+void DVEntries::set(string key, int offset, MeasurementType mt, int vi, int storagenr, int tariff, int subunit,
+                    string hex_value)
+{
+    uchar difvif[32];
+    int len, count;
+    if (!parseKey(key, difvif, sizeof(difvif), &len, &count)) return;
+    vector<uchar> data;
+    hex2bin(hex_value, &data);
+
+    DVEntry *old = find(key);
+    if (old != NULL && old->value_len == (int)data.size())
+    {
+        // Overwrite in place, the byte store does not grow.
+        old->type = mt;
+        old->value_information = vi;
+        old->storagenr = storagenr;
+        old->tariff = tariff;
+        old->subunit = subunit;
+        old->offset = offset;
+        if (data.size() > 0) memcpy(&bytes_[old->value_start], &data[0], data.size());
+        return;
+    }
+    if (old != NULL)
+    {
+        entries_.erase(entries_.begin() + (old - &entries_[0]));
+    }
+    DVEntry e;
+    e.type = mt;
+    e.value_information = vi;
+    e.storagenr = storagenr;
+    e.tariff = tariff;
+    e.subunit = subunit;
+    e.offset = offset;
+    e.count = count;
+    e.key_start = bytes_.size();
+    e.key_len = len;
+    bytes_.insert(bytes_.end(), difvif, difvif+len);
+    e.value_start = bytes_.size();
+    e.value_len = data.size();
+    bytes_.insert(bytes_.end(), data.begin(), data.end());
+    entries_.push_back(e);
+    sorted_ = false;
+}
+
+DVEntry *DVEntries::find(const string &key)
+{
+    uchar difvif[32];
+    int len, count;
+    if (!parseKey(key, difvif, sizeof(difvif), &len, &count)) return NULL;
+    if (!sorted_) sort();
+
+    // Binary search in the sorted records.
+    int lo = 0, hi = entries_.size()-1;
+    while (lo <= hi)
+    {
+        int mid = (lo+hi)/2;
+        DVEntry &e = entries_[mid];
+        int c = compare(&bytes_[e.key_start], e.key_len, e.count, difvif, len, count);
+        if (c == 0) return &e;
+        if (c < 0) lo = mid+1;
+        else hi = mid-1;
+    }
+    return NULL;
+}
+
+string DVEntries::key(DVEntry &e)
+{
+    string s;
+    for (int i=0; i<e.key_len; ++i)
+    {
+        char hex[3];
+        snprintf(hex, 3, "%02X", bytes_[e.key_start+i]);
+        s.append(hex);
+    }
+    if (e.count > 1) s += "_"+to_string(e.count);
+    return s;
+}
+
+string DVEntries::valueHex(DVEntry &e)
+{
+    auto i = bytes_.begin()+e.value_start;
+    return bin2hex(i, bytes_.end(), e.value_len);
+}
+
 bool parseDV(Telegram *t,
              vector<uchar> &databytes,
              vector<uchar>::iterator data,
              size_t data_len,
-             map<string,pair<int,DVEntry>> *values,
+             DVEntries *values,
              vector<uchar>::iterator *format,
              size_t format_len,
              uint16_t *format_hash)
 {
-    map<string,int> dv_count;
+    if (format == NULL && t->decode_plans != NULL &&
+        t->decode_plans->apply(t, data, data_len, values, false))
+    {
+        // The difvifs are exactly where they were in an earlier telegram, no need to parse them again.
+        return true;
+    }
+
     vector<uchar> format_bytes;
     vector<uchar> id_bytes;
-    vector<uchar> data_bytes;
-    string dv, key;
     size_t start_parse_here = t->parsed.size();
     vector<uchar>::iterator data_start = data;
     vector<uchar>::iterator data_end = data+data_len;
@@ -83,6 +339,20 @@ bool parseDV(Telegram *t,
     bool data_has_difvifs = true;
     bool variable_length = false;
 
+    // A plan can only be made if all records have fixed lengths and the whole data is parsed.
+    bool plannable = t->decode_plans != NULL && values->size() == 0;
+    shared_ptr<DecodePlan> plan;
+    if (plannable) plan = make_shared<DecodePlan>();
+    int mfct_0f_index = -1;
+    // Remember where the difvif bytes are in the data.
+    auto addHeader = [&](int from)
+    {
+        if (!plannable) return;
+        int to = std::distance(data_start, data);
+        plan->headers.push_back({ from, to-from });
+        plan->header_bytes.insert(plan->header_bytes.end(), data_start+from, data);
+    };
+
     if (format == NULL) {
         // No format string was supplied, we therefore assume
         // that the difvifs necessary to parse the data is
@@ -95,8 +365,11 @@ bool parseDV(Telegram *t,
         // Since the data does not have the difvifs.
         data_has_difvifs = false;
         format_end = *format+format_len;
-        string s = bin2hex(*format, format_end, format_len);
-        debug("(dvparser) using format \"%s\"\n", s.c_str());
+        if (isDebugEnabled())
+        {
+            string s = bin2hex(*format, format_end, format_len);
+            debug("(dvparser) using format \"%s\"\n", s.c_str());
+        }
     }
 
     // Data format is:
@@ -130,6 +403,7 @@ bool parseDV(Telegram *t,
         DEBUG_PARSER("(dvparser debug) Remaining format data %ju\n", std::distance(*format,format_end));
         if (*format == format_end) break;
         uchar dif = **format;
+        int record_start = std::distance(data_start, data);
 
         MeasurementType mt = difMeasurementType(dif);
         int datalen = difLenBytes(dif);
@@ -144,26 +418,37 @@ bool parseDV(Telegram *t,
                 string value = bin2hex(data+1, data_end, datalen-1);
                 t->mfct_0f_index = 1+std::distance(data_start, data);
                 assert(t->mfct_0f_index >= 0);
+                mfct_0f_index = t->mfct_0f_index;
+                if (plannable && data_has_difvifs)
+                {
+                    plan->headers.push_back({ record_start, 1 });
+                    plan->header_bytes.push_back(dif);
+                }
                 t->addExplanationAndIncrementPos(data, datalen, "%02X manufacturer specific data %s", dif, value.c_str());
                 break;
             }
             debug("(dvparser) cannot handle dif %02X ignoring rest of telegram.\n", dif);
+            plannable = false;
             break;
         }
         if (dif == 0x2f) {
-            t->addExplanationAndIncrementPos(*format, 1, "%02X skip", dif);
+            t->addExplanationAndIncrementPos(*format, 1, ExplanationKind::Skip);
             DEBUG_PARSER("\n");
+            if (data_has_difvifs) addHeader(record_start);
+            // The skipped byte of a compact format ends up in the parsed bytes.
+            else plannable = false;
             continue;
         }
         if (datalen == -1) {
             variable_length = true;
+            plannable = false;
         } else {
             variable_length = false;
         }
         if (data_has_difvifs) {
             format_bytes.push_back(dif);
             id_bytes.push_back(dif);
-            t->addExplanationAndIncrementPos(*format, 1, "%02X dif (%s)", dif, difType(dif).c_str());
+            t->addExplanationAndIncrementPos(*format, 1, ExplanationKind::Dif);
         } else {
             id_bytes.push_back(**format);
             (*format)++;
@@ -179,7 +464,7 @@ bool parseDV(Telegram *t,
         bool has_another_dife = (dif & 0x80) == 0x80;
 
         while (has_another_dife) {
-            if (*format == format_end) { debug("(dvparser) warning: unexpected end of data (dife expected)\n"); break; }
+            if (*format == format_end) { debug("(dvparser) warning: unexpected end of data (dife expected)\n"); plannable = false; break; }
             uchar dife = **format;
             int subunit_bit = (dife & 0x40) >> 6;
             subunit |= subunit_bit << difenr;
@@ -193,8 +478,8 @@ bool parseDV(Telegram *t,
             if (data_has_difvifs) {
                 format_bytes.push_back(dife);
                 id_bytes.push_back(dife);
-                t->addExplanationAndIncrementPos(*format, 1, "%02X dife (subunit=%d tariff=%d storagenr=%d)",
-                                  dife, subunit, tariff, storage_nr);
+                t->addExplanationAndIncrementPos(*format, 1, ExplanationKind::Dife,
+                                                 subunit, tariff, storage_nr);
             } else {
                 id_bytes.push_back(**format);
                 (*format)++;
@@ -204,14 +489,14 @@ bool parseDV(Telegram *t,
             difenr++;
         }
 
-        if (*format == format_end) { debug("(dvparser) warning: unexpected end of data (vif expected)\n"); break; }
+        if (*format == format_end) { debug("(dvparser) warning: unexpected end of data (vif expected)\n"); plannable = false; break; }
 
         uchar vif = **format;
-        DEBUG_PARSER("(dvparser debug) vif=%02x \"%s\"\n", vif, vifType(vif).c_str());
+        DEBUG_PARSER("(dvparser debug) vif=%02x \"%s\"\n", vif, vifType(vif));
         if (data_has_difvifs) {
             format_bytes.push_back(vif);
             id_bytes.push_back(vif);
-            t->addExplanationAndIncrementPos(*format, 1, "%02X vif (%s)", vif, vifType(vif).c_str());
+            t->addExplanationAndIncrementPos(*format, 1, ExplanationKind::Vif);
         } else {
             id_bytes.push_back(**format);
             (*format)++;
@@ -219,36 +504,20 @@ bool parseDV(Telegram *t,
 
         bool has_another_vife = (vif & 0x80) == 0x80;
         while (has_another_vife) {
-            if (*format == format_end) { debug("(dvparser) warning: unexpected end of data (vife expected)\n"); break; }
+            if (*format == format_end) { debug("(dvparser) warning: unexpected end of data (vife expected)\n"); plannable = false; break; }
             uchar vife = **format;
             DEBUG_PARSER("(dvparser debug) vife=%02x (%s)\n", vife, vifeType(dif, vif, vife).c_str());
             if (data_has_difvifs) {
                 format_bytes.push_back(vife);
                 id_bytes.push_back(vife);
-                t->addExplanationAndIncrementPos(*format, 1, "%02X vife (%s)", vife, vifeType(dif, vif, vife).c_str());
+                t->addExplanationAndIncrementPos(*format, 1, ExplanationKind::Vife, dif, vif);
             } else {
                 id_bytes.push_back(**format);
                 (*format)++;
             }
             has_another_vife = (vife & 0x80) == 0x80;
         }
-
-        dv = "";
-        for (uchar c : id_bytes) {
-            char hex[3];
-            hex[2] = 0;
-            snprintf(hex, 3, "%02X", c);
-            dv.append(hex);
-        }
-        DEBUG_PARSER("(dvparser debug) key \"%s\"\n", dv.c_str());
-
-        int count = ++dv_count[dv];
-        if (count > 1) {
-            strprintf(key, "%s_%d", dv.c_str(), count);
-        } else {
-            strprintf(key, "%s", dv.c_str());
-        }
-        DEBUG_PARSER("(dvparser debug) DifVif key is %s\n", key.c_str());
+        if (data_has_difvifs) addHeader(record_start);
 
         int remaining = std::distance(data, data_end);
         if (variable_length) {
@@ -263,19 +532,20 @@ bool parseDV(Telegram *t,
         if (remaining < datalen) {
             debug("(dvparser) warning: unexpected end of data\n");
             datalen = remaining-1;
+            plannable = false;
         }
 
         // Skip the length byte in the variable length data.
         if (variable_length) {
-            t->addExplanationAndIncrementPos(data, 1, "%02X varlen=%d", datalen, datalen);
+            t->addExplanationAndIncrementPos(data, 1, ExplanationKind::VarLen, datalen);
         }
-        string value = bin2hex(data, data_end, datalen);
+        int value_len = max(0, min(datalen, (int)std::distance(data, data_end)));
         int offset = start_parse_here+data-data_start;
-        (*values)[key] = { offset, DVEntry(mt, vif&0x7f, storage_nr, tariff, subunit, value) };
-        if (value.length() > 0) {
+        values->add(&id_bytes[0], id_bytes.size(), value_len > 0 ? &*data : NULL, value_len, offset,
+                    mt, vif&0x7f, storage_nr, tariff, subunit);
+        if (value_len > 0) {
             // This call increments data with datalen.
-            t->addExplanationAndIncrementPos(data, datalen, "%s", value.c_str());
-            DEBUG_PARSER("(dvparser debug) data \"%s\"\n\n", value.c_str());
+            t->addExplanationAndIncrementPos(data, datalen, ExplanationKind::Hex);
         }
         if (remaining == datalen || data == databytes.end()) {
             // We are done here!
@@ -283,13 +553,30 @@ bool parseDV(Telegram *t,
         }
     }
 
-    string format_string = bin2hex(format_bytes);
+    values->sort();
+
+    if (plannable && data == data_end)
+    {
+        plan->compact = !data_has_difvifs;
+        plan->format_signature = plan->compact ? t->format_signature : 0;
+        plan->data_len = data_len;
+        plan->mfct_0f_index = mfct_0f_index;
+        plan->values = *values;
+        for (auto &e : plan->values) e.offset -= start_parse_here;
+        t->decode_plans->add(plan);
+    }
+
     uint16_t hash = crc16_EN13757(&format_bytes[0], format_bytes.size());
 
     if (data_has_difvifs) {
+        WITH(hash_to_format_mutex_, parseDV);
         if (hash_to_format_.count(hash) == 0) {
-            hash_to_format_[hash] = format_string;
-            debug("(dvparser) found new format \"%s\" with hash %x, remembering!\n", format_string.c_str(), hash);
+            hash_to_format_[hash] = format_bytes;
+            if (isDebugEnabled())
+            {
+                string format_string = bin2hex(format_bytes);
+                debug("(dvparser) found new format \"%s\" with hash %x, remembering!\n", format_string.c_str(), hash);
+            }
         }
     }
 
@@ -307,13 +594,13 @@ LIST_OF_VALUETYPES
     assert(0);
 }
 
-bool hasKey(std::map<std::string,std::pair<int,DVEntry>> *values, std::string key)
+bool hasKey(DVEntries *values, std::string key)
 {
-    return values->count(key) > 0;
+    return values->find(key) != NULL;
 }
 
 bool findKey(MeasurementType mit, ValueInformation vif, int storagenr, int tariffnr,
-             std::string *key, std::map<std::string,std::pair<int,DVEntry>> *values)
+             std::string *key, DVEntries *values)
 {
     int low, hi;
     valueInfoRange(vif, &low, &hi);
@@ -324,12 +611,12 @@ bool findKey(MeasurementType mit, ValueInformation vif, int storagenr, int tarif
 
     for (auto& v : *values)
     {
-        MeasurementType ty = v.second.second.type;
-        int vi = v.second.second.value_information;
-        int sn = v.second.second.storagenr;
-        int tn = v.second.second.tariff;
+        MeasurementType ty = v.type;
+        int vi = v.value_information;
+        int sn = v.storagenr;
+        int tn = v.tariff;
         /*debug("(dvparser) match? %s type=%s vif=%02x (%s) and storagenr=%d\n",
-              v.first.c_str(),
+              values->key(v).c_str(),
               measurementTypeName(ty).c_str(), vi, toString(toValueInformation(vi)), storagenr, sn);*/
 
         if (vi >= low && vi <= hi
@@ -337,9 +624,9 @@ bool findKey(MeasurementType mit, ValueInformation vif, int storagenr, int tarif
             && (storagenr == ANY_STORAGENR || storagenr == sn)
             && (tariffnr == ANY_TARIFFNR || tariffnr == tn))
         {
-            *key = v.first;
+            *key = values->key(v);
             /*debug("(dvparser) found key %s for type=%s vif=%02x (%s) storagenr=%d\n",
-                  v.first.c_str(), measurementTypeName(ty).c_str(),
+                  key->c_str(), measurementTypeName(ty).c_str(),
                   vi, toString(toValueInformation(vi)), storagenr);*/
             return true;
         }
@@ -347,257 +634,311 @@ bool findKey(MeasurementType mit, ValueInformation vif, int storagenr, int tarif
     return false;
 }
 
-void extractDV(string &s, uchar *dif, uchar *vif)
+bool extractDV(uchar *bytes, size_t len, uchar *dif, uchar *vif)
 {
-    vector<uchar> bytes;
-    hex2bin(s, &bytes);
     *dif = bytes[0];
     bool has_another_dife = (*dif & 0x80) == 0x80;
     size_t i=1;
     while (has_another_dife) {
-        if (i >= bytes.size()) {
-            debug("(dvparser) Invalid key \"%s\" used. Settinf vif to zero.\n", s.c_str());
+        if (i >= len) {
             *vif = 0;
-            return;
+            return false;
         }
         uchar dife = bytes[i];
         has_another_dife = (dife & 0x80) == 0x80;
         i++;
     }
+    *vif = i < len ? bytes[i] : 0;
+    return true;
+}
+
+void extractDV(string &s, uchar *dif, uchar *vif)
+{
+    vector<uchar> bytes;
+    hex2bin(s, &bytes);
+    if (!extractDV(&bytes[0], bytes.size(), dif, vif)) {
+        debug("(dvparser) Invalid key \"%s\" used. Settinf vif to zero.\n", s.c_str());
+    }
+}
+
+// Lookup the record and decode its dif and vif from the stored difvif bytes.
+static DVEntry *findEntry(DVEntries *values, string &key, uchar *dif, uchar *vif)
+{
+    DVEntry *e = values->find(key);
+    if (e == NULL) return NULL;
+    extractDV(values->difvif(*e), e->key_len, dif, vif);
+    return e;
+}
+
+// The kernel helpers are always inlined, also when optimizing for size.
+static inline __attribute__((always_inline)) uint32_t load32LE(const uchar *data)
+{
+    uint32_t v;
+    memcpy(&v, data, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+// Loads 1 to 8 bytes without reading outside of the data and without a branch
+// per length. Lengths of 4 and above are two overlapping 32 bit loads, shorter
+// lengths are the first, the middle and the last byte. The overlapping bytes
+// land on the same bits and the or:s are harmless.
+static inline __attribute__((always_inline)) uint64_t loadLE(const uchar *data, int len)
+{
+    if (len >= 4)
+    {
+        uint64_t lo = load32LE(data);
+        uint64_t hi = load32LE(data+len-4);
+        return lo | (hi << (8*(len-4)));
+    }
+    if (len <= 0) return 0;
+    return ((uint64_t)data[0]) |
+        (((uint64_t)data[len>>1]) << (8*(len>>1))) |
+        (((uint64_t)data[len-1]) << (8*(len-1)));
+}
+
+// Convert all digits at once, within a 64 bit register. First every byte
+// becomes 0-99, then every 16 bit lane 0-9999, every 32 bit lane 0-99999999
+// and finally the whole number. Nibbles above 9 give the same result as
+// adding them up digit by digit, no lane can overflow into its neighbour.
+static inline __attribute__((always_inline)) uint64_t bcdToBinary(uint64_t x)
+{
+    x = (x & 0x0f0f0f0f0f0f0f0fULL) + ((x >> 4) & 0x0f0f0f0f0f0f0f0fULL) * 10;
+    x = (x & 0x00ff00ff00ff00ffULL) + ((x >> 8) & 0x00ff00ff00ff00ffULL) * 100;
+    x = (x & 0x0000ffff0000ffffULL) + ((x >> 16) & 0x0000ffff0000ffffULL) * 10000;
+    x = (x & 0x00000000ffffffffULL) + (x >> 32) * 100000000ULL;
+    return x;
+}
+
+static inline __attribute__((always_inline)) bool bcdIsNegative(uint64_t x, int len)
+{
+    return ((x >> (8*len-4)) & 0xf) == 0xf;
+}
+
+uint64_t decodeDVUint(const uchar *data, int len)
+{
+    if (len > 8) return 0;
+    return loadLE(data, len);
+}
+
+int64_t decodeDVInt(const uchar *data, int len)
+{
+    if (len <= 0 || len > 8) return 0;
+    int shift = 64-8*len;
+    return ((int64_t)(loadLE(data, len) << shift)) >> shift;
+}
+
+uint64_t decodeDVBCD(const uchar *data, int len, bool *negative)
+{
+    if (len <= 0 || len > 8)
+    {
+        if (negative) *negative = false;
+        return 0;
+    }
+    uint64_t x = loadLE(data, len);
+    bool neg = bcdIsNegative(x, len);
+    if (neg) x &= ~(((uint64_t)0xf0) << (8*(len-1)));
+    if (negative) *negative = neg;
+    return bcdToBinary(x);
+}
 
-    *vif = bytes[i];
+float decodeDVReal(const uchar *data)
+{
+    uint32_t bits = load32LE(data);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+bool decodeDVValue(int dif, const uchar *data, size_t len, double *value)
+{
+    int t = dif & 0x0f;
+    int n = difLenBytes(dif);
+    if (n < 0 || t == 0x8 || (size_t)n > len)
+    {
+        *value = 0;
+        return false;
+    }
+    if (t == 0x5)
+    {
+        *value = decodeDVReal(data);
+        return true;
+    }
+    uint64_t x = loadLE(data, n);
+    if (t >= 0x9)
+    {
+        // 2, 4, 6, 8 and 12 digit BCD, 74140000 -> 00001474
+        bool negative = bcdIsNegative(x, n);
+        if (negative) x &= ~(((uint64_t)0xf0) << (8*(n-1)));
+        double v = bcdToBinary(x);
+        *value = negative ? -v : v;
+        return true;
+    }
+    // 8, 16, 24, 32, 48 and 64 bit integers. Storing 64 bit data into
+    // a double might lose precision, since the mantissa is less than 64 bit.
+    *value = x;
+    return true;
 }
 
-bool extractDVuint8(map<string,pair<int,DVEntry>> *values,
+bool extractDVuint8(DVEntries *values,
                     string key,
                     int *offset,
                     uchar *value)
 {
-    if ((*values).count(key) == 0) {
+    uchar dif, vif;
+    DVEntry *e = findEntry(values, key, &dif, &vif);
+    if (e == NULL) {
         verbose("(dvparser) warning: cannot extract uint16 from non-existant key \"%s\"\n", key.c_str());
         *offset = -1;
         *value = 0;
         return false;
     }
-    uchar dif, vif;
-    extractDV(key, &dif, &vif);
-
-    pair<int,DVEntry>&  p = (*values)[key];
-    *offset = p.first;
-    vector<uchar> v;
-    hex2bin(p.second.value, &v);
+    *offset = e->offset;
+    if (e->value_len < 1) {
+        verbose("(dvparser) warning: too few bytes to extract uint8 from key \"%s\"\n", key.c_str());
+        *value = 0;
+        return false;
+    }
+    uchar *v = values->value(*e);
 
     *value = v[0];
     return true;
 }
 
-bool extractDVuint16(map<string,pair<int,DVEntry>> *values,
+bool extractDVuint16(DVEntries *values,
                      string key,
                      int *offset,
                      uint16_t *value)
 {
-    if ((*values).count(key) == 0) {
+    uchar dif, vif;
+    DVEntry *e = findEntry(values, key, &dif, &vif);
+    if (e == NULL) {
         verbose("(dvparser) warning: cannot extract uint16 from non-existant key \"%s\"\n", key.c_str());
         *offset = -1;
         *value = 0;
         return false;
     }
-    uchar dif, vif;
-    extractDV(key, &dif, &vif);
-
-    pair<int,DVEntry>&  p = (*values)[key];
-    *offset = p.first;
-    vector<uchar> v;
-    hex2bin(p.second.value, &v);
+    *offset = e->offset;
+    if (e->value_len < 2) {
+        verbose("(dvparser) warning: too few bytes to extract uint16 from key \"%s\"\n", key.c_str());
+        *value = 0;
+        return false;
+    }
+    uchar *v = values->value(*e);
 
-    *value = v[1]<<8 | v[0];
+    *value = decodeDVUint(v, 2);
     return true;
 }
 
-bool extractDVuint24(map<string,pair<int,DVEntry>> *values,
+bool extractDVuint24(DVEntries *values,
                      string key,
                      int *offset,
                      uint32_t *value)
 {
-    if ((*values).count(key) == 0) {
+    uchar dif, vif;
+    DVEntry *e = findEntry(values, key, &dif, &vif);
+    if (e == NULL) {
         verbose("(dvparser) warning: cannot extract uint24 from non-existant key \"%s\"\n", key.c_str());
         *offset = -1;
         *value = 0;
         return false;
     }
-    uchar dif, vif;
-    extractDV(key, &dif, &vif);
-
-    pair<int,DVEntry>&  p = (*values)[key];
-    *offset = p.first;
-    vector<uchar> v;
-    hex2bin(p.second.value, &v);
+    *offset = e->offset;
+    if (e->value_len < 3) {
+        verbose("(dvparser) warning: too few bytes to extract uint24 from key \"%s\"\n", key.c_str());
+        *value = 0;
+        return false;
+    }
+    uchar *v = values->value(*e);
 
-    *value = v[2] << 16 | v[1]<<8 | v[0];
+    *value = decodeDVUint(v, 3);
     return true;
 }
 
-bool extractDVuint32(map<string,pair<int,DVEntry>> *values,
+bool extractDVuint32(DVEntries *values,
                      string key,
                      int *offset,
                      uint32_t *value)
 {
-    if ((*values).count(key) == 0) {
+    uchar dif, vif;
+    DVEntry *e = findEntry(values, key, &dif, &vif);
+    if (e == NULL) {
         verbose("(dvparser) warning: cannot extract uint32 from non-existant key \"%s\"\n", key.c_str());
         *offset = -1;
         *value = 0;
         return false;
     }
-    uchar dif, vif;
-    extractDV(key, &dif, &vif);
-
-    pair<int,DVEntry>&  p = (*values)[key];
-    *offset = p.first;
-    vector<uchar> v;
-    hex2bin(p.second.value, &v);
+    *offset = e->offset;
+    if (e->value_len < 4) {
+        verbose("(dvparser) warning: too few bytes to extract uint32 from key \"%s\"\n", key.c_str());
+        *value = 0;
+        return false;
+    }
+    uchar *v = values->value(*e);
 
-    *value = v[2] << 16 | v[1]<<8 | v[0];
+    *value = decodeDVUint(v, 4);
     return true;
 }
 
-bool extractDVdouble(map<string,pair<int,DVEntry>> *values,
+bool extractDVdouble(DVEntries *values,
                      string key,
                      int *offset,
                      double *value,
                      bool auto_scale)
 {
-    if ((*values).count(key) == 0) {
+    uchar dif, vif;
+    DVEntry *e = findEntry(values, key, &dif, &vif);
+    if (e == NULL) {
         verbose("(dvparser) warning: cannot extract double from non-existant key \"%s\"\n", key.c_str());
         *offset = 0;
         *value = 0;
         return false;
     }
-    uchar dif, vif;
-    extractDV(key, &dif, &vif);
+    *offset = e->offset;
 
-    pair<int,DVEntry>&  p = (*values)[key];
-    *offset = p.first;
-
-    if (p.second.value.length() == 0) {
+    if (e->value_len == 0) {
         verbose("(dvparser) warning: key found but no data  \"%s\"\n", key.c_str());
         *offset = 0;
         *value = 0;
         return false;
     }
 
-    int t = dif&0xf;
-    if (t == 0x1 || // 8 Bit Integer/Binary
-        t == 0x2 || // 16 Bit Integer/Binary
-        t == 0x3 || // 24 Bit Integer/Binary
-        t == 0x4 || // 32 Bit Integer/Binary
-        t == 0x6 || // 48 Bit Integer/Binary
-        t == 0x7)   // 64 Bit Integer/Binary
-    {
-        vector<uchar> v;
-        hex2bin(p.second.value, &v);
-        unsigned int raw = 0;
-        if (t == 0x1) {
-            assert(v.size() == 1);
-            raw = v[0];
-        } else if (t == 0x2) {
-            assert(v.size() == 2);
-            raw = v[1]*256 + v[0];
-        } else if (t == 0x3) {
-            assert(v.size() == 3);
-            raw = v[2]*256*256 + v[1]*256 + v[0];
-        } else if (t == 0x4) {
-            assert(v.size() == 4);
-            raw = ((unsigned int)v[3])*256*256*256
-                + ((unsigned int)v[2])*256*256
-                + ((unsigned int)v[1])*256
-                + ((unsigned int)v[0]);
-        } else if (t == 0x6) {
-            assert(v.size() == 6);
-            raw = ((uint64_t)v[5])*256*256*256*256*256
-                + ((uint64_t)v[4])*256*256*256*256
-                + ((uint64_t)v[3])*256*256*256
-                + ((uint64_t)v[2])*256*256
-                + ((uint64_t)v[1])*256
-                + ((uint64_t)v[0]);
-        } else if (t == 0x7) {
-            assert(v.size() == 8);
-            raw = ((uint64_t)v[7])*256*256*256*256*256*256*256
-                + ((uint64_t)v[6])*256*256*256*256*256*256
-                + ((uint64_t)v[5])*256*256*256*256*256
-                + ((uint64_t)v[4])*256*256*256*256
-                + ((uint64_t)v[3])*256*256*256
-                + ((uint64_t)v[2])*256*256
-                + ((uint64_t)v[1])*256
-                + ((uint64_t)v[0]);
-        }
-        double scale = 1.0;
-        if (auto_scale) scale = vifScale(vif);
-        *value = ((double)raw) / scale;
-    }
-    else
-    if (t == 0x9 || // 2 digit BCD
-        t == 0xA || // 4 digit BCD
-        t == 0xB || // 6 digit BCD
-        t == 0xC || // 8 digit BCD
-        t == 0xE)   // 12 digit BCD
-    {
-        // 74140000 -> 00001474
-        string& v = p.second.value;
-        unsigned int raw = 0;
-        if (t == 0x9) {
-            assert(v.size() == 2);
-            raw = (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xA) {
-            assert(v.size() == 4);
-            raw = (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xB) {
-            assert(v.size() == 6);
-            raw = (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
-                + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xC) {
-            assert(v.size() == 8);
-            raw = (v[6]-'0')*10*10*10*10*10*10*10 + (v[7]-'0')*10*10*10*10*10*10
-                + (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
-                + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        } else if (t ==  0xE) {
-            assert(v.size() == 12);
-            raw =(v[10]-'0')*10*10*10*10*10*10*10*10*10*10*10 + (v[11]-'0')*10*10*10*10*10*10*10*10*10*10
-                + (v[8]-'0')*10*10*10*10*10*10*10*10*10 + (v[9]-'0')*10*10*10*10*10*10*10*10
-                + (v[6]-'0')*10*10*10*10*10*10*10 + (v[7]-'0')*10*10*10*10*10*10
-                + (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
-                + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
-                + (v[0]-'0')*10 + (v[1]-'0');
-        }
-
-        double scale = 1.0;
-        if (auto_scale) scale = vifScale(vif);
-        *value = ((double)raw) / scale;
+    int t = dif & 0x0f;
+    int n = difLenBytes(dif);
+    if (n >= 0 && t != 0x8 && e->value_len < n) {
+        verbose("(dvparser) warning: too few bytes to extract double from key \"%s\"\n", key.c_str());
+        *value = 0;
+        return false;
     }
-    else
+    uchar *v = values->value(*e);
+    double raw;
+    if (!decodeDVValue(dif, v, e->value_len, &raw))
     {
         error("Unsupported dif format for extraction to double! dif=%02x\n", dif);
     }
+    double scale = 1.0;
+    if (auto_scale) scale = vifScale(vif);
+    *value = raw / scale;
 
     return true;
 }
 
-bool extractDVstring(map<string,pair<int,DVEntry>> *values,
+bool extractDVstring(DVEntries *values,
                      string key,
                      int *offset,
                      string *value)
 {
-    if ((*values).count(key) == 0) {
+    DVEntry *e = values->find(key);
+    if (e == NULL) {
         verbose("(dvparser) warning: cannot extract string from non-existant key \"%s\"\n", key.c_str());
         *offset = -1;
         *value = "";
         return false;
     }
-    pair<int,DVEntry>&  p = (*values)[key];
-    *offset = p.first;
-    *value = p.second.value;
+    *offset = e->offset;
+    *value = values->valueHex(*e);
     return true;
 }
 
@@ -635,12 +976,14 @@ bool extractTime(uchar hi, uchar lo, struct tm *date)
     return true;
 }
 
-bool extractDVdate(map<string,pair<int,DVEntry>> *values,
+bool extractDVdate(DVEntries *values,
                    string key,
                    int *offset,
                    struct tm *value)
 {
-    if ((*values).count(key) == 0)
+    uchar dif, vif;
+    DVEntry *e = findEntry(values, key, &dif, &vif);
+    if (e == NULL)
     {
         verbose("(dvparser) warning: cannot extract date from non-existant key \"%s\"\n", key.c_str());
         *offset = -1;
@@ -658,23 +1001,18 @@ bool extractDVdate(map<string,pair<int,DVEntry>> *values,
     value->tm_mon = 0;
     value->tm_year = 0;
 
-    uchar dif, vif;
-    extractDV(key, &dif, &vif);
-
-    pair<int,DVEntry>&  p = (*values)[key];
-    *offset = p.first;
-    vector<uchar> v;
-    hex2bin(p.second.value, &v);
+    *offset = e->offset;
+    uchar *v = values->value(*e);
 
     bool ok = true;
-    if (v.size() == 2) {
+    if (e->value_len == 2) {
         ok &= extractDate(v[1], v[0], value);
     }
-    else if (v.size() == 4) {
+    else if (e->value_len == 4) {
         ok &= extractDate(v[3], v[2], value);
         ok &= extractTime(v[1], v[0], value);
     }
-    else if (v.size() == 6) {
+    else if (e->value_len == 6) {
         ok &= extractDate(v[4], v[3], value);
         ok &= extractTime(v[2], v[1], value);
         // ..ss ssss
@@ -18,10 +18,14 @@
 #ifndef DVPARSER_H
 #define DVPARSER_H
 
+#include"threads.h"
 #include"util.h"
 #include"wmbus.h"
 
+#include<atomic>
+#include<deque>
 #include<map>
+#include<memory>
 #include<stdint.h>
 #include<time.h>
 #include<functional>
@@ -53,11 +57,53 @@ ValueInformation toValueInformation(int i);
 
 bool loadFormatBytesFromSignature(uint16_t format_signature, vector<uchar> *format_bytes);
 
+// A meter sends telegrams with the same layout over and over again. When parseDV
+// has parsed a telegram, the layout is remembered as a plan: where the difvif bytes
+// are and the records found. A later telegram with exactly the same difvif bytes
+// at the same places (or the same format signature for a compact frame) and the
+// same length then gets its records by copying the data bytes into the plan's records.
+struct DecodePlan
+{
+    bool compact {}; // The difvifs came from the format signature, not from the data.
+    int format_signature {};
+    size_t data_len {};
+    std::vector<std::pair<int,int>> headers; // Offset and length of the difvif bytes in the data.
+    std::vector<uchar> header_bytes;
+    int mfct_0f_index = -1;
+    DVEntries values; // The offsets are relative to the start of the data.
+};
+
+// The plans of a meter driver, shared by all meters using the driver.
+struct DecodePlans
+{
+    // Fill in the values using a plan matching the data, returns false if there is none.
+    bool apply(Telegram *t, std::vector<uchar>::iterator data, size_t data_len, DVEntries *values, bool compact);
+    void add(std::shared_ptr<DecodePlan> plan);
+    uint64_t hits() { return hits_; }
+    uint64_t misses() { return misses_; }
+
+private:
+
+    std::shared_ptr<DecodePlan> find(Telegram *t, uchar *data, size_t data_len, bool compact);
+
+    // The most recently added plan first.
+    std::deque<std::shared_ptr<DecodePlan>> plans_;
+    std::atomic<uint64_t> hits_ {};
+    std::atomic<uint64_t> misses_ {};
+    RecursiveMutex mutex_ = { "decode_plans_mutex" };
+#define LOCK_DECODE_PLANS(where) WITH(mutex_, where)
+};
+
+// A meter with changing layouts, eg alternating long and compact frames, keeps this many plans.
+#define MAX_DECODE_PLANS_PER_DRIVER 16
+
+DecodePlans *decodePlans(const std::string &driver);
+
 bool parseDV(Telegram *t,
              std::vector<uchar> &databytes,
              std::vector<uchar>::iterator data,
              size_t data_len,
-             std::map<std::string,std::pair<int,DVEntry>> *values,
+             DVEntries *values,
              std::vector<uchar>::iterator *format = NULL,
              size_t format_len = 0,
              uint16_t *format_hash = NULL);
@@ -67,46 +113,62 @@ bool parseDV(Telegram *t,
 // Like: Volume, VolumeFlow, FlowTemperature, ExternalTemperature etc
 // in combination with the storagenr. (Later I will add tariff/subunit)
 bool findKey(MeasurementType mt, ValueInformation vi, int storagenr, int tariffnr,
-             std::string *key, std::map<std::string,std::pair<int,DVEntry>> *values);
+             std::string *key, DVEntries *values);
 
 #define ANY_STORAGENR -1
 #define ANY_TARIFFNR -1
 
-bool hasKey(std::map<std::string,std::pair<int,DVEntry>> *values, std::string key);
-
-bool extractDVuint8(std::map<std::string,std::pair<int,DVEntry>> *values,
+bool hasKey(DVEntries *values, std::string key);
+
+// The value decoding kernel. Works directly on the data bytes of a record,
+// len is the number of bytes, as given by difLenBytes.
+// Little endian unsigned integer of 0 to 8 bytes.
+uint64_t decodeDVUint(const uchar *data, int len);
+// Little endian two's complement integer of 1 to 8 bytes.
+int64_t decodeDVInt(const uchar *data, int len);
+// Packed bcd of 1 to 8 bytes, least significant byte first. A high nibble
+// 0xF in the most significant byte is the minus sign.
+uint64_t decodeDVBCD(const uchar *data, int len, bool *negative = NULL);
+// IEEE 754 single precision, little endian.
+float decodeDVReal(const uchar *data);
+// Decode the record value according to the dif data field. Integers are unsigned.
+// Returns false for variable length, selection for readout, special functions
+// and when there are fewer than difLenBytes(dif) bytes.
+bool decodeDVValue(int dif, const uchar *data, size_t len, double *value);
+
+bool extractDVuint8(DVEntries *values,
                     std::string key,
                     int *offset,
                     uchar *value);
 
-bool extractDVuint16(std::map<std::string,std::pair<int,DVEntry>> *values,
+bool extractDVuint16(DVEntries *values,
                      std::string key,
                      int *offset,
                      uint16_t *value);
 
-bool extractDVuint24(std::map<std::string,std::pair<int,DVEntry>> *values,
+bool extractDVuint24(DVEntries *values,
                      std::string key,
                      int *offset,
                      uint32_t *value);
 
-bool extractDVuint32(std::map<std::string,std::pair<int,DVEntry>> *values,
+bool extractDVuint32(DVEntries *values,
                      std::string key,
                      int *offset,
                      uint32_t *value);
 
 // All volume values are scaled to cubic meters, m3.
-bool extractDVdouble(std::map<std::string,std::pair<int,DVEntry>> *values,
+bool extractDVdouble(DVEntries *values,
                     std::string key,
                     int *offset,
                     double *value,
                     bool auto_scale = true);
 
-bool extractDVstring(std::map<std::string,std::pair<int,DVEntry>> *values,
+bool extractDVstring(DVEntries *values,
                      std::string key,
                      int *offset,
                      string *value);
 
-bool extractDVdate(std::map<std::string,std::pair<int,DVEntry>> *values,
+bool extractDVdate(DVEntries *values,
                    std::string key,
                    int *offset,
                    struct tm *value);
@@ -41,7 +41,7 @@ int main(int argc, char **argv)
         databytes.insert(databytes.end(), buf, buf+len);
     }
 
-    map<string,pair<int,DVEntry>> values;
+    DVEntries values;
     Telegram t;
     vector<uchar>::iterator i = databytes.begin();
 
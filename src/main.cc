@@ -15,21 +15,28 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include"capture.h"
 #include"cmdline.h"
 #include"config.h"
 #include"meters.h"
 #include"printer.h"
+#include"replay.h"
 #include"rtlsdr.h"
 #include"serial.h"
 #include"shell.h"
+#include"statistics.h"
 #include"threads.h"
+#include"timeseries.h"
+#include"timings.h"
 #include"util.h"
 #include"version.h"
 #include"wmbus.h"
 
 #include <algorithm>
+#include <atomic>
 #include <errno.h>
 #include <fcntl.h>
+#include <map>
 #include <pthread.h>
 #include <semaphore.h>
 #include <set>
@@ -46,14 +53,21 @@ using namespace std;
 int main(int argc, char **argv);
 void check_if_multiple_wmbus_meters_running();
 void check_for_dead_wmbus_devices(Configuration *config);
-shared_ptr<Meter> create_meter(Configuration *config, MeterType type, MeterInfo *mi, const char *keymsg);
+shared_ptr<Meter> create_meter(Configuration *config, MeterType type, MeterInfo *mi);
+void log_configured_meter(MeterInfo *mi);
 shared_ptr<Printer> create_printer(Configuration *config);
+bool has_shells(Configuration *config);
 shared_ptr<WMBus> create_wmbus_object(Detected *detected, Configuration *config, shared_ptr<SerialCommunicationManager> manager);
 enum class DetectionType { STDIN_FILE_SIMULATION, ALL };
 void detect_and_configure_wmbus_devices(Configuration *config, DetectionType dt);
 SpecifiedDevice *find_specified_device_from_detected(Configuration *c, Detected *d);
 bool find_specified_device_and_update_detected(Configuration *c, Detected *d);
 void find_specified_device_and_mark_as_handled(Configuration *c, Detected *d);
+void bulk_decode(Configuration *config);
+void dump_capture(Configuration *config, string file);
+void dump_timeseries(Configuration *config, string file);
+vector<string> list_rtlsdr_devices();
+vector<string> list_serial_ttys();
 void list_fields(Configuration *config, string meter_type);
 void list_shell_envs(Configuration *config, string meter_type);
 void list_meters(Configuration *config);
@@ -63,6 +77,7 @@ void open_wmbus_device_and_set_linkmodes(Configuration *config, string how, Dete
 void perform_auto_scan_of_serial_devices(Configuration *config);
 void perform_auto_scan_of_swradio_devices(Configuration *config);
 void regular_checkup(Configuration *config);
+bool reload_meters_and_devices(Configuration *config);
 void remove_lost_serial_devices_from_ignore_list(vector<string> &devices);
 void remove_lost_swradio_devices_from_ignore_list(vector<string> &devices);
 bool start(Configuration *config);
@@ -70,6 +85,9 @@ void start_using_config_files(string root, bool is_daemon, string device_overrid
 void start_daemon(string pid_file, string device_override, string listento_override); // Will use config files.
 void setup_log_file(Configuration *config);
 void setup_meters(Configuration *config, MeterManager *manager);
+void setup_meter_output(Configuration *config, Meter *meter);
+void setup_statistics();
+int flush_files_interval(Configuration *config);
 void write_pid(string pid_file, int pid);
 
 // The serial communication manager takes care of
@@ -110,6 +128,24 @@ shared_ptr<Printer> printer_;
 // Set as true when the warning for no detected wmbus devices has been printed.
 bool printed_warning_ = false;
 
+// Listing the ttys and the rtlsdr dongles is expensive, therefore the lists are
+// reused until a hot plug event arrives, if the kernel sends such events.
+atomic<bool> hot_plug_events_ { false };
+atomic<int> hot_plug_rescans_ { 0 };
+atomic<bool> list_devices_ { true };
+atomic<time_t> devices_listed_ { 0 };
+// The cached device lists are protected by LOCK_WMBUS_DEVICES.
+vector<string> serial_ttys_;
+vector<string> rtlsdr_devices_;
+
+// When running from the config files, a HUP reloads the meters and the devices
+// without closing the wmbus devices that are still configured.
+bool use_config_files_ = false;
+string config_root_, device_override_, listento_override_;
+volatile sig_atomic_t reload_requested_ = 0;
+// Set when the reloaded config changed more than the meters and the devices.
+bool restart_requested_ = false;
+
 int main(int argc, char **argv)
 {
     auto config = parseCommandLine(argc, argv);
@@ -166,6 +202,18 @@ provided you with this binary. Read the full license for all details.
         exit(0);
     }
 
+    if (config->dump_capture != "")
+    {
+        dump_capture(config.get(), config->dump_capture);
+        exit(0);
+    }
+
+    if (config->dump_timeseries != "")
+    {
+        dump_timeseries(config.get(), config->dump_timeseries);
+        exit(0);
+    }
+
     if (config->need_help)
     {
         printf("wmbusmeters version: " VERSION "\n");
@@ -181,6 +229,24 @@ provided you with this binary. Read the full license for all details.
         exit(0);
     }
 
+    if (config->bulk)
+    {
+        if (config->useconfig)
+        {
+            shared_ptr<Configuration> c = loadConfiguration(config->config_root, "", "");
+            c->bulk = true;
+            c->bulk_threads = config->bulk_threads;
+            c->bulk_files = config->bulk_files;
+            c->verbose |= config->verbose;
+            bulk_decode(c.get());
+        }
+        else
+        {
+            bulk_decode(config.get());
+        }
+        exit(0);
+    }
+
     if (config->useconfig)
     {
         start_using_config_files(config->config_root, false, config->device_override, config->listento_override);
@@ -300,7 +366,7 @@ void check_for_dead_wmbus_devices(Configuration *config)
     }
 }
 
-shared_ptr<Meter> create_meter(Configuration *config, MeterType type, MeterInfo *mi, const char *keymsg)
+shared_ptr<Meter> create_meter(Configuration *config, MeterType type, MeterInfo *mi)
 {
     shared_ptr<Meter> newm;
 
@@ -311,8 +377,6 @@ shared_ptr<Meter> create_meter(Configuration *config, MeterType type, MeterInfo
         {                                                  \
             newm = create##cname(*mi);                      \
             newm->addConversions(config->conversions);     \
-            verbose("(main) configured \"%s\" \"" #mname "\" \"%s\" %s\n", \
-                    mi->name.c_str(), mi->id.c_str(), keymsg);              \
             return newm;                                                \
         }                                                               \
         break;
@@ -325,6 +389,14 @@ LIST_OF_METERS
     return newm;
 }
 
+// The meters are created in parallel, thus they are logged afterwards in the configured order.
+void log_configured_meter(MeterInfo *mi)
+{
+    const char *keymsg = (mi->key[0] == 0) ? "not-encrypted" : "encrypted";
+    verbose("(main) configured \"%s\" \"%s\" \"%s\" %s\n",
+            mi->name.c_str(), toMeterName(toMeterType(mi->type)).c_str(), mi->id.c_str(), keymsg);
+}
+
 shared_ptr<WMBus> create_wmbus_object(Detected *detected, Configuration *config,
                                       shared_ptr<SerialCommunicationManager> manager)
 {
@@ -491,15 +563,29 @@ shared_ptr<WMBus> create_wmbus_object(Detected *detected, Configuration *config,
     return wmbus;
 }
 
+bool has_shells(Configuration *config)
+{
+    if (config->telegram_shells.size() > 0 || config->telegram_shellpipes.size() > 0) return true;
+    for (auto &m : config->meters)
+    {
+        if (m.shells.size() > 0) return true;
+    }
+    return false;
+}
+
 shared_ptr<Printer> create_printer(Configuration *config)
 {
     return shared_ptr<Printer>(new Printer(config->json, config->fields,
                                            config->separator, config->meterfiles, config->meterfiles_dir,
                                            config->use_logfile, config->logfile,
                                            config->telegram_shells,
+                                           config->telegram_shellpipes,
                                            config->meterfiles_action == MeterFileType::Overwrite,
                                            config->meterfiles_naming,
-                                           config->meterfiles_timestamp));
+                                           config->meterfiles_timestamp,
+                                           config->flushfiles_ms,
+                                           config->flushfiles_bytes,
+                                           config->timeseries_dir));
 }
 
 void detect_and_configure_wmbus_devices(Configuration *config, DetectionType dt)
@@ -575,7 +661,7 @@ void detect_and_configure_wmbus_devices(Configuration *config, DetectionType dt)
             if (not_serial_wmbus_devices_.count(specified_device.file) > 0)
             {
                 // Enumerate all serial devices that might connect to a wmbus device.
-                vector<string> ttys = serial_manager_->listSerialTTYs();
+                vector<string> ttys = list_serial_ttys();
                 // Did a non-wmbus-device get unplugged? Then remove it from the known-not-wmbus-device set.
                 remove_lost_serial_devices_from_ignore_list(ttys);
                 if (not_serial_wmbus_devices_.count(specified_device.file) > 0)
@@ -709,8 +795,9 @@ void list_shell_envs(Configuration *config, string meter_type)
     vector<string> envs;
     Telegram t;
     MeterInfo mi;
-    shared_ptr<Meter> meter = create_meter(config, toMeterType(meter_type), &mi, "");
+    shared_ptr<Meter> meter = create_meter(config, toMeterType(meter_type), &mi);
     meter->printMeter(&t,
+                      OUTPUT_ENVS,
                       &ignore1,
                       &ignore2, config->separator,
                       &ignore3,
@@ -729,7 +816,7 @@ void list_shell_envs(Configuration *config, string meter_type)
 void list_fields(Configuration *config, string meter_type)
 {
     MeterInfo mi;
-    shared_ptr<Meter> meter = create_meter(config, toMeterType(meter_type), &mi, "");
+    shared_ptr<Meter> meter = create_meter(config, toMeterType(meter_type), &mi);
 
     int width = 0;
     for (auto &p : meter->prints())
@@ -770,6 +857,133 @@ LIST_OF_METERS
 #undef X
 }
 
+void dump_capture(Configuration *config, string file)
+{
+    CaptureReader capture;
+    if (!capture.open(file))
+    {
+        error("Not a capture file \"%s\"\n", file.c_str());
+    }
+
+    // Print the telegrams as a simulation file, with --verbose
+    // also the receiver, rssi and time of each telegram.
+    uint64_t first_us = 0;
+    auto print = [&](CaptureRecord &rec)
+        {
+            if (first_us == 0) first_us = rec.timestamp_us;
+            if (config->verbose)
+            {
+                time_t t = rec.timestamp_us/1000000;
+                struct tm tm;
+                gmtime_r(&t, &tm);
+                char ts[32];
+                strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+                printf("# %s.%06dZ receiver=%s rssi_dbm=%d\n", ts, (int)(rec.timestamp_us%1000000),
+                       rec.receiver.c_str(), rec.rssi_dbm);
+            }
+            string hex = bin2hex(rec.frame, rec.len);
+            printf("telegram=|%s|+%" PRIu64 "\n", hex.c_str(), (rec.timestamp_us-first_us)/1000000);
+            return true;
+        };
+
+    bool ok;
+    if (config->dump_capture_id == "" && config->dump_capture_from == 0 && config->dump_capture_to == 0)
+    {
+        ok = capture.forEach(print);
+    }
+    else
+    {
+        // The index blocks let find skip the blocks without the id or outside the time.
+        uint64_t from_us = (uint64_t)config->dump_capture_from*1000000;
+        uint64_t to_us = config->dump_capture_to == 0 ? UINT64_MAX : (uint64_t)config->dump_capture_to*1000000+999999;
+        if (config->dump_capture_id != "")
+        {
+            uint32_t id = strtoul(config->dump_capture_id.c_str(), NULL, 16);
+            ok = capture.find(id, from_us, to_us, print);
+        }
+        else
+        {
+            ok = capture.find(from_us, to_us, print);
+        }
+    }
+    if (!ok)
+    {
+        warning("The capture \"%s\" is truncated or broken.\n", file.c_str());
+    }
+}
+
+void dump_timeseries(Configuration *config, string file)
+{
+    TimeSeriesReader reader;
+    vector<TimeSeriesChunk> chunks;
+    if (!reader.open(file))
+    {
+        error("Cannot read time series file \"%s\"\n", file.c_str());
+    }
+    bool ok = reader.chunks(&chunks);
+
+    // Print the readings with the separator, a new header line is
+    // printed whenever the columns change.
+    char sep = config->separator;
+    string prev_header;
+    for (auto &c : chunks)
+    {
+        string header = "timestamp";
+        header += sep;
+        header += "meter";
+        for (auto &col : c.columns)
+        {
+            header += sep;
+            header += col.name;
+        }
+        if (header != prev_header)
+        {
+            printf("%s\n", header.c_str());
+            prev_header = header;
+        }
+
+        vector<int64_t> ts;
+        vector<vector<double>> doubles(c.columns.size());
+        vector<vector<string>> strings(c.columns.size());
+        bool decoded = reader.timestamps(c, &ts);
+        for (size_t i=0; i<c.columns.size(); ++i)
+        {
+            if (c.columns[i].kind == TIMESERIES_DOUBLE) decoded &= reader.doubles(c, c.columns[i], &doubles[i]);
+            else decoded &= reader.strings(c, c.columns[i], &strings[i]);
+        }
+        if (!decoded)
+        {
+            ok = false;
+            break;
+        }
+        for (size_t r=0; r<c.rows; ++r)
+        {
+            string line = to_string(ts[r]);
+            line += sep;
+            line += c.meter_type;
+            for (size_t i=0; i<c.columns.size(); ++i)
+            {
+                line += sep;
+                if (c.columns[i].kind == TIMESERIES_DOUBLE)
+                {
+                    char buf[32];
+                    snprintf(buf, sizeof(buf), "%.15g", doubles[i][r]);
+                    line += buf;
+                }
+                else
+                {
+                    line += strings[i][r];
+                }
+            }
+            printf("%s\n", line.c_str());
+        }
+    }
+    if (!ok)
+    {
+        warning("The time series \"%s\" is truncated or broken.\n", file.c_str());
+    }
+}
+
 void log_start_information(Configuration *config)
 {
     verbose("(wmbusmeters) version: " VERSION "\n");
@@ -904,14 +1118,43 @@ void open_wmbus_device_and_set_linkmodes(Configuration *config, string how, Dete
         debug("(main) added %s to files\n", detected->found_file.c_str());
         simulation_files_.insert(detected->specified_device.file);
     }
-    wmbus->onTelegram([&, simulated](AboutTelegram &about,vector<uchar> data){return meter_manager_->handleTelegram(about, data, simulated);});
+    wmbus->onTelegram([&, simulated](AboutTelegram &about,vector<uchar> &data){return meter_manager_->handleTelegram(about, data, simulated);});
     wmbus->setTimeout(config->alarm_timeout, config->alarm_expected_activity);
 }
 
+vector<string> list_serial_ttys()
+{
+    if (list_devices_)
+    {
+        // Listing the ttys takes the serial lock, thus it is done outside of the wmbus lock.
+        vector<string> ttys = serial_manager_->listSerialTTYs();
+        devices_listed_ = time(NULL);
+        LOCK_WMBUS_DEVICES(list_serial_ttys);
+        serial_ttys_ = ttys;
+        return serial_ttys_;
+    }
+    LOCK_WMBUS_DEVICES(list_serial_ttys);
+    return serial_ttys_;
+}
+
+vector<string> list_rtlsdr_devices()
+{
+    if (list_devices_)
+    {
+        vector<string> devices = listRtlSdrDevices();
+        devices_listed_ = time(NULL);
+        LOCK_WMBUS_DEVICES(list_rtlsdr_devices);
+        rtlsdr_devices_ = devices;
+        return rtlsdr_devices_;
+    }
+    LOCK_WMBUS_DEVICES(list_rtlsdr_devices);
+    return rtlsdr_devices_;
+}
+
 void perform_auto_scan_of_serial_devices(Configuration *config)
 {
     // Enumerate all serial devices that might connect to a wmbus device.
-    vector<string> ttys = serial_manager_->listSerialTTYs();
+    vector<string> ttys = list_serial_ttys();
 
     // Did a non-wmbus-device get unplugged? Then remove it from the known-not-wmbus-device set.
     remove_lost_serial_devices_from_ignore_list(ttys);
@@ -971,7 +1214,7 @@ void perform_auto_scan_of_serial_devices(Configuration *config)
 void perform_auto_scan_of_swradio_devices(Configuration *config)
 {
     // Enumerate all swradio devices, that can be used.
-    vector<string> serialnrs = listRtlSdrDevices();
+    vector<string> serialnrs = list_rtlsdr_devices();
 
     // Did an unavailable swradio-device get unplugged? Then remove it from the known-not-swradio-device set.
     remove_lost_swradio_devices_from_ignore_list(serialnrs);
@@ -1012,6 +1255,34 @@ void perform_auto_scan_of_swradio_devices(Configuration *config)
     }
 }
 
+// Write the statistics this often with --stats=<dir>.
+#define STATISTICS_INTERVAL_SECONDS 10
+
+void setup_statistics()
+{
+    // The per receiver and per driver counters are collected where they happen,
+    // these values are sampled from the queues and the process when written.
+    addStatisticsValue("decode_queue_depth", "Telegrams waiting for the decode threads.", false,
+                       [](){ return meter_manager_->decodeStatistics().queued; });
+    addStatisticsValue("decode_queue_peak", "The most telegrams waiting in a decode queue.", false,
+                       [](){ return meter_manager_->decodeStatistics().peak_queued; });
+    addStatisticsValue("decode_dropped", "Telegrams dropped since a decode queue was full.", true,
+                       [](){ return meter_manager_->decodeStatistics().dropped; });
+    addStatisticsValue("output_queue_depth", "Outputs waiting for the output thread.", false,
+                       [](){ return printer_->queuedOutputs(); });
+    addStatisticsValue("duplicates_ignored", "Duplicate telegrams ignored.", true,
+                       [](){ DuplicateCache *dc = duplicateCache(); return dc ? dc->hits() : 0; });
+    addStatisticsValue("rss_bytes", "Resident set size.", false,
+                       [](){ return getCurrentRSS(); });
+    addStatisticsValue("peak_rss_bytes", "Peak resident set size.", false,
+                       [](){ return getPeakRSS(); });
+    addStatisticsValue("heap_bytes", "Heap bytes in use.", false,
+                       [](){ return getHeapBytes(); });
+    enableAllocationCounting();
+    addStatisticsValue("allocations", "Heap allocations.", true,
+                       [](){ return numAllocations(); });
+}
+
 time_t last_info_print_ = 0;
 
 void regular_checkup(Configuration *config)
@@ -1031,9 +1302,32 @@ void regular_checkup(Configuration *config)
         }
     }
 
+    reapShellPipes();
+
+    if (reload_requested_ && serial_manager_ && config)
+    {
+        reload_requested_ = 0;
+        if (!reload_meters_and_devices(config))
+        {
+            restart_requested_ = true;
+            serial_manager_->stop();
+            return;
+        }
+    }
+
     if (serial_manager_ && config)
     {
+        if (hot_plug_rescans_ > 0)
+        {
+            hot_plug_rescans_--;
+            list_devices_ = true;
+        }
+        if (!hot_plug_events_ || time(NULL)-devices_listed_ >= HOT_PLUG_FALLBACK_SECONDS)
+        {
+            list_devices_ = true;
+        }
         detect_and_configure_wmbus_devices(config, DetectionType::ALL);
+        list_devices_ = false;
     }
 
     {
@@ -1049,6 +1343,167 @@ void regular_checkup(Configuration *config)
     }
 }
 
+// Meters with exactly the same config are kept, with their state, over a reload.
+static string meter_info_key(MeterInfo &mi)
+{
+    string k = mi.name+'\0'+mi.type+'\0'+mi.id+'\0'+mi.key+'\0'+to_string(mi.link_modes.asBits());
+    for (auto &s : mi.shells) k += '\0'+s;
+    k += '\1';
+    for (auto &j : mi.jsons) k += '\0'+j;
+    return k;
+}
+
+// A wmbus device is kept open if it is still specified, or if it was found
+// by the auto detection and the auto detection is still enabled.
+static bool still_specified(Configuration *old_config, Configuration *new_config, Detected *detected)
+{
+    string s = detected->specified_device.str();
+    for (SpecifiedDevice &sd : new_config->supplied_wmbus_devices)
+    {
+        if (sd.str() == s) return true;
+    }
+    if (!new_config->use_auto_device_detect) return false;
+    for (SpecifiedDevice &sd : old_config->supplied_wmbus_devices)
+    {
+        if (sd.str() == s) return false;
+    }
+    return true;
+}
+
+static string devices_signature(Configuration *config)
+{
+    string s = config->use_auto_device_detect ? "auto:"+config->auto_device_linkmodes.hr() : "";
+    for (SpecifiedDevice &sd : config->supplied_wmbus_devices) s += " "+sd.str();
+    return s;
+}
+
+// Stdin, files, simulations and commands are only opened once, and the auto
+// detection probes every tty again, thus a change of these devices needs a restart.
+// A command is looked up using its index, thus the index must not change either.
+static string fixed_devices_signature(Configuration *config)
+{
+    string s = config->use_auto_device_detect ? "auto:"+config->auto_device_linkmodes.hr() : "";
+    for (SpecifiedDevice &sd : config->supplied_wmbus_devices)
+    {
+        if (sd.is_stdin || sd.is_file || sd.is_simulation || sd.command != "")
+        {
+            s += " "+to_string(sd.index)+":"+sd.str();
+        }
+    }
+    return s;
+}
+
+bool reload_meters_and_devices(Configuration *config)
+{
+    shared_ptr<Configuration> nc = loadConfiguration(config_root_, device_override_, listento_override_);
+
+    for (MeterInfo &m : nc->meters)
+    {
+        // Creating the meter, also when restarting, exits on an unknown type.
+        // Thus a typo in a meter file keeps the running config instead of stopping the daemon.
+        if (toMeterType(m.type) == MeterType::UNKNOWN)
+        {
+            notice("(wmbusmeters) no such meter type \"%s\" for meter \"%s\", keeping the running config.\n",
+                   m.type.c_str(), m.name.c_str());
+            return true;
+        }
+    }
+    if (nc->settings != config->settings)
+    {
+        notice("(wmbusmeters) settings changed, the config cannot be reloaded without a restart.\n");
+        return false;
+    }
+    if (nc->meters.empty() != config->meters.empty())
+    {
+        // Switching between decoding meters and printing the ids of all telegrams.
+        notice("(wmbusmeters) meters added to or removed from none, the config cannot be reloaded without a restart.\n");
+        return false;
+    }
+    if (has_shells(nc.get()) != has_shells(config))
+    {
+        // The output thread, which keeps the shells from stalling the decoding, is only started at start.
+        notice("(wmbusmeters) shells added or removed, the config cannot be reloaded without a restart.\n");
+        return false;
+    }
+    if (fixed_devices_signature(nc.get()) != fixed_devices_signature(config))
+    {
+        notice("(wmbusmeters) devices changed, the config cannot be reloaded without a restart.\n");
+        return false;
+    }
+    string old_devices = devices_signature(config);
+    string new_devices = devices_signature(nc.get());
+
+    // The running meters are in the same order as the meters in the running config.
+    vector<shared_ptr<Meter>> running = meter_manager_->meters();
+    assert(running.size() == config->meters.size());
+    multimap<string,size_t> running_index;
+    for (size_t i = 0; i < config->meters.size(); ++i)
+    {
+        running_index.insert({ meter_info_key(config->meters[i]), i });
+    }
+
+    vector<shared_ptr<Meter>> meters(nc->meters.size());
+    vector<size_t> added;
+    for (size_t i = 0; i < nc->meters.size(); ++i)
+    {
+        auto r = running_index.find(meter_info_key(nc->meters[i]));
+        if (r != running_index.end())
+        {
+            meters[i] = running[r->second];
+            running_index.erase(r);
+        }
+        else
+        {
+            added.push_back(i);
+        }
+    }
+    parallelFor(added.size(), startupThreads(added.size()), [&](size_t i)
+        {
+            MeterInfo &m = nc->meters[added[i]];
+            meters[added[i]] = create_meter(config, toMeterType(m.type), &m);
+        });
+    MeterKeys::forgetDecodedKeys();
+    for (size_t i : added)
+    {
+        log_configured_meter(&nc->meters[i]);
+        setup_meter_output(config, meters[i].get());
+    }
+    meter_manager_->replaceMeters(meters);
+    config->meters = nc->meters;
+
+    notice("(wmbusmeters) HUP received, reloaded config, %zu meters added %zu removed %zu kept.\n",
+           added.size(), running_index.size(), meters.size()-added.size());
+
+    if (old_devices != new_devices)
+    {
+        {
+            LOCK_WMBUS_DEVICES(reload_meters_and_devices);
+
+            vector<WMBus*> removed;
+            for (auto &w : wmbus_devices_)
+            {
+                if (!still_specified(config, nc.get(), w->getDetected()))
+                {
+                    notice("(wmbusmeters) closing %s no longer in config\n", w->hr().c_str());
+                    w->close();
+                    removed.push_back(w.get());
+                }
+            }
+            for (auto w : removed)
+            {
+                auto i = find_if(wmbus_devices_.begin(), wmbus_devices_.end(),
+                                 [w](shared_ptr<WMBus> &p) { return p.get() == w; });
+                wmbus_devices_.erase(i);
+            }
+        }
+        config->supplied_wmbus_devices = nc->supplied_wmbus_devices;
+        config->all_device_linkmodes_specified = nc->all_device_linkmodes_specified;
+        // The new devices are opened by the regular checkup, right after the reload.
+        list_devices_ = true;
+    }
+    return true;
+}
+
 void remove_lost_serial_devices_from_ignore_list(vector<string> &devices)
 {
     vector<string> to_be_removed;
@@ -1119,12 +1574,165 @@ void setup_log_file(Configuration *config)
 
 void setup_meters(Configuration *config, MeterManager *manager)
 {
-    for (auto &m : config->meters)
+    // Create the meters in parallel, but add them in the configured order.
+    vector<shared_ptr<Meter>> meters(config->meters.size());
+    parallelFor(meters.size(), startupThreads(meters.size()), [&](size_t i)
+        {
+            MeterInfo &m = config->meters[i];
+            meters[i] = create_meter(config, toMeterType(m.type), &m);
+        });
+    MeterKeys::forgetDecodedKeys();
+    for (size_t i = 0; i < meters.size(); ++i)
+    {
+        log_configured_meter(&config->meters[i]);
+        manager->addMeter(meters[i]);
+    }
+}
+
+// Attach a received-telegram-callback from the meter to the printer.
+void setup_meter_output(Configuration *config, Meter *meter)
+{
+    meter->onUpdate([config](Telegram *t,Meter *meter)
+                    {
+                        printer_->print(t, meter, &config->jsons, &config->selected_fields);
+                        oneshot_check(config, t, meter);
+                    });
+}
+
+#define MAX_QUEUED_TELEGRAMS_PER_BULK_THREAD 1000
+
+struct BulkWork
+{
+    AboutTelegram about;
+    vector<uchar> frame;
+};
+
+// Every bulk thread has its own meters, created from the same configuration.
+// Thus a meter configured with a wildcard id is decoded in parallel as well.
+struct BulkThread
+{
+    BoundedQueue<BulkWork> queue { "bulk_queue", MAX_QUEUED_TELEGRAMS_PER_BULK_THREAD };
+    shared_ptr<MeterManager> meters;
+    function<void()> loop;
+    pthread_t thread {};
+};
+
+void bulk_decode(Configuration *config)
+{
+    silentLogging(config->silent);
+    verboseEnabled(config->verbose);
+    debugEnabled(config->debug);
+    traceEnabled(config->trace);
+    stderrEnabled(config->use_stderr_for_log);
+    setIgnoreDuplicateTelegrams(config->ignore_duplicates_window, config->duplicate_cache_size);
+
+    int num_threads = config->bulk_threads;
+    if (num_threads <= 0) num_threads = max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+
+    // Write the output in large blocks, unless a flush policy was configured.
+    if (config->flushfiles_ms == 0 && config->flushfiles_bytes == 0)
+    {
+        config->flushfiles_bytes = 1024*1024;
+    }
+    setvbuf(stdout, NULL, _IOFBF, 1024*1024);
+
+    printer_ = create_printer(config);
+    printer_->startOutputThread();
+
+    vector<unique_ptr<BulkThread>> threads;
+    for (int i=0; i<num_threads; ++i)
+    {
+        BulkThread *bt = new BulkThread();
+        bt->meters = createMeterManager();
+        setup_meters(config, bt->meters.get());
+        bt->meters->forEachMeter(
+            [&](Meter *meter)
+            {
+                meter->onUpdate([&](Telegram *t,Meter *meter)
+                                {
+                                    printer_->print(t, meter, &config->jsons, &config->selected_fields);
+                                });
+            });
+        bt->loop = [bt]()
+            {
+                BulkWork work;
+                while (bt->queue.pop(&work))
+                {
+                    bt->meters->handleTelegram(work.about, work.frame, false);
+                }
+            };
+        threads.push_back(unique_ptr<BulkThread>(bt));
+        bt->thread = startWorkerThread(&bt->loop);
+    }
+
+    auto start = chrono::steady_clock::now();
+    size_t num_telegrams = 0;
+    DuplicateCache *dc = duplicateCache();
+    for (string &file : config->bulk_files)
+    {
+        CaptureReader capture;
+        if (!capture.open(file))
+        {
+            error("Not a capture file \"%s\"\n", file.c_str());
+        }
+        bool ok = capture.forEach([&](CaptureRecord &rec)
+            {
+                BulkWork work;
+                work.about = AboutTelegram(rec.receiver, rec.rssi_dbm);
+                work.about.timestamp = rec.timestamp_us/1000000;
+                work.frame.assign(rec.frame, rec.frame+rec.len);
+                if (dc && dc->seenBefore(work.frame, chrono::steady_clock::time_point(chrono::microseconds(rec.timestamp_us))))
+                {
+                    return true;
+                }
+                // The telegrams from a meter always go to the same thread, thus they are decoded in order.
+                threads[rec.id % num_threads]->queue.push(std::move(work), true);
+                num_telegrams++;
+                return true;
+            });
+        if (!ok)
+        {
+            warning("The capture \"%s\" is truncated or broken.\n", file.c_str());
+        }
+    }
+
+    for (auto &bt : threads) bt->queue.close();
+    for (auto &bt : threads) pthread_join(bt->thread, NULL);
+    printer_->stopOutputThread();
+    printer_.reset();
+    fflush(stdout);
+    if (config->stats_dir != "") writeStatistics(config->stats_dir);
+
+    double s = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    verbose("(bulk) decoded %zu telegrams from %zu files in %.3f s using %d threads, %.0f telegrams/s\n",
+            num_telegrams, config->bulk_files.size(), s, num_threads, s > 0 ? num_telegrams/s : 0);
+}
+
+// The files kept open between telegrams need a regular callback, to flush them when
+// flushing by time, to check if they have been moved, to write old time series chunks
+// and to write the buffered capture. Returns the interval in seconds, 0 if not needed.
+int flush_files_interval(Configuration *config)
+{
+    int interval = 0;
+    auto need = [&](int seconds)
+        {
+            if (interval == 0 || seconds < interval) interval = seconds;
+        };
+    int flush_seconds = max(1, config->flushfiles_ms/1000);
+
+    if (config->meterfiles || config->use_logfile)
+    {
+        need(config->flushfiles_ms > 0 ? flush_seconds : CHECK_MOVED_FILES_SECONDS);
+    }
+    if (config->timeseries_dir != "")
+    {
+        need(config->flushfiles_ms > 0 ? flush_seconds : CHECK_MOVED_FILES_SECONDS);
+    }
+    if (captureWriter())
     {
-        const char *keymsg = (m.key[0] == 0) ? "not-encrypted" : "encrypted";
-        auto meter = create_meter(config, toMeterType(m.type), &m, keymsg);
-        manager->addMeter(meter);
+        need(config->flushfiles_ms > 0 ? flush_seconds : 1);
     }
+    return interval;
 }
 
 bool start(Configuration *config)
@@ -1146,7 +1754,10 @@ bool start(Configuration *config)
     traceEnabled(config->trace);
     stderrEnabled(config->use_stderr_for_log);
     setAlarmShells(config->alarm_shells);
-    setIgnoreDuplicateTelegrams(config->ignore_duplicate_telegrams);
+    setIgnoreDuplicateTelegrams(config->ignore_duplicates_window, config->duplicate_cache_size);
+    setCombineTelegrams(config->combine_telegrams_ms);
+    setReplay(config->replay_speed);
+    setCapture(config->capture_file);
 
     log_start_information(config);
 
@@ -1155,6 +1766,11 @@ bool start(Configuration *config)
     // If our software unexpectedly exits, then stop the manager, to try
     // to achive a nice shutdown.
     onExit(call(serial_manager_.get(),stop));
+    if (use_config_files_)
+    {
+        // The reload is done by the regular checkup, outside of the signal handler.
+        onHup([](){ reload_requested_ = 1; });
+    }
     //serial_manager_->eachEventLooping([]() { check_statuses(); });
 
     // Create the printer object that knows how to translate
@@ -1169,20 +1785,22 @@ bool start(Configuration *config)
 
     // Attach a received-telegram-callback from the meter and
     // attach it to the printer.
-    meter_manager_->forEachMeter(
-        [&](Meter *meter)
-        {
-            meter->onUpdate([&](Telegram *t,Meter *meter)
-                            {
-                                printer_->print(t, meter, &config->jsons, &config->selected_fields);
-                                oneshot_check(config, t, meter);
-                            });
-        }
-        );
+    meter_manager_->forEachMeter([config](Meter *meter) { setup_meter_output(config, meter); });
+
+    if (config->decodethreads > 0 || has_shells(config))
+    {
+        // Invoking the shells must not stall the reception of telegrams.
+        printer_->startOutputThread();
+    }
+    if (config->decodethreads > 0)
+    {
+        meter_manager_->startDecodeThreads(config->decodethreads);
+    }
 
     // Detect and initialize any devices.
     // Future changes are triggered through this callback.
     printed_warning_ = true;
+    list_devices_ = true;
 
     detect_and_configure_wmbus_devices(config, DetectionType::STDIN_FILE_SIMULATION);
 
@@ -1203,6 +1821,11 @@ bool start(Configuration *config)
         }
     }
 
+    // The devices are listed again when the kernel reports that a tty or usb device
+    // was plugged in or removed. Without such events they are listed every checkup.
+    hot_plug_events_ = serial_manager_->onHotPlug([](){ hot_plug_rescans_ = HOT_PLUG_RESCANS; });
+    if (hot_plug_events_) debug("(main) listing devices on hot plug events\n");
+
     // Every 2 seconds detect any plugged in or removed wmbus devices.
     serial_manager_->startRegularCallback("HOT_PLUG_DETECTOR",
                                   2,
@@ -1210,6 +1833,30 @@ bool start(Configuration *config)
                                       regular_checkup(config);
                                   });
 
+    if (config->stats_dir != "")
+    {
+        setup_statistics();
+        serial_manager_->startRegularCallback("STATISTICS",
+                                              STATISTICS_INTERVAL_SECONDS,
+                                              [&](){
+                                                  writeStatistics(config->stats_dir);
+                                              });
+    }
+
+    int flush_interval = flush_files_interval(config);
+    if (flush_interval > 0)
+    {
+        // The meter files, the logfile, the capture and the time series chunks
+        // are kept open between telegrams.
+        serial_manager_->startRegularCallback("FLUSH_FILES",
+                                              flush_interval,
+                                              [&](){
+                                                  printer_->flushFiles();
+                                                  CaptureWriter *cw = captureWriter();
+                                                  if (cw) cw->flush();
+                                              });
+    }
+
     if (config->daemon)
     {
         notice("(wmbusmeters) waiting for telegrams\n");
@@ -1219,7 +1866,7 @@ bool start(Configuration *config)
     {
         notice("No meters configured. Printing id:s of all telegrams heard!\n");
 
-        meter_manager_->onTelegram([](AboutTelegram &about, vector<uchar> frame) {
+        meter_manager_->onTelegram([](AboutTelegram &about, vector<uchar> &frame) {
                 Telegram t;
                 t.about = about;
                 MeterKeys mk;
@@ -1245,6 +1892,41 @@ bool start(Configuration *config)
     // the alarm checks, is started in a separate thread.
     serial_manager_->waitForStop();
 
+    // Finish decoding and printing the telegrams already received.
+    TelegramCombiner *tc = telegramCombiner();
+    if (tc)
+    {
+        tc->stop();
+        for (auto &p : tc->receiverStatistics())
+        {
+            verbose("(wmbusmeters) %s received %zu telegrams, %zu with the best rssi.\n",
+                    p.first.c_str(), p.second.received, p.second.best);
+        }
+    }
+    meter_manager_->stopDecodeThreads();
+    printer_->stopOutputThread();
+    setCapture("");
+
+    ReplayStatistics *rs = replayStatistics();
+    if (rs)
+    {
+        rs->end();
+        rs->report();
+    }
+
+    if (config->stats_dir != "")
+    {
+        writeStatistics(config->stats_dir);
+        removeStatisticsValues();
+    }
+
+    DuplicateCache *dc = duplicateCache();
+    if (dc)
+    {
+        verbose("(wmbusmeters) ignored %" PRIu64 " duplicate telegrams and passed on %" PRIu64 " telegrams.\n",
+                dc->hits(), dc->misses());
+    }
+
     if (config->daemon)
     {
         notice("(wmbusmeters) shutting down\n");
@@ -1257,7 +1939,10 @@ bool start(Configuration *config)
     serial_manager_.reset();
 
     restoreSignalHandlers();
-    return gotHupped();
+    bool restart = gotHupped() || restart_requested_;
+    restart_requested_ = false;
+    reload_requested_ = 0;
+    return restart;
 }
 
 void start_daemon(string pid_file, string device_override, string listento_override)
@@ -1315,6 +2000,11 @@ void start_daemon(string pid_file, string device_override, string listento_overr
 
 void start_using_config_files(string root, bool is_daemon, string device_override, string listento_override)
 {
+    use_config_files_ = true;
+    config_root_ = root;
+    device_override_ = device_override;
+    listento_override_ = listento_override;
+
     bool restart = false;
     do
     {
@@ -80,12 +80,12 @@ void MeterApator08::processContent(Telegram *t)
     vector<uchar> content;
     t->extractPayload(&content);
 
-    map<string,pair<int,DVEntry>> vendor_values;
+    DVEntries vendor_values;
 
     string total;
     strprintf(total, "%02x%02x%02x%02x", content[0], content[1], content[2], content[3]);
 
-    vendor_values["0413"] = { 25, DVEntry(MeasurementType::Instantaneous, 0x13, 0, 0, 0, total) };
+    vendor_values.set("0413", 25, MeasurementType::Instantaneous, 0x13, 0, 0, 0, total);
     int offset;
     string key;
     if(findKey(MeasurementType::Unknown, ValueInformation::Volume, 0, 0, &key, &vendor_values))
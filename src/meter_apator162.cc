@@ -76,7 +76,7 @@ void MeterApator162::processContent(Telegram *t)
 
     t->extractPayload(&content);
 
-    map<string,pair<int,DVEntry>> vendor_values;
+    DVEntries vendor_values;
 
     string total;
     // Current assumption of this proprietary protocol is that byte 13 tells
@@ -165,7 +165,7 @@ void MeterApator162::processContent(Telegram *t)
         debug("(apator162) adjusting to offset %d instead\n", o);
     }
 
-    vendor_values["0413"] = { 25, DVEntry(MeasurementType::Instantaneous, 0x13, 0, 0, 0, total) };
+    vendor_values.set("0413", 25, MeasurementType::Instantaneous, 0x13, 0, 0, 0, total);
     int offset;
     string key;
     if(findKey(MeasurementType::Unknown, ValueInformation::Volume, 0, 0, &key, &vendor_values))
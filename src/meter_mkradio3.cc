@@ -69,7 +69,7 @@ void MKRadio3::processContent(Telegram *t)
     // simple wrapped inside a wmbus telegram since the ci-field is 0xa2.
     // Which means that the entire payload is manufacturer specific.
 
-    map<string,pair<int,DVEntry>> vendor_values;
+    DVEntries vendor_values;
     vector<uchar> content;
 
     t->extractPayload(&content);
@@ -81,8 +81,8 @@ void MKRadio3::processContent(Telegram *t)
     string prevs;
     strprintf(prevs, "%02x%02x", prev_lo, prev_hi);
     int offset = t->parsed.size()+3;
-    vendor_values["0215"] = { offset, DVEntry(MeasurementType::Instantaneous, 0x15, 0, 0, 0, prevs) };
-    t->explanations.push_back({ offset, prevs });
+    vendor_values.set("0215", offset, MeasurementType::Instantaneous, 0x15, 0, 0, 0, prevs);
+    if (t->explaining()) t->explanations.push_back({ offset, prevs });
     t->addMoreExplanation(offset, " prev consumption (%f m3)", prev);
 
     uchar curr_lo = content[7];
@@ -92,8 +92,8 @@ void MKRadio3::processContent(Telegram *t)
     string currs;
     strprintf(currs, "%02x%02x", curr_lo, curr_hi);
     offset = t->parsed.size()+7;
-    vendor_values["0215"] = { offset, DVEntry(MeasurementType::Instantaneous, 0x15, 0, 0, 0, currs) };
-    t->explanations.push_back({ offset, currs });
+    vendor_values.set("0215", offset, MeasurementType::Instantaneous, 0x15, 0, 0, 0, currs);
+    if (t->explaining()) t->explanations.push_back({ offset, currs });
     t->addMoreExplanation(offset, " curr consumption (%f m3)", curr);
 
     total_water_consumption_m3_ = prev+curr;
@@ -94,7 +94,7 @@ void MeterVario451::processContent(Telegram *t)
     // simple wrapped inside a wmbus telegram since the ci-field is 0xa2.
     // Which means that the entire payload is manufacturer specific.
 
-    map<string,pair<int,DVEntry>> vendor_values;
+    DVEntries vendor_values;
     vector<uchar> content;
 
     t->extractPayload(&content);
@@ -105,8 +105,8 @@ void MeterVario451::processContent(Telegram *t)
     string prevs;
     strprintf(prevs, "%02x%02x", prev_lo, prev_hi);
     int offset = t->parsed.size()+3;
-    vendor_values["0215"] = { offset, DVEntry(MeasurementType::Instantaneous, 0x15, 0, 0, 0, prevs) };
-    t->explanations.push_back({ offset, prevs });
+    vendor_values.set("0215", offset, MeasurementType::Instantaneous, 0x15, 0, 0, 0, prevs);
+    if (t->explaining()) t->explanations.push_back({ offset, prevs });
     t->addMoreExplanation(offset, " energy used in previous billing period (%f GJ)", prev);
 
     uchar curr_lo = content[7];
@@ -116,8 +116,8 @@ void MeterVario451::processContent(Telegram *t)
     string currs;
     strprintf(currs, "%02x%02x", curr_lo, curr_hi);
     offset = t->parsed.size()+7;
-    vendor_values["0215"] = { offset, DVEntry(MeasurementType::Instantaneous, 0x15, 0, 0, 0, currs) };
-    t->explanations.push_back({ offset, currs });
+    vendor_values.set("0215", offset, MeasurementType::Instantaneous, 0x15, 0, 0, 0, currs);
+    if (t->explaining()) t->explanations.push_back({ offset, currs });
     t->addMoreExplanation(offset, " energy used in current billing period (%f GJ)", curr);
 
     total_energy_gj_ = prev+curr;
@@ -15,8 +15,10 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include"dvparser.h"
 #include"meters.h"
 #include"meters_common_implementation.h"
+#include"replay.h"
 #include"units.h"
 #include"wmbus.h"
 #include"wmbus_utils.h"
@@ -25,27 +27,206 @@
 #include<memory.h>
 #include<time.h>
 #include<cmath>
+#include<unordered_map>
+
+// Maps a telegram id to the meters that might want the telegram.
+// Exact ids are found through a hash map and wildcard expressions
+// (eg 1234*) through a prefix trie walked digit by digit along the id.
+// Negated expressions are indexed the same way and veto a candidate.
+// The index only narrows down the candidates, each meter still runs
+// its own isTelegramForMe check.
+struct MeterIdIndex
+{
+    MeterIdIndex()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        exact_.clear();
+        exact_negated_.clear();
+        always_.clear();
+        trie_.clear();
+        trie_.push_back(TrieNode());
+    }
+
+    void add(size_t meter_nr, vector<string> &expressions)
+    {
+        for (auto &e : expressions)
+        {
+            string me = e;
+            bool negated = me.length() > 0 && me.front() == '!';
+            if (negated) me.erase(0, 1);
+
+            if (me.length() > 0 && me.back() != '*')
+            {
+                if (negated) exact_negated_[me].push_back(meter_nr);
+                else exact_[me].push_back(meter_nr);
+                continue;
+            }
+            int node = 0;
+            bool indexable = me.length() > 0;
+            for (size_t i = 0; indexable && i+1 < me.length(); ++i)
+            {
+                int nibble = hexNibble(me[i]);
+                if (nibble < 0)
+                {
+                    indexable = false;
+                    break;
+                }
+                if (trie_[node].children[nibble] == 0)
+                {
+                    trie_[node].children[nibble] = trie_.size();
+                    trie_.push_back(TrieNode());
+                }
+                node = trie_[node].children[nibble];
+            }
+            if (!indexable)
+            {
+                // Cannot happen for validated expressions, but stay correct
+                // by always offering the telegram to this meter.
+                if (!negated) always_.push_back(meter_nr);
+                continue;
+            }
+            if (negated) trie_[node].negated.push_back(meter_nr);
+            else trie_[node].positive.push_back(meter_nr);
+        }
+    }
+
+    // Stores the candidate meter numbers, sorted in the order the meters were added.
+    void lookup(const string &id, vector<size_t> *candidates)
+    {
+        candidates->clear();
+        if (id.length() == 0) return;
+
+        vector<size_t> vetoed;
+        candidates->insert(candidates->end(), always_.begin(), always_.end());
+        auto e = exact_.find(id);
+        if (e != exact_.end()) candidates->insert(candidates->end(), e->second.begin(), e->second.end());
+        auto n = exact_negated_.find(id);
+        if (n != exact_negated_.end()) vetoed.insert(vetoed.end(), n->second.begin(), n->second.end());
+
+        int node = 0;
+        for (size_t i = 0; ; ++i)
+        {
+            TrieNode &tn = trie_[node];
+            candidates->insert(candidates->end(), tn.positive.begin(), tn.positive.end());
+            vetoed.insert(vetoed.end(), tn.negated.begin(), tn.negated.end());
+            if (i >= id.length()) break;
+            int nibble = hexNibble(id[i]);
+            if (nibble < 0 || tn.children[nibble] == 0) break;
+            node = tn.children[nibble];
+        }
+
+        if (candidates->size() > 1)
+        {
+            sort(candidates->begin(), candidates->end());
+            candidates->erase(unique(candidates->begin(), candidates->end()), candidates->end());
+        }
+        if (vetoed.size() > 0 && candidates->size() > 0)
+        {
+            sort(vetoed.begin(), vetoed.end());
+            auto end = remove_if(candidates->begin(), candidates->end(),
+                                 [&](size_t m) { return binary_search(vetoed.begin(), vetoed.end(), m); });
+            candidates->erase(end, candidates->end());
+        }
+    }
+
+private:
+
+    struct TrieNode
+    {
+        int children[16] {};
+        vector<size_t> positive;
+        vector<size_t> negated;
+    };
+
+    static int hexNibble(char c)
+    {
+        if (c >= '0' && c <= '9') return c-'0';
+        if (c >= 'a' && c <= 'f') return c-'a'+10;
+        if (c >= 'A' && c <= 'F') return c-'A'+10;
+        return -1;
+    }
+
+    unordered_map<string,vector<size_t>> exact_;
+    unordered_map<string,vector<size_t>> exact_negated_;
+    vector<size_t> always_;
+    vector<TrieNode> trie_;
+};
+
+struct DecodeWork
+{
+    AboutTelegram about;
+    vector<uchar> frame;
+    // Parsed once by the receiving thread, to pick the decode thread.
+    Telegram header;
+    bool simulated {};
+};
+
+// A real radio cannot wait, when a decode thread falls this far behind,
+// then the telegrams for it are dropped. Simulations wait instead.
+#define MAX_QUEUED_TELEGRAMS_PER_DECODE_THREAD 1000
+
+// The meters and their id index. A reload builds a new table and swaps it in,
+// a decoder keeps using the table it started with until it is done with the telegram.
+struct MeterTable
+{
+    vector<shared_ptr<Meter>> meters;
+    MeterIdIndex index;
+};
+
+struct DecodeThread
+{
+    BoundedQueue<DecodeWork> queue { "decode_queue", MAX_QUEUED_TELEGRAMS_PER_DECODE_THREAD };
+    function<void()> loop;
+    pthread_t thread {};
+};
 
 struct MeterManagerImplementation : public virtual MeterManager
 {
     void addMeter(shared_ptr<Meter> meter)
     {
-        meters_.push_back(meter);
+        // Meters are added while setting up, before any telegrams arrive,
+        // thus the table is extended in place.
+        MeterTable *t = table_.get();
+        vector<string> ids = meter->ids();
+        t->index.add(t->meters.size(), ids);
+        t->meters.push_back(meter);
     }
 
     Meter *lastAddedMeter()
     {
-        return meters_.back().get();
+        return table()->meters.back().get();
     }
 
     void removeAllMeters()
     {
-        meters_.clear();
+        atomic_store(&table_, make_shared<MeterTable>());
+    }
+
+    void replaceMeters(vector<shared_ptr<Meter>> &meters)
+    {
+        shared_ptr<MeterTable> t = make_shared<MeterTable>();
+        for (auto &meter : meters)
+        {
+            vector<string> ids = meter->ids();
+            t->index.add(t->meters.size(), ids);
+            t->meters.push_back(meter);
+        }
+        atomic_store(&table_, t);
+    }
+
+    vector<shared_ptr<Meter>> meters()
+    {
+        return table()->meters;
     }
 
     void forEachMeter(std::function<void(Meter*)> cb)
     {
-        for (auto &meter : meters_)
+        shared_ptr<MeterTable> t = table();
+        for (auto &meter : t->meters)
         {
             cb(meter.get());
         }
@@ -53,7 +234,8 @@ struct MeterManagerImplementation : public virtual MeterManager
 
     bool hasAllMetersReceivedATelegram()
     {
-        for (auto &meter : meters_)
+        shared_ptr<MeterTable> t = table();
+        for (auto &meter : t->meters)
         {
             if (meter->numUpdates() == 0) return false;
         }
@@ -63,10 +245,10 @@ struct MeterManagerImplementation : public virtual MeterManager
 
     bool hasMeters()
     {
-        return meters_.size() != 0;
+        return table()->meters.size() != 0;
     }
 
-    bool handleTelegram(AboutTelegram &about, vector<uchar> data, bool simulated)
+    bool handleTelegram(AboutTelegram &about, vector<uchar> &data, bool simulated)
     {
         if (!hasMeters())
         {
@@ -77,31 +259,141 @@ struct MeterManagerImplementation : public virtual MeterManager
             return true;
         }
 
+        // Parse the DLL header once to find the id, then only offer
+        // the telegram to the meters whose match expressions can match.
+        // The parsed header is shared by all these meters.
+        Telegram header;
+        header.about = about;
+        if (simulated) header.markAsSimulated();
+        bool ok = header.parseHeader(data);
+
+        if (decode_threads_.size() == 0)
+        {
+            return decodeTelegram(about, data, header, ok, simulated);
+        }
+        if (!ok) return false;
+
+        // The same id always goes to the same decode thread,
+        // which keeps the telegrams from a meter in order.
+        size_t n = hash<string>()(header.id) % decode_threads_.size();
+        string id = header.id;
+        DecodeWork work;
+        work.about = about;
+        work.frame = data;
+        work.header = std::move(header);
+        work.simulated = simulated;
+        ok = decode_threads_[n]->queue.push(std::move(work), simulated);
+        if (!ok)
+        {
+            size_t dropped = decode_threads_[n]->queue.dropped();
+            if (dropped % 100 == 1)
+            {
+                warning("(meter) decode queue full, dropping telegram from %s (dropped %zu so far)\n",
+                        id.c_str(), dropped);
+            }
+        }
+        return ok;
+    }
+
+    // Returns true if a meter handled the telegram. The header has been parsed from data,
+    // header_ok is false if that failed.
+    bool decodeTelegram(AboutTelegram &about, vector<uchar> &data, Telegram &header, bool header_ok, bool simulated)
+    {
         bool handled = false;
+        shared_ptr<MeterTable> t = table();
 
-        string id;
-        for (auto &m : meters_)
+        vector<size_t> candidates;
+        if (header_ok) t->index.lookup(header.id, &candidates);
+
+        ReplayStatistics *rs = replayStatistics();
+        for (size_t m : candidates)
         {
-            bool h = m->handleTelegram(about, data, simulated, &id);
+            chrono::steady_clock::time_point start;
+            if (rs) start = chrono::steady_clock::now();
+            bool h = t->meters[m]->handleTelegram(about, data, header, simulated);
             if (h) handled = true;
+            if (h && rs)
+            {
+                auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-start).count();
+                rs->addDecodeLatency(t->meters[m]->meterName(), ns);
+            }
         }
         if (isVerboseEnabled() && !handled)
         {
-            verbose("(wmbus) telegram from %s ignored by all configured meters!\n", id.c_str());
+            verbose("(wmbus) telegram from %s ignored by all configured meters!\n", header.id.c_str());
         }
         return handled;
     }
 
-    void onTelegram(function<void(AboutTelegram &about, vector<uchar>)> cb)
+    // With --decodethreads=N the event loop thread only frames the telegrams and
+    // hands them over to N decode threads, which parse, decrypt and decode them and
+    // format the output. The output thread then writes the output to stdout/files
+    // and invokes the shells. Thus a slow shell or disk can no longer stall the
+    // reception of telegrams.
+    void startDecodeThreads(int num_threads)
+    {
+        for (int i=0; i<num_threads; ++i)
+        {
+            DecodeThread *dt = new DecodeThread();
+            dt->loop = [this,dt]()
+                {
+                    DecodeWork work;
+                    while (dt->queue.pop(&work))
+                    {
+                        decodeTelegram(work.about, work.frame, work.header, true, work.simulated);
+                    }
+                };
+            decode_threads_.push_back(unique_ptr<DecodeThread>(dt));
+            dt->thread = startWorkerThread(&dt->loop);
+        }
+        verbose("(meter) decoding telegrams in %d threads\n", num_threads);
+    }
+
+    void stopDecodeThreads()
+    {
+        if (decode_threads_.size() == 0) return;
+
+        for (auto &dt : decode_threads_) dt->queue.close();
+        for (auto &dt : decode_threads_) pthread_join(dt->thread, NULL);
+
+        DecodeStatistics ds = decodeStatistics();
+        verbose("(meter) decode threads stopped, received %zu dropped %zu peak queue %zu\n",
+                ds.received, ds.dropped, ds.peak_queued);
+        decode_threads_.clear();
+    }
+
+    DecodeStatistics decodeStatistics()
+    {
+        DecodeStatistics ds;
+        for (auto &dt : decode_threads_)
+        {
+            ds.queued += dt->queue.size();
+            ds.peak_queued = max(ds.peak_queued, dt->queue.peak());
+            ds.received += dt->queue.pushed();
+            ds.dropped += dt->queue.dropped();
+        }
+        return ds;
+    }
+
+    void onTelegram(function<void(AboutTelegram &about, vector<uchar> &)> cb)
     {
         on_telegram_ = cb;
     }
-    ~MeterManagerImplementation() {}
+    ~MeterManagerImplementation()
+    {
+        stopDecodeThreads();
+    }
 
 private:
 
-    vector<shared_ptr<Meter>> meters_;
-    function<void(AboutTelegram&,vector<uchar>)> on_telegram_;
+    shared_ptr<MeterTable> table()
+    {
+        return atomic_load(&table_);
+    }
+
+    shared_ptr<MeterTable> table_ { make_shared<MeterTable>() };
+    vector<unique_ptr<DecodeThread>> decode_threads_;
+    function<void(AboutTelegram&,vector<uchar>&)> on_telegram_;
 };
 
 shared_ptr<MeterManager> createMeterManager()
@@ -113,10 +405,13 @@ MeterCommonImplementation::MeterCommonImplementation(MeterInfo &mi,
                                                      MeterType type) :
     type_(type), name_(mi.name)
 {
+    counters_ = driverCounters(toMeterName(type));
+    decode_plans_ = decodePlans(toMeterName(type));
     ids_ = splitMatchExpressions(mi.id);
     if (mi.key.length() > 0)
     {
-        hex2bin(mi.key, &meter_keys_.confidentiality_key);
+        // Expand the key now, before telegrams start arriving.
+        meter_keys_.setConfidentialityKey(mi.key);
     }
     /*if (bus->type() == DEVICE_SIMULATION)
     {
@@ -174,7 +469,7 @@ void MeterCommonImplementation::addPrint(string vname, Quantity vquantity,
     string default_unit = unitToStringLowerCase(defaultUnitForQuantity(vquantity));
     string field_name = vname+"_"+default_unit;
     fields_.push_back(field_name);
-    prints_.push_back( { vname, vquantity, defaultUnitForQuantity(vquantity), getValueFunc, NULL, help, field, json, field_name });
+    prints_.push_back( { move(vname), vquantity, defaultUnitForQuantity(vquantity), move(getValueFunc), NULL, move(help), field, json, move(field_name) });
 }
 
 void MeterCommonImplementation::addPrint(string vname, Quantity vquantity, Unit unit,
@@ -183,14 +478,14 @@ void MeterCommonImplementation::addPrint(string vname, Quantity vquantity, Unit
     string default_unit = unitToStringLowerCase(defaultUnitForQuantity(vquantity));
     string field_name = vname+"_"+default_unit;
     fields_.push_back(field_name);
-    prints_.push_back( { vname, vquantity, unit, getValueFunc, NULL, help, field, json, field_name });
+    prints_.push_back( { move(vname), vquantity, unit, move(getValueFunc), NULL, move(help), field, json, move(field_name) });
 }
 
 void MeterCommonImplementation::addPrint(string vname, Quantity vquantity,
                                          function<string()> getValueFunc,
                                          string help, bool field, bool json)
 {
-    prints_.push_back( { vname, vquantity, defaultUnitForQuantity(vquantity), NULL, getValueFunc, help, field, json, vname } );
+    prints_.push_back( { vname, vquantity, defaultUnitForQuantity(vquantity), NULL, move(getValueFunc), move(help), field, json, vname } );
 }
 
 vector<string> MeterCommonImplementation::ids()
@@ -220,7 +515,7 @@ void MeterCommonImplementation::onUpdate(function<void(Telegram*,Meter*)> cb)
 
 int MeterCommonImplementation::numUpdates()
 {
-    return num_updates_;
+    return num_updates_.load();
 }
 
 string MeterCommonImplementation::datetimeOfUpdateHumanReadable()
@@ -325,90 +620,58 @@ uint16_t MeterCommonImplementation::getRecordAsUInt16(string record)
 
 void MeterCommonImplementation::triggerUpdate(Telegram *t)
 {
-    datetime_of_update_ = time(NULL);
+    datetime_of_update_ = t->about.timestamp ? t->about.timestamp : time(NULL);
     num_updates_++;
     for (auto &cb : on_update_) if (cb) cb(t, this);
     t->handled = true;
 }
 
-string concatAllFields(Meter *m, Telegram *t, char c, vector<Print> &prints, vector<Unit> &cs, bool hr)
+// Appends the selected fields, in the order they were selected.
+void concatSelectedFields(string &s, Meter *m, Telegram *t, char c, vector<Print> &prints, vector<Unit> &cs,
+                          vector<string> *selected_fields)
 {
-    string s;
-    s = "";
-    s += m->name() + c;
-    s += t->id + c;
-    for (Print p : prints)
-    {
-        if (p.field)
-        {
-            if (p.getValueDouble)
-            {
-                Unit u = replaceWithConversionUnit(p.default_unit, cs);
-                double v = p.getValueDouble(u);
-                if (hr) {
-                    s += valueToString(v, u);
-                    s += " "+unitToStringHR(u);
-                } else {
-                    s += to_string(v);
-                }
-            }
-            if (p.getValueString)
-            {
-                s += p.getValueString();
-            }
-            s += c;
-        }
-    }
-    s += m->datetimeOfUpdateHumanReadable();
-    return s;
-}
-
-string concatFields(Meter *m, Telegram *t, char c, vector<Print> &prints, vector<Unit> &cs, bool hr,
-                    vector<string> *selected_fields)
-{
-    if (selected_fields == NULL || selected_fields->size() == 0)
-    {
-        return concatAllFields(m, t, c, prints, cs, hr);
-    }
-    string s;
-    s = "";
-
-    for (string field : *selected_fields)
+    for (string &field : *selected_fields)
     {
         if (field == "name")
         {
-            s += m->name() + c;
+            s += m->name();
+            s += c;
             continue;
         }
         if (field == "id")
         {
-            s += t->id + c;
+            s += t->id;
+            s += c;
             continue;
         }
         if (field == "timestamp")
         {
-            s += m->datetimeOfUpdateHumanReadable() + c;
+            s += m->datetimeOfUpdateHumanReadable();
+            s += c;
             continue;
         }
         if (field == "device")
         {
-            s += t->about.device + c;
+            s += t->about.device;
+            s += c;
             continue;
         }
         if (field == "rssi_dbm")
         {
-            s += to_string(t->about.rssi_dbm) + c;
+            s += to_string(t->about.rssi_dbm);
+            s += c;
             continue;
         }
 
         bool handled = false;
-        for (Print p : prints)
+        for (Print &p : prints)
         {
             if (p.getValueString)
             {
                 if (field == p.vname)
                 {
-                    s += p.getValueString() + c;
+                    s += p.getValueString();
+                    s += c;
                     handled = true;
                 }
             }
@@ -418,7 +681,8 @@ string concatFields(Meter *m, Telegram *t, char c, vector<Print> &prints, vector
                 string var = p.vname+"_"+default_unit;
                 if (field == var)
                 {
-                    s += valueToString(p.getValueDouble(p.default_unit), p.default_unit) + c;
+                    s += valueToString(p.getValueDouble(p.default_unit), p.default_unit);
+                    s += c;
                     handled = true;
                 }
                 else
@@ -430,7 +694,8 @@ string concatFields(Meter *m, Telegram *t, char c, vector<Print> &prints, vector
                         string var = p.vname+"_"+unit;
                         if (field == var)
                         {
-                            s += valueToString(p.getValueDouble(u), u) + c;
+                            s += valueToString(p.getValueDouble(u), u);
+                            s += c;
                             handled = true;
                         }
                     }
@@ -439,40 +704,43 @@ string concatFields(Meter *m, Telegram *t, char c, vector<Print> &prints, vector
         }
         if (!handled)
         {
-            s += "?"+field+"?"+c;
+            s += "?"+field+"?";
+            s += c;
         }
     }
-    if (s.back() == c) s.pop_back();
-    return s;
+    if (s.size() > 0 && s.back() == c) s.pop_back();
 }
 
-bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<uchar> input_frame, bool simulated, string *id)
+bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<uchar> &input_frame, Telegram &header, bool simulated)
 {
-    Telegram t;
-    t.about = about;
-    bool ok = t.parseHeader(input_frame);
-
-    if (simulated) t.markAsSimulated();
-
-    *id = t.id;
-
-    if (!ok || !isTelegramForMe(&t))
+    if (!isTelegramForMe(&header))
     {
         // This telegram is not intended for this meter.
         return false;
     }
 
-    verbose("(meter) %s %s handling telegram from %s\n", name().c_str(), meterName().c_str(), t.id.c_str());
+    // A meter with a wildcard id can be offered telegrams by several decode threads.
+    WITH(handle_telegram_mutex_, handleTelegram);
+
+    verbose("(meter) %s %s handling telegram from %s\n", name().c_str(), meterName().c_str(), header.id.c_str());
 
     if (isDebugEnabled())
     {
         string msg = bin2hex(input_frame);
-        debug("(meter) %s %s \"%s\"\n", name().c_str(), t.id.c_str(), msg.c_str());
+        debug("(meter) %s %s \"%s\"\n", name().c_str(), header.id.c_str(), msg.c_str());
     }
 
-    ok = t.parse(input_frame, &meter_keys_);
+    // The full parse decrypts using this meter's keys, therefore it is done per meter.
+    auto start = chrono::steady_clock::now();
+    Telegram t;
+    t.about = about;
+    if (simulated) t.markAsSimulated();
+    t.decode_plans = decode_plans_;
+    bool ok = t.parse(input_frame, &meter_keys_);
     if (!ok)
     {
+        if (t.mac_failed) increment(counters_->mac_failures);
+        else if (t.decryption_failed) increment(counters_->decrypt_failures);
         // Ignoring telegram since it could not be parsed.
         return false;
     }
@@ -484,6 +752,9 @@ bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
     // Invoke meter specific parsing!
     processContent(&t);
     // All done....
+    auto parsed = chrono::steady_clock::now();
+    increment(counters_->telegrams);
+    counters_->parse.add(chrono::duration_cast<chrono::nanoseconds>(parsed-start).count());
 
     if (isDebugEnabled())
     {
@@ -492,10 +763,12 @@ bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
         t.explainParse(log_prefix, 0);
     }
     triggerUpdate(&t);
+    counters_->print.add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-parsed).count());
     return true;
 }
 
 void MeterCommonImplementation::printMeter(Telegram *t,
+                                           int outputs,
                                            string *human_readable,
                                            string *fields, char separator,
                                            string *json,
@@ -503,96 +776,216 @@ void MeterCommonImplementation::printMeter(Telegram *t,
                                            vector<string> *more_json,
                                            vector<string> *selected_fields)
 {
-    *human_readable = concatFields(this, t, '\t', prints_, conversions_, true, selected_fields);
-    *fields = concatFields(this, t, separator, prints_, conversions_, false, selected_fields);
-
-    string s;
-    s += "{";
-    s += "\"media\":\""+mediaTypeJSON(t->dll_type)+"\",";
-    s += "\"meter\":\""+meterName()+"\",";
-    s += "\"name\":\""+name()+"\",";
-    s += "\"id\":\""+t->id+"\",";
-    for (Print p : prints_)
+    bool do_hr = outputs & OUTPUT_HR;
+    bool do_fields = outputs & OUTPUT_FIELDS;
+    bool do_envs = outputs & OUTPUT_ENVS;
+    bool do_json = (outputs & OUTPUT_JSON) || do_envs;
+    bool all_fields = selected_fields == NULL || selected_fields->size() == 0;
+
+    string &hr = *human_readable;
+    string &fs = *fields;
+    string &js = *json;
+    hr.clear();
+    fs.clear();
+    js.clear();
+    envs->clear();
+
+    if (!all_fields)
     {
-        if (p.json)
-        {
-            string default_unit = unitToStringLowerCase(p.default_unit);
-            string var = p.vname;
-            if (p.getValueString) {
-                s += "\""+var+"\":\""+p.getValueString()+"\",";
-            }
-            if (p.getValueDouble) {
-                s += "\""+var+"_"+default_unit+"\":"+valueToString(p.getValueDouble(p.default_unit), p.default_unit)+",";
+        if (do_hr) concatSelectedFields(hr, this, t, '\t', prints_, conversions_, selected_fields);
+        if (do_fields) concatSelectedFields(fs, this, t, separator, prints_, conversions_, selected_fields);
+        // The selected fields are already printed.
+        do_hr = do_fields = false;
+    }
 
-                Unit u = replaceWithConversionUnit(p.default_unit, conversions_);
-                if (u != p.default_unit)
-                {
-                    string unit = unitToStringLowerCase(u);
-                    s += "\""+var+"_"+unit+"\":"+valueToString(p.getValueDouble(u), u)+",";
-                }
-            }
-        }
+    if (do_hr)
+    {
+        hr += name();
+        hr += '\t';
+        hr += t->id;
+        hr += '\t';
     }
-    s += "\"timestamp\":\""+datetimeOfUpdateRobot()+"\"";
-    if (t->about.device != "")
+    if (do_fields)
     {
-        s += ",";
-        s += "\"device\":\""+t->about.device+"\",";
-        s += "\"rssi_dbm\":"+to_string(t->about.rssi_dbm);
+        fs += name();
+        fs += separator;
+        fs += t->id;
+        fs += separator;
     }
-    for (string add_json : additionalJsons())
+    if (do_json)
     {
-        s += ",";
-        s += makeQuotedJson(add_json);
+        js += "{\"media\":";
+        appendJsonString(js, mediaTypeJSON(t->dll_type));
+        js += ",\"meter\":";
+        appendJsonString(js, meterName());
+        js += ",\"name\":";
+        appendJsonString(js, name());
+        js += ",\"id\":";
+        appendJsonString(js, t->id);
+        js += ',';
     }
-    for (string add_json : *more_json)
+    size_t meter_json_env = 0;
+    if (do_envs)
     {
-        s += ",";
-        s += makeQuotedJson(add_json);
+        envs->reserve(prints_.size()+8);
+        // METER_JSON is filled in when the json is complete.
+        meter_json_env = envs->size();
+        envs->push_back("");
+        envs->push_back(string("METER_TYPE=")+meterName());
+        envs->push_back(string("METER_NAME=")+name());
+        envs->push_back(string("METER_ID=")+t->id);
     }
-    s += "}";
-    *json = s;
-
-    envs->push_back(string("METER_JSON=")+*json);
-    envs->push_back(string("METER_TYPE=")+meterName());
-    envs->push_back(string("METER_NAME=")+name());
-    envs->push_back(string("METER_ID=")+t->id);
 
-    for (Print p : prints_)
+    // A single pass over the prints, where each value is fetched once and then
+    // appended to all outputs that want it.
+    string var, VAR;
+    for (Print &p : prints_)
     {
-        if (p.json)
+        bool in_fields = p.field && (do_hr || do_fields);
+        bool in_json = p.json && do_json;
+        if (!in_fields && !in_json) continue;
+
+        var = p.vname;
+        if (do_envs && in_json)
         {
-            string default_unit = unitToStringUpperCase(p.default_unit);
-            string var = p.vname;
-            std::transform(var.begin(), var.end(), var.begin(), ::toupper);
-            if (p.getValueString) {
-                string envvar = "METER_"+var+"="+p.getValueString();
-                envs->push_back(envvar);
-            }
-            if (p.getValueDouble) {
-                string envvar = "METER_"+var+"_"+default_unit+"="+valueToString(p.getValueDouble(p.default_unit), p.default_unit);
-                envs->push_back(envvar);
+            VAR = p.vname;
+            std::transform(VAR.begin(), VAR.end(), VAR.begin(), ::toupper);
+        }
 
-                Unit u = replaceWithConversionUnit(p.default_unit, conversions_);
+        if (p.getValueDouble)
+        {
+            // The hr and fields only print the converted value, the json prints both.
+            Unit u = replaceWithConversionUnit(p.default_unit, conversions_);
+            double cv = p.getValueDouble(u);
+            if (in_fields)
+            {
+                if (do_hr)
+                {
+                    hr += valueToString(cv, u);
+                    hr += ' ';
+                    hr += unitToStringHR(u);
+                }
+                if (do_fields)
+                {
+                    fs += to_string(cv);
+                }
+            }
+            if (in_json)
+            {
+                double dv = (u == p.default_unit) ? cv : p.getValueDouble(p.default_unit);
+                string dvs = valueToString(dv, p.default_unit);
+                js += '"';
+                js += var;
+                js += '_';
+                js += unitToStringLowerCase(p.default_unit);
+                js += "\":";
+                js += dvs;
+                js += ',';
+                if (do_envs)
+                {
+                    envs->push_back("METER_"+VAR+"_"+unitToStringUpperCase(p.default_unit)+"="+dvs);
+                }
                 if (u != p.default_unit)
                 {
-                    string unit = unitToStringUpperCase(u);
-                    string envvar = "METER_"+var+"_"+unit+"="+valueToString(p.getValueDouble(u), u);
-                    envs->push_back(envvar);
+                    string cvs = valueToString(cv, u);
+                    js += '"';
+                    js += var;
+                    js += '_';
+                    js += unitToStringLowerCase(u);
+                    js += "\":";
+                    js += cvs;
+                    js += ',';
+                    if (do_envs)
+                    {
+                        envs->push_back("METER_"+VAR+"_"+unitToStringUpperCase(u)+"="+cvs);
+                    }
                 }
             }
         }
+        if (p.getValueString)
+        {
+            string sv = p.getValueString();
+            if (in_fields)
+            {
+                if (do_hr) hr += sv;
+                if (do_fields) fs += sv;
+            }
+            if (in_json)
+            {
+                appendJsonString(js, var);
+                js += ':';
+                appendJsonString(js, sv);
+                js += ',';
+                if (do_envs)
+                {
+                    envs->push_back("METER_"+VAR+"="+sv);
+                }
+            }
+        }
+        if (in_fields)
+        {
+            if (do_hr) hr += '\t';
+            if (do_fields) fs += separator;
+        }
     }
-    envs->push_back(string("METER_TIMESTAMP=")+datetimeOfUpdateRobot());
-    // If the configuration has supplied json_address=Roodroad 123
-    // then the env variable METER_address will available and have the content "Roodroad 123"
-    for (string add_json : additionalJsons())
+
+    if (do_hr) hr += datetimeOfUpdateHumanReadable();
+    if (do_fields) fs += datetimeOfUpdateHumanReadable();
+
+    if (do_json)
     {
-        envs->push_back(string("METER_")+add_json);
+        js += "\"timestamp\":\"";
+        js += datetimeOfUpdateRobot();
+        js += '"';
+        if (t->about.device != "")
+        {
+            js += ",\"device\":";
+            appendJsonString(js, t->about.device);
+            js += ",\"rssi_dbm\":";
+            js += to_string(t->about.rssi_dbm);
+        }
+        if (t->about.received_by.size() > 0)
+        {
+            js += ",\"received_by\":[";
+            for (size_t i = 0; i < t->about.received_by.size(); ++i)
+            {
+                ReceivedBy &rb = t->about.received_by[i];
+                if (i > 0) js += ',';
+                js += "{\"device\":";
+                appendJsonString(js, rb.device);
+                js += ",\"rssi_dbm\":";
+                js += to_string(rb.rssi_dbm);
+                js += '}';
+            }
+            js += ']';
+        }
+        for (string &add_json : additionalJsons())
+        {
+            js += ',';
+            appendQuotedJson(js, add_json);
+        }
+        for (string &add_json : *more_json)
+        {
+            js += ',';
+            appendQuotedJson(js, add_json);
+        }
+        js += '}';
     }
-    for (string add_json : *more_json)
+
+    if (do_envs)
     {
-        envs->push_back(string("METER_")+add_json);
+        (*envs)[meter_json_env] = string("METER_JSON=")+js;
+        envs->push_back(string("METER_TIMESTAMP=")+datetimeOfUpdateRobot());
+        // If the configuration has supplied json_address=Roodroad 123
+        // then the env variable METER_address will available and have the content "Roodroad 123"
+        for (string &add_json : additionalJsons())
+        {
+            envs->push_back(string("METER_")+add_json);
+        }
+        for (string &add_json : *more_json)
+        {
+            envs->push_back(string("METER_")+add_json);
+        }
     }
 }
 
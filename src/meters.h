@@ -18,6 +18,7 @@
 #ifndef METER_H_
 #define METER_H_
 
+#include"statistics.h"
 #include"util.h"
 #include"units.h"
 #include"wmbus.h"
@@ -210,6 +211,21 @@ struct Print
     string field_name; // Field name for default unit.
 };
 
+// The outputs rendered by printMeter, the outputs not asked for are left empty.
+// The shell envs include METER_JSON, thus OUTPUT_ENVS also renders the json.
+#define OUTPUT_HR     1
+#define OUTPUT_FIELDS 2
+#define OUTPUT_JSON   4
+#define OUTPUT_ENVS   8
+#define OUTPUT_ALL    (OUTPUT_HR|OUTPUT_FIELDS|OUTPUT_JSON|OUTPUT_ENVS)
+
+// The rendered outputs of a meter, kept by the meter and reused for every telegram.
+struct MeterOutputs
+{
+    string human_readable, fields, json;
+    vector<string> envs;
+};
+
 struct Meter
 {
     // This meter listens to these ids.
@@ -220,14 +236,20 @@ struct Meter
     virtual string meterName() = 0;
     virtual string name() = 0;
     virtual MeterType type() = 0;
+    // The statistics of this meter's driver, shared with the other meters of the same type.
+    virtual DriverCounters *counters() = 0;
 
     virtual string datetimeOfUpdateHumanReadable() = 0;
     virtual string datetimeOfUpdateRobot() = 0;
 
     virtual void onUpdate(std::function<void(Telegram*t,Meter*)> cb) = 0;
     virtual int numUpdates() = 0;
+    // The printer renders into these buffers from the update callback, where the
+    // handleTelegram lock is held. They keep their capacity between telegrams.
+    virtual MeterOutputs &outputBuffers() = 0;
 
     virtual void printMeter(Telegram *t,
+                            int outputs,
                             string *human_readable,
                             string *fields, char separator,
                             string *json,
@@ -236,8 +258,10 @@ struct Meter
                             vector<string> *selected_fields) = 0;
 
     // The handleTelegram expects an input_frame where the DLL crcs have been removed.
+    // The header telegram has already been parsed with parseHeader from the same frame,
+    // it is shared between all meters offered this frame.
     // Returns true of this meter handled this telegram!
-    virtual bool handleTelegram(AboutTelegram &about, vector<uchar> input_frame, bool simulated, string *id) = 0;
+    virtual bool handleTelegram(AboutTelegram &about, vector<uchar> &input_frame, Telegram &header, bool simulated) = 0;
     virtual bool isTelegramForMe(Telegram *t) = 0;
     virtual MeterKeys *meterKeys() = 0;
 
@@ -253,16 +277,39 @@ struct Meter
     virtual ~Meter() = default;
 };
 
+// Counters for the telegrams handed over to the decode threads.
+struct DecodeStatistics
+{
+    size_t queued {}; // Telegrams waiting to be decoded right now.
+    size_t peak_queued {}; // The largest number of telegrams waiting in a single queue.
+    size_t received {}; // Telegrams handed over to the decode threads.
+    size_t dropped {}; // Telegrams dropped because the decode queue was full.
+};
+
 struct MeterManager
 {
     virtual void addMeter(shared_ptr<Meter> meter) = 0;
     virtual Meter*lastAddedMeter() = 0;
     virtual void removeAllMeters() = 0;
+    // Swap in a new set of meters while telegrams are being decoded. Telegrams already
+    // being decoded finish with the old meters, the meters kept keep their state.
+    virtual void replaceMeters(vector<shared_ptr<Meter>> &meters) = 0;
+    virtual vector<shared_ptr<Meter>> meters() = 0;
     virtual void forEachMeter(std::function<void(Meter*)> cb) = 0;
-    virtual bool handleTelegram(AboutTelegram &about, vector<uchar> data, bool simulated) = 0;
+    // Returns true if a meter handled the telegram. With decode threads the telegram
+    // is decoded later, then true only means that it was accepted for decoding and
+    // false that its header could not be parsed or that the decode queue was full.
+    virtual bool handleTelegram(AboutTelegram &about, vector<uchar> &data, bool simulated) = 0;
     virtual bool hasAllMetersReceivedATelegram() = 0;
     virtual bool hasMeters() = 0;
-    virtual void onTelegram(function<void(AboutTelegram&,vector<uchar>)> cb) = 0;
+    virtual void onTelegram(function<void(AboutTelegram&,vector<uchar>&)> cb) = 0;
+    // Hand over the telegrams to num_threads decode threads, instead of decoding them
+    // in the thread calling handleTelegram. Telegrams with the same id are always
+    // decoded by the same thread, thus in the order they were received.
+    virtual void startDecodeThreads(int num_threads) = 0;
+    // Decode the telegrams still queued, then stop the decode threads.
+    virtual void stopDecodeThreads() = 0;
+    virtual DecodeStatistics decodeStatistics() = 0;
     virtual ~MeterManager() = default;
 };
 
@@ -19,8 +19,10 @@
 #define METERS_COMMON_IMPLEMENTATION_H_
 
 #include"meters.h"
+#include"threads.h"
 #include"units.h"
 
+#include<atomic>
 #include<map>
 #include<set>
 
@@ -53,6 +55,8 @@ struct MeterCommonImplementation : public virtual Meter
     ~MeterCommonImplementation() = default;
 
     string meterName() { return toMeterName(type_); }
+    DriverCounters *counters() { return counters_; }
+    MeterOutputs &outputBuffers() { return output_buffers_; }
 
 protected:
 
@@ -74,8 +78,9 @@ protected:
     // Print the dimensionless Text quantity, no unit is needed.
     void addPrint(string vname, Quantity vquantity,
                   function<std::string()> getValueFunc, string help, bool field, bool json);
-    bool handleTelegram(AboutTelegram &about, vector<uchar> frame, bool simulated, string *id);
+    bool handleTelegram(AboutTelegram &about, vector<uchar> &frame, Telegram &header, bool simulated);
     void printMeter(Telegram *t,
+                    int outputs, // OUTPUT_HR|OUTPUT_JSON etc
                     string *human_readable,
                     string *fields, char separator,
                     string *json,
@@ -88,17 +93,22 @@ protected:
 private:
 
     MeterType type_ {};
+    DriverCounters *counters_ {};
+    DecodePlans *decode_plans_ {};
     MeterKeys meter_keys_ {};
     ELLSecurityMode expected_ell_sec_mode_ {};
     TPLSecurityMode expected_tpl_sec_mode_ {};
     string name_;
     vector<string> ids_;
     vector<function<void(Telegram*,Meter*)>> on_update_;
-    int num_updates_ {};
+    // Incremented by the decode threads, read by the oneshot check and the printer.
+    atomic<int> num_updates_ { 0 };
     time_t datetime_of_update_ {};
     LinkModeSet link_modes_ {};
     vector<string> shell_cmdlines_;
     vector<string> jsons_;
+    RecursiveMutex handle_telegram_mutex_ { "handle_telegram_mutex" };
+    MeterOutputs output_buffers_;
 
 protected:
     std::map<std::string,std::pair<int,std::string>> values_;
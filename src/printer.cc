@@ -18,14 +18,23 @@
 #include"printer.h"
 #include"shell.h"
 
+#include<stdio.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
 using namespace std;
 
 Printer::Printer(bool json, bool fields, char separator,
                  bool use_meterfiles, string &meterfiles_dir,
                  bool use_logfile, string &logfile,
-                 vector<string> shell_cmdlines, bool overwrite,
+                 vector<string> shell_cmdlines,
+                 vector<string> shellpipe_cmdlines,
+                 bool overwrite,
                  MeterFileNaming naming,
-                 MeterFileTimestamp timestamp)
+                 MeterFileTimestamp timestamp,
+                 int flush_after_ms,
+                 int flush_after_bytes,
+                 string timeseries_dir)
 {
     json_ = json;
     fields_ = fields;
@@ -35,66 +44,232 @@ Printer::Printer(bool json, bool fields, char separator,
     use_logfile_ = use_logfile;
     logfile_ = logfile;
     shell_cmdlines_ = shell_cmdlines;
+    for (auto &cmdline : shellpipe_cmdlines)
+    {
+        ShellPipe sp;
+        sp.cmdline = cmdline;
+        shellpipes_.push_back(sp);
+    }
     overwrite_ = overwrite;
     naming_ = naming;
     timestamp_ = timestamp;
+    flush_after_ms_ = flush_after_ms;
+    flush_after_bytes_ = flush_after_bytes;
+    last_flush_ = chrono::steady_clock::now();
+    last_moved_check_ = time(NULL);
+    if (timeseries_dir != "")
+    {
+        // The partial chunks are written as often as the files are flushed, but at least once an hour.
+        int max_chunk_age = TIMESERIES_MAX_CHUNK_AGE;
+        if (flush_after_ms > 0) max_chunk_age = min(max_chunk_age, max(1, flush_after_ms/1000));
+        timeseries_ = unique_ptr<TimeSeriesSink>(new TimeSeriesSink(timeseries_dir, max_chunk_age));
+    }
+}
+
+// The output thread only exists to decouple slow shells/disks from the decoding,
+// it makes the decode threads wait when it falls this far behind.
+#define MAX_QUEUED_OUTPUTS 1000
+
+// The least recently used meter file is closed when this many files are open.
+#define MAX_OPEN_OUTPUT_FILES 256
+
+Printer::~Printer()
+{
+    stopOutputThread();
+    stopShellPipes();
+    closeFiles();
+    timeseries_.reset();
 }
 
 void Printer::print(Telegram *t, Meter *meter,
                     vector<string> *more_json,
                     vector<string> *selected_fields)
 {
-    string human_readable, fields, json;
-    vector<string> envs;
-    bool printed = false;
+    PrinterOutput po;
+    po.name = meter->name();
+    po.id = t->id;
+    po.counters = meter->counters();
+
+    if (meter->shellCmdlines().size() > 0)
+    {
+        po.shells = meter->shellCmdlines();
+    }
+    else
+    {
+        po.shells = shell_cmdlines_;
+    }
+
+    // Only render the outputs that write() will use.
+    int outputs = 0;
+    if (use_meterfiles_ || (po.shells.size() == 0 && shellpipes_.size() == 0))
+    {
+        outputs |= json_ ? OUTPUT_JSON : (fields_ ? OUTPUT_FIELDS : OUTPUT_HR);
+    }
+    if (po.shells.size() > 0) outputs |= OUTPUT_ENVS;
+    if (shellpipes_.size() > 0) outputs |= OUTPUT_JSON;
+
+    // The meter's buffers are cleared and rendered into, thus their capacity is reused.
+    MeterOutputs &out = meter->outputBuffers();
+    meter->printMeter(t, outputs, &out.human_readable, &out.fields, separator_, &out.json, &out.envs, more_json, selected_fields);
 
-    meter->printMeter(t, &human_readable, &fields, separator_, &json, &envs, more_json, selected_fields);
+    if (timeseries_) printTimeSeries(t, meter);
 
-    if (shell_cmdlines_.size() > 0 || meter->shellCmdlines().size() > 0) {
-        printShells(meter, envs);
+    if (output_queue_)
+    {
+        // The buffers are rendered into again by the next telegram, the queue needs its own copy.
+        po.out = out;
+        output_queue_->push(std::move(po), true);
+    }
+    else
+    {
+        write(po, out);
+    }
+}
+
+void Printer::printTimeSeries(Telegram *t, Meter *meter)
+{
+    // The same values, in the default units, as printed in the json.
+    vector<TimeSeriesValue> values;
+    for (Print &p : meter->prints())
+    {
+        if (!p.json) continue;
+        TimeSeriesValue v;
+        if (p.getValueDouble)
+        {
+            v.name = p.vname+"_"+unitToStringLowerCase(p.default_unit);
+            v.kind = TIMESERIES_DOUBLE;
+            v.d = p.getValueDouble(p.default_unit);
+        }
+        else if (p.getValueString)
+        {
+            v.name = p.vname;
+            v.kind = TIMESERIES_STRING;
+            v.s = p.getValueString();
+        }
+        else
+        {
+            continue;
+        }
+        values.push_back(v);
+    }
+    time_t ts = t->about.timestamp ? t->about.timestamp : time(NULL);
+    timeseries_->add(t->id, meter->meterName(), ts, values);
+}
+
+void Printer::startOutputThread()
+{
+    output_queue_ = unique_ptr<BoundedQueue<PrinterOutput>>(new BoundedQueue<PrinterOutput>("output_queue", MAX_QUEUED_OUTPUTS));
+    output_loop_ = [this]()
+        {
+            PrinterOutput po;
+            while (output_queue_->pop(&po))
+            {
+                write(po, po.out);
+            }
+        };
+    output_thread_ = startWorkerThread(&output_loop_);
+}
+
+void Printer::stopOutputThread()
+{
+    if (!output_queue_) return;
+
+    output_queue_->close();
+    pthread_join(output_thread_, NULL);
+    output_queue_.reset();
+}
+
+void Printer::write(PrinterOutput &po, const MeterOutputs &out)
+{
+    bool printed = false;
+
+    if (po.shells.size() > 0 || shellpipes_.size() > 0)
+    {
+        auto start = chrono::steady_clock::now();
+        if (po.shells.size() > 0) printShells(po, out);
+        if (shellpipes_.size() > 0) printShellPipes(out);
+        po.counters->shell.add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-start).count());
         printed = true;
     }
     if (use_meterfiles_) {
-        printFiles(meter, t, human_readable, fields, json);
+        printFiles(po, out);
         printed = true;
     }
     if (!printed) {
         // This will print on stdout or in the logfile.
-        printFiles(meter, t, human_readable, fields, json);
-        fflush(stdout);
+        printFiles(po, out);
+        if (flushAfterEveryTelegram()) fflush(stdout);
     }
 }
 
-void Printer::printShells(Meter *meter, vector<string> &envs)
+void Printer::printShells(PrinterOutput &po, const MeterOutputs &out)
 {
-    vector<string> *shells = &shell_cmdlines_;
-    if (meter->shellCmdlines().size() > 0) {
-        shells = &meter->shellCmdlines();
-    }
-    for (auto &s : *shells) {
+    for (auto &s : po.shells) {
         vector<string> args;
         args.push_back("-c");
         args.push_back(s);
-        invokeShell("/bin/sh", args, envs);
+        invokeShell("/bin/sh", args, out.envs);
+    }
+}
+
+void Printer::printShellPipes(const MeterOutputs &out)
+{
+    string line = out.json+"\n";
+    for (auto &sp : shellpipes_)
+    {
+        // Restart a shell pipe that has exited, but only retry once per telegram.
+        for (int attempt = 0; attempt < 2; ++attempt)
+        {
+            if (sp.fd != -1 && !stillRunning(sp.pid))
+            {
+                warning("(shellpipe) \"%s\" has exited, restarting it.\n", sp.cmdline.c_str());
+                close(sp.fd);
+                sp.fd = -1;
+            }
+            if (sp.fd == -1)
+            {
+                vector<string> args;
+                args.push_back("-c");
+                args.push_back(sp.cmdline);
+                vector<string> envs;
+                if (!invokeShellPipe("/bin/sh", args, envs, &sp.fd, &sp.pid)) break;
+            }
+            if (writeShellPipe(sp.fd, line)) break;
+
+            // The shell no longer reads its stdin.
+            warning("(shellpipe) \"%s\" has stopped reading, restarting it.\n", sp.cmdline.c_str());
+            stopShellPipe(sp.fd, sp.pid);
+            sp.fd = -1;
+        }
+    }
+}
+
+void Printer::stopShellPipes()
+{
+    for (auto &sp : shellpipes_)
+    {
+        if (sp.fd == -1) continue;
+        stopShellPipe(sp.fd, sp.pid);
+        sp.fd = -1;
     }
+    waitForShellPipes();
 }
 
-void Printer::printFiles(Meter *meter, Telegram *t, string &human_readable, string &fields, string &json)
+void Printer::printFiles(PrinterOutput &po, const MeterOutputs &out)
 {
-    FILE *output = stdout;
+    const string &line = json_ ? out.json : (fields_ ? out.fields : out.human_readable);
 
     if (use_meterfiles_) {
-        char filename[256];
-        memset(filename, 0, sizeof(filename));
+        string filename = meterfiles_dir_+"/";
         switch (naming_) {
         case MeterFileNaming::Name:
-            snprintf(filename, 127, "%s/%s", meterfiles_dir_.c_str(), meter->name().c_str());
+            filename += po.name;
             break;
         case MeterFileNaming::Id:
-            snprintf(filename, 127, "%s/%s", meterfiles_dir_.c_str(), t->id.c_str());
+            filename += po.id;
             break;
         case MeterFileNaming::NameId:
-            snprintf(filename, 127, "%s/%s-%s", meterfiles_dir_.c_str(), meter->name().c_str(), t->id.c_str());
+            filename += po.name+"-"+po.id;
             break;
         }
         string stamp;
@@ -117,49 +292,177 @@ void Printer::printFiles(Meter *meter, Telegram *t, string &human_readable, stri
             break;
         }
 
+        string path = filename;
         if (stamp.length() > 0)
         {
             // There is a timestamp, lets append it.
-            strcat(filename, "_");
-            strcat(filename, stamp.c_str());
+            path += "_"+stamp;
         }
 
-        const char *mode = overwrite_ ? "w" : "a";
-        output = fopen(filename, mode);
-        if (!output) {
-            warning("Could not open file \"%s\" for writing!\n", filename);
-            return;
+        if (overwrite_) {
+            overwriteFile(path, line);
+        } else {
+            appendFile(filename, path, line);
         }
     } else if (use_logfile_) {
-        output = fopen(logfile_.c_str(), "a");
-        if (!output) {
-            warning("Could not open file \"%s\" for writing!\n", logfile_.c_str());
+        appendFile(logfile_, logfile_, line);
+    } else {
+        fprintf(stdout, "%s\n", line.c_str());
+    }
+}
+
+void Printer::appendFile(string key, string path, const string &line)
+{
+    LOCK_FILES(append_file);
+
+    auto i = files_.find(key);
+    if (i != files_.end() && i->second.path != path)
+    {
+        // The timestamp suffix has rolled over, continue in the new file.
+        closeFile(i->second);
+        files_.erase(i);
+        i = files_.end();
+    }
+    if (i == files_.end())
+    {
+        if (files_.size() >= MAX_OPEN_OUTPUT_FILES)
+        {
+            auto lru = files_.begin();
+            for (auto j = files_.begin(); j != files_.end(); ++j)
+            {
+                if (j->second.last_used < lru->second.last_used) lru = j;
+            }
+            closeFile(lru->second);
+            files_.erase(lru);
+        }
+        OutputFile of;
+        of.path = path;
+        of.file = fopen(path.c_str(), "a");
+        if (!of.file) {
+            warning("Could not open file \"%s\" for writing!\n", path.c_str());
             return;
         }
-    }
-    if (json_) {
-        if (output) {
-            fprintf(output, "%s\n", json.c_str());
-        } else {
-            notice("%s\n", json.c_str());
+        struct stat st;
+        if (fstat(fileno(of.file), &st) == 0)
+        {
+            of.dev = st.st_dev;
+            of.ino = st.st_ino;
+        }
+        if (flush_after_bytes_ > BUFSIZ)
+        {
+            setvbuf(of.file, NULL, _IOFBF, flush_after_bytes_);
         }
+        i = files_.insert({ key, of }).first;
     }
-    else if (fields_) {
-        if (output) {
-            fprintf(output, "%s\n", fields.c_str());
-        } else {
-            notice("%s\n", fields.c_str());
+
+    OutputFile &of = i->second;
+    of.last_used = ++files_used_;
+    fprintf(of.file, "%s\n", line.c_str());
+    bool was_clean = of.unflushed == 0;
+    of.unflushed += line.length()+1;
+
+    if (flushAfterEveryTelegram())
+    {
+        fflush(of.file);
+        of.unflushed = 0;
+    }
+    else if (flush_after_bytes_ > 0 && of.unflushed >= (size_t)flush_after_bytes_)
+    {
+        flushFile(of);
+    }
+    else if (flush_after_ms_ > 0 && was_clean)
+    {
+        // The file is now dirty, the FLUSH_FILES callback flushes it when the deadline has passed.
+        of.flush_deadline = chrono::steady_clock::now()+chrono::milliseconds(flush_after_ms_);
+    }
+}
+
+void Printer::overwriteFile(string path, const string &line)
+{
+    LOCK_FILES(overwrite_file);
+
+    // Write a new file and rename it into place, a reader will then
+    // never see an empty or half written meter file.
+    string tmp = path+".tmp";
+    FILE *output = fopen(tmp.c_str(), "w");
+    if (!output) {
+        warning("Could not open file \"%s\" for writing!\n", tmp.c_str());
+        return;
+    }
+    fprintf(output, "%s\n", line.c_str());
+    int rc = fclose(output);
+    if (rc == 0) rc = rename(tmp.c_str(), path.c_str());
+    if (rc != 0) {
+        warning("Could not write file \"%s\"!\n", path.c_str());
+        unlink(tmp.c_str());
+    }
+}
+
+void Printer::flushFile(OutputFile &of)
+{
+    fflush(of.file);
+    // When flushing less often than after every telegram, then the data
+    // is also synced to disk, once for all telegrams written since the last flush.
+    if (!flushAfterEveryTelegram()) fsync(fileno(of.file));
+    of.unflushed = 0;
+}
+
+void Printer::closeFile(OutputFile &of)
+{
+    if (of.unflushed > 0) flushFile(of);
+    fclose(of.file);
+    of.file = NULL;
+}
+
+void Printer::flushFiles()
+{
+    LOCK_FILES(flush_files);
+
+    if (timeseries_) timeseries_->flush(false);
+
+    auto now = chrono::steady_clock::now();
+    if (flush_after_ms_ > 0)
+    {
+        for (auto &p : files_)
+        {
+            if (p.second.unflushed > 0 && now >= p.second.flush_deadline) flushFile(p.second);
+        }
+        if (chrono::duration_cast<chrono::milliseconds>(now-last_flush_).count() >= flush_after_ms_)
+        {
+            fflush(stdout);
+            last_flush_ = now;
         }
     }
-    else {
-        if (output) {
-            fprintf(output, "%s\n", human_readable.c_str());
-        } else {
-            notice("%s\n", human_readable.c_str());
+
+    time_t curr = time(NULL);
+    if (curr-last_moved_check_ < CHECK_MOVED_FILES_SECONDS) return;
+    last_moved_check_ = curr;
+
+    for (auto i = files_.begin(); i != files_.end(); )
+    {
+        struct stat st;
+        OutputFile &of = i->second;
+        if (stat(of.path.c_str(), &st) != 0 || st.st_dev != of.dev || st.st_ino != of.ino)
+        {
+            // The file has been moved away or removed, it is created again on the next write.
+            debug("(printer) file %s has been moved, closing it\n", of.path.c_str());
+            closeFile(of);
+            i = files_.erase(i);
+        }
+        else
+        {
+            i++;
         }
     }
+}
+
+void Printer::closeFiles()
+{
+    LOCK_FILES(close_files);
 
-    if (output != stdout && output) {
-        fclose(output);
+    for (auto &p : files_)
+    {
+        closeFile(p.second);
     }
+    files_.clear();
 }
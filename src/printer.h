@@ -17,10 +17,50 @@
 
 #include"cmdline.h"
 #include"meters.h"
+#include"threads.h"
+#include"timeseries.h"
 #include"wmbus.h"
 
+#include<chrono>
+#include<map>
+#include<memory>
+#include<sys/types.h>
+
 using namespace std;
 
+// Check this often if the open files have been moved away or removed.
+#define CHECK_MOVED_FILES_SECONDS 10
+
+// The formatted output of one meter update, ready to be written and passed to the shells.
+struct PrinterOutput
+{
+    string name; // Meter name.
+    string id; // Telegram id.
+    DriverCounters *counters {}; // The shells are timed per driver.
+    vector<string> shells; // Shell cmdlines to invoke.
+    MeterOutputs out; // A copy of the meter's buffers, only filled in when queued.
+};
+
+// A meter file or the logfile, kept open between telegrams.
+struct OutputFile
+{
+    string path; // Including the timestamp suffix, if any.
+    FILE *file {};
+    dev_t dev {}; // Used to detect that the file has been moved away or removed.
+    ino_t ino {};
+    size_t unflushed {}; // Bytes written since the last flush.
+    std::chrono::steady_clock::time_point flush_deadline; // When flushing by time, set by the first unflushed write.
+    uint64_t last_used {};
+};
+
+// A long lived shell that receives the json of every telegram on its stdin.
+struct ShellPipe
+{
+    string cmdline;
+    int fd {-1}; // The stdin of the shell, -1 when not running.
+    int pid {};
+};
+
 struct Printer {
     Printer(bool json,
             bool fields,
@@ -28,12 +68,31 @@ struct Printer {
             bool meterfiles, string &meterfiles_dir,
             bool use_logfile, string &logfile,
             vector<string> shell_cmdlines,
+            vector<string> shellpipe_cmdlines,
             bool overwrite,
             MeterFileNaming naming,
-            MeterFileTimestamp timestamp);
+            MeterFileTimestamp timestamp,
+            int flush_after_ms,
+            int flush_after_bytes,
+            string timeseries_dir);
 
+    // Formats the output in the calling thread. The output is then written in the
+    // calling thread, or queued for the output thread if it has been started.
     void print(Telegram *t, Meter *meter, vector<string> *more_json, vector<string> *selected_fields);
 
+    void startOutputThread();
+    // Writes the output still queued, then stops the output thread.
+    void stopOutputThread();
+
+    // Invoked regularly to flush the files when the flush interval has passed,
+    // and to close the files that have been moved away, for example by logrotate.
+    void flushFiles();
+
+    // The number of outputs waiting for the output thread.
+    size_t queuedOutputs() { return output_queue_ ? output_queue_->size() : 0; }
+
+    ~Printer();
+
     private:
 
     bool json_, fields_;
@@ -43,11 +102,38 @@ struct Printer {
     string logfile_;
     char separator_;
     vector<string> shell_cmdlines_;
+    vector<ShellPipe> shellpipes_;
     bool overwrite_;
     MeterFileNaming naming_;
     MeterFileTimestamp timestamp_;
+    int flush_after_ms_ {}; // Both 0 means flush after every telegram.
+    int flush_after_bytes_ {};
+    unique_ptr<TimeSeriesSink> timeseries_; // NULL unless --timeseries is used.
+
+    // Open files keyed on the path without the timestamp suffix,
+    // thus a rolled over timestamp replaces the old file.
+    map<string,OutputFile> files_;
+    uint64_t files_used_ {};
+    std::chrono::steady_clock::time_point last_flush_;
+    time_t last_moved_check_ {};
+    RecursiveMutex files_mutex_ = { "files_mutex" };
+#define LOCK_FILES(where) WITH(files_mutex_, where)
+
+    unique_ptr<BoundedQueue<PrinterOutput>> output_queue_;
+    function<void()> output_loop_;
+    pthread_t output_thread_ {};
 
-    void printShells(Meter *meter, vector<string> &envs);
-    void printFiles(Meter *meter, Telegram *t, string &human_readable, string &fields, string &json);
+    void write(PrinterOutput &po, const MeterOutputs &out);
+    void printShells(PrinterOutput &po, const MeterOutputs &out);
+    void printShellPipes(const MeterOutputs &out);
+    void stopShellPipes();
+    void printFiles(PrinterOutput &po, const MeterOutputs &out);
+    void printTimeSeries(Telegram *t, Meter *meter);
+    void appendFile(string key, string path, const string &line);
+    void overwriteFile(string path, const string &line);
+    bool flushAfterEveryTelegram() { return flush_after_ms_ == 0 && flush_after_bytes_ == 0; }
+    void flushFile(OutputFile &of);
+    void closeFile(OutputFile &of);
+    void closeFiles();
 
 };
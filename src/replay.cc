@@ -0,0 +1,195 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"replay.h"
+#include"util.h"
+
+#include<algorithm>
+#include<atomic>
+#include<memory>
+#include<new>
+#include<stdlib.h>
+
+using namespace std;
+
+// The allocations are only counted when a replay or the statistics asks for them.
+// Every thread then counts in its own cache line, thus the decode threads do
+// not contend on a shared counter.
+#define ALLOCATION_COUNTERS 64
+
+struct alignas(64) AllocationCounter
+{
+    atomic<uint64_t> n { 0 };
+};
+
+static atomic<bool> count_allocations_ { false };
+static AllocationCounter allocation_counters_[ALLOCATION_COUNTERS];
+static atomic<int> next_allocation_counter_ { 0 };
+static thread_local int allocation_counter_ = -1;
+
+void *operator new(size_t size)
+{
+    if (count_allocations_.load(memory_order_relaxed))
+    {
+        if (allocation_counter_ == -1)
+        {
+            allocation_counter_ = next_allocation_counter_.fetch_add(1, memory_order_relaxed) % ALLOCATION_COUNTERS;
+        }
+        allocation_counters_[allocation_counter_].n.fetch_add(1, memory_order_relaxed);
+    }
+    void *p = malloc(size ? size : 1);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t size) noexcept
+{
+    free(p);
+}
+
+void enableAllocationCounting()
+{
+    count_allocations_.store(true, memory_order_relaxed);
+}
+
+uint64_t numAllocations()
+{
+    uint64_t n = 0;
+    for (auto &c : allocation_counters_) n += c.n.load(memory_order_relaxed);
+    return n;
+}
+
+void ReplayStatistics::begin()
+{
+    telegrams_ = 0;
+    allocations_begin_ = numAllocations();
+    heap_begin_ = getHeapBytes();
+    begin_ = chrono::steady_clock::now();
+}
+
+void ReplayStatistics::addDecodeLatency(const string &driver, uint64_t ns)
+{
+    LOCK_REPLAY_STATISTICS(addDecodeLatency);
+
+    latencies_[driver].push_back(ns);
+}
+
+void ReplayStatistics::end()
+{
+    end_ = chrono::steady_clock::now();
+    allocations_end_ = numAllocations();
+    heap_end_ = getHeapBytes();
+}
+
+double ReplayStatistics::telegramsPerSecond()
+{
+    double s = chrono::duration<double>(end_-begin_).count();
+    if (s <= 0) return 0;
+    return telegrams_/s;
+}
+
+double ReplayStatistics::allocationsPerTelegram()
+{
+    if (telegrams_ == 0) return 0;
+    return (double)(allocations_end_-allocations_begin_)/telegrams_;
+}
+
+double ReplayStatistics::heapGrowthPerTelegram()
+{
+    if (telegrams_ == 0) return 0;
+    return ((double)heap_end_-(double)heap_begin_)/telegrams_;
+}
+
+uint64_t ReplayStatistics::decodeLatency(const string &driver, double p)
+{
+    LOCK_REPLAY_STATISTICS(decodeLatency);
+
+    auto i = latencies_.find(driver);
+    if (i == latencies_.end() || i->second.size() == 0) return 0;
+
+    vector<uint64_t> &v = i->second;
+    size_t n = (size_t)(p/100.0*(v.size()-1)+0.5);
+    nth_element(v.begin(), v.begin()+n, v.end());
+    return v[n];
+}
+
+vector<string> ReplayStatistics::drivers()
+{
+    LOCK_REPLAY_STATISTICS(drivers);
+
+    vector<string> ds;
+    for (auto &p : latencies_) ds.push_back(p.first);
+    return ds;
+}
+
+void ReplayStatistics::report()
+{
+    notice("(replay) %zu telegrams in %.3f s, %.0f telegrams/s, %.1f allocations/telegram, heap grew %.1f bytes/telegram\n",
+           telegrams_, chrono::duration<double>(end_-begin_).count(),
+           telegramsPerSecond(), allocationsPerTelegram(), heapGrowthPerTelegram());
+
+    for (auto &d : drivers())
+    {
+        size_t n;
+        {
+            LOCK_REPLAY_STATISTICS(report);
+            n = latencies_[d].size();
+        }
+        notice("(replay) %-16s %8zu telegrams, decode latency p50 %.1f us p99 %.1f us\n",
+               d.c_str(), n, decodeLatency(d, 50)/1000.0, decodeLatency(d, 99)/1000.0);
+    }
+}
+
+static unique_ptr<ReplayStatistics> replay_statistics_;
+
+void setReplay(double speed)
+{
+    if (speed >= 0)
+    {
+        replay_statistics_ = unique_ptr<ReplayStatistics>(new ReplayStatistics(speed));
+        enableAllocationCounting();
+    }
+    else
+    {
+        replay_statistics_.reset();
+    }
+}
+
+ReplayStatistics *replayStatistics()
+{
+    return replay_statistics_.get();
+}
@@ -0,0 +1,85 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "threads.h"
+
+#include <chrono>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Every binary replaces the global operator new, to be able to count the allocations.
+// Start counting them, the counting is off by default.
+void enableAllocationCounting();
+// The number of allocations made through operator new since the counting was enabled.
+uint64_t numAllocations();
+
+// Measures a replay of a simulation file: the number of telegrams per second,
+// the decode latency per meter driver, the allocations and the heap growth per telegram.
+struct ReplayStatistics
+{
+    // A speed of 0 ignores the +N offsets in the simulation file, otherwise
+    // the telegrams are replayed speed times faster than they were recorded.
+    ReplayStatistics(double speed) : speed_(speed) {}
+    double speed() { return speed_; }
+
+    void begin();
+    void telegramReplayed() { telegrams_++; }
+    // Called from the decode threads, when a driver has decoded a telegram.
+    void addDecodeLatency(const std::string &driver, uint64_t ns);
+    // Called when all replayed telegrams have been decoded and printed.
+    void end();
+
+    size_t telegrams() { return telegrams_; }
+    double telegramsPerSecond();
+    // Also counts the allocations that are freed again while decoding the telegram.
+    double allocationsPerTelegram();
+    // The heap growth from malloc statistics, thus without hooking the allocator.
+    double heapGrowthPerTelegram();
+    // The p:th percentile (0-100) of the decode latencies for driver, in nanoseconds.
+    uint64_t decodeLatency(const std::string &driver, double p);
+    std::vector<std::string> drivers();
+
+    void report();
+
+private:
+
+    double speed_ {};
+    size_t telegrams_ {};
+    uint64_t allocations_begin_ {};
+    uint64_t allocations_end_ {};
+    size_t heap_begin_ {};
+    size_t heap_end_ {};
+    std::chrono::steady_clock::time_point begin_;
+    std::chrono::steady_clock::time_point end_;
+    std::map<std::string,std::vector<uint64_t>> latencies_;
+
+    RecursiveMutex mutex_ = { "replay_statistics_mutex" };
+#define LOCK_REPLAY_STATISTICS(where) WITH(mutex_, where)
+};
+
+// Replay the simulation files as fast as possible (speed 0) or speed times faster
+// than recorded, and measure the decoding. A negative speed turns off replay.
+void setReplay(double speed);
+// Returns NULL when not replaying.
+ReplayStatistics *replayStatistics();
+
+#endif
@@ -24,6 +24,7 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <dirent.h>
 #include <fcntl.h>
 #include <functional>
@@ -41,12 +42,127 @@
 #include <unistd.h>
 
 #if defined(__linux__)
+#include <linux/netlink.h>
 #include <linux/serial.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#define HAS_EPOLL 1
 #endif
 
 static int openSerialTTY(const char *tty, int baud_rate);
 static string showTTYSettings(int fd);
 
+#ifdef HAS_EPOLL
+// Maximum number of ready file descriptors handled per epoll_wait.
+#define MAX_EPOLL_EVENTS 64
+
+// The fds are level triggered, not edge triggered. The device read callbacks read
+// what is available and return, they do not read until EAGAIN. With edge triggering
+// the bytes left unread would not be reported again until more bytes arrive.
+static void addToInterestList(int epoll_fd, int fd)
+{
+    struct epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    int rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    if (rc == -1)
+    {
+        warning("(serial) could not add fd %d to epoll! errno=%s\n", fd, strerror(errno));
+    }
+}
+
+static void signalFd(int fd)
+{
+    if (fd == -1) return;
+    uint64_t one = 1;
+    ssize_t n = write(fd, &one, sizeof(one));
+    (void)n; // A failed write means the eventfd counter is already non-zero.
+}
+
+static void drainFd(int fd)
+{
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) == sizeof(count)) { }
+}
+
+static int createTimerFd(int seconds, bool repeat)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+    {
+        error("Could not create timerfd! errno=%s\n", strerror(errno));
+    }
+    struct itimerspec its {};
+    its.it_value.tv_sec = seconds;
+    if (repeat) its.it_interval.tv_sec = seconds;
+    timerfd_settime(fd, 0, &its, NULL);
+    return fd;
+}
+
+static int openUeventSocket()
+{
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd == -1)
+    {
+        debug("(serial) could not open uevent socket! errno=%s\n", strerror(errno));
+        return -1;
+    }
+    struct sockaddr_nl addr {};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // The kernel events, not the ones re-broadcasted by udev.
+    int rc = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (rc == -1)
+    {
+        debug("(serial) could not bind uevent socket! errno=%s\n", strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read all pending uevents, returns true if any of them was a hot plug.
+static bool receiveUevents(int fd)
+{
+    bool hot_plug = false;
+    char buf[8192];
+    for (;;)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf)-1, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        // ENOBUFS means that events were lost, list the devices to be sure.
+        if (n < 0 && errno == ENOBUFS) { hot_plug = true; continue; }
+        if (n <= 0) break;
+        buf[n] = 0;
+        if (isHotPlugUevent(buf, n))
+        {
+            debug("(serial) hot plug %s\n", buf);
+            hot_plug = true;
+        }
+    }
+    return hot_plug;
+}
+#endif
+
+bool isHotPlugUevent(const char *msg, size_t len)
+{
+    // The message is a header "add@/devices/..." followed by
+    // zero terminated KEY=value strings.
+    bool action = false, subsystem = false;
+    size_t i = 0;
+    while (i < len)
+    {
+        const char *s = msg+i;
+        size_t n = strnlen(s, len-i);
+        string kv(s, n);
+        if (kv == "ACTION=add" || kv == "ACTION=remove") action = true;
+        if (kv == "SUBSYSTEM=tty" || kv == "SUBSYSTEM=usb" || kv == "SUBSYSTEM=usb-serial") subsystem = true;
+        i += n+1;
+    }
+    return action && subsystem;
+}
+
 struct SerialDeviceImp;
 struct SerialDeviceTTY;
 struct SerialDeviceCommand;
@@ -59,6 +175,7 @@ struct Timer
     time_t last_call;
     function<void()> callback;
     string name;
+    int fd; // The timerfd driving this timer, -1 when timers are polled.
 
     bool isTime(time_t now)
     {
@@ -88,11 +205,13 @@ struct SerialCommunicationManagerImp : public SerialCommunicationManager
 
     shared_ptr<SerialDevice> addSerialDeviceForManagement(SerialDevice *sd);
     void tickleEventLoop();
+    void wakeEventLoop();
     void removeNonWorkingSerialDevices();
     void closeAllDoNotRemove();
 
     int startRegularCallback(string name, int seconds, function<void()> callback);
     void stopRegularCallback(int id);
+    bool onHotPlug(function<void()> cb, int uevent_fd);
 
     vector<string> listSerialTTYs();
     shared_ptr<SerialDevice> lookup(std::string device);
@@ -103,6 +222,7 @@ private:
     void *eventLoop();
     void *timerLoop();
 
+    void waitForData(vector<shared_ptr<SerialDevice>> *to_be_notified);
     void executeTimerCallbacks();
     time_t calculateTimeToNearestTimerCallback(time_t now);
 
@@ -121,6 +241,31 @@ private:
     vector<Timer> timers_;  // Protected by LOCK_TIMERS
     RecursiveMutex timers_mutex_ = { "timers_mutex" };
 #define LOCK_TIMERS(where) WITH(timers_mutex_, where)
+
+#ifdef HAS_EPOLL
+    void updateInterestList();
+    void executeTimerCallbacks(vector<int> &fired);
+
+    // The serial devices are registered in the epoll interest list once and
+    // the list is only updated when tickleEventLoop reports that a device
+    // was added, opened, closed or removed.
+    int epoll_fd_ = -1;
+    int wakeup_fd_ = -1; // eventfd written by wakeEventLoop.
+    bool interest_list_changed_ = true; // Protected by LOCK_SERIAL_DEVICES
+    map<int,shared_ptr<SerialDevice>> listening_; // fd -> device in the interest list.
+    vector<shared_ptr<SerialDevice>> always_readable_; // Regular files cannot be polled with epoll.
+
+    // The timer loop sleeps in epoll_wait on the timerfds of the regular callbacks.
+    int timer_epoll_fd_ = -1;
+    int timer_wakeup_fd_ = -1;
+    int exit_after_fd_ = -1;
+    bool wakes_on_sig_chld_ {};
+
+    // The kernel uevents are received in the same interest list as the serial devices.
+    int uevent_fd_ = -1;
+    function<void()> on_hot_plug_; // Protected by LOCK_SERIAL_DEVICES
+    atomic<bool> hot_plugged_ { false }; // Set when a uevent is received, consumed after the wait.
+#endif
 };
 
 SerialCommunicationManagerImp::~SerialCommunicationManagerImp()
@@ -133,17 +278,35 @@ SerialCommunicationManagerImp::~SerialCommunicationManagerImp()
     closeAllDoNotRemove();
     // Remove all closed devices.
     removeNonWorkingSerialDevices();
+#ifdef HAS_EPOLL
+    if (wakes_on_sig_chld_) wakeFdOnSigChld(-1);
+    {
+        LOCK_TIMERS(close_timers);
+        for (Timer &t : timers_) ::close(t.fd);
+        timers_.clear();
+    }
+    if (exit_after_fd_ != -1) ::close(exit_after_fd_);
+    if (uevent_fd_ != -1) ::close(uevent_fd_);
+    ::close(timer_wakeup_fd_);
+    ::close(timer_epoll_fd_);
+    listening_.clear();
+    always_readable_.clear();
+    ::close(wakeup_fd_);
+    ::close(epoll_fd_);
+    exit_after_fd_ = timer_wakeup_fd_ = timer_epoll_fd_ = wakeup_fd_ = epoll_fd_ = uevent_fd_ = -1;
+#endif
     // Now we can be sure the eventLoop has stopped and it is safe to
     // free this Manager object.
 }
 
 struct SerialDeviceImp : public SerialDevice
 {
-    void disableCallbacks() { no_callbacks_ = true; }
-    void enableCallbacks() { no_callbacks_ = false; }
+    void disableCallbacks() { no_callbacks_ = true; manager_->tickleEventLoop(); }
+    void enableCallbacks() { no_callbacks_ = false; manager_->tickleEventLoop(); }
     bool skippingCallbacks() { return no_callbacks_; }
     void fill(vector<uchar> &data) {};
     int receive(vector<uchar> *data);
+    int receive(ReceiveBuffer *buffer);
     bool waitFor(uchar c);
     bool working() { return resetting_ || fd_ != -1; }
     bool opened() { return resetting_ || fd_ != -2; }
@@ -157,7 +320,7 @@ struct SerialDeviceImp : public SerialDevice
     int fd() { return fd_; }
     SerialCommunicationManager *manager() { return manager_; }
     void resetInitiated() { debug("(serial) initiate reset\n"); resetting_ = true; }
-    void resetCompleted() { debug("(serial) reset completed\n"); resetting_ = false; }
+    void resetCompleted() { debug("(serial) reset completed\n"); resetting_ = false; manager_->tickleEventLoop(); }
     bool checkIfDataIsPending()
     {
         if (!opened() || !working()) return false; // No data can be pending if device is not opened nor working.
@@ -199,6 +362,36 @@ protected:
     friend struct SerialCommunicationManagerImp;
 };
 
+void ReceiveBuffer::consume(size_t n)
+{
+    assert(n <= size());
+    start_ += n;
+    // An empty buffer starts over from the front, without moving any bytes.
+    if (start_ == end_) clear();
+}
+
+uchar *ReceiveBuffer::prepareWrite(size_t n)
+{
+    if (buffer_.size()-end_ < n && start_ > 0)
+    {
+        // Move the partial frame to the front to reuse the consumed space.
+        memmove(buffer_.data(), buffer_.data()+start_, end_-start_);
+        end_ -= start_;
+        start_ = 0;
+    }
+    if (buffer_.size()-end_ < n)
+    {
+        buffer_.resize(max(end_+n, 2*buffer_.size()));
+    }
+    return buffer_.data()+end_;
+}
+
+void ReceiveBuffer::append(const uchar *data, size_t n)
+{
+    memcpy(prepareWrite(n), data, n);
+    commitWrite(n);
+}
+
 bool SerialDeviceImp::waitFor(uchar c)
 {
     vector<uchar> data;
@@ -212,20 +405,28 @@ bool SerialDeviceImp::waitFor(uchar c)
 }
 
 int SerialDeviceImp::receive(vector<uchar> *data)
+{
+    ReceiveBuffer buffer;
+    int num_read = receive(&buffer);
+    data->assign(buffer.begin(), buffer.end());
+    return num_read;
+}
+
+int SerialDeviceImp::receive(ReceiveBuffer *buffer)
 {
     LOCK_READ_SERIAL(receive);
 
     bool close_me = false;
 
-    data->clear();
+    size_t received_from = buffer->size();
     int num_read = 0;
 
     while (true)
     {
-        data->resize(num_read+1024);
-        int nr = read(fd_, &((*data)[num_read]), 1024);
+        int nr = read(fd_, buffer->prepareWrite(1024), 1024);
         if (nr > 0)
         {
+            buffer->commitWrite(nr);
             num_read += nr;
         }
         if (nr == 0)
@@ -258,18 +459,17 @@ int SerialDeviceImp::receive(vector<uchar> *data)
             break;
         }
     }
-    data->resize(num_read);
 
     if (isDebugEnabled())
     {
         if (expecting_ascii_)
         {
-            string msg = safeString(*data);
+            string msg = safeString(buffer->data()+received_from, num_read);
             debug("(serial) received ascii \"%s\"\n", msg.c_str());
         }
         else
         {
-            string msg = bin2hex(*data);
+            string msg = bin2hex(buffer->data()+received_from, num_read);
             debug("(serial) received binary \"%s\"\n", msg.c_str());
         }
     }
@@ -341,6 +541,8 @@ AccessCheck SerialDeviceTTY::open(bool fail_if_not_ok)
             }
         }
     }
+    manager_->tickleEventLoop();
+
     verbose("(serialtty) opened %s fd %d (%s)\n", device_.c_str(), fd_, purpose_.c_str());
     return AccessCheck::AccessOK;
 }
@@ -388,10 +590,7 @@ bool SerialDeviceTTY::send(vector<uchar> &data)
         debug("(serial %s) sent \"%s\"\n", device_.c_str(), msg.c_str());
     }
 
-    if (signalsInstalled())
-    {
-        if (getEventLoopThread()) pthread_kill(getEventLoopThread(), SIGUSR1);
-    }
+    manager_->wakeEventLoop();
 
     end:
     return rc;
@@ -470,6 +669,7 @@ AccessCheck SerialDeviceCommand::open(bool fail_if_not_ok)
     assert(fd_ >= 0);
     if (!ok) return AccessCheck::NotThere;
     setIsStdin();
+    manager_->tickleEventLoop();
     verbose("(serialcmd) opened %s pid %d fd %d (%s)\n", command_.c_str(), pid_, fd_, purpose_.c_str());
     return AccessCheck::AccessOK;
 }
@@ -665,6 +865,13 @@ struct SerialDeviceSimulator : public SerialDeviceImp
         data_.clear();
         return data->size();
     }
+    int receive(ReceiveBuffer *buffer)
+    {
+        int n = data_.size();
+        buffer->append(data_.data(), n);
+        data_.clear();
+        return n;
+    }
     int available() { return data_.size(); }
     int fd() { return -1; }
     bool working() { return false; } // Only one message that has already been handled! So return false here.
@@ -678,16 +885,39 @@ SerialCommunicationManagerImp::SerialCommunicationManagerImp(time_t exit_after_s
                                                              bool start_event_loop)
 {
     running_ = true;
+    start_time_ = time(NULL);
+    exit_after_seconds_ = exit_after_seconds;
+#ifdef HAS_EPOLL
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    timer_epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ == -1 || wakeup_fd_ == -1 || timer_epoll_fd_ == -1 || timer_wakeup_fd_ == -1)
+    {
+        error("Could not create the event loop file descriptors! errno=%s\n", strerror(errno));
+    }
+    addToInterestList(epoll_fd_, wakeup_fd_);
+    addToInterestList(timer_epoll_fd_, timer_wakeup_fd_);
+    if (exit_after_seconds_ > 0)
+    {
+        exit_after_fd_ = createTimerFd(exit_after_seconds_, false);
+        addToInterestList(timer_epoll_fd_, exit_after_fd_);
+    }
+#endif
     // Block the event loop until everything is configured.
     if (start_event_loop)
     {
         event_loop_mutex_.lock();
         startEventLoopThread(call(this, eventLoop));
         startTimerLoopThread(call(this, timerLoop));
+#ifdef HAS_EPOLL
+        // A pthread_kill can arrive just before the event loop enters epoll_wait
+        // and then be lost, the eventfd cannot.
+        wakeFdOnSigChld(wakeup_fd_);
+        wakes_on_sig_chld_ = true;
+#endif
     }
     wakeMeUpOnSigChld(getEventLoopThread());
-    start_time_ = time(NULL);
-    exit_after_seconds_ = exit_after_seconds;
 }
 
 shared_ptr<SerialDevice> SerialCommunicationManagerImp::createSerialDeviceTTY(string device,
@@ -752,6 +982,10 @@ void SerialCommunicationManagerImp::stop()
     {
         debug("(serial) stopping manager\n");
         running_ = false;
+#ifdef HAS_EPOLL
+        signalFd(wakeup_fd_);
+        signalFd(timer_wakeup_fd_);
+#endif
         if (getMainThread() != 0)
         {
             if (signalsInstalled())
@@ -791,6 +1025,10 @@ void SerialCommunicationManagerImp::waitForStop()
 
     closeAllDoNotRemove();
 
+#ifdef HAS_EPOLL
+    signalFd(wakeup_fd_);
+    signalFd(timer_wakeup_fd_);
+#endif
     if (signalsInstalled())
     {
         if (getEventLoopThread()) pthread_kill(getEventLoopThread(), SIGUSR1);
@@ -821,28 +1059,44 @@ void SerialCommunicationManagerImp::tickleEventLoop()
 {
     LOCK_SERIAL_DEVICES(tickle);
 
+#ifdef HAS_EPOLL
+    // Tickle the event loop to update the interest list with the new or closed file descriptor.
+    interest_list_changed_ = true;
+#endif
+    wakeEventLoop();
+}
+
+void SerialCommunicationManagerImp::wakeEventLoop()
+{
+#ifdef HAS_EPOLL
+    signalFd(wakeup_fd_);
+#else
     if (signalsInstalled())
     {
         // Tickle the event loop to use the new file descriptor in the select.
         if (getEventLoopThread()) pthread_kill(getEventLoopThread(), SIGUSR1);
     }
+#endif
 }
 
 void SerialCommunicationManagerImp::removeNonWorkingSerialDevices()
 {
     LOCK_SERIAL_DEVICES(remove_non_working_serial_devices);
 
+    bool removed = false;
     for (auto i = serial_devices_.begin(); i != serial_devices_.end(); )
     {
         if ((*i)->opened() && !(*i)->working())
         {
             i = serial_devices_.erase(i);
+            removed = true;
         }
         else
         {
             i++;
         }
     }
+    if (removed) tickleEventLoop();
 
     if (serial_devices_.size() == 0 && expect_devices_to_work_)
     {
@@ -907,6 +1161,76 @@ time_t SerialCommunicationManagerImp::calculateTimeToNearestTimerCallback(time_t
     return r;
 }
 
+#ifdef HAS_EPOLL
+
+void SerialCommunicationManagerImp::executeTimerCallbacks(vector<int> &fired)
+{
+    time_t curr = time(NULL);
+    vector<Timer> to_be_called;
+
+    {
+        LOCK_TIMERS(execute_timer_callbacks);
+
+        for (Timer &t : timers_)
+        {
+            if (find(fired.begin(), fired.end(), t.fd) != fired.end())
+            {
+                trace("[SERIAL] timer fired! %d %s\n", t.id, t.name.c_str());
+                t.last_call = curr;
+                to_be_called.push_back(t);
+            }
+        }
+    }
+
+    for (Timer &t : to_be_called)
+    {
+        trace("[SERIAL] invoking callback %s(%d)\n", t.name.c_str(), t.id);
+        t.callback();
+    }
+}
+
+void *SerialCommunicationManagerImp::timerLoop()
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    while (running_)
+    {
+        // Sleep until a timerfd expires or we are woken up to stop.
+        int n = epoll_wait(timer_epoll_fd_, events, MAX_EPOLL_EVENTS, -1);
+        if (n == -1 && errno == EINTR)
+        {
+            debug("(serial) TIMER thread interrupted\n");
+            continue;
+        }
+        if (!running_) break;
+        if (n == -1)
+        {
+            warning("(serial) internal error after epoll_wait! errno=%s\n", strerror(errno));
+            break;
+        }
+
+        vector<int> fired;
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            drainFd(fd);
+            if (fd == exit_after_fd_)
+            {
+                // Running time limit hit, now stop.
+                verbose("(serial) exit after %ld seconds\n", time(NULL)-start_time_);
+                stop();
+                return NULL;
+            }
+            if (fd != timer_wakeup_fd_) fired.push_back(fd);
+        }
+
+        executeTimerCallbacks(fired);
+    }
+    return NULL;
+}
+
+#else
+
 void *SerialCommunicationManagerImp::timerLoop()
 {
     while (running_)
@@ -937,89 +1261,232 @@ void *SerialCommunicationManagerImp::timerLoop()
     return NULL;
 }
 
-void *SerialCommunicationManagerImp::eventLoop()
+#endif
+
+#ifdef HAS_EPOLL
+
+void SerialCommunicationManagerImp::updateInterestList()
 {
-    LOCK_EVENT_LOOP(eventLoop);
+    // Called by the event loop with LOCK_SERIAL_DEVICES taken.
+    interest_list_changed_ = false;
 
-    fd_set readfds;
+    map<int,shared_ptr<SerialDevice>> wanted;
+    for (shared_ptr<SerialDevice> &sd : serial_devices_)
+    {
+        if (sd->opened() && sd->working() && !sd->skippingCallbacks() && sd->fd() >= 0)
+        {
+            wanted[sd->fd()] = sd;
+        }
+    }
 
-    while (running_)
+    for (auto &p : listening_)
     {
-        FD_ZERO(&readfds);
+        if (wanted.count(p.first) == 0)
+        {
+            // A closed fd has already left the interest list, thus ENOENT/EBADF are expected here.
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, p.first, NULL);
+            trace("[SERIAL] epoll removed fd %d\n", p.first);
+        }
+    }
 
-        bool all_working = true;
+    listening_.clear();
+    always_readable_.clear();
 
+    for (auto &p : wanted)
+    {
+        struct epoll_event ev {};
+        ev.events = EPOLLIN; // Level triggered, see addToInterestList.
+        ev.data.fd = p.first;
+        // The fd might have been closed and reopened with the same number since
+        // the last update, the modify then fails and the fd is added again.
+        int rc = epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, p.first, &ev);
+        if (rc == -1 && errno == ENOENT)
         {
-            LOCK_SERIAL_DEVICES(list_file_descriptiors_to_listen_to);
+            rc = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, p.first, &ev);
+            trace("[SERIAL] epoll added fd %d\n", p.first);
+        }
+        if (rc == -1 && errno == EPERM)
+        {
+            // Regular files (and /dev/null) cannot be polled, they are always readable.
+            always_readable_.push_back(p.second);
+            continue;
+        }
+        if (rc == -1)
+        {
+            warning("(serial) could not listen to fd %d! errno=%s\n", p.first, strerror(errno));
+            continue;
+        }
+        listening_[p.first] = p.second;
+    }
+}
 
-            for (shared_ptr<SerialDevice> &sd : serial_devices_)
-            {
-                if (sd->opened() && sd->working() && !sd->skippingCallbacks())
-                {
-                    trace("[SERIAL] select read on fd %d\n", sd->fd());
-                    FD_SET(sd->fd(), &readfds);
-                }
-                if (sd->opened() && !sd->working()) all_working = false;
-            }
+void SerialCommunicationManagerImp::waitForData(vector<shared_ptr<SerialDevice>> *to_be_notified)
+{
+    int timeout = -1;
+    {
+        LOCK_SERIAL_DEVICES(update_interest_list);
+
+        if (interest_list_changed_) updateInterestList();
+        if (always_readable_.size() > 0) timeout = 0;
+    }
+
+    // No timeout, the devices, tickleEventLoop and stop will wake us up.
+    trace("[SERIAL] epoll wait timeout %d ms\n", timeout);
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int n = epoll_wait(epoll_fd_, events, MAX_EPOLL_EVENTS, timeout);
+
+    if (n == -1)
+    {
+        if (errno == EINTR)
+        {
+            debug("(serial) EVENT thread interrupted\n");
         }
+        else
+        {
+            warning("(serial) internal error after epoll_wait! errno=%s\n", strerror(errno));
+        }
+        return;
+    }
+    if (!running_) return;
 
-        if (!all_working && expect_devices_to_work_)
+    LOCK_SERIAL_DEVICES(find_triggering_file_descriptions);
+
+    for (int i = 0; i < n; ++i)
+    {
+        int fd = events[i].data.fd;
+        if (fd == wakeup_fd_)
         {
-            debug("(serial) not all devices working, emergency exit!\n");
-            stop();
-            break;
+            drainFd(wakeup_fd_);
+            continue;
+        }
+        if (fd == uevent_fd_)
+        {
+            if (receiveUevents(uevent_fd_)) hot_plugged_ = true;
+            continue;
+        }
+        auto p = listening_.find(fd);
+        if (p == listening_.end()) continue;
+        shared_ptr<SerialDevice> &sd = p->second;
+        if (sd->opened() && sd->working() && !sd->skippingCallbacks() && sd->fd() == fd)
+        {
+            trace("[SERIAL] epoll detected data available for reading on fd %d\n", fd);
+            to_be_notified->push_back(sd);
+        }
+    }
+    for (shared_ptr<SerialDevice> &sd : always_readable_)
+    {
+        if (sd->opened() && sd->working() && !sd->skippingCallbacks())
+        {
+            to_be_notified->push_back(sd);
         }
+    }
+}
 
-        // Perform a select call every second.
-        struct timeval timeout { 1, 0 };
+#else
 
-        trace("[SERIAL] select timeout %d s\n", timeout.tv_sec);
+void SerialCommunicationManagerImp::waitForData(vector<shared_ptr<SerialDevice>> *to_be_notified)
+{
+    fd_set readfds;
+    FD_ZERO(&readfds);
 
-        int max_fd = 0;
-        for (shared_ptr<SerialDevice> &sp : serial_devices_)
+    int max_fd = 0;
+    {
+        LOCK_SERIAL_DEVICES(list_file_descriptiors_to_listen_to);
+
+        for (shared_ptr<SerialDevice> &sd : serial_devices_)
         {
-            if (sp->fd() > max_fd)
+            if (sd->opened() && sd->working() && !sd->skippingCallbacks())
+            {
+                trace("[SERIAL] select read on fd %d\n", sd->fd());
+                FD_SET(sd->fd(), &readfds);
+            }
+            if (sd->fd() > max_fd)
             {
-                max_fd = sp->fd();
+                max_fd = sd->fd();
             }
         }
+    }
+
+    // Perform a select call every second.
+    struct timeval timeout { SELECT_TIMEOUT, 0 };
+
+    trace("[SERIAL] select timeout %d s\n", timeout.tv_sec);
+
+    int activity = select(max_fd+1 , &readfds, NULL , NULL, &timeout);
+
+    if (activity == -1 && errno == EINTR)
+    {
+        debug("(serial) EVENT thread interrupted\n");
+    }
+    if (!running_) return;
+    if (activity < 0 && errno!=EINTR)
+    {
+        warning("(serial) internal error after select! errno=%s\n", strerror(errno));
+    }
 
-        int activity = select(max_fd+1 , &readfds, NULL , NULL, &timeout);
+    if (activity > 0)
+    {
+        // Something has happened that caused the sleeping select to wake up.
+        LOCK_SERIAL_DEVICES(find_triggering_file_descriptions);
 
-        if (activity == -1 && errno == EINTR)
+        for (shared_ptr<SerialDevice> &sd : serial_devices_)
         {
-            debug("(serial) EVENT thread interrupted\n");
+            if (sd->opened() && sd->working() && FD_ISSET(sd->fd(), &readfds))
+            {
+                trace("[SERIAL] select detected data available for reading on fd %d\n", sd->fd());
+                to_be_notified->push_back(sd);
+            }
         }
-        if (!running_) break;
-        if (activity < 0 && errno!=EINTR)
+    }
+}
+
+#endif
+
+void *SerialCommunicationManagerImp::eventLoop()
+{
+    LOCK_EVENT_LOOP(eventLoop);
+
+    while (running_)
+    {
+        bool all_working = true;
+
         {
-            warning("(serial) internal error after select! errno=%s\n", strerror(errno));
+            LOCK_SERIAL_DEVICES(check_all_working);
+
+            for (shared_ptr<SerialDevice> &sd : serial_devices_)
+            {
+                if (sd->opened() && !sd->working()) all_working = false;
+            }
         }
 
-        if (activity > 0)
+        if (!all_working && expect_devices_to_work_)
         {
-            // Something has happened that caused the sleeping select to wake up.
-            vector<shared_ptr<SerialDevice>> to_be_notified;
-            {
-                LOCK_SERIAL_DEVICES(find_triggering_file_descriptions);
+            debug("(serial) not all devices working, emergency exit!\n");
+            stop();
+            break;
+        }
 
-                for (shared_ptr<SerialDevice> &sd : serial_devices_)
-                {
-                    if (sd->opened() && sd->working() && FD_ISSET(sd->fd(), &readfds))
-                    {
-                        trace("[SERIAL] select detected data available for reading on fd %d\n", sd->fd());
-                        to_be_notified.push_back(sd);
-                    }
-                }
-            }
+        vector<shared_ptr<SerialDevice>> to_be_notified;
+        waitForData(&to_be_notified);
+        if (!running_) break;
 
-            for (shared_ptr<SerialDevice> &sd : to_be_notified)
+#ifdef HAS_EPOLL
+        function<void()> on_hot_plug;
+        if (hot_plugged_.exchange(false))
+        {
+            LOCK_SERIAL_DEVICES(hot_plug);
+            on_hot_plug = on_hot_plug_;
+        }
+        if (on_hot_plug) on_hot_plug();
+#endif
+
+        for (shared_ptr<SerialDevice> &sd : to_be_notified)
+        {
+            SerialDeviceImp *si = dynamic_cast<SerialDeviceImp*>(sd.get());
+            if (si->on_data_)
             {
-                SerialDeviceImp *si = dynamic_cast<SerialDeviceImp*>(sd.get());
-                if (si->on_data_)
-                {
-                    si->on_data_();
-                }
+                si->on_data_();
             }
         }
 
@@ -1151,7 +1618,11 @@ int SerialCommunicationManagerImp::startRegularCallback(string name, int seconds
 {
     LOCK_TIMERS(start_regular_callback);
 
-    Timer t = { (int)timers_.size(), seconds, time(NULL), callback, name };
+    Timer t = { (int)timers_.size(), seconds, time(NULL), callback, name, -1 };
+#ifdef HAS_EPOLL
+    t.fd = createTimerFd(seconds, true);
+    addToInterestList(timer_epoll_fd_, t.fd);
+#endif
     timers_.push_back(t);
     debug("(serial) registered regular callback %s(%d) every %d seconds\n", name.c_str(), t.id, seconds);
 
@@ -1167,12 +1638,35 @@ void SerialCommunicationManagerImp::stopRegularCallback(int id)
     {
         if ((*i).id == id)
         {
+#ifdef HAS_EPOLL
+            ::close((*i).fd);
+#endif
             timers_.erase(i);
             break;
         }
     }
 }
 
+bool SerialCommunicationManagerImp::onHotPlug(function<void()> cb, int uevent_fd)
+{
+#ifdef HAS_EPOLL
+    LOCK_SERIAL_DEVICES(on_hot_plug);
+
+    if (uevent_fd_ == -1)
+    {
+        if (uevent_fd == -1) uevent_fd = openUeventSocket();
+        if (uevent_fd == -1) return false;
+        uevent_fd_ = uevent_fd;
+        addToInterestList(epoll_fd_, uevent_fd_);
+        debug("(serial) listening to hot plug events on fd %d\n", uevent_fd_);
+    }
+    on_hot_plug_ = cb;
+    return true;
+#else
+    if (uevent_fd != -1) ::close(uevent_fd);
+    return false;
+#endif
+}
 
 shared_ptr<SerialDevice> SerialCommunicationManagerImp::lookup(string device)
 {
@@ -1202,6 +1696,7 @@ bool SerialCommunicationManagerImp::removeNonWorking(string device)
             i++;
         }
     }
+    if (found_and_removed) tickleEventLoop();
 
     return found_and_removed;
 }
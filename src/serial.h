@@ -29,6 +29,36 @@ using namespace std;
 
 struct SerialCommunicationManager;
 
+/**
+  The bytes received from a serial device that have not yet been consumed as frames.
+  The device read()s straight into the free space at the end of the buffer and the
+  frame checkers work directly on the unconsumed bytes. Consuming a frame only moves
+  the start offset, the remaining bytes are moved to the front of the buffer when the
+  free space at the end runs out.
+*/
+struct ReceiveBuffer
+{
+    size_t size() { return end_-start_; }
+    uchar *data() { return buffer_.data()+start_; }
+    uchar *begin() { return data(); }
+    uchar *end() { return buffer_.data()+end_; }
+    uchar &operator[](size_t i) { return buffer_[start_+i]; }
+
+    // Drop n bytes from the front of the buffer.
+    void consume(size_t n);
+    void clear() { start_ = end_ = 0; }
+    // Make room for at least n more bytes and return where to write them,
+    // then commit the number of bytes actually written.
+    uchar *prepareWrite(size_t n);
+    void commitWrite(size_t n) { end_ += n; }
+    void append(const uchar *data, size_t n);
+
+private:
+    std::vector<uchar> buffer_;
+    size_t start_ {};
+    size_t end_ {};
+};
+
 /**
   A SerialDevice can be connected to a tty with a baudrate.
   But can also be connected to stdin, a file, or the output from a subshell.
@@ -45,6 +75,8 @@ struct SerialDevice
     virtual bool send(std::vector<uchar> &data) = 0;
     // Receive returns the number of bytes received.
     virtual int receive(std::vector<uchar> *data) = 0;
+    // Append the received bytes to the buffer, returns the number of bytes received.
+    virtual int receive(ReceiveBuffer *buffer) = 0;
     // Read and skip until the desired character is found
     // and no further bytes can be read.
     virtual bool waitFor(uchar c) = 0;
@@ -103,6 +135,10 @@ struct SerialCommunicationManager
     // Returns an id for the timer.
     virtual int startRegularCallback(std::string name, int seconds, function<void()> callback) = 0;
     virtual void stopRegularCallback(int id) = 0;
+    // Invoke cb from the event loop when the kernel reports that a tty or usb device was added or removed.
+    // Returns false if there are no such events, then the devices have to be listed regularly instead.
+    // The uevent_fd replaces the kernel netlink socket when testing, it is closed by the manager.
+    virtual bool onHotPlug(function<void()> cb, int uevent_fd = -1) = 0;
 
     // List all real serial devices (avoid pseudo ttys)
     virtual std::vector<std::string> listSerialTTYs() = 0;
@@ -113,6 +149,9 @@ struct SerialCommunicationManager
     virtual ~SerialCommunicationManager();
 };
 
+// Returns true if the kernel uevent message reports that a tty or usb device was added or removed.
+bool isHotPlugUevent(const char *msg, size_t len);
+
 shared_ptr<SerialCommunicationManager> createSerialCommunicationManager(time_t exit_after_seconds,
                                                                         bool start_event_loop);
 
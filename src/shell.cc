@@ -16,14 +16,18 @@
  */
 
 #include "shell.h"
+#include "threads.h"
 #include "util.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <memory.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 void invokeShell(string program, vector<string> args, vector<string> envs)
@@ -153,6 +157,179 @@ bool invokeBackgroundShell(string program, vector<string> args, vector<string> e
     return true;
 }
 
+bool invokeShellPipe(string program, vector<string> args, vector<string> envs, int *fd_in, int *pid)
+{
+    int link[2];
+    vector<const char*> argv(args.size()+2);
+    char *p = new char[program.length()+1];
+    strcpy(p, program.c_str());
+    argv[0] = p;
+    int i = 1;
+    debug("(shellpipe) exec \"%s\"\n", program.c_str());
+    for (auto &a : args) {
+        argv[i] = a.c_str();
+        i++;
+        debug("(shellpipe) arg \"%s\"\n", a.c_str());
+    }
+    argv[i] = NULL;
+
+    vector<const char*> env(envs.size()+1);
+    env[0] = p;
+    i = 0;
+    for (auto &e : envs) {
+        env[i] = e.c_str();
+        i++;
+        debug("(shellpipe) env \"%s\"\n", e.c_str());
+    }
+    env[i] = NULL;
+
+    // Other shells forked by other threads must not inherit the write end of the pipe,
+    // then the shell pipe would never see the end of its input. Thus the pipe is
+    // created close-on-exec, dup2 clears the flag on the stdin of the shell pipe.
+#if (defined(__APPLE__) && defined(__MACH__))
+    if (pipe(link) == -1) {
+        error("(shellpipe) could not create pipe!\n");
+    }
+    fcntl(link[0], F_SETFD, FD_CLOEXEC);
+    fcntl(link[1], F_SETFD, FD_CLOEXEC);
+#else
+    if (pipe2(link, O_CLOEXEC) == -1) {
+        error("(shellpipe) could not create pipe!\n");
+    }
+#endif
+
+    *pid = fork();
+    if (*pid == 0) {
+        // I am the child!
+        restoreSignalHandlers();
+        // A ctrl-c in the terminal should not kill the shell pipe before
+        // wmbusmeters has passed on the telegrams it has already received.
+        setpgid(0, 0);
+        // Redirect stdin from the pipe.
+        dup2 (link[0], STDIN_FILENO);
+        close(link[0]);
+        close(link[1]);
+
+#if (defined(__APPLE__) && defined(__MACH__)) || defined(__FreeBSD__)
+        execve(program.c_str(), (char*const*)&argv[0], (char*const*)&env[0]);
+#else
+        execvpe(program.c_str(), (char*const*)&argv[0], (char*const*)&env[0]);
+#endif
+
+        perror("Execvp failed:");
+        error("(shellpipe) invoking %s failed!\n", program.c_str());
+        return false;
+    }
+    delete[] p;
+    close(link[0]);
+
+    if (*pid == -1) {
+        close(link[1]);
+        warning("(shellpipe) could not fork!\n");
+        return false;
+    }
+
+    *fd_in = link[1];
+    return true;
+}
+
+bool writeShellPipe(int fd_in, string &line)
+{
+    // A shell pipe that has exited must not kill wmbusmeters with a SIGPIPE,
+    // block the signal in this thread and get EPIPE from the write instead.
+    sigset_t pipe_set, old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+    bool ok = true;
+    size_t written = 0;
+    while (written < line.size())
+    {
+        ssize_t n = write(fd_in, line.c_str()+written, line.size()-written);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            ok = false;
+            break;
+        }
+        written += n;
+    }
+
+    if (!ok && errno == EPIPE)
+    {
+        // Consume the SIGPIPE before unblocking it.
+        sigset_t pending;
+        sigpending(&pending);
+        if (sigismember(&pending, SIGPIPE))
+        {
+            int sig;
+            sigwait(&pipe_set, &sig);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    return ok;
+}
+
+// A shell pipe gets this many seconds to handle the end of its input, before it is killed.
+#define SHELL_PIPE_EXIT_SECONDS 5
+
+struct StoppingShellPipe
+{
+    int pid;
+    time_t deadline;
+};
+
+// Shell pipes that have had their stdin closed, but have not been reaped yet.
+static RecursiveMutex stopping_shell_pipes_mutex_("stopping_shell_pipes_mutex");
+static vector<StoppingShellPipe> stopping_shell_pipes_;
+
+void stopShellPipe(int fd_in, int pid)
+{
+    close(fd_in);
+    if (!stillRunning(pid)) return;
+
+    WITH(stopping_shell_pipes_mutex_, stopShellPipe);
+    stopping_shell_pipes_.push_back({ pid, time(NULL)+SHELL_PIPE_EXIT_SECONDS });
+}
+
+void reapShellPipes()
+{
+    WITH(stopping_shell_pipes_mutex_, reapShellPipes);
+    time_t now = time(NULL);
+    auto i = stopping_shell_pipes_.begin();
+    while (i != stopping_shell_pipes_.end())
+    {
+        if (!stillRunning(i->pid))
+        {
+            i = stopping_shell_pipes_.erase(i);
+        }
+        else if (now >= i->deadline)
+        {
+            debug("(shellpipe) %d did not exit, stopping it.\n", i->pid);
+            stopBackgroundShell(i->pid);
+            i = stopping_shell_pipes_.erase(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+void waitForShellPipes()
+{
+    for (;;)
+    {
+        reapShellPipes();
+        {
+            WITH(stopping_shell_pipes_mutex_, waitForShellPipes);
+            if (stopping_shell_pipes_.size() == 0) return;
+        }
+        usleep(10*1000);
+    }
+}
+
 bool stillRunning(int pid)
 {
     if (pid == 0) return false;
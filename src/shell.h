@@ -23,6 +23,18 @@ using namespace std;
 void invokeShell(string program, vector<string> args, vector<string> envs);
 bool invokeShellCaptureOutput(string program, vector<string> args, vector<string> envs, string *out, bool do_not_warn_if_fail);
 bool invokeBackgroundShell(string program, vector<string> args, vector<string> envs, int *out, int *pid);
+// Start a long lived shell that reads newline separated lines on its stdin.
+// The shell shares stdout/stderr with wmbusmeters.
+bool invokeShellPipe(string program, vector<string> args, vector<string> envs, int *fd_in, int *pid);
+// Returns false if the shell pipe has exited.
+bool writeShellPipe(int fd_in, string &line);
+// Close the stdin of the shell pipe and give it some time to process what is left, before killing it.
+// Does not block, the stopped shell pipe is reaped later by reapShellPipes or waitForShellPipes.
+void stopShellPipe(int fd_in, int pid);
+// Reap the stopped shell pipes that have exited and kill those that are past their deadline.
+void reapShellPipes();
+// Block until all stopped shell pipes have exited or been killed.
+void waitForShellPipes();
 bool stillRunning(int pid);
 void stopBackgroundShell(int pid);
 void detectProcesses(string cmd, vector<int> *pids);
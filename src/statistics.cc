@@ -0,0 +1,304 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"statistics.h"
+#include"threads.h"
+#include"util.h"
+
+#include<map>
+#include<memory>
+#include<stdio.h>
+#include<unistd.h>
+#include<vector>
+
+using namespace std;
+
+struct StatisticsValue
+{
+    string name;
+    string help;
+    bool counter {};
+    function<double()> sample;
+};
+
+static map<string,unique_ptr<ReceiverCounters>> receivers_;
+static map<string,unique_ptr<DriverCounters>> drivers_;
+static vector<StatisticsValue> values_;
+RecursiveMutex statistics_mutex_ = { "statistics_mutex" };
+#define LOCK_STATISTICS(where) WITH(statistics_mutex_, where)
+
+void LatencyHistogram::add(uint64_t ns)
+{
+    uint64_t us = ns/1000;
+    // Bucket i counts the latencies below 2^i us.
+    int b = us == 0 ? 0 : 64-__builtin_clzll(us);
+    if (b > LATENCY_BUCKETS) b = LATENCY_BUCKETS;
+    increment(buckets[b]);
+    increment(count);
+    increment(sum_ns, ns);
+}
+
+ReceiverCounters *receiverCounters(const string &receiver)
+{
+    LOCK_STATISTICS(receiver_counters);
+
+    auto &rc = receivers_[receiver];
+    if (!rc) rc = unique_ptr<ReceiverCounters>(new ReceiverCounters());
+    return rc.get();
+}
+
+DriverCounters *driverCounters(const string &driver)
+{
+    LOCK_STATISTICS(driver_counters);
+
+    auto &dc = drivers_[driver];
+    if (!dc) dc = unique_ptr<DriverCounters>(new DriverCounters());
+    return dc.get();
+}
+
+void addStatisticsValue(string name, string help, bool counter, function<double()> sample)
+{
+    LOCK_STATISTICS(add_statistics_value);
+
+    StatisticsValue v;
+    v.name = name;
+    v.help = help;
+    v.counter = counter;
+    v.sample = sample;
+    values_.push_back(v);
+}
+
+void removeStatisticsValues()
+{
+    LOCK_STATISTICS(remove_statistics_values);
+
+    values_.clear();
+}
+
+static uint64_t get(const atomic<uint64_t> &c)
+{
+    return c.load(memory_order_relaxed);
+}
+
+// The upper bound in us of the bucket holding the p:th percentile.
+static uint64_t percentileUs(LatencyHistogram &h, double p)
+{
+    uint64_t n = get(h.count);
+    if (n == 0) return 0;
+    uint64_t sum = 0;
+    for (int i=0; i<LATENCY_BUCKETS; ++i)
+    {
+        sum += get(h.buckets[i]);
+        if (sum >= p*n) return 1ull << i;
+    }
+    return 1ull << LATENCY_BUCKETS;
+}
+
+static void appendNumber(string &s, double d)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", d);
+    s += buf;
+}
+
+static void appendHistogramJson(string &s, const char *name, LatencyHistogram &h)
+{
+    s += ",\"";
+    s += name;
+    s += "\":{\"count\":"+to_string(get(h.count));
+    s += ",\"sum_us\":"+to_string(get(h.sum_ns)/1000);
+    s += ",\"p50_us\":"+to_string(percentileUs(h, 0.5));
+    s += ",\"p99_us\":"+to_string(percentileUs(h, 0.99));
+    s += "}";
+}
+
+string statisticsJson()
+{
+    LOCK_STATISTICS(statistics_json);
+
+    string s = "{\"timestamp\":\""+currentMicros()+"\"";
+    s += ",\"receivers\":{";
+    bool first = true;
+    for (auto &p : receivers_)
+    {
+        ReceiverCounters &rc = *p.second;
+        if (!first) s += ",";
+        first = false;
+        appendJsonString(s, p.first);
+        s += ":{\"bytes\":"+to_string(get(rc.bytes));
+        s += ",\"frames\":"+to_string(get(rc.frames));
+        s += ",\"crc_errors\":"+to_string(get(rc.crc_errors));
+        s += ",\"protocol_errors\":"+to_string(get(rc.protocol_errors));
+        s += ",\"resets\":"+to_string(get(rc.resets));
+        s += "}";
+    }
+    s += "},\"drivers\":{";
+    first = true;
+    for (auto &p : drivers_)
+    {
+        DriverCounters &dc = *p.second;
+        if (!first) s += ",";
+        first = false;
+        appendJsonString(s, p.first);
+        s += ":{\"telegrams\":"+to_string(get(dc.telegrams));
+        s += ",\"decrypt_failures\":"+to_string(get(dc.decrypt_failures));
+        s += ",\"mac_failures\":"+to_string(get(dc.mac_failures));
+        appendHistogramJson(s, "parse", dc.parse);
+        appendHistogramJson(s, "print", dc.print);
+        appendHistogramJson(s, "shell", dc.shell);
+        s += "}";
+    }
+    s += "}";
+    for (auto &v : values_)
+    {
+        s += ",";
+        appendJsonString(s, v.name);
+        s += ":";
+        appendNumber(s, v.sample());
+    }
+    s += "}\n";
+    return s;
+}
+
+static void appendLabel(string &s, const char *label, const string &value)
+{
+    s += label;
+    s += "=\"";
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"') s += '\\';
+        if (c == '\n') { s += "\\n"; continue; }
+        s += c;
+    }
+    s += "\"";
+}
+
+static void appendHeader(string &s, const string &name, const char *help, const char *type)
+{
+    s += "# HELP "+name+" "+help+"\n";
+    s += "# TYPE "+name+" "+type+"\n";
+}
+
+static void appendReceiverCounter(string &s, const char *name, const char *help,
+                                  atomic<uint64_t> ReceiverCounters::*member)
+{
+    string metric = string("wmbusmeters_receiver_")+name+"_total";
+    appendHeader(s, metric, help, "counter");
+    for (auto &p : receivers_)
+    {
+        s += metric+"{";
+        appendLabel(s, "receiver", p.first);
+        s += "} "+to_string(get((*p.second).*member))+"\n";
+    }
+}
+
+static void appendDriverCounter(string &s, const char *name, const char *help,
+                                atomic<uint64_t> DriverCounters::*member)
+{
+    string metric = string("wmbusmeters_driver_")+name+"_total";
+    appendHeader(s, metric, help, "counter");
+    for (auto &p : drivers_)
+    {
+        s += metric+"{";
+        appendLabel(s, "driver", p.first);
+        s += "} "+to_string(get((*p.second).*member))+"\n";
+    }
+}
+
+static void appendDriverHistogram(string &s, const char *name, const char *help,
+                                  LatencyHistogram DriverCounters::*member)
+{
+    string metric = string("wmbusmeters_driver_")+name+"_seconds";
+    appendHeader(s, metric, help, "histogram");
+    for (auto &p : drivers_)
+    {
+        LatencyHistogram &h = (*p.second).*member;
+        string label;
+        appendLabel(label, "driver", p.first);
+        uint64_t sum = 0;
+        for (int i=0; i<=LATENCY_BUCKETS; ++i)
+        {
+            sum += get(h.buckets[i]);
+            s += metric+"_bucket{"+label+",le=\"";
+            if (i < LATENCY_BUCKETS) appendNumber(s, (1ull << i)/1000000.0);
+            else s += "+Inf";
+            s += "\"} "+to_string(sum)+"\n";
+        }
+        s += metric+"_sum{"+label+"} ";
+        appendNumber(s, get(h.sum_ns)/1000000000.0);
+        s += "\n";
+        s += metric+"_count{"+label+"} "+to_string(get(h.count))+"\n";
+    }
+}
+
+string statisticsPrometheus()
+{
+    LOCK_STATISTICS(statistics_prometheus);
+
+    string s;
+    appendReceiverCounter(s, "bytes", "Bytes read from the dongle.", &ReceiverCounters::bytes);
+    appendReceiverCounter(s, "frames", "Telegrams received.", &ReceiverCounters::frames);
+    appendReceiverCounter(s, "crc_errors", "Telegrams dropped because the crcs failed.", &ReceiverCounters::crc_errors);
+    appendReceiverCounter(s, "protocol_errors", "Garbled messages from the dongle.", &ReceiverCounters::protocol_errors);
+    appendReceiverCounter(s, "resets", "Resets of the dongle.", &ReceiverCounters::resets);
+    appendDriverCounter(s, "telegrams", "Telegrams decoded.", &DriverCounters::telegrams);
+    appendDriverCounter(s, "decrypt_failures", "Telegrams that could not be decrypted.", &DriverCounters::decrypt_failures);
+    appendDriverCounter(s, "mac_failures", "Telegrams with a bad mac.", &DriverCounters::mac_failures);
+    appendDriverHistogram(s, "parse", "Time to decrypt and parse a telegram.", &DriverCounters::parse);
+    appendDriverHistogram(s, "print", "Time to format and write or queue the output.", &DriverCounters::print);
+    appendDriverHistogram(s, "shell", "Time to invoke the shells and write to the shell pipes.", &DriverCounters::shell);
+    for (auto &v : values_)
+    {
+        string metric = "wmbusmeters_"+v.name;
+        if (v.counter) metric += "_total";
+        appendHeader(s, metric, v.help.c_str(), v.counter ? "counter" : "gauge");
+        s += metric+" ";
+        appendNumber(s, v.sample());
+        s += "\n";
+    }
+    return s;
+}
+
+static bool replaceFile(string path, string &content)
+{
+    // Write a new file and rename it into place, a scraper then never reads a half written file.
+    string tmp = path+".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f)
+    {
+        warning("Could not open file \"%s\" for writing!\n", tmp.c_str());
+        return false;
+    }
+    fwrite(content.data(), 1, content.length(), f);
+    int rc = fclose(f);
+    if (rc == 0) rc = rename(tmp.c_str(), path.c_str());
+    if (rc != 0)
+    {
+        warning("Could not write file \"%s\"!\n", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool writeStatistics(string dir)
+{
+    string json = statisticsJson();
+    string prom = statisticsPrometheus();
+    bool ok = replaceFile(dir+"/wmbusmeters_stats.json", json);
+    return replaceFile(dir+"/wmbusmeters.prom", prom) && ok;
+}
@@ -0,0 +1,85 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include<atomic>
+#include<functional>
+#include<stdint.h>
+#include<string>
+
+// Counters for the stages of the receive pipeline. They are always collected,
+// and written with --stats=<dir> as dir/wmbusmeters_stats.json and as the
+// Prometheus text format in dir/wmbusmeters.prom.
+//
+// The counters are created on first use and never removed, thus a receiver or
+// a meter driver looks up its counters once and then updates them with relaxed
+// atomic increments, without any locking.
+
+// Latencies from 1us to 2^(LATENCY_BUCKETS-1)us (about 8s) in doubling buckets,
+// the last bucket counts the even slower ones.
+#define LATENCY_BUCKETS 24
+
+struct LatencyHistogram
+{
+    void add(uint64_t ns);
+
+    std::atomic<uint64_t> buckets[LATENCY_BUCKETS+1] {};
+    std::atomic<uint64_t> count {};
+    std::atomic<uint64_t> sum_ns {};
+};
+
+struct ReceiverCounters
+{
+    std::atomic<uint64_t> bytes {}; // Read from the dongle.
+    std::atomic<uint64_t> frames {}; // Telegrams received.
+    std::atomic<uint64_t> crc_errors {}; // Telegrams dropped since the dll crcs failed.
+    std::atomic<uint64_t> protocol_errors {}; // Garbled dongle messages.
+    std::atomic<uint64_t> resets {};
+};
+
+struct DriverCounters
+{
+    std::atomic<uint64_t> telegrams {}; // Telegrams decoded by the driver.
+    std::atomic<uint64_t> decrypt_failures {};
+    std::atomic<uint64_t> mac_failures {};
+    LatencyHistogram parse; // Decrypting and parsing the telegram.
+    LatencyHistogram print; // Formatting the output and writing it or queueing it for the output thread.
+    LatencyHistogram shell; // Invoking the shells and writing to the shell pipes.
+};
+
+inline void increment(std::atomic<uint64_t> &c, uint64_t n = 1)
+{
+    c.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Returns the counters for this receiver or meter driver, created on first use.
+ReceiverCounters *receiverCounters(const std::string &receiver);
+DriverCounters *driverCounters(const std::string &driver);
+
+// A value sampled when the statistics are written, eg a queue depth or the rss.
+// A counter only ever increases, otherwise it is a gauge.
+void addStatisticsValue(std::string name, std::string help, bool counter, std::function<double()> sample);
+void removeStatisticsValues();
+
+std::string statisticsJson();
+std::string statisticsPrometheus();
+// Replaces dir/wmbusmeters_stats.json and dir/wmbusmeters.prom with the current statistics.
+bool writeStatistics(std::string dir);
+
+#endif
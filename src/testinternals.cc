@@ -15,28 +15,65 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include"aes.h"
 #include"aescmac.h"
+#include"capture.h"
 #include"cmdline.h"
 #include"config.h"
 #include"meters.h"
 #include"printer.h"
 #include"serial.h"
+#include"shell.h"
+#include"statistics.h"
+#include"threads.h"
+#include"timeseries.h"
 #include"util.h"
 #include"wmbus.h"
 #include"dvparser.h"
 
+#include<chrono>
+#include<atomic>
 #include<string.h>
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<unistd.h>
 
 using namespace std;
 
 int test_crc();
 int test_dvparser();
+void test_dif_vif_tables();
+void test_dv_values();
 int test_test();
 int test_linkmodes();
 void test_ids();
+void test_aes();
 void test_kdf();
 void test_periods();
 void test_devices();
+void test_meter_dispatch();
+void test_bounded_queue();
+void test_event_loop();
+void test_shell_pipe_stop();
+void test_hot_plug();
+void test_receive_buffer();
+void test_json();
+void test_crc_engines();
+void test_trim_crcs();
+void test_duplicate_cache();
+void test_combiner();
+void test_capture();
+void test_timeseries();
+void test_statistics();
+void test_decode_plans();
+void benchmark_meter_dispatch();
+void benchmark_aes();
+void benchmark_crc();
+void benchmark_decode_plans();
+void benchmark_dif_vif_lookups();
+void benchmark_dv_values();
+void benchmark_startup();
+double dataAsDouble(int dif, int vif, int vife, string data);
 
 int main(int argc, char **argv)
 {
@@ -50,18 +87,47 @@ int main(int argc, char **argv)
             debugEnabled(true);
             traceEnabled(true);
         }
+        if (!strcmp(argv[1], "--benchmark"))
+        {
+            benchmark_meter_dispatch();
+            benchmark_aes();
+            benchmark_crc();
+            benchmark_decode_plans();
+            benchmark_dif_vif_lookups();
+            benchmark_dv_values();
+            benchmark_startup();
+            return 0;
+        }
     }
     onExit([](){});
 
     test_crc();
+    test_crc_engines();
+    test_trim_crcs();
     test_dvparser();
+    test_dif_vif_tables();
+    test_dv_values();
+    test_decode_plans();
     test_test();
     test_devices();
     /*
       test_linkmodes();*/
     test_ids();
+    test_aes();
     test_kdf();
     test_periods();
+    test_meter_dispatch();
+    test_bounded_queue();
+    test_event_loop();
+    test_shell_pipe_stop();
+    test_hot_plug();
+    test_receive_buffer();
+    test_json();
+    test_duplicate_cache();
+    test_combiner();
+    test_capture();
+    test_timeseries();
+    test_statistics();
     return 0;
 }
 
@@ -126,7 +192,7 @@ int test_crc()
     return rc;
 }
 
-int test_parse(const char *data, std::map<std::string,std::pair<int,DVEntry>> *values, int testnr)
+int test_parse(const char *data, DVEntries *values, int testnr)
 {
     debug("\n\nTest nr %d......\n\n", testnr);
     bool b;
@@ -140,7 +206,7 @@ int test_parse(const char *data, std::map<std::string,std::pair<int,DVEntry>> *v
     return b;
 }
 
-void test_double(map<string,pair<int,DVEntry>> &values, const char *key, double v, int testnr)
+void test_double(DVEntries &values, const char *key, double v, int testnr)
 {
     int offset;
     double value;
@@ -154,7 +220,7 @@ void test_double(map<string,pair<int,DVEntry>> &values, const char *key, double
     }
 }
 
-void test_string(map<string,pair<int,DVEntry>> &values, const char *key, const char *v, int testnr)
+void test_string(DVEntries &values, const char *key, const char *v, int testnr)
 {
     int offset;
     string value;
@@ -167,7 +233,7 @@ void test_string(map<string,pair<int,DVEntry>> &values, const char *key, const c
     }
 }
 
-void test_date(map<string,pair<int,DVEntry>> &values, const char *key, string date_expected, int testnr)
+void test_date(DVEntries &values, const char *key, string date_expected, int testnr)
 {
     int offset;
     struct tm value;
@@ -186,7 +252,7 @@ void test_date(map<string,pair<int,DVEntry>> &values, const char *key, string da
 
 int test_dvparser()
 {
-    map<string,pair<int,DVEntry>> values;
+    DVEntries values;
 
     int testnr = 1;
     test_parse("2F 2F 0B 13 56 34 12 8B 82 00 93 3E 67 45 23 0D FD 10 0A 30 31 32 33 34 35 36 37 38 39 0F 88 2F", &values, testnr);
@@ -210,9 +276,96 @@ int test_dvparser()
     values.clear();
     test_parse("426C FE04", &values, testnr);
     test_date(values, "426C", "2007-04-30 00:00:00", testnr); // 2010-dec-31
+
+    // The second record with the same difvif gets the _2 suffix,
+    // and a set with a value of the same length overwrites it.
+    testnr++;
+    values.clear();
+    test_parse("0B 13 56 34 12 0B 13 78 56 34 0C 13 00 00 00 00", &values, testnr);
+    test_double(values, "0B13", 123.456, testnr);
+    test_double(values, "0B13_2", 345.678, testnr);
+    values.set("0B13_2", 0, MeasurementType::Instantaneous, 0x13, 0, 0, 0, "111111");
+    test_double(values, "0B13_2", 111.111, testnr);
+    test_double(values, "0B13", 123.456, testnr);
     return 0;
 }
 
+// Parse the data, after a few header bytes, and print the records found.
+string decodeWithPlans(DecodePlans *plans, const char *hex, const char *format = NULL, int format_signature = 0)
+{
+    Telegram t;
+    t.decode_plans = plans;
+    t.format_signature = format_signature;
+    t.parsed = { 0x11, 0x22, 0x33 };
+    vector<uchar> databytes;
+    hex2bin(hex, &databytes);
+    vector<uchar> format_bytes;
+    if (format != NULL)
+    {
+        hex2bin(format, &format_bytes);
+        vector<uchar>::iterator f = format_bytes.begin();
+        // As parse_TPL_79 does, try the plans before the format.
+        if (plans == NULL || !plans->apply(&t, databytes.begin(), databytes.size(), &t.values, true))
+        {
+            parseDV(&t, databytes, databytes.begin(), databytes.size(), &t.values, &f, format_bytes.size());
+        }
+    }
+    else
+    {
+        parseDV(&t, databytes, databytes.begin(), databytes.size(), &t.values);
+    }
+    string s;
+    for (auto &e : t.values)
+    {
+        s += t.values.key(e)+"="+t.values.valueHex(e)+"@"+to_string(e.offset)+" ";
+    }
+    s += "parsed="+bin2hex(t.parsed)+" 0f="+to_string(t.mfct_0f_index);
+    return s;
+}
+
+void test_decode_plan(DecodePlans *plans, const char *hex, uint64_t expected_hits,
+                      const char *format = NULL, int format_signature = 0)
+{
+    string expected = decodeWithPlans(NULL, hex, format, format_signature);
+    string got = decodeWithPlans(plans, hex, format, format_signature);
+    if (got != expected)
+    {
+        printf("ERROR in decode plan for \"%s\"\nexpected \"%s\"\n     got \"%s\"\n",
+               hex, expected.c_str(), got.c_str());
+    }
+    if (plans->hits() != expected_hits)
+    {
+        printf("ERROR in decode plan for \"%s\" expected %ju hits but got %ju\n",
+               hex, expected_hits, plans->hits());
+    }
+}
+
+void test_decode_plans()
+{
+    DecodePlans plans;
+
+    // The first telegram is parsed and the plan is made, the second uses the plan.
+    test_decode_plan(&plans, "2F2F 0B13 563412 8B8200933E 674523 0F 882F", 0);
+    test_decode_plan(&plans, "2F2F 0B13 654321 8B8200933E 998877 0F 7766", 1);
+    // Same length but another vif, must be parsed.
+    test_decode_plan(&plans, "2F2F 0B3B 563412 8B8200933E 674523 0F 882F", 1);
+    test_decode_plan(&plans, "2F2F 0B3B 000000 8B8200933E 010203 0F 0000", 2);
+    // Same difvifs but the telegram is longer, must be parsed.
+    test_decode_plan(&plans, "2F2F 0B13 563412 8B8200933E 674523 0F 882F00", 2);
+    // A variable length record makes the layout depend on the data.
+    test_decode_plan(&plans, "0DFD10 02 3031 0B13 563412", 2);
+    test_decode_plan(&plans, "0DFD10 02 3132 0B13 563412", 2);
+    // Records with the same difvif get _2 keys.
+    test_decode_plan(&plans, "0413 01000000 0413 02000000", 2);
+    test_decode_plan(&plans, "0413 03000000 0413 04000000", 3);
+
+    // Compact frames are matched on the format signature.
+    test_decode_plan(&plans, "563412 674523", 3, "0B13 8B8200933E", 0x1234);
+    test_decode_plan(&plans, "111111 222222", 4, "0B13 8B8200933E", 0x1234);
+    test_decode_plan(&plans, "111111 222222", 4, "0B3B 8B8200933E", 0x4321);
+    test_decode_plan(&plans, "333333 444444", 5, "0B3B 8B8200933E", 0x4321);
+}
+
 int test_test()
 {
     shared_ptr<SerialCommunicationManager> manager = createSerialCommunicationManager(0, false);
@@ -416,6 +569,313 @@ void test_ids()
     test_does_id_match_expression("78563413", "*,!00156327,!00048713", true);
 }
 
+// An unencrypted rfmamb telegram from id 11772288.
+const char *dispatch_telegram_hex =
+    "5744b40988227711101b7ab20800000265a00842658f088201659f08226589081265a0086265510852652b0902fb1aba01"
+    "42fb1ab0018201fb1abd0122fb1aa90112fb1aba0162fb1aa60152fb1af501066d3b3bb36b2a00";
+
+void setTelegramId(vector<uchar> &frame, uint32_t id)
+{
+    // The dll-id is stored as little endian bcd at offset 4.
+    string ids = tostrprintf("%08x", id);
+    vector<uchar> bcd;
+    hex2bin(ids, &bcd);
+    for (int i=0; i<4; ++i) frame[4+i] = bcd[3-i];
+}
+
+void test_dispatch(const char *ids, uint32_t telegram_id, const char *expected_updates)
+{
+    shared_ptr<MeterManager> manager = createMeterManager();
+    vector<string> mes;
+    string s = ids;
+    // Meters are separated with a space, the match expressions of a meter with a comma.
+    size_t start = 0;
+    for (;;)
+    {
+        size_t end = s.find(' ', start);
+        mes.push_back(s.substr(start, end == string::npos ? string::npos : end-start));
+        if (end == string::npos) break;
+        start = end+1;
+    }
+    vector<string> no_shells, no_jsons;
+    string type = "rfmamb";
+    for (auto &me : mes)
+    {
+        MeterInfo mi("m", type, me, "", toMeterLinkModeSet(type), no_shells, no_jsons);
+        manager->addMeter(createRfmAmb(mi));
+    }
+
+    vector<uchar> frame;
+    hex2bin(dispatch_telegram_hex, &frame);
+    setTelegramId(frame, telegram_id);
+    AboutTelegram about;
+    manager->handleTelegram(about, frame, true);
+
+    string updates;
+    manager->forEachMeter([&](Meter *m) { updates += m->numUpdates() > 0 ? "1" : "0"; });
+    if (updates != expected_updates)
+    {
+        printf("ERROR! Dispatch of %08x to \"%s\" expected updates %s but got %s\n",
+               telegram_id, ids, expected_updates, updates.c_str());
+    }
+}
+
+void test_meter_dispatch()
+{
+    const char *ids = "11772288 1177* *,!11772288 !11772288 2* 1*,!117* 11772288,1*";
+    test_dispatch(ids, 0x11772288, "1100001");
+    test_dispatch(ids, 0x11772289, "0110001");
+    test_dispatch(ids, 0x21772289, "0010100");
+    test_dispatch(ids, 0x12345678, "0010011");
+}
+
+void benchmark_meter_dispatch()
+{
+    vector<uchar> frame;
+    hex2bin(dispatch_telegram_hex, &frame);
+    // This id does not belong to any meter, so only the dispatch is measured.
+    setTelegramId(frame, 0x99999999);
+    AboutTelegram about;
+    vector<string> no_shells, no_jsons;
+    string type = "rfmamb";
+    int num_telegrams = 10000;
+
+    for (int num_meters : { 10, 1000, 10000 })
+    {
+        shared_ptr<MeterManager> manager = createMeterManager();
+        vector<vector<string>> all_ids;
+        for (int i=0; i<num_meters; ++i)
+        {
+            // Every tenth meter uses a wildcard and every hundredth a negation.
+            string id = tostrprintf("%08d", i);
+            if (i % 10 == 1) id = tostrprintf("%07d*", i/10);
+            if (i % 100 == 2) id = tostrprintf("%06d*,!%08d", i/100, i);
+            MeterInfo mi("m", type, id, "", toMeterLinkModeSet(type), no_shells, no_jsons);
+            manager->addMeter(createRfmAmb(mi));
+            all_ids.push_back(splitMatchExpressions(id));
+        }
+
+        auto start = chrono::steady_clock::now();
+        for (int i=0; i<num_telegrams; ++i)
+        {
+            manager->handleTelegram(about, frame, true);
+        }
+        auto indexed = chrono::steady_clock::now()-start;
+
+        // The same work done the old way, a header parse and an id match per meter.
+        // Fewer rounds here since this is slow for large fleets.
+        int linear_telegrams = max(10, 100000/num_meters);
+        start = chrono::steady_clock::now();
+        int matches = 0;
+        for (int i=0; i<linear_telegrams; ++i)
+        {
+            for (auto &mes : all_ids)
+            {
+                Telegram t;
+                t.parseHeader(frame);
+                if (doesIdMatchExpressions(t.id, mes)) matches++;
+            }
+        }
+        auto linear = chrono::steady_clock::now()-start;
+
+        printf("dispatch %5d meters: indexed %8.2f us/telegram linear %10.2f us/telegram%s\n",
+               num_meters,
+               chrono::duration<double,micro>(indexed).count()/num_telegrams,
+               chrono::duration<double,micro>(linear).count()/linear_telegrams,
+               matches > 0 ? " (unexpected match)" : "");
+    }
+}
+
+void test_bounded_queue()
+{
+    BoundedQueue<int> q("test_queue", 2);
+    int a = 1, b = 2, c = 3;
+    if (!q.push(std::move(a), false) || !q.push(std::move(b), false))
+    {
+        printf("ERROR in bounded queue, push failed\n");
+    }
+    if (q.push(std::move(c), false) || q.dropped() != 1)
+    {
+        printf("ERROR in bounded queue, expected the third item to be dropped\n");
+    }
+
+    // A waiting push continues when the consumer has made room.
+    int popped = 0, sum = 0;
+    function<void()> consume = [&]() { int i; while (q.pop(&i)) { popped++; sum += i; } };
+    pthread_t consumer = startWorkerThread(&consume);
+    for (int i=3; i<=100; ++i)
+    {
+        int v = i;
+        q.push(std::move(v), true);
+    }
+    q.close();
+    pthread_join(consumer, NULL);
+
+    if (popped != 100 || sum != 5050 || q.pushed() != 100 || q.peak() != 2)
+    {
+        printf("ERROR in bounded queue, popped %d sum %d pushed %zu peak %zu\n", popped, sum, q.pushed(), q.peak());
+    }
+}
+
+void test_event_loop()
+{
+    auto manager = createSerialCommunicationManager(0, true);
+
+    int ticks = 0;
+    manager->startRegularCallback("test_tick", 1, [&](){ ticks++; });
+
+    vector<string> args = { "-c", "echo hello" };
+    vector<string> envs;
+    auto cmd = manager->createSerialDeviceCommand("test", "/bin/sh", args, envs, [](){}, "test");
+    string received;
+    manager->listenTo(cmd.get(), [&]()
+                      {
+                          vector<uchar> data;
+                          cmd->receive(&data);
+                          received.append(data.begin(), data.end());
+                      });
+    cmd->open(false);
+    manager->startEventLoop();
+
+    // The exiting child interrupts usleep with SIGCHLD, thus sleep until the deadline.
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(1500);
+    while (chrono::steady_clock::now() < deadline) usleep(100*1000);
+    manager->stop();
+    manager->waitForStop();
+
+    if (received != "hello\n")
+    {
+        printf("ERROR in event loop, expected \"hello\" from the command but got \"%s\"\n", received.c_str());
+    }
+    if (ticks != 1)
+    {
+        printf("ERROR in event loop, expected the regular callback to be called once but it was called %d times\n", ticks);
+    }
+}
+
+void test_shell_pipe_stop()
+{
+    vector<string> args = { "-c", "cat > /dev/null; sleep 1" };
+    vector<string> envs;
+    int fd, pid;
+    if (!invokeShellPipe("/bin/sh", args, envs, &fd, &pid))
+    {
+        printf("ERROR in shell pipe, could not start it\n");
+        return;
+    }
+
+    // Stopping the shell pipe must not wait for it to exit.
+    auto start = chrono::steady_clock::now();
+    stopShellPipe(fd, pid);
+    auto stopped = chrono::steady_clock::now();
+    waitForShellPipes();
+    auto waited = chrono::steady_clock::now();
+
+    if (stopped-start > chrono::milliseconds(500))
+    {
+        printf("ERROR in shell pipe, stopping it blocked\n");
+    }
+    if (waited-start < chrono::milliseconds(500) || stillRunning(pid))
+    {
+        printf("ERROR in shell pipe, it was not waited for\n");
+    }
+}
+
+void test_uevent(const string &msg, bool expected)
+{
+    if (isHotPlugUevent(msg.c_str(), msg.size()) != expected)
+    {
+        printf("ERROR in hot plug expected %s for uevent \"%s\"\n", expected?"true":"false", msg.c_str());
+    }
+}
+
+// A kernel uevent is a header followed by KEY=value strings, all zero terminated.
+string uevent(vector<string> parts)
+{
+    string msg;
+    for (string &p : parts)
+    {
+        msg += p;
+        msg += '\0';
+    }
+    return msg;
+}
+
+void test_hot_plug()
+{
+    string add_tty = uevent({ "add@/devices/pci0000:00/0000:00:14.0/usb1/1-1/1-1:1.0/ttyUSB0/tty/ttyUSB0",
+                              "ACTION=add",
+                              "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-1/1-1:1.0/ttyUSB0/tty/ttyUSB0",
+                              "SUBSYSTEM=tty", "MAJOR=188", "MINOR=0", "DEVNAME=ttyUSB0", "SEQNUM=4711" });
+    string remove_usb = uevent({ "remove@/devices/pci0000:00/0000:00:14.0/usb1/1-1",
+                                 "ACTION=remove", "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-1",
+                                 "SUBSYSTEM=usb", "DEVTYPE=usb_device", "SEQNUM=4712" });
+    string change_block = uevent({ "change@/devices/virtual/block/loop0",
+                                   "ACTION=change", "DEVPATH=/devices/virtual/block/loop0",
+                                   "SUBSYSTEM=block", "SEQNUM=4713" });
+    string add_net = uevent({ "add@/devices/virtual/net/veth0",
+                              "ACTION=add", "DEVPATH=/devices/virtual/net/veth0",
+                              "SUBSYSTEM=net", "SEQNUM=4714" });
+    test_uevent(add_tty, true);
+    test_uevent(remove_usb, true);
+    test_uevent(change_block, false);
+    test_uevent(add_net, false);
+
+    // Feed the event loop with uevents from a socket pair instead of the kernel.
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) == -1)
+    {
+        printf("ERROR in hot plug, could not create socket pair\n");
+        return;
+    }
+    auto manager = createSerialCommunicationManager(0, true);
+    atomic<int> hot_plugs { 0 };
+    if (!manager->onHotPlug([&](){ hot_plugs++; }, fds[0]))
+    {
+        // No epoll event loop on this platform.
+        manager->stop();
+        manager->waitForStop();
+        close(fds[1]);
+        return;
+    }
+    manager->startEventLoop();
+
+    auto waitFor = [&](int expected)
+        {
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(1000);
+            while (hot_plugs < expected && chrono::steady_clock::now() < deadline) usleep(10*1000);
+            // Give the event loop the chance to report too many hot plugs.
+            usleep(50*1000);
+        };
+
+    ssize_t n = send(fds[1], change_block.c_str(), change_block.size(), 0);
+    n += send(fds[1], add_net.c_str(), add_net.size(), 0);
+    waitFor(0);
+    if (hot_plugs != 0)
+    {
+        printf("ERROR in hot plug, expected no hot plug from block and net uevents but got %d\n", (int)hot_plugs);
+    }
+    n += send(fds[1], add_tty.c_str(), add_tty.size(), 0);
+    waitFor(1);
+    if (hot_plugs != 1)
+    {
+        printf("ERROR in hot plug, expected one hot plug from the tty uevent but got %d\n", (int)hot_plugs);
+    }
+    n += send(fds[1], remove_usb.c_str(), remove_usb.size(), 0);
+    waitFor(2);
+    if (hot_plugs != 2)
+    {
+        printf("ERROR in hot plug, expected two hot plugs after the usb uevent but got %d\n", (int)hot_plugs);
+    }
+    if (n != (ssize_t)(change_block.size()+add_net.size()+add_tty.size()+remove_usb.size()))
+    {
+        printf("ERROR in hot plug, could not send the uevents\n");
+    }
+    manager->stop();
+    manager->waitForStop();
+    close(fds[1]);
+}
+
 void eq(string a, string b, const char *tn)
 {
     if (a != b)
@@ -432,6 +892,581 @@ void eqn(int a, int b, const char *tn)
     }
 }
 
+void test_dif_vif_tables()
+{
+    eqn(difLenBytes(0x0C), 4, "dif len 0C");
+    eqn(difLenBytes(0x4B), 3, "dif len 4B");
+    eqn(difLenBytes(0x0D), -1, "dif len 0D");
+    eqn(difLenBytes(0x2F), 1, "dif len 2F");
+    eqn(difLenBytes(0x0F), -2, "dif len 0F");
+    eqn((int)difMeasurementType(0x1C), (int)MeasurementType::Maximum, "dif type 1C");
+    eqn((int)difMeasurementType(0x3C), (int)MeasurementType::AtError, "dif type 3C");
+    eq(difType(0x4C), "8 digit BCD Instantaneous value storagenr=1", "dif type 4C");
+    eq(difType(0x0F), "Special Functions", "dif type 0F");
+    eq(vifType(0x13), "Volume l", "vif type 13");
+    eq(vifType(0xFD), "Second extension of VIF-codes", "vif type FD");
+    eq(vifType(0x93), "Volume l", "vif type 93");
+    eq(vifKey(0x3B), "volume_flow", "vif key 3B");
+    eq(vifUnit(0x3B), "m3/h", "vif unit 3B");
+    eq(vifUnit(0x6E), "", "vif unit 6E");
+    if (vifScale(0x13) != 1000.0 || vifScale(0x4E) != 1000.0*3600 || vifScale(0x23) != 1.0/24.0)
+    {
+        printf("ERROR in vif scale\n");
+    }
+}
+
+// The byte by byte decoding that the value kernel replaced, with 64 bit accumulators.
+uint64_t referenceUint(const uchar *v, int len)
+{
+    uint64_t raw = 0;
+    for (int i=len-1; i>=0; --i) raw = raw*256 + v[i];
+    return raw;
+}
+
+uint64_t referenceBCD(const uchar *v, int len)
+{
+    uint64_t raw = 0;
+    for (int i=len-1; i>=0; --i) raw = raw*100 + (v[i] >> 4)*10 + (v[i] & 0x0f);
+    return raw;
+}
+
+void checkDVValue(const uchar *v, int len)
+{
+    uint64_t u = decodeDVUint(v, len);
+    if (u != referenceUint(v, len))
+    {
+        printf("ERROR in dv uint len %d got %ju expected %ju\n", len, u, referenceUint(v, len));
+    }
+    int64_t i = decodeDVInt(v, len);
+    if ((uint64_t)i<<(64-8*len) != u<<(64-8*len) || (i < 0) != ((v[len-1] & 0x80) != 0))
+    {
+        printf("ERROR in dv int len %d got %jd\n", len, i);
+    }
+    bool negative;
+    uint64_t b = decodeDVBCD(v, len, &negative);
+    uchar top = v[len-1];
+    uint64_t expected = referenceBCD(v, len);
+    if ((top & 0xf0) == 0xf0)
+    {
+        vector<uchar> abs(v, v+len);
+        abs[len-1] &= 0x0f;
+        expected = referenceBCD(&abs[0], len);
+    }
+    if (b != expected || negative != ((top & 0xf0) == 0xf0))
+    {
+        printf("ERROR in dv bcd len %d got %ju expected %ju\n", len, b, expected);
+    }
+}
+
+void test_dv_values()
+{
+    // Exhaustive up to 24 bits, then pseudo random values.
+    uchar v[8];
+    for (uint32_t x = 0; x < (1<<24); ++x)
+    {
+        v[0] = x; v[1] = x>>8; v[2] = x>>16;
+        if (x < (1<<8)) checkDVValue(v, 1);
+        if (x < (1<<16)) checkDVValue(v, 2);
+        checkDVValue(v, 3);
+    }
+    uint64_t r = 0x9e3779b97f4a7c15ULL;
+    for (int n = 0; n < 1000000; ++n)
+    {
+        r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+        for (int i=0; i<8; ++i) v[i] = r >> (8*i);
+        for (int len=4; len<=8; ++len) checkDVValue(v, len);
+    }
+
+    vector<uchar> bytes;
+    double d;
+    hex2bin("74140000", &bytes);
+    if (!decodeDVValue(0x0C, &bytes[0], bytes.size(), &d) || d != 1474)
+    {
+        printf("ERROR in dv 8 digit bcd got %g\n", d);
+    }
+    bytes.clear();
+    hex2bin("452301F0", &bytes);
+    if (!decodeDVValue(0x0C, &bytes[0], 4, &d) || d != -12345)
+    {
+        printf("ERROR in dv negative bcd got %g\n", d);
+    }
+    bytes.clear();
+    hex2bin("999999999999", &bytes);
+    if (!decodeDVValue(0x0E, &bytes[0], 6, &d) || d != 999999999999.0)
+    {
+        printf("ERROR in dv 12 digit bcd got %f\n", d);
+    }
+    bytes.clear();
+    hex2bin("FFFFFFFFFFFF", &bytes);
+    if (!decodeDVValue(0x06, &bytes[0], 6, &d) || d != 281474976710655.0 || decodeDVInt(&bytes[0], 6) != -1)
+    {
+        printf("ERROR in dv 48 bit integer got %f\n", d);
+    }
+    bytes.clear();
+    hex2bin("0000C03F", &bytes);
+    if (!decodeDVValue(0x05, &bytes[0], 4, &d) || d != 1.5)
+    {
+        printf("ERROR in dv real got %g\n", d);
+    }
+    if (decodeDVValue(0x0C, &bytes[0], 3, &d) ||
+        decodeDVValue(0x0D, &bytes[0], 4, &d) ||
+        decodeDVValue(0x08, &bytes[0], 4, &d) ||
+        decodeDVValue(0x0F, &bytes[0], 4, &d))
+    {
+        printf("ERROR in dv short or non numeric data was decoded\n");
+    }
+
+    // The 32 bit extraction used to drop the most significant byte.
+    Telegram t;
+    bytes.clear();
+    hex2bin("04FF0778563412", &bytes);
+    parseDV(&t, bytes, bytes.begin(), bytes.size(), &t.values);
+    int offset;
+    uint32_t u32;
+    extractDVuint32(&t.values, "04FF07", &offset, &u32);
+    if (u32 != 0x12345678)
+    {
+        printf("ERROR in dv uint32 got %08x\n", u32);
+    }
+
+    // A truncated telegram stores fewer bytes than the dif promises.
+    Telegram tt;
+    bytes.clear();
+    hex2bin("04FF077856", &bytes);
+    parseDV(&tt, bytes, bytes.begin(), bytes.size(), &tt.values);
+    uint16_t u16;
+    uchar u8;
+    if (extractDVuint32(&tt.values, "04FF07", &offset, &u32) || u32 != 0 ||
+        extractDVuint16(&tt.values, "04FF07", &offset, &u16) || u16 != 0 ||
+        !extractDVuint8(&tt.values, "04FF07", &offset, &u8) || u8 != 0x78)
+    {
+        printf("ERROR in dv truncated record got %08x %04x %02x\n", u32, u16, u8);
+    }
+    if (extractDVdouble(&tt.values, "04FF07", &offset, &d) || d != 0)
+    {
+        printf("ERROR in dv truncated record extracted to double got %g\n", d);
+    }
+}
+
+// Known answer tests from NIST SP 800-38A, run with every implementation available on this cpu.
+void test_aes()
+{
+    vector<uchar> key, iv, plain;
+    hex2bin("2b7e151628aed2a6abf7158809cf4f3c", &key);
+    hex2bin("000102030405060708090a0b0c0d0e0f", &iv);
+    hex2bin("6bc1bee22e409f96e93d7e117393172a"
+            "ae2d8a571e03ac9c9eb76fac45af8e51"
+            "30c81c46a35ce411e5fbc1191a0a52ef"
+            "f69f2445df4f9b17ad2b417be66c3710", &plain);
+    string ecb = "3AD77BB40D7A3660A89ECAF32466EF97"
+                 "F5D3D58503B9699DE785895A96FDBAAF"
+                 "43B1CD7F598ECE23881B00E3ED030688"
+                 "7B0C785E27E8AD3F8223207104725DD4";
+    string cbc = "7649ABAC8119B246CEE98E9B12E9197D"
+                 "5086CB9B507219EE95DB113A917678B2"
+                 "73BED6B8E3C1743B7116E69E22229516"
+                 "3FF1CAA1681FAC09120ECA307586E1A7";
+
+    int default_impl = AES_implementation();
+    for (int impl : { AES_IMPL_REFERENCE, AES_IMPL_TTABLE, AES_IMPL_AESNI })
+    {
+        if (!AES_set_implementation(impl)) continue;
+        const char *name = AES_implementation_name(impl);
+        AES_ctx ctx;
+        AES_init_ctx(&ctx, &key[0]);
+
+        vector<uchar> buf = plain;
+        for (size_t i=0; i<buf.size(); i+=16) AES_ECB_encrypt(&ctx, &buf[i]);
+        string s = bin2hex(buf);
+        if (s != ecb)
+        {
+            printf("ERROR in aes-ecb (%s) expected \"%s\" but got \"%s\"\n", name, ecb.c_str(), s.c_str());
+        }
+        for (size_t i=0; i<buf.size(); i+=16) AES_ECB_decrypt(&ctx, &buf[i]);
+        if (buf != plain)
+        {
+            printf("ERROR in aes-ecb (%s) decrypt did not return the plain text\n", name);
+        }
+
+        vector<uchar> chain = iv;
+        AES_CBC_encrypt_buffer(&ctx, &chain[0], &buf[0], buf.size());
+        s = bin2hex(buf);
+        if (s != cbc)
+        {
+            printf("ERROR in aes-cbc (%s) expected \"%s\" but got \"%s\"\n", name, cbc.c_str(), s.c_str());
+        }
+        // Decrypt in two calls to check that the chain continues.
+        chain = iv;
+        AES_CBC_decrypt_buffer(&ctx, &chain[0], &buf[0], 32);
+        AES_CBC_decrypt_buffer(&ctx, &chain[0], &buf[32], 32);
+        if (buf != plain)
+        {
+            printf("ERROR in aes-cbc (%s) decrypt did not return the plain text\n", name);
+        }
+    }
+    AES_set_implementation(default_impl);
+
+    // The meter keys expand the key again when it is changed.
+    MeterKeys mk;
+    if (mk.confidentialityContext() != NULL)
+    {
+        printf("ERROR in aes meter keys expected no context without a key\n");
+    }
+    mk.confidentiality_key = iv;
+    vector<uchar> buf(plain.begin(), plain.begin()+16);
+    vector<uchar> expected(16);
+    AES_ECB_encrypt(&buf[0], &iv[0], &expected[0], 16);
+    AES_ECB_encrypt(mk.confidentialityContext(), &buf[0]);
+    if (buf != expected)
+    {
+        printf("ERROR in aes meter keys wrong context for the first key\n");
+    }
+    mk.confidentiality_key = key;
+    buf.assign(plain.begin(), plain.begin()+16);
+    AES_ECB_encrypt(mk.confidentialityContext(), &buf[0]);
+    string s = bin2hex(buf);
+    if (s != ecb.substr(0, 32))
+    {
+        printf("ERROR in aes meter keys expected \"%s\" but got \"%s\"\n", ecb.substr(0, 32).c_str(), s.c_str());
+    }
+}
+
+void benchmark_aes()
+{
+    vector<uchar> key, buf;
+    hex2bin("2b7e151628aed2a6abf7158809cf4f3c", &key);
+    buf.resize(16*1024);
+    int rounds = 200;
+
+    int default_impl = AES_implementation();
+    for (int impl : { AES_IMPL_REFERENCE, AES_IMPL_TTABLE, AES_IMPL_AESNI })
+    {
+        if (!AES_set_implementation(impl)) continue;
+        AES_ctx ctx;
+        AES_init_ctx(&ctx, &key[0]);
+        vector<uchar> iv(16);
+
+        auto start = chrono::steady_clock::now();
+        for (int r=0; r<rounds; ++r)
+        {
+            for (size_t i=0; i<buf.size(); i+=16) AES_ECB_encrypt(&ctx, &buf[i]);
+        }
+        auto enc = chrono::steady_clock::now()-start;
+        start = chrono::steady_clock::now();
+        for (int r=0; r<rounds; ++r)
+        {
+            AES_CBC_decrypt_buffer(&ctx, &iv[0], &buf[0], buf.size());
+        }
+        auto dec = chrono::steady_clock::now()-start;
+        double blocks = rounds*buf.size()/16.0;
+        printf("aes %-9s: encrypt %6.1f ns/block cbc decrypt %6.1f ns/block\n",
+               AES_implementation_name(impl),
+               chrono::duration<double,nano>(enc).count()/blocks,
+               chrono::duration<double,nano>(dec).count()/blocks);
+    }
+
+    // The old way, expanding the key for every block.
+    AES_set_implementation(AES_IMPL_REFERENCE);
+    auto start = chrono::steady_clock::now();
+    for (size_t i=0; i<buf.size(); i+=16) AES_ECB_encrypt(&buf[i], &key[0], &buf[i], 16);
+    auto enc = chrono::steady_clock::now()-start;
+    printf("aes %-9s: encrypt %6.1f ns/block\n", "expanding",
+           chrono::duration<double,nano>(enc).count()/(buf.size()/16.0));
+    AES_set_implementation(default_impl);
+}
+
+void test_crc_engines()
+{
+    // The table and slice by 8 engines must agree with the bitwise reference
+    // for all lengths, since the slice by 8 loop handles the tail separately.
+    vector<uchar> data(300);
+    uint32_t x = 4711;
+    for (auto &b : data)
+    {
+        x = x*1103515245+12345;
+        b = x >> 16;
+    }
+    for (size_t len = 0; len < data.size(); ++len)
+    {
+        uint16_t a = crc16_EN13757_bitwise(&data[0], len);
+        uint16_t b = crc16_EN13757_table(&data[0], len);
+        uint16_t c = crc16_EN13757_slice8(&data[0], len);
+        if (a != b || a != c)
+        {
+            printf("ERROR! crc16_EN13757 len %zu bitwise %04x table %04x slice8 %04x\n", len, a, b, c);
+        }
+        a = crc16_CCITT_bitwise(&data[0], len);
+        b = crc16_CCITT_table(&data[0], len);
+        c = crc16_CCITT_slice8(&data[0], len);
+        if (a != b || a != c)
+        {
+            printf("ERROR! crc16_CCITT len %zu bitwise %04x table %04x slice8 %04x\n", len, a, b, c);
+        }
+    }
+
+    // The CRC-16/IBM-SDLC check value of "123456789" is 906e, the ccitt
+    // here is the same crc before the final inversion.
+    uchar check[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    uint16_t crc = ~crc16_CCITT(check, 9);
+    if (crc != 0x906e)
+    {
+        printf("ERROR! %4x should be 906e\n", crc);
+    }
+}
+
+// Append the data with the dll crcs inserted after every block.
+void addBlockWithCRC(vector<uchar> &frame, vector<uchar> &data, size_t from, size_t len)
+{
+    frame.insert(frame.end(), data.begin()+from, data.begin()+from+len);
+    uint16_t crc = crc16_EN13757(&data[from], len);
+    frame.push_back(crc >> 8);
+    frame.push_back(crc & 0xff);
+}
+
+void testtrim(bool format_a, size_t len)
+{
+    vector<uchar> data(len);
+    for (size_t i = 0; i < len; ++i) data[i] = i*7+3;
+    data[0] = len-1;
+
+    vector<uchar> frame;
+    if (format_a)
+    {
+        addBlockWithCRC(frame, data, 0, 10);
+        for (size_t pos = 10; pos < len; pos += 16)
+        {
+            addBlockWithCRC(frame, data, pos, min((size_t)16, len-pos));
+        }
+    }
+    else
+    {
+        addBlockWithCRC(frame, data, 0, min((size_t)126, len));
+        if (len > 126) addBlockWithCRC(frame, data, 126, len-126);
+    }
+    vector<uchar> good = frame;
+    bool ok = format_a ? trimCRCsFrameFormatA(frame) : trimCRCsFrameFormatB(frame);
+    if (!ok || frame != data)
+    {
+        printf("ERROR! trimming crcs from frame %c of %zu bytes failed.\n", format_a?'a':'b', len);
+    }
+
+    // A broken crc in the last block must be detected and leave the payload as it was.
+    good[good.size()-1] ^= 0x01;
+    frame = good;
+    ok = format_a ? trimCRCsFrameFormatA(frame) : trimCRCsFrameFormatB(frame);
+    if (ok || frame != good)
+    {
+        printf("ERROR! a bad crc in frame %c of %zu bytes was not detected.\n", format_a?'a':'b', len);
+    }
+}
+
+void test_trim_crcs()
+{
+    for (size_t len : { 11, 26, 27, 42, 100, 150, 255 })
+    {
+        testtrim(true, len);
+        testtrim(false, len);
+    }
+}
+
+void benchmark_crc()
+{
+    vector<uchar> buf(16);
+    for (size_t i = 0; i < buf.size(); ++i) buf[i] = i;
+    int rounds = 1000000;
+
+    // The frame format A blocks are 16 bytes.
+    auto bench = [&](const char *name, function<uint16_t(uchar*,size_t)> crc)
+        {
+            uint16_t sum = 0;
+            auto start = chrono::steady_clock::now();
+            for (int r=0; r<rounds; ++r) sum += crc(&buf[0], buf.size());
+            auto d = chrono::steady_clock::now()-start;
+            printf("crc %-17s: %6.1f ns/block (%04x)\n", name,
+                   chrono::duration<double,nano>(d).count()/rounds, sum);
+        };
+    bench("en13757 bitwise", crc16_EN13757_bitwise);
+    bench("en13757 table", crc16_EN13757_table);
+    bench("en13757 slice8", crc16_EN13757_slice8);
+    bench("ccitt bitwise", [](uchar *d, size_t l) { return crc16_CCITT_bitwise(d, l); });
+    bench("ccitt table", [](uchar *d, size_t l) { return crc16_CCITT_table(d, l); });
+    bench("ccitt slice8", [](uchar *d, size_t l) { return crc16_CCITT_slice8(d, l); });
+}
+
+void benchmark_decode_plans()
+{
+    vector<uchar> databytes;
+    hex2bin("0C1348550000426CE1F14C130000000082046C21298C041333000000046D0D0B5C2B03FD6C5E150082206C5C290BFD0F0200018C4079678885238310FD3100000082106C01018110FD610002FD66020002FD170000", &databytes);
+    vector<uchar> format_bytes;
+    hex2bin("02FF2004134413615B6167", &format_bytes);
+    vector<uchar> compact;
+    hex2bin("000000000000000000000000", &compact);
+    int rounds = 100000;
+
+    auto bench = [&](const char *name, DecodePlans *plans, vector<uchar> &data, bool use_format)
+        {
+            size_t n = 0;
+            auto start = chrono::steady_clock::now();
+            for (int r=0; r<rounds; ++r)
+            {
+                Telegram t;
+                t.decode_plans = plans;
+                t.format_signature = 0xa8ed;
+                if (use_format)
+                {
+                    if (plans == NULL || !plans->apply(&t, data.begin(), data.size(), &t.values, true))
+                    {
+                        vector<uchar>::iterator f = format_bytes.begin();
+                        parseDV(&t, data, data.begin(), data.size(), &t.values, &f, format_bytes.size());
+                    }
+                }
+                else
+                {
+                    parseDV(&t, data, data.begin(), data.size(), &t.values);
+                }
+                n += t.values.size();
+            }
+            auto d = chrono::steady_clock::now()-start;
+            printf("decode %-13s: %6.0f ns/telegram (%zu records, %ju plan hits)\n", name,
+                   chrono::duration<double,nano>(d).count()/rounds, n/rounds, plans ? plans->hits() : 0);
+        };
+    DecodePlans full_plans, compact_plans;
+    bench("full parse", NULL, databytes, false);
+    bench("full plan", &full_plans, databytes, false);
+    bench("compact parse", NULL, compact, true);
+    bench("compact plan", &compact_plans, compact, true);
+}
+
+template<typename LOOKUP>
+void benchmark_lookup(const char *name, vector<pair<uchar,uchar>> &records, LOOKUP lookup)
+{
+    int rounds = 1000000;
+    size_t sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int r=0; r<rounds; ++r)
+    {
+        for (auto &dv : records) sum += lookup(dv.first, dv.second);
+    }
+    auto d = chrono::steady_clock::now()-start;
+    printf("lookup %-13s: %6.1f ns/record (%zu)\n", name,
+           chrono::duration<double,nano>(d).count()/rounds/records.size(), sum);
+}
+
+void benchmark_dif_vif_lookups()
+{
+    // The difvifs of a typical heat meter telegram.
+    vector<pair<uchar,uchar>> records = {
+        { 0x0C, 0x06 }, { 0x0C, 0x13 }, { 0x0B, 0x3B }, { 0x0A, 0x5A }, { 0x0A, 0x5E },
+        { 0x0B, 0x2B }, { 0x4C, 0x06 }, { 0x4C, 0x13 }, { 0x02, 0x61 }, { 0x04, 0x22 } };
+
+    // What parseDV and extractDVdouble look up for every record.
+    benchmark_lookup("parse", records, [](uchar dif, uchar vif)
+          {
+              return (size_t)difLenBytes(dif)+(size_t)difMeasurementType(dif)+(size_t)vifScale(vif);
+          });
+    benchmark_lookup("key and unit", records, [](uchar dif, uchar vif) { return strlen(vifKey(vif))+strlen(vifUnit(vif)); });
+    // What the explanations look up for every record.
+    benchmark_lookup("explain", records, [](uchar dif, uchar vif) { return difType(dif).size()+strlen(vifType(vif)); });
+}
+
+template<typename DECODE>
+void benchmark_values(const char *name, size_t n, DECODE decode)
+{
+    int rounds = 1000000;
+    double sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int r=0; r<rounds; ++r)
+    {
+        for (size_t i=0; i<n; ++i) sum += decode(i);
+    }
+    auto d = chrono::steady_clock::now()-start;
+    printf("value %-14s: %6.1f ns/value (%g)\n", name,
+           chrono::duration<double,nano>(d).count()/rounds/n, sum);
+}
+
+void benchmark_dv_values()
+{
+    // The data fields of a typical heat meter telegram.
+    vector<pair<uchar,string>> records = {
+        { 0x0C, "48550000" }, { 0x0C, "33000000" }, { 0x0B, "150000" }, { 0x0A, "5101" },
+        { 0x0A, "2912" }, { 0x0B, "000000" }, { 0x04, "0D0B5C2B" }, { 0x02, "0200" },
+        { 0x0E, "123456789012" }, { 0x06, "0D0B5C2B0000" } };
+    vector<pair<uchar,vector<uchar>>> binary;
+    for (auto &r : records)
+    {
+        vector<uchar> bytes;
+        hex2bin(r.second, &bytes);
+        binary.push_back({ r.first, bytes });
+    }
+    benchmark_values("byte by byte", binary.size(), [&](size_t i)
+          {
+              vector<uchar> &b = binary[i].second;
+              int t = binary[i].first & 0x0f;
+              return (double)(t >= 0x9 ? referenceBCD(&b[0], b.size()) : referenceUint(&b[0], b.size()));
+          });
+    benchmark_values("kernel", binary.size(), [&](size_t i)
+          {
+              double d;
+              decodeDVValue(binary[i].first, &binary[i].second[0], binary[i].second.size(), &d);
+              return d;
+          });
+    benchmark_values("hex string", records.size(), [&](size_t i) { return dataAsDouble(records[i].first, 0, 0, records[i].second); });
+}
+
+void benchmark_startup()
+{
+    // A large installation where the meters share a few keys.
+    int num_meters = 8000;
+    char tmpl[] = "/tmp/wmbusmeters_startup_XXXXXX";
+    if (!mkdtemp(tmpl)) return;
+    string dir = tmpl;
+    for (int i=0; i<num_meters; ++i)
+    {
+        string file = tostrprintf("%s/Meter%05d", tmpl, i);
+        FILE *f = fopen(file.c_str(), "w");
+        if (!f) break;
+        fprintf(f, "name=Meter%05d\ntype=multical21\nid=%08d\nkey=00112233445566778899AABBCCDD%04X\n"
+                "shell=echo $METER_JSON\njson_floor=%d\n", i, 10000000+i, i%50, i%10);
+        fclose(f);
+    }
+    int num_threads = max(2, startupThreads(num_meters));
+
+    auto bench = [&](const char *name, function<size_t()> cb)
+        {
+            auto start = chrono::steady_clock::now();
+            size_t n = cb();
+            auto d = chrono::steady_clock::now()-start;
+            printf("startup %-21s: %7.1f ms (%zu meters)\n", name, chrono::duration<double,milli>(d).count(), n);
+        };
+    auto load = [&](int threads, string snapshot)
+        {
+            Configuration c;
+            c.config_snapshot = snapshot;
+            loadMeterFiles(&c, dir, threads);
+            return c.meters.size();
+        };
+    string snapshot = dir+".snapshot";
+    bench("parse 1 thread", [&]() { return load(1, ""); });
+    bench(tostrprintf("parse %d threads", num_threads).c_str(), [&]() { return load(num_threads, ""); });
+    bench("parse, write snapshot", [&]() { return load(num_threads, snapshot); });
+    bench("load snapshot", [&]() { return load(num_threads, snapshot); });
+
+    Configuration c;
+    loadMeterFiles(&c, dir, 1);
+    auto create = [&](int threads)
+        {
+            vector<shared_ptr<Meter>> meters(c.meters.size());
+            parallelFor(meters.size(), threads, [&](size_t i) { meters[i] = createMultical21(c.meters[i]); });
+            return meters.size();
+        };
+    bench("create 1 thread", [&]() { return create(1); });
+    bench(tostrprintf("create %d threads", num_threads).c_str(), [&]() { return create(num_threads); });
+
+    for (int i=0; i<num_meters; ++i) unlink(tostrprintf("%s/Meter%05d", tmpl, i).c_str());
+    rmdir(tmpl);
+    unlink(snapshot.c_str());
+}
+
 void test_kdf()
 {
     vector<uchar> key;
@@ -636,3 +1671,445 @@ void test_devices()
 
 
 }
+
+void test_receive_buffer()
+{
+    ReceiveBuffer buf;
+    vector<uchar> frames;
+    for (int i=0; i<30; ++i) frames.push_back(i);
+
+    // Three frames of 10 bytes each, consumed one at a time.
+    buf.append(frames.data(), frames.size());
+    uchar *start = buf.begin();
+    buf.consume(10);
+    if (buf.size() != 20 || buf[0] != 10 || buf.begin() != start+10)
+    {
+        printf("ERROR in receive buffer, consume should only move the start, size %zu first %d\n", buf.size(), buf[0]);
+    }
+
+    // There is no free space left at the end, the two remaining frames are moved to the front.
+    uchar *p = buf.prepareWrite(5);
+    if (buf.begin() != start || p != start+20 || buf[0] != 10 || buf[19] != 29)
+    {
+        printf("ERROR in receive buffer, expected the unconsumed bytes to be moved to the front\n");
+    }
+    for (int i=0; i<5; ++i) p[i] = 30+i;
+    buf.commitWrite(5);
+
+    string hex = bin2hex(buf.data(), buf.size());
+    if (hex != "0A0B0C0D0E0F101112131415161718191A1B1C1D1E1F202122")
+    {
+        printf("ERROR in receive buffer, got %s\n", hex.c_str());
+    }
+
+    buf.consume(buf.size());
+    if (buf.size() != 0 || buf.prepareWrite(1) != start)
+    {
+        printf("ERROR in receive buffer, an empty buffer should start over from the front\n");
+    }
+}
+
+void testj(string in, string expected)
+{
+    string out;
+    appendQuotedJson(out, in);
+    if (out != expected)
+    {
+        printf("ERROR! Expected json %s but got %s\n", expected.c_str(), out.c_str());
+    }
+}
+
+void test_json()
+{
+    testj("floor=5", "\"floor\":\"5\"");
+    testj("address=Roodroad 123", "\"address\":\"Roodroad 123\"");
+    testj("nothing", "\"nothing\":\"\"");
+    testj("note=say \"hi\"", "\"note\":\"say \\\"hi\\\"\"");
+    testj("path=c:\\tmp", "\"path\":\"c:\\\\tmp\"");
+    testj("lines=a\nb\x01", "\"lines\":\"a\\nb\\u0001\"");
+}
+
+void test_duplicate_cache()
+{
+    // The test vectors from the SipHash paper.
+    uchar key[16];
+    uchar msg[15];
+    for (int i = 0; i < 16; ++i) key[i] = i;
+    for (int i = 0; i < 15; ++i) msg[i] = i;
+    uint64_t h = siphash24(key, msg, 0);
+    if (h != 0x726fdb47dd0e0e31ULL)
+    {
+        printf("ERROR! siphash24 of empty message %016" PRIx64 " should be 726fdb47dd0e0e31\n", h);
+    }
+    h = siphash24(key, msg, 15);
+    if (h != 0xa129ca6149be45e5ULL)
+    {
+        printf("ERROR! siphash24 of 15 bytes %016" PRIx64 " should be a129ca6149be45e5\n", h);
+    }
+
+    DuplicateCache dc(10, 3);
+    vector<uchar> a = { 0x2e, 0x44, 0x01 };
+    vector<uchar> b = { 0x2e, 0x44, 0x02 };
+    vector<uchar> c = { 0x2e, 0x44, 0x03 };
+    vector<uchar> d = { 0x2e, 0x44, 0x04 };
+    auto now = chrono::steady_clock::now();
+
+    if (dc.seenBefore(a, now) || !dc.seenBefore(a, now) || dc.seenBefore(b, now))
+    {
+        printf("ERROR! duplicate cache did not find the duplicate.\n");
+    }
+    // After the window has passed, a is forgotten.
+    if (dc.seenBefore(a, now+chrono::seconds(10)))
+    {
+        printf("ERROR! duplicate cache remembered a frame longer than the window.\n");
+    }
+    // Three frames fit, the fourth evicts the oldest.
+    now += chrono::seconds(10);
+    dc.seenBefore(b, now);
+    dc.seenBefore(c, now);
+    dc.seenBefore(d, now);
+    if (dc.size() != 3 || dc.seenBefore(c, now) == false || dc.seenBefore(a, now) == true)
+    {
+        printf("ERROR! duplicate cache did not evict the oldest frame.\n");
+    }
+    // A full cache still finds its oldest frame, only a new frame evicts it.
+    if (dc.seenBefore(c, now) == false)
+    {
+        printf("ERROR! full duplicate cache evicted the oldest frame before the lookup.\n");
+    }
+    if (dc.hits() != 3 || dc.misses() != 7)
+    {
+        printf("ERROR! duplicate cache counted %" PRIu64 " hits and %" PRIu64 " misses, expected 3 and 7\n",
+               dc.hits(), dc.misses());
+    }
+}
+
+void test_combiner()
+{
+    vector<AboutTelegram> got;
+    TelegramListeners listeners;
+    listeners.push_back([&](AboutTelegram &about, vector<uchar> &frame) { got.push_back(about); return true; });
+
+    vector<uchar> a = { 0x2e, 0x44, 0x01 };
+    vector<uchar> b = { 0x2e, 0x44, 0x02 };
+    AboutTelegram ra("im871a[1]", -80), rb("im871a[2]", -60), rc("rtlwmbus[3]", -70);
+
+    TelegramCombiner tc(1000);
+    tc.add(ra, a, listeners);
+    tc.add(rb, a, listeners);
+    tc.add(rc, b, listeners);
+    tc.add(rc, a, listeners);
+    // Stopping hands over the waiting telegrams without waiting for the window.
+    tc.stop();
+
+    if (got.size() != 2 ||
+        got[0].device != "im871a[2]" || got[0].rssi_dbm != -60 || got[0].received_by.size() != 3 ||
+        got[1].device != "rtlwmbus[3]" || got[1].received_by.size() != 1)
+    {
+        printf("ERROR! the combiner did not pick the telegram copies with the best rssi.\n");
+    }
+    map<string,ReceiverStatistics> rs = tc.receiverStatistics();
+    if (rs["im871a[1]"].received != 1 || rs["im871a[1]"].best != 0 ||
+        rs["im871a[2]"].best != 1 || rs["rtlwmbus[3]"].received != 2 || rs["rtlwmbus[3]"].best != 1)
+    {
+        printf("ERROR! the combiner counted the wrong receiver statistics.\n");
+    }
+}
+
+void test_capture()
+{
+    mkdir("testoutput", 0755);
+    string file = "testoutput/test_capture.wmb";
+    unlink(file.c_str());
+
+    // Three meters, enough telegrams for several index blocks.
+    vector<uchar> frames[3] = {
+        { 0x2e, 0x44, 0x2d, 0x2c, 0x78, 0x56, 0x34, 0x12, 0x1b, 0x16 },
+        { 0x2e, 0x44, 0x2d, 0x2c, 0x99, 0x87, 0x34, 0x76, 0x1b, 0x16 },
+        { 0x2e, 0x44, 0x2d, 0x2c, 0x78, 0x56, 0x34, 0x12 }
+    };
+    AboutTelegram ra("im871a[1]", -80), rb("rtlwmbus", -105);
+    int n = CAPTURE_INDEX_BLOCK_SIZE*2+100;
+    {
+        CaptureWriter cw(file);
+        for (int i=0; i<n; ++i)
+        {
+            cw.write(i%2 ? ra : rb, C1_bit, frames[i%3], 1000000+i);
+        }
+    }
+    {
+        // Appending continues the index chain. An empty frame is not recorded.
+        CaptureWriter cw(file);
+        vector<uchar> empty;
+        cw.write(rb, T1_bit, empty, 4000000);
+        cw.write(ra, T1_bit, frames[1], 5000000);
+    }
+
+    CaptureReader cr;
+    if (!cr.open(file))
+    {
+        printf("ERROR! capture file could not be opened.\n");
+        return;
+    }
+
+    int count = 0;
+    bool ok = cr.forEach([&](CaptureRecord &rec)
+        {
+            if (rec.timestamp_us == 1000001 &&
+                (rec.receiver != "im871a[1]" || rec.rssi_dbm != -80 || rec.link_modes != C1_bit ||
+                 rec.id != 0x76348799 || rec.len != frames[1].size()))
+            {
+                printf("ERROR! captured telegram was read back wrong.\n");
+            }
+            if (rec.timestamp_us == 1000000 && (rec.receiver != "rtlwmbus" || rec.rssi_dbm != -105))
+            {
+                printf("ERROR! captured receiver or rssi was read back wrong.\n");
+            }
+            count++;
+            return true;
+        });
+    if (!ok || count != n+1)
+    {
+        printf("ERROR! expected %d captured telegrams but got %d.\n", n+1, count);
+    }
+
+    // Only the telegrams from 76348799, within the time window.
+    count = 0;
+    ok = cr.find(0x76348799, 1000000+CAPTURE_INDEX_BLOCK_SIZE, 5000000, [&](CaptureRecord &rec)
+        {
+            if (rec.id != 0x76348799) printf("ERROR! found telegram with the wrong id.\n");
+            count++;
+            return true;
+        });
+    int expected = 1;
+    for (int i=CAPTURE_INDEX_BLOCK_SIZE; i<n; ++i) if (i%3 == 1) expected++;
+    if (!ok || count != expected)
+    {
+        printf("ERROR! expected to find %d telegrams but found %d.\n", expected, count);
+    }
+
+    // A capture that was not closed properly is cut at its last whole record.
+    {
+        CaptureReader broken;
+        broken.open(file);
+        size_t size = broken.size();
+        if (truncate(file.c_str(), size-15) != 0) printf("ERROR! could not truncate capture.\n");
+    }
+    {
+        silentLogging(true);
+        CaptureWriter cw(file);
+        cw.write(rb, T1_bit, frames[0], 6000000);
+        silentLogging(false);
+    }
+    CaptureReader recovered;
+    count = 0;
+    ok = recovered.open(file) && recovered.forEach([&](CaptureRecord &rec) { count++; return true; });
+    if (!ok || count != n+2)
+    {
+        printf("ERROR! expected %d telegrams in recovered capture but got %d.\n", n+2, count);
+    }
+    count = 0;
+    ok = recovered.find(0x12345678, 0, 10000000, [&](CaptureRecord &rec) { count++; return true; });
+    expected = 1;
+    for (int i=0; i<n; ++i) if (i%3 != 1) expected++;
+    if (!ok || count != expected)
+    {
+        printf("ERROR! expected to find %d telegrams in recovered capture but found %d.\n", expected, count);
+    }
+    unlink(file.c_str());
+
+    // A capture that is still being written can end with a frame that looks like an end record,
+    // here pointing to a real index. It must not hide the telegrams after that index.
+    {
+        CaptureWriter cw(file);
+        cw.write(ra, C1_bit, frames[1], 1000000);
+    }
+    uint64_t last_index;
+    {
+        CaptureReader closed;
+        closed.open(file);
+        const uchar *e = closed.data()+closed.size()-8;
+        last_index = 0;
+        for (int i=7; i>=0; --i) last_index = (last_index << 8) | e[i];
+    }
+    vector<uchar> fake = frames[2];
+    fake.push_back(CAPTURE_END);
+    for (int i=0; i<8; ++i) fake.push_back(last_index >> (8*i));
+    {
+        CaptureWriter cw(file);
+        cw.write(ra, C1_bit, fake, 2000000);
+        cw.flush();
+        CaptureReader open;
+        count = 0;
+        ok = open.open(file) && open.find(0x12345678, 0, 10000000, [&](CaptureRecord &rec) { count++; return true; });
+        if (!ok || count != 1)
+        {
+            printf("ERROR! expected to find 1 telegram after a fake end record but found %d.\n", count);
+        }
+    }
+    unlink(file.c_str());
+}
+
+void test_timeseries()
+{
+    string dir = "testoutput/timeseries";
+    mkdir("testoutput", 0755);
+    mkdir(dir.c_str(), 0755);
+    string file = dir+"/12345678.wmts";
+    unlink(file.c_str());
+
+    // Two and a half chunks of a water meter reporting every 16 seconds, with some jitter.
+    int n = TIMESERIES_CHUNK_ROWS*2+TIMESERIES_CHUNK_ROWS/2;
+    vector<int64_t> tss;
+    vector<double> totals;
+    {
+        TimeSeriesSink sink(dir, TIMESERIES_MAX_CHUNK_AGE);
+        int64_t ts = 1600000000;
+        double total = 123.456;
+        for (int i=0; i<n; ++i)
+        {
+            ts += 16 + (i%7 == 0 ? 1 : 0);
+            if (i%5 == 0) total += 0.001*(i%13);
+            vector<TimeSeriesValue> values(3);
+            values[0].name = "total_m3";
+            values[0].kind = TIMESERIES_DOUBLE;
+            values[0].d = total;
+            values[1].name = "flow_temperature_c";
+            values[1].kind = TIMESERIES_DOUBLE;
+            values[1].d = 10.0+(i%4)*0.5;
+            values[2].name = "current_status";
+            values[2].kind = TIMESERIES_STRING;
+            values[2].s = i < 100 ? "OK" : "DRY";
+            sink.add("12345678", "multical21", ts, values);
+            tss.push_back(ts);
+            totals.push_back(total);
+        }
+    }
+
+    TimeSeriesReader reader;
+    vector<TimeSeriesChunk> chunks;
+    if (!reader.open(file) || !reader.chunks(&chunks) || chunks.size() != 3)
+    {
+        printf("ERROR! expected 3 time series chunks but got %zu.\n", chunks.size());
+        return;
+    }
+
+    size_t row = 0;
+    for (auto &c : chunks)
+    {
+        vector<int64_t> ts;
+        vector<double> total, temp;
+        vector<string> status;
+        TimeSeriesColumnInfo *tc = c.column("total_m3");
+        TimeSeriesColumnInfo *fc = c.column("flow_temperature_c");
+        TimeSeriesColumnInfo *sc = c.column("current_status");
+        if (c.meter_type != "multical21" || !tc || !fc || !sc ||
+            !reader.timestamps(c, &ts) || !reader.doubles(c, *tc, &total) ||
+            !reader.doubles(c, *fc, &temp) || !reader.strings(c, *sc, &status))
+        {
+            printf("ERROR! could not decode time series chunk at %" PRIu64 ".\n", c.offset);
+            return;
+        }
+        for (size_t i=0; i<c.rows; ++i, ++row)
+        {
+            if (ts[i] != tss[row] || total[i] != totals[row] || temp[i] != 10.0+(row%4)*0.5 ||
+                status[i] != (row < 100 ? "OK" : "DRY"))
+            {
+                printf("ERROR! time series row %zu was read back wrong.\n", row);
+                return;
+            }
+        }
+        if (tc->min != total.front() || tc->max != total.back())
+        {
+            printf("ERROR! wrong min/max for time series chunk at %" PRIu64 ".\n", c.offset);
+        }
+    }
+    if (row != (size_t)n)
+    {
+        printf("ERROR! expected %d time series rows but got %zu.\n", n, row);
+    }
+
+    // The readings should compress well below the 8+8+8 bytes per row of the raw values.
+    struct stat st;
+    stat(file.c_str(), &st);
+    if (st.st_size > n*4)
+    {
+        printf("ERROR! time series file is %zu bytes for %d rows.\n", (size_t)st.st_size, n);
+    }
+
+    // A scan for the last total only decodes the last chunk.
+    int found = 0;
+    bool ok = reader.scan("total_m3", 0, INT64_MAX, totals.back(), totals.back(),
+                          [&](int64_t ts, double v) { found++; });
+    int expected = 0;
+    for (double d : totals) if (d == totals.back()) expected++;
+    if (!ok || found != expected)
+    {
+        printf("ERROR! expected %d time series scan hits but got %d.\n", expected, found);
+    }
+    found = 0;
+    ok = reader.scan("total_m3", tss[10], tss[19], -1e9, 1e9, [&](int64_t ts, double v) { found++; });
+    if (!ok || found != 10)
+    {
+        printf("ERROR! expected 10 time series values in time range but got %d.\n", found);
+    }
+
+    // A chunk cut off in the middle of the meter type must be rejected,
+    // not read past the end of the chunk.
+    vector<char> buf;
+    loadFile(file, &buf);
+    buf.resize(30);
+    buf[4] = 30; buf[5] = 0; buf[6] = 0; buf[7] = 0;
+    string truncated = dir+"/truncated.wmts";
+    FILE *f = fopen(truncated.c_str(), "w");
+    fwrite(&buf[0], 1, buf.size(), f);
+    fclose(f);
+    TimeSeriesReader truncated_reader;
+    chunks.clear();
+    if (!truncated_reader.open(truncated) || truncated_reader.chunks(&chunks))
+    {
+        printf("ERROR! expected the truncated time series chunk to be rejected.\n");
+    }
+    unlink(truncated.c_str());
+    unlink(file.c_str());
+    rmdir(dir.c_str());
+}
+
+void test_statistics()
+{
+    LatencyHistogram h;
+    h.add(500); // Below 1us.
+    for (int i=0; i<97; ++i) h.add(3000); // 3us, below 4us.
+    h.add(100*1000); // 100us, below 128us.
+    h.add(20ull*1000*1000*1000); // 20s, slower than the last bucket.
+    if (h.buckets[0] != 1 || h.buckets[2] != 97 || h.buckets[7] != 1 || h.buckets[LATENCY_BUCKETS] != 1 ||
+        h.count != 100)
+    {
+        printf("ERROR! latency histogram has the wrong buckets.\n");
+    }
+
+    ReceiverCounters *rc = receiverCounters("/dev/ttyUSB9:test");
+    if (rc != receiverCounters("/dev/ttyUSB9:test"))
+    {
+        printf("ERROR! expected the same receiver counters.\n");
+    }
+    increment(rc->bytes, 42);
+    increment(rc->crc_errors);
+
+    DriverCounters *dc = driverCounters("test\"driver");
+    for (int i=0; i<100; ++i) dc->parse.add(i < 50 ? 1500 : 10000);
+
+    string json = statisticsJson();
+    if (json.find("\"/dev/ttyUSB9:test\":{\"bytes\":42,\"frames\":0,\"crc_errors\":1,") == string::npos ||
+        json.find("\"parse\":{\"count\":100,\"sum_us\":575,\"p50_us\":2,\"p99_us\":16}") == string::npos)
+    {
+        printf("ERROR! unexpected statistics json %s\n", json.c_str());
+    }
+    string prom = statisticsPrometheus();
+    if (prom.find("wmbusmeters_receiver_bytes_total{receiver=\"/dev/ttyUSB9:test\"} 42\n") == string::npos ||
+        prom.find("wmbusmeters_driver_parse_seconds_bucket{driver=\"test\\\"driver\",le=\"8e-06\"} 50\n") == string::npos ||
+        prom.find("wmbusmeters_driver_parse_seconds_bucket{driver=\"test\\\"driver\",le=\"1.6e-05\"} 100\n") == string::npos)
+    {
+        printf("ERROR! unexpected statistics prometheus output %s\n", prom.c_str());
+    }
+}
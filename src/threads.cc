@@ -17,14 +17,21 @@
 
 #include "threads.h"
 
+#include <atomic>
 #include <unistd.h>
 #include <sys/resource.h>
 #include <stdio.h>
+#include <vector>
 
 #if defined(__APPLE__) && defined(__MACH__)
 #include <mach/mach.h>
 #endif
 
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HAS_MALLINFO2
+#endif
+
 using namespace std;
 
 pthread_t main_thread_ {};
@@ -74,6 +81,30 @@ void startTimerLoopThread(function<void()> cb)
     pthread_create(&timer_loop_thread_, NULL, dispatch, &timer_loop_entry_point_);
 }
 
+pthread_t startWorkerThread(function<void()> *cb)
+{
+    pthread_t thread {};
+    pthread_create(&thread, NULL, dispatch, cb);
+    return thread;
+}
+
+void parallelFor(size_t n, int num_threads, function<void(size_t)> cb)
+{
+    atomic<size_t> next { 0 };
+    function<void()> work = [&]()
+        {
+            for (size_t i = next++; i < n; i = next++) cb(i);
+        };
+    if ((size_t)num_threads > n) num_threads = n;
+    vector<pthread_t> threads;
+    for (int i = 1; i < num_threads; ++i)
+    {
+        threads.push_back(startWorkerThread(&work));
+    }
+    work();
+    for (pthread_t t : threads) pthread_join(t, NULL);
+}
+
 pthread_mutex_t wmbus_devices_lock_ = PTHREAD_MUTEX_INITIALIZER;
 const char *wmbus_devices_lock_func_ = "";
 pid_t       wmbus_devices_lock_pid_;
@@ -235,3 +266,13 @@ size_t getCurrentRSS()
 
 #endif
 }
+
+size_t getHeapBytes()
+{
+#ifdef HAS_MALLINFO2
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks+mi.hblkhd;
+#else
+    return 0;
+#endif
+}
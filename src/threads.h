@@ -21,6 +21,7 @@
 #include "util.h"
 
 #include <assert.h>
+#include <deque>
 #include <errno.h>
 #include <functional>
 #include <pthread.h>
@@ -52,9 +53,19 @@ void startEventLoopThread(std::function<void()> cb);
 pthread_t getTimerLoopThread();
 void startTimerLoopThread(std::function<void()> cb);
 
+// Start a joinable thread that invokes cb once and then exits.
+// The cb must stay alive until the thread is joined.
+pthread_t startWorkerThread(std::function<void()> *cb);
+
+// Invoke cb(0) to cb(n-1) using num_threads threads, the calling thread being one
+// of them. The calls are made in any order. Returns when all calls have returned.
+void parallelFor(size_t n, int num_threads, std::function<void(size_t)> cb);
+
 
 size_t getPeakRSS();
 size_t getCurrentRSS();
+// The heap bytes handed out by malloc and not yet freed, 0 if the libc cannot tell.
+size_t getHeapBytes();
 
 
 #define LOCK(module,func,x) { trace("[LOCKING] " #x " " func " (%s %d)\n", x ## func_, x ## pid_); \
@@ -101,6 +112,99 @@ private:
     const char *func_name_;
 };
 
+// A bounded fifo for handing over work between threads.
+template<typename T>
+struct BoundedQueue
+{
+    BoundedQueue(const char *name, size_t max_size) : name_(name), max_size_(max_size)
+    {
+        pthread_mutex_init(&mutex_, NULL);
+        pthread_cond_init(&not_empty_, NULL);
+        pthread_cond_init(&not_full_, NULL);
+    }
+
+    ~BoundedQueue()
+    {
+        pthread_cond_destroy(&not_full_);
+        pthread_cond_destroy(&not_empty_);
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    // If the queue is full, either wait for space or drop the item.
+    // Returns false if the item was dropped or the queue is closed.
+    bool push(T &&item, bool wait_when_full)
+    {
+        pthread_mutex_lock(&mutex_);
+        while (!closed_ && items_.size() >= max_size_ && wait_when_full)
+        {
+            pthread_cond_wait(&not_full_, &mutex_);
+        }
+        bool ok = !closed_ && items_.size() < max_size_;
+        if (ok)
+        {
+            items_.push_back(std::move(item));
+            pushed_++;
+            if (items_.size() > peak_) peak_ = items_.size();
+            pthread_cond_signal(&not_empty_);
+        }
+        else
+        {
+            dropped_++;
+        }
+        pthread_mutex_unlock(&mutex_);
+        return ok;
+    }
+
+    // Waits for the next item. Returns false when the queue
+    // has been closed and all items have been popped.
+    bool pop(T *item)
+    {
+        pthread_mutex_lock(&mutex_);
+        while (!closed_ && items_.size() == 0)
+        {
+            pthread_cond_wait(&not_empty_, &mutex_);
+        }
+        bool ok = items_.size() > 0;
+        if (ok)
+        {
+            *item = std::move(items_.front());
+            items_.pop_front();
+            pthread_cond_signal(&not_full_);
+        }
+        pthread_mutex_unlock(&mutex_);
+        return ok;
+    }
+
+    // Nothing more can be pushed, the remaining items can still be popped.
+    void close()
+    {
+        pthread_mutex_lock(&mutex_);
+        closed_ = true;
+        pthread_cond_broadcast(&not_empty_);
+        pthread_cond_broadcast(&not_full_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    const char *name() { return name_; }
+    size_t size() { pthread_mutex_lock(&mutex_); size_t n = items_.size(); pthread_mutex_unlock(&mutex_); return n; }
+    size_t peak() { pthread_mutex_lock(&mutex_); size_t n = peak_; pthread_mutex_unlock(&mutex_); return n; }
+    size_t pushed() { pthread_mutex_lock(&mutex_); size_t n = pushed_; pthread_mutex_unlock(&mutex_); return n; }
+    size_t dropped() { pthread_mutex_lock(&mutex_); size_t n = dropped_; pthread_mutex_unlock(&mutex_); return n; }
+
+private:
+
+    const char *name_;
+    size_t max_size_;
+    std::deque<T> items_;
+    bool closed_ {};
+    size_t peak_ {};
+    size_t pushed_ {};
+    size_t dropped_ {};
+    pthread_mutex_t mutex_;
+    pthread_cond_t not_empty_;
+    pthread_cond_t not_full_;
+};
+
 struct Semaphore
 {
     Semaphore(const char *name);
@@ -0,0 +1,527 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"timeseries.h"
+
+#include<algorithm>
+#include<errno.h>
+#include<fcntl.h>
+#include<math.h>
+#include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+using namespace std;
+
+static const uchar timeseries_magic_[4] = { 'W','M','T','S' };
+
+struct BitWriter
+{
+    vector<uchar> bytes;
+    int free_bits = 0; // Unused bits in the last byte.
+
+    void put(uint64_t v, int n)
+    {
+        while (n > 0)
+        {
+            if (free_bits == 0)
+            {
+                bytes.push_back(0);
+                free_bits = 8;
+            }
+            int take = min(n, free_bits);
+            uint64_t bits = (v >> (n-take)) & ((1ull << take)-1);
+            bytes.back() |= bits << (free_bits-take);
+            free_bits -= take;
+            n -= take;
+        }
+    }
+};
+
+struct BitReader
+{
+    const uchar *data;
+    size_t len;
+    size_t pos = 0; // In bits.
+    bool overrun = false;
+
+    BitReader(const uchar *d, size_t l) : data(d), len(l) {}
+
+    uint64_t get(int n)
+    {
+        uint64_t v = 0;
+        while (n > 0)
+        {
+            if (pos/8 >= len)
+            {
+                overrun = true;
+                return 0;
+            }
+            int left_in_byte = 8 - pos%8;
+            int take = min(n, left_in_byte);
+            uint64_t bits = (data[pos/8] >> (left_in_byte-take)) & ((1u << take)-1);
+            v = (v << take) | bits;
+            pos += take;
+            n -= take;
+        }
+        return v;
+    }
+};
+
+static uint64_t doubleBits(double d)
+{
+    uint64_t u;
+    memcpy(&u, &d, 8);
+    return u;
+}
+
+static double bitsDouble(uint64_t u)
+{
+    double d;
+    memcpy(&d, &u, 8);
+    return d;
+}
+
+// The timestamps are encoded as the delta of the deltas, a steady
+// reading interval then costs a single bit per reading.
+static void encodeTimestamps(vector<int64_t> &ts, BitWriter &w)
+{
+    int64_t prev = 0, prev_delta = 0;
+    for (size_t i=0; i<ts.size(); ++i)
+    {
+        if (i == 0)
+        {
+            w.put(ts[0], 64);
+            prev = ts[0];
+            continue;
+        }
+        int64_t delta = ts[i]-prev;
+        int64_t dod = delta-prev_delta;
+        if (dod == 0) w.put(0, 1);
+        else if (dod >= -63 && dod <= 64) { w.put(2, 2); w.put(dod+63, 7); }
+        else if (dod >= -255 && dod <= 256) { w.put(6, 3); w.put(dod+255, 9); }
+        else if (dod >= -2047 && dod <= 2048) { w.put(14, 4); w.put(dod+2047, 12); }
+        else { w.put(15, 4); w.put(dod, 64); }
+        prev = ts[i];
+        prev_delta = delta;
+    }
+}
+
+static bool decodeTimestamps(const uchar *data, size_t len, size_t n, vector<int64_t> *ts)
+{
+    BitReader r(data, len);
+    int64_t prev = 0, prev_delta = 0;
+    for (size_t i=0; i<n; ++i)
+    {
+        if (i == 0)
+        {
+            prev = r.get(64);
+            ts->push_back(prev);
+            continue;
+        }
+        int64_t dod;
+        if (r.get(1) == 0) dod = 0;
+        else if (r.get(1) == 0) dod = (int64_t)r.get(7)-63;
+        else if (r.get(1) == 0) dod = (int64_t)r.get(9)-255;
+        else if (r.get(1) == 0) dod = (int64_t)r.get(12)-2047;
+        else dod = r.get(64);
+        prev_delta += dod;
+        prev += prev_delta;
+        ts->push_back(prev);
+    }
+    return !r.overrun;
+}
+
+// The values are xor:ed with the previous value. An unchanged value costs a single bit,
+// and a slowly changing meter value only has a few meaningful bits in the middle.
+static void encodeDoubles(vector<double> &values, BitWriter &w)
+{
+    uint64_t prev = 0;
+    int prev_lead = -1, prev_trail = 0;
+    for (size_t i=0; i<values.size(); ++i)
+    {
+        uint64_t v = doubleBits(values[i]);
+        if (i == 0)
+        {
+            w.put(v, 64);
+            prev = v;
+            continue;
+        }
+        uint64_t x = v ^ prev;
+        prev = v;
+        if (x == 0)
+        {
+            w.put(0, 1);
+            continue;
+        }
+        int lead = min(__builtin_clzll(x), 31);
+        int trail = __builtin_ctzll(x);
+        if (prev_lead >= 0 && lead >= prev_lead && trail >= prev_trail)
+        {
+            // The meaningful bits fit within the previous window.
+            w.put(2, 2);
+            w.put(x >> prev_trail, 64-prev_lead-prev_trail);
+        }
+        else
+        {
+            int len = 64-lead-trail;
+            w.put(3, 2);
+            w.put(lead, 5);
+            w.put(len-1, 6);
+            w.put(x >> trail, len);
+            prev_lead = lead;
+            prev_trail = trail;
+        }
+    }
+}
+
+static bool decodeDoubles(const uchar *data, size_t len, size_t n, vector<double> *values)
+{
+    BitReader r(data, len);
+    uint64_t prev = 0;
+    int prev_lead = 0, prev_trail = 0;
+    for (size_t i=0; i<n; ++i)
+    {
+        if (i == 0)
+        {
+            prev = r.get(64);
+        }
+        else if (r.get(1) == 1)
+        {
+            if (r.get(1) == 1)
+            {
+                prev_lead = r.get(5);
+                int len = r.get(6)+1;
+                prev_trail = 64-prev_lead-len;
+            }
+            uint64_t x = r.get(64-prev_lead-prev_trail) << prev_trail;
+            prev ^= x;
+        }
+        values->push_back(bitsDouble(prev));
+    }
+    return !r.overrun;
+}
+
+static void put16(vector<uchar> &b, uint16_t v)
+{
+    b.push_back(v & 0xff);
+    b.push_back(v >> 8);
+}
+
+static void put32(vector<uchar> &b, uint32_t v)
+{
+    put16(b, v & 0xffff);
+    put16(b, v >> 16);
+}
+
+static void put64(vector<uchar> &b, uint64_t v)
+{
+    put32(b, v & 0xffffffff);
+    put32(b, v >> 32);
+}
+
+static void putString8(vector<uchar> &b, const string &s)
+{
+    size_t len = min(s.length(), (size_t)255);
+    b.push_back(len);
+    b.insert(b.end(), s.begin(), s.begin()+len);
+}
+
+static uint16_t get16(const uchar *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uchar *p)
+{
+    return get16(p) | ((uint32_t)get16(p+2) << 16);
+}
+
+static uint64_t get64(const uchar *p)
+{
+    return get32(p) | ((uint64_t)get32(p+4) << 32);
+}
+
+TimeSeriesSink::TimeSeriesSink(string dir, int max_chunk_age) : dir_(dir), max_chunk_age_(max_chunk_age)
+{
+}
+
+TimeSeriesSink::~TimeSeriesSink()
+{
+    flush(true);
+}
+
+void TimeSeriesSink::add(const string &id, const string &meter_type, time_t ts, vector<TimeSeriesValue> &values)
+{
+    LOCK_TIMESERIES(add);
+
+    Pending &p = pending_[id];
+
+    bool same_columns = p.meter_type == meter_type && p.columns.size() == values.size();
+    for (size_t i=0; same_columns && i<values.size(); ++i)
+    {
+        same_columns = p.columns[i].name == values[i].name && p.columns[i].kind == values[i].kind;
+    }
+    if (!same_columns)
+    {
+        // A new meter, or the meter type was changed in the config.
+        if (p.timestamps.size() > 0) writeChunk(id, p);
+        p.meter_type = meter_type;
+        p.columns.clear();
+        for (auto &v : values)
+        {
+            Column c;
+            c.name = v.name;
+            c.kind = v.kind;
+            p.columns.push_back(c);
+        }
+    }
+
+    if (p.timestamps.size() == 0) p.started = time(NULL);
+    p.timestamps.push_back(ts);
+    for (size_t i=0; i<values.size(); ++i)
+    {
+        if (values[i].kind == TIMESERIES_DOUBLE) p.columns[i].doubles.push_back(values[i].d);
+        else p.columns[i].strings.push_back(values[i].s);
+    }
+
+    if (p.timestamps.size() >= TIMESERIES_CHUNK_ROWS) writeChunk(id, p);
+}
+
+void TimeSeriesSink::flush(bool all)
+{
+    LOCK_TIMESERIES(flush);
+
+    time_t now = time(NULL);
+    for (auto &i : pending_)
+    {
+        Pending &p = i.second;
+        if (p.timestamps.size() == 0) continue;
+        if (all) writeChunk(i.first, p);
+        else if (now-p.started >= max_chunk_age_) writeChunk(i.first, p, true);
+    }
+}
+
+void TimeSeriesSink::writeChunk(const string &id, Pending &p, bool sync)
+{
+    vector<uchar> b;
+    b.insert(b.end(), timeseries_magic_, timeseries_magic_+4);
+    put32(b, 0); // The chunk size is filled in below.
+    put32(b, p.timestamps.size());
+    put64(b, p.timestamps.front());
+    put64(b, p.timestamps.back());
+    putString8(b, p.meter_type);
+
+    BitWriter tw;
+    encodeTimestamps(p.timestamps, tw);
+    put32(b, tw.bytes.size());
+    b.insert(b.end(), tw.bytes.begin(), tw.bytes.end());
+
+    put16(b, p.columns.size());
+    for (Column &c : p.columns)
+    {
+        b.push_back(c.kind);
+        putString8(b, c.name);
+        if (c.kind == TIMESERIES_DOUBLE)
+        {
+            double mi = INFINITY, ma = -INFINITY;
+            for (double d : c.doubles)
+            {
+                if (d < mi) mi = d;
+                if (d > ma) ma = d;
+            }
+            put64(b, doubleBits(mi));
+            put64(b, doubleBits(ma));
+            BitWriter vw;
+            encodeDoubles(c.doubles, vw);
+            put32(b, vw.bytes.size());
+            b.insert(b.end(), vw.bytes.begin(), vw.bytes.end());
+            c.doubles.clear();
+        }
+        else
+        {
+            vector<uchar> runs;
+            for (size_t i=0; i<c.strings.size(); )
+            {
+                size_t j = i+1;
+                while (j < c.strings.size() && c.strings[j] == c.strings[i]) j++;
+                size_t len = min(c.strings[i].length(), (size_t)0xffff);
+                put32(runs, j-i);
+                put16(runs, len);
+                runs.insert(runs.end(), c.strings[i].begin(), c.strings[i].begin()+len);
+                i = j;
+            }
+            put32(b, runs.size());
+            b.insert(b.end(), runs.begin(), runs.end());
+            c.strings.clear();
+        }
+    }
+    uint32_t size = b.size();
+    b[4] = size & 0xff; b[5] = (size >> 8) & 0xff; b[6] = (size >> 16) & 0xff; b[7] = size >> 24;
+    p.timestamps.clear();
+
+    string file = dir_+"/"+id+".wmts";
+    int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        warning("Could not open timeseries file \"%s\" errno=%d\n", file.c_str(), errno);
+        return;
+    }
+    // A single write, thus a reader never sees half a chunk unless the disk is full.
+    ssize_t n = ::write(fd, &b[0], b.size());
+    if (n != (ssize_t)b.size())
+    {
+        warning("Could not write timeseries file \"%s\" errno=%d\n", file.c_str(), errno);
+    }
+    if (sync) fdatasync(fd);
+    ::close(fd);
+}
+
+TimeSeriesColumnInfo *TimeSeriesChunk::column(const string &name)
+{
+    for (auto &c : columns)
+    {
+        if (c.name == name) return &c;
+    }
+    return NULL;
+}
+
+TimeSeriesReader::~TimeSeriesReader()
+{
+    if (data_) munmap((void*)data_, size_);
+}
+
+bool TimeSeriesReader::open(string file)
+{
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && st.st_size > 0;
+    if (ok)
+    {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = m != MAP_FAILED;
+        if (ok)
+        {
+            data_ = (const uchar*)m;
+            size_ = st.st_size;
+        }
+    }
+    ::close(fd);
+    return ok;
+}
+
+bool TimeSeriesReader::chunks(vector<TimeSeriesChunk> *chunks)
+{
+    size_t pos = 0;
+    while (pos < size_)
+    {
+        const uchar *p = data_+pos;
+        size_t left = size_-pos;
+        if (left < 29 || memcmp(p, timeseries_magic_, 4)) return false;
+        uint32_t size = get32(p+4);
+        if (size > left || size < 29) return false;
+
+        TimeSeriesChunk c;
+        c.offset = pos;
+        c.rows = get32(p+8);
+        c.first_ts = get64(p+12);
+        c.last_ts = get64(p+20);
+
+        const uchar *end = p+size;
+        const uchar *q = p+28;
+#define NEED(n) if (q+(n) > end) return false;
+        NEED(1); NEED(1+q[0]); c.meter_type = string((const char*)q+1, q[0]); q += 1+q[0];
+        NEED(4); c.timestamps_len = get32(q); c.timestamps = q+4; q += 4+c.timestamps_len;
+        NEED(2); int ncols = get16(q); q += 2;
+        for (int i=0; i<ncols; ++i)
+        {
+            TimeSeriesColumnInfo ci;
+            NEED(2); ci.kind = (TimeSeriesColumnKind)q[0]; q++;
+            NEED(1+q[0]); ci.name = string((const char*)q+1, q[0]); q += 1+q[0];
+            if (ci.kind == TIMESERIES_DOUBLE)
+            {
+                NEED(16); ci.min = bitsDouble(get64(q)); ci.max = bitsDouble(get64(q+8)); q += 16;
+            }
+            NEED(4); ci.len = get32(q); ci.data = q+4; q += 4+ci.len;
+            NEED(0);
+            c.columns.push_back(ci);
+        }
+#undef NEED
+        chunks->push_back(c);
+        pos += size;
+    }
+    return true;
+}
+
+bool TimeSeriesReader::timestamps(TimeSeriesChunk &chunk, vector<int64_t> *ts)
+{
+    return decodeTimestamps(chunk.timestamps, chunk.timestamps_len, chunk.rows, ts);
+}
+
+bool TimeSeriesReader::doubles(TimeSeriesChunk &chunk, TimeSeriesColumnInfo &column, vector<double> *values)
+{
+    if (column.kind != TIMESERIES_DOUBLE) return false;
+    return decodeDoubles(column.data, column.len, chunk.rows, values);
+}
+
+bool TimeSeriesReader::strings(TimeSeriesChunk &chunk, TimeSeriesColumnInfo &column, vector<string> *values)
+{
+    if (column.kind != TIMESERIES_STRING) return false;
+    const uchar *q = column.data;
+    const uchar *end = column.data+column.len;
+    while (q+6 <= end)
+    {
+        uint32_t count = get32(q);
+        uint16_t len = get16(q+4);
+        if (q+6+len > end || values->size()+count > chunk.rows) return false;
+        values->insert(values->end(), count, string((const char*)q+6, len));
+        q += 6+len;
+    }
+    return values->size() == chunk.rows;
+}
+
+bool TimeSeriesReader::scan(string column, int64_t from, int64_t to, double min, double max,
+                            function<void(int64_t,double)> cb)
+{
+    vector<TimeSeriesChunk> cs;
+    bool ok = chunks(&cs);
+
+    vector<int64_t> ts;
+    vector<double> values;
+    for (auto &c : cs)
+    {
+        if (c.last_ts < from || c.first_ts > to) continue;
+        TimeSeriesColumnInfo *ci = c.column(column);
+        if (ci == NULL || ci->kind != TIMESERIES_DOUBLE) continue;
+        if (ci->max < min || ci->min > max) continue;
+
+        ts.clear();
+        values.clear();
+        if (!timestamps(c, &ts) || !doubles(c, *ci, &values)) return false;
+        for (size_t i=0; i<ts.size(); ++i)
+        {
+            if (ts[i] >= from && ts[i] <= to && values[i] >= min && values[i] <= max)
+            {
+                cb(ts[i], values[i]);
+            }
+        }
+    }
+    return ok;
+}
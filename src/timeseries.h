@@ -0,0 +1,154 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TIMESERIES_H
+#define TIMESERIES_H
+
+#include"threads.h"
+#include"util.h"
+
+#include<functional>
+#include<map>
+#include<stdint.h>
+#include<string>
+#include<time.h>
+#include<vector>
+
+// Columnar storage of the meter readings, written with --timeseries=<dir>.
+//
+// The readings of each meter id are appended to <dir>/<id>.wmts as chunks.
+// A chunk holds up to TIMESERIES_CHUNK_ROWS readings, a partial chunk is written
+// by the regular flush when its oldest reading is max_chunk_age seconds old and at exit.
+// Thus a crash or a power loss loses at most max_chunk_age seconds of readings.
+// All numbers are little endian:
+//
+// u32 magic "WMTS" u32 chunk_size u32 rows i64 first_ts i64 last_ts
+// u8 len meter_type[len]
+// u32 len timestamps[len]   Delta of delta encoded seconds since the epoch.
+// u16 columns, for each column:
+//   u8 kind u8 len name[len]
+//   kind 1 (double): f64 min f64 max u32 len values[len]  XOR encoded as in Gorilla.
+//   kind 2 (string): u32 len runs[len]  Run length encoded, u32 count u16 len text[len].
+//
+// A reader skips from chunk to chunk using chunk_size, and only decodes the chunks
+// whose time range and min/max overlap the query.
+
+#define TIMESERIES_CHUNK_ROWS 1024
+#define TIMESERIES_MAX_CHUNK_AGE 3600
+
+enum TimeSeriesColumnKind
+{
+    TIMESERIES_DOUBLE = 1,
+    TIMESERIES_STRING = 2
+};
+
+struct TimeSeriesValue
+{
+    std::string name; // Eg total_m3 or current_status.
+    TimeSeriesColumnKind kind {};
+    double d {};
+    std::string s;
+};
+
+struct TimeSeriesSink
+{
+    TimeSeriesSink(std::string dir, int max_chunk_age);
+    // Writes the partial chunks.
+    ~TimeSeriesSink();
+
+    void add(const std::string &id, const std::string &meter_type, time_t ts, std::vector<TimeSeriesValue> &values);
+    // Writes and syncs the partial chunks that are too old, or writes all of them.
+    void flush(bool all);
+
+private:
+
+    struct Column
+    {
+        std::string name;
+        TimeSeriesColumnKind kind {};
+        std::vector<double> doubles;
+        std::vector<std::string> strings;
+    };
+
+    struct Pending
+    {
+        std::string meter_type;
+        std::vector<int64_t> timestamps;
+        std::vector<Column> columns;
+        time_t started {};
+    };
+
+    void writeChunk(const std::string &id, Pending &p, bool sync = false);
+
+    std::string dir_;
+    int max_chunk_age_ {};
+    std::map<std::string,Pending> pending_;
+
+    RecursiveMutex mutex_ = { "timeseries_mutex" };
+#define LOCK_TIMESERIES(where) WITH(mutex_, where)
+};
+
+struct TimeSeriesColumnInfo
+{
+    std::string name;
+    TimeSeriesColumnKind kind {};
+    double min {}, max {};
+    const uchar *data {};
+    size_t len {};
+};
+
+struct TimeSeriesChunk
+{
+    uint64_t offset {};
+    uint32_t rows {};
+    int64_t first_ts {}, last_ts {};
+    std::string meter_type;
+    const uchar *timestamps {};
+    size_t timestamps_len {};
+    std::vector<TimeSeriesColumnInfo> columns;
+
+    // Returns NULL if the chunk has no such column.
+    TimeSeriesColumnInfo *column(const std::string &name);
+};
+
+struct TimeSeriesReader
+{
+    TimeSeriesReader() {}
+    ~TimeSeriesReader();
+
+    // Memory map the file, returns false if it cannot be read.
+    bool open(std::string file);
+    // Reads only the chunk headers. Returns false if the file is broken,
+    // the chunks before the broken part are still returned.
+    bool chunks(std::vector<TimeSeriesChunk> *chunks);
+
+    bool timestamps(TimeSeriesChunk &chunk, std::vector<int64_t> *ts);
+    bool doubles(TimeSeriesChunk &chunk, TimeSeriesColumnInfo &column, std::vector<double> *values);
+    bool strings(TimeSeriesChunk &chunk, TimeSeriesColumnInfo &column, std::vector<std::string> *values);
+
+    // Invoke cb for the values of the double column within [from,to] and [min,max].
+    // Chunks outside of the ranges are skipped without being decoded.
+    bool scan(std::string column, int64_t from, int64_t to, double min, double max,
+              std::function<void(int64_t,double)> cb);
+
+private:
+
+    const uchar *data_ {};
+    size_t size_ {};
+};
+
+#endif
@@ -24,4 +24,12 @@
 // Default checkStatus callback frequency every 2 seconds, when an alarmtimeout has been set.
 #define CHECKSTATUS_TIMER 2
 
+// Without hot plug events from the kernel, the ttys and rtlsdr dongles are listed every regular checkup.
+// With hot plug events they are listed after an event, and also this often in case an event was lost.
+#define HOT_PLUG_FALLBACK_SECONDS 60
+
+// The kernel event can arrive before udev has created the device node and set its permissions,
+// therefore list the devices at this many checkups after an event.
+#define HOT_PLUG_RESCANS 3
+
 #endif
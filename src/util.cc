@@ -43,10 +43,18 @@ using namespace std;
 // Sigint, sigterm will call the exit handler.
 function<void()> exit_handler_;
 
+// Sighup calls the hup handler instead, when there is one.
+function<void()> hup_handler_;
+
 bool got_hupped_ {};
 
 void exitHandler(int signum)
 {
+    if (signum == SIGHUP && hup_handler_)
+    {
+        hup_handler_();
+        return;
+    }
     got_hupped_ = signum == SIGHUP;
     if (exit_handler_) exit_handler_();
 }
@@ -63,12 +71,26 @@ void wakeMeUpOnSigChld(pthread_t t)
     wake_me_up_on_sig_chld_ = t;
 }
 
+int wake_fd_on_sig_chld_ = -1;
+
+void wakeFdOnSigChld(int fd)
+{
+    wake_fd_on_sig_chld_ = fd;
+}
+
 void doNothing(int signum)
 {
 }
 
 void signalMyself(int signum)
 {
+    if (wake_fd_on_sig_chld_ != -1)
+    {
+        // Writing to an eventfd is async signal safe.
+        uint64_t one = 1;
+        ssize_t n = write(wake_fd_on_sig_chld_, &one, sizeof(one));
+        (void)n;
+    }
     if (wake_me_up_on_sig_chld_)
     {
         if (signalsInstalled())
@@ -109,6 +131,11 @@ void onExit(function<void()> cb)
     sigaction(SIGUSR2, &new_action, &old_usr2);
 }
 
+void onHup(function<void()> cb)
+{
+    hup_handler_ = cb;
+}
+
 bool signalsInstalled()
 {
     return exit_handler_ != NULL;
@@ -117,6 +144,7 @@ bool signalsInstalled()
 void restoreSignalHandlers()
 {
     exit_handler_ = NULL;
+    hup_handler_ = NULL;
 
     sigaction(SIGINT, &old_int, NULL);
     sigaction(SIGHUP, &old_hup, NULL);
@@ -193,9 +221,13 @@ bool hex2bin(vector<uchar> &src, vector<uchar> *target)
 char const hex[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A','B','C','D','E','F'};
 
 std::string bin2hex(vector<uchar> &target) {
+    return bin2hex(target.data(), target.size());
+}
+
+std::string bin2hex(const uchar *data, size_t len) {
     std::string str;
-    for (size_t i = 0; i < target.size(); ++i) {
-        const char ch = target[i];
+    for (size_t i = 0; i < len; ++i) {
+        const char ch = data[i];
         str.append(&hex[(ch  & 0xF0) >> 4], 1);
         str.append(&hex[ch & 0xF], 1);
     }
@@ -214,9 +246,13 @@ std::string bin2hex(vector<uchar>::iterator data, vector<uchar>::iterator end, i
 }
 
 std::string safeString(vector<uchar> &target) {
+    return safeString(target.data(), target.size());
+}
+
+std::string safeString(const uchar *data, size_t len) {
     std::string str;
-    for (size_t i = 0; i < target.size(); ++i) {
-        const char ch = target[i];
+    for (size_t i = 0; i < len; ++i) {
+        const char ch = data[i];
         if (ch >= 32 && ch < 127 && ch != '<' && ch != '>') {
             str += ch;
         } else {
@@ -815,6 +851,15 @@ void debugPayload(string intro, vector<uchar> &payload, vector<uchar>::iterator
     }
 }
 
+void debugPayload(string intro, const uchar *data, size_t len)
+{
+    if (isDebugEnabled())
+    {
+        string msg = bin2hex(data, len);
+        debug("%s \"%s\"\n", intro.c_str(), msg.c_str());
+    }
+}
+
 void logTelegram(vector<uchar> &parsed, int header_size, int suffix_size)
 {
     if (isLogTelegramsEnabled())
@@ -889,15 +934,15 @@ string padLeft(string input, int width)
 
 int parseTime(string time) {
     int mul = 1;
-    if (time.back() == 'h') {
+    if (!time.empty() && time.back() == 'h') {
         time.pop_back();
         mul = 3600;
     }
-    if (time.back() == 'm') {
+    if (!time.empty() && time.back() == 'm') {
         time.pop_back();
         mul = 60;
     }
-    if (time.back() == 's') {
+    if (!time.empty() && time.back() == 's') {
         time.pop_back();
         mul = 1;
     }
@@ -905,6 +950,39 @@ int parseTime(string time) {
     return n*mul;
 }
 
+int parseTimeMs(string time) {
+    if (time.length() > 2 && time.substr(time.length()-2) == "ms") {
+        return atoi(time.c_str());
+    }
+    return parseTime(time)*1000;
+}
+
+bool parseDateTime(string s, time_t *t)
+{
+    struct tm tm {};
+    int n = 0;
+    if (sscanf(s.c_str(), "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) != 3) return false;
+    if (n < (int)s.length())
+    {
+        int m = 0;
+        if ((s[n] != 'T' && s[n] != ' ') ||
+            sscanf(s.c_str()+n+1, "%2d:%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &m) != 3 ||
+            n+1+m != (int)s.length())
+        {
+            return false;
+        }
+    }
+    if (tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31 ||
+        tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60)
+    {
+        return false;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *t = timegm(&tm);
+    return true;
+}
+
 #define CRC16_EN_13757 0x3D65
 
 uint16_t crc16_EN13757_per_byte(uint16_t crc, uchar b)
@@ -925,12 +1003,61 @@ uint16_t crc16_EN13757_per_byte(uint16_t crc, uchar b)
     return crc;
 }
 
-uint16_t crc16_EN13757(uchar *data, size_t len)
+#define CRC16_INIT_VALUE 0xFFFF
+#define CRC16_GOOD_VALUE 0x0F47
+#define CRC16_POLYNOM    0x8408
+
+uint16_t crc16_CCITT_per_byte(uint16_t crc, uchar byte)
+{
+    int bits = 8;
+    while(bits--)
+    {
+        if((byte & 1) ^ (crc & 1))
+        {
+            crc = (crc >> 1) ^ CRC16_POLYNOM;
+        }
+        else
+            crc >>= 1;
+        byte >>= 1;
+    }
+    return crc;
+}
+
+// Table k holds the crc of a byte followed by k zero bytes, which lets
+// the slice by 8 loop handle eight bytes with eight independent lookups.
+// The tables are built from the bitwise per byte functions above when
+// the program is loaded.
+struct CRC16Tables
+{
+    uint16_t en13757[8][256];
+    uint16_t ccitt[8][256];
+
+    CRC16Tables()
+    {
+        for (int b = 0; b < 256; ++b)
+        {
+            en13757[0][b] = crc16_EN13757_per_byte(0, b);
+            ccitt[0][b] = crc16_CCITT_per_byte(0, b);
+        }
+        for (int k = 1; k < 8; ++k)
+        {
+            for (int b = 0; b < 256; ++b)
+            {
+                uint16_t e = en13757[k-1][b];
+                en13757[k][b] = (e << 8) ^ en13757[0][e >> 8];
+                uint16_t c = ccitt[k-1][b];
+                ccitt[k][b] = (c >> 8) ^ ccitt[0][c & 0xff];
+            }
+        }
+    }
+};
+
+static CRC16Tables crc16_tables_;
+
+uint16_t crc16_EN13757_bitwise(uchar *data, size_t len)
 {
     uint16_t crc = 0x0000;
 
-    assert(len == 0 || data != NULL);
-    assert(len < 1024);
     for (size_t i=0; i<len; ++i) {
         crc = crc16_EN13757_per_byte(crc, data[i]);
     }
@@ -938,38 +1065,162 @@ uint16_t crc16_EN13757(uchar *data, size_t len)
     return (~crc);
 }
 
-#define CRC16_INIT_VALUE 0xFFFF
-#define CRC16_GOOD_VALUE 0x0F47
-#define CRC16_POLYNOM    0x8408
+uint16_t crc16_EN13757_table(uchar *data, size_t len)
+{
+    const uint16_t (&t)[256] = crc16_tables_.en13757[0];
+    uint16_t crc = 0x0000;
 
-uint16_t crc16_CCITT(uchar *data, uint16_t length)
+    for (size_t i=0; i<len; ++i) {
+        crc = (crc << 8) ^ t[(crc >> 8) ^ data[i]];
+    }
+
+    return (~crc);
+}
+
+uint16_t crc16_EN13757_slice8(uchar *data, size_t len)
+{
+    const uint16_t (&t)[8][256] = crc16_tables_.en13757;
+    uint16_t crc = 0x0000;
+
+    while (len >= 8)
+    {
+        crc = t[7][data[0] ^ (crc >> 8)] ^ t[6][data[1] ^ (crc & 0xff)] ^
+              t[5][data[2]] ^ t[4][data[3]] ^ t[3][data[4]] ^
+              t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        crc = (crc << 8) ^ t[0][(crc >> 8) ^ *data++];
+    }
+
+    return (~crc);
+}
+
+uint16_t crc16_EN13757(uchar *data, size_t len)
+{
+    assert(len == 0 || data != NULL);
+    assert(len < 1024);
+    return crc16_EN13757_slice8(data, len);
+}
+
+uint16_t crc16_CCITT_bitwise(uchar *data, uint16_t length)
 {
-    uint16_t initVal = CRC16_INIT_VALUE;
-    uint16_t crc = initVal;
+    uint16_t crc = CRC16_INIT_VALUE;
     while(length--)
     {
-        int bits = 8;
-        uchar byte = *data++;
-        while(bits--)
-        {
-            if((byte & 1) ^ (crc & 1))
-            {
-                crc = (crc >> 1) ^ CRC16_POLYNOM;
-            }
-            else
-                crc >>= 1;
-            byte >>= 1;
-        }
+        crc = crc16_CCITT_per_byte(crc, *data++);
+    }
+    return crc;
+}
+
+uint16_t crc16_CCITT_table(uchar *data, uint16_t length)
+{
+    const uint16_t (&t)[256] = crc16_tables_.ccitt[0];
+    uint16_t crc = CRC16_INIT_VALUE;
+    while(length--)
+    {
+        crc = (crc >> 8) ^ t[(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+uint16_t crc16_CCITT_slice8(uchar *data, uint16_t length)
+{
+    const uint16_t (&t)[8][256] = crc16_tables_.ccitt;
+    uint16_t crc = CRC16_INIT_VALUE;
+    size_t len = length;
+
+    while (len >= 8)
+    {
+        crc = t[7][data[0] ^ (crc & 0xff)] ^ t[6][data[1] ^ (crc >> 8)] ^
+              t[5][data[2]] ^ t[4][data[3]] ^ t[3][data[4]] ^
+              t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
     }
     return crc;
 }
 
+uint16_t crc16_CCITT(uchar *data, uint16_t length)
+{
+    return crc16_CCITT_slice8(data, length);
+}
+
 bool crc16_CCITT_check(uchar *data, uint16_t length)
 {
     uint16_t crc = ~crc16_CCITT(data, length);
     return crc == CRC16_GOOD_VALUE;
 }
 
+#define SIP_ROTL(x,b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND        \
+    v0 += v1;            \
+    v1 = SIP_ROTL(v1,13); \
+    v1 ^= v0;            \
+    v0 = SIP_ROTL(v0,32); \
+    v2 += v3;            \
+    v3 = SIP_ROTL(v3,16); \
+    v3 ^= v2;            \
+    v0 += v3;            \
+    v3 = SIP_ROTL(v3,21); \
+    v3 ^= v0;            \
+    v2 += v1;            \
+    v1 = SIP_ROTL(v1,17); \
+    v1 ^= v2;            \
+    v2 = SIP_ROTL(v2,32);
+
+static uint64_t readLE64(const uchar *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
+}
+
+uint64_t siphash24(const uchar key[16], const uchar *data, size_t len)
+{
+    uint64_t k0 = readLE64(key);
+    uint64_t k1 = readLE64(key+8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const uchar *end = data + len - (len % 8);
+    for (; data != end; data += 8)
+    {
+        uint64_t m = readLE64(data);
+        v3 ^= m;
+        SIP_ROUND;
+        SIP_ROUND;
+        v0 ^= m;
+    }
+
+    // The last block holds the remaining bytes and the length in the top byte.
+    uint64_t b = ((uint64_t)len) << 56;
+    for (int i = len % 8 - 1; i >= 0; --i)
+    {
+        b |= ((uint64_t)data[i]) << (8*i);
+    }
+    v3 ^= b;
+    SIP_ROUND;
+    SIP_ROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIP_ROUND;
+    SIP_ROUND;
+    SIP_ROUND;
+    SIP_ROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
 bool listFiles(string dir, vector<string> *files)
 {
     DIR *dp = NULL;
@@ -1039,30 +1290,37 @@ int loadFile(string file, vector<string> *lines)
 
 bool loadFile(string file, vector<char> *buf)
 {
-    int blocksize = 1024;
-    char block[blocksize];
-
     int fd = open(file.c_str(), O_RDONLY);
     if (fd == -1) {
         warning("Could not open file %s errno=%d\n", file.c_str(), errno);
         return false;
     }
+    // Read the whole file in one read, there can be thousands of small
+    // meter files to load at startup. The size is only a hint, the file
+    // might grow while we read it.
+    struct stat st;
+    size_t blocksize = 1024;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) blocksize = st.st_size+1;
+    size_t start = buf->size();
+    size_t got = 0;
     while (true) {
-        ssize_t n = read(fd, block, sizeof(block));
+        buf->resize(start+got+blocksize);
+        ssize_t n = read(fd, &(*buf)[start+got], blocksize);
         if (n == -1) {
             if (errno == EINTR) {
                 continue;
             }
             warning("Could not read file %s errno=%d\n", file.c_str(), errno);
             close(fd);
-
+            buf->resize(start+got);
             return false;
         }
-        buf->insert(buf->end(), block, block+n);
-        if (n < (ssize_t)sizeof(block)) {
+        got += n;
+        if (n < (ssize_t)blocksize) {
             break;
         }
     }
+    buf->resize(start+got);
     close(fd);
     return true;
 }
@@ -1199,22 +1457,48 @@ bool startsWith(string &s, const char *prefix)
     return !strncmp(&s[0], prefix, len);
 }
 
-string makeQuotedJson(string &s)
+void appendJsonString(string &out, const string &s)
+{
+    out += '"';
+    for (char c : s)
+    {
+        switch (c)
+        {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+                out += buf;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+void appendQuotedJson(string &out, const string &s)
 {
     size_t p = s.find('=');
-    string key, value;
     if (p != string::npos)
     {
-        key = s.substr(0,p);
-        value = s.substr(p+1);
+        appendJsonString(out, s.substr(0,p));
+        out += ':';
+        appendJsonString(out, s.substr(p+1));
     }
     else
     {
-        key = s;
-        value = "";
+        appendJsonString(out, s);
+        out += ":\"\"";
     }
-
-    return string("\"")+key+"\":\""+value+"\"";
 }
 
 string currentDay()
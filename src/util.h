@@ -27,9 +27,13 @@
 enum class MeterType;
 
 void onExit(std::function<void()> cb);
+// Invoke cb, from the signal handler, on sighup instead of exiting.
+void onHup(std::function<void()> cb);
 void restoreSignalHandlers();
 bool gotHupped();
 void wakeMeUpOnSigChld(pthread_t t);
+// Also write to this eventfd when a child exits, -1 to stop.
+void wakeFdOnSigChld(int fd);
 bool signalsInstalled();
 
 typedef unsigned char uchar;
@@ -37,6 +41,7 @@ typedef unsigned char uchar;
 #define call(A,B) ([&](){A->B();})
 #define calll(A,B,T) ([&](T t){A->B(t);})
 
+int char2int(char input);
 uchar bcd2bin(uchar c);
 uchar revbcd2bin(uchar c);
 uchar reverse(uchar c);
@@ -45,7 +50,9 @@ bool hex2bin(std::string &src, std::vector<uchar> *target);
 bool hex2bin(std::vector<uchar> &src, std::vector<uchar> *target);
 std::string bin2hex(std::vector<uchar> &target);
 std::string bin2hex(std::vector<uchar>::iterator data, std::vector<uchar>::iterator end, int len);
+std::string bin2hex(const uchar *data, size_t len);
 std::string safeString(std::vector<uchar> &target);
+std::string safeString(const uchar *data, size_t len);
 void strprintf(std::string &s, const char* fmt, ...);
 std::string tostrprintf(const char* fmt, ...);
 
@@ -87,6 +94,7 @@ bool isLogTelegramsEnabled();
 
 void debugPayload(std::string intro, std::vector<uchar> &payload);
 void debugPayload(std::string intro, std::vector<uchar> &payload, std::vector<uchar>::iterator &pos);
+void debugPayload(std::string intro, const uchar *data, size_t len);
 void logTelegram(std::vector<uchar> &parsed, int header_size, int suffix_size);
 
 enum class Alarm
@@ -131,6 +139,10 @@ std::string padLeft(std::string input, int width);
 
 // Parse text string into seconds, 5h = (3600*5) 2m = (60*2) 1s = 1
 int parseTime(std::string time);
+// Parse text string into milliseconds, 200ms = 200, otherwise as parseTime above.
+int parseTimeMs(std::string time);
+// Parse 2020-02-08 or 2020-02-08T13:45:00 as UTC.
+bool parseDateTime(std::string s, time_t *t);
 
 // Test if current time is inside any of the specified periods.
 // For example: mon-sun(00-24) is always true!
@@ -139,12 +151,25 @@ int parseTime(std::string time);
 bool isInsideTimePeriod(time_t now, std::string periods);
 bool isValidTimePeriod(std::string periods);
 
+// The wmbus dll crc. Computed eight bytes at a time using the slice by 8 tables.
 uint16_t crc16_EN13757(uchar *data, size_t len);
 
 // This crc is used by im871a for its serial communication.
 uint16_t crc16_CCITT(uchar *data, uint16_t length);
 bool     crc16_CCITT_check(uchar *data, uint16_t length);
 
+// SipHash-2-4, a fast keyed 64 bit hash.
+uint64_t siphash24(const uchar key[16], const uchar *data, size_t len);
+
+// The crc engines, exported for the tests and benchmarks.
+// The bitwise versions are the reference.
+uint16_t crc16_EN13757_bitwise(uchar *data, size_t len);
+uint16_t crc16_EN13757_table(uchar *data, size_t len);
+uint16_t crc16_EN13757_slice8(uchar *data, size_t len);
+uint16_t crc16_CCITT_bitwise(uchar *data, uint16_t length);
+uint16_t crc16_CCITT_table(uchar *data, uint16_t length);
+uint16_t crc16_CCITT_slice8(uchar *data, uint16_t length);
+
 // Eat characters from the vector v, iterating using i, until the end char c is found.
 // If end char == -1, then do not expect any end char, get all until eof.
 // If the end char is not found, return error.
@@ -165,8 +190,10 @@ int countSetBits(int v);
 
 bool startsWith(std::string &s, const char *prefix);
 
-// Given alfa=beta it returns "alfa":"beta"
-std::string makeQuotedJson(std::string &s);
+// Append s as a json string, with quotes and escapes, to out.
+void appendJsonString(std::string &out, const std::string &s);
+// Given alfa=beta it appends "alfa":"beta" to out.
+void appendQuotedJson(std::string &out, const std::string &s);
 
 std::string currentDay();
 std::string currentHour();
@@ -16,7 +16,7 @@
 */
 
 #include"aescmac.h"
-#include"sha256.h"
+#include"capture.h"
 #include"timings.h"
 #include"meters.h"
 #include"wmbus.h"
@@ -24,6 +24,7 @@
 #include"wmbus_utils.h"
 #include"dvparser.h"
 #include<assert.h>
+#include<fcntl.h>
 #include<semaphore.h>
 #include<stdarg.h>
 #include<string.h>
@@ -249,6 +250,8 @@ void Telegram::print()
 
 void Telegram::printDLL()
 {
+    if (!isVerboseEnabled()) return;
+
     string possible_drivers = autoDetectPossibleDrivers();
 
     string man = manufacturerFlag(dll_mfct);
@@ -268,7 +271,7 @@ void Telegram::printDLL()
 
 void Telegram::printELL()
 {
-    if (ell_ci == 0) return;
+    if (ell_ci == 0 || !isVerboseEnabled()) return;
 
     string ell_cc_info = ccType(ell_cc);
     verbose("(telegram) ELL CI=%02x CC=%02x (%s) ACC=%02x",
@@ -311,7 +314,7 @@ void Telegram::printAFL()
 
 void Telegram::printTPL()
 {
-    if (tpl_ci == 0) return;
+    if (tpl_ci == 0 || !isVerboseEnabled()) return;
 
     verbose("(telegram) TPL CI=%02x", tpl_ci);
 
@@ -334,31 +337,77 @@ void Telegram::printTPL()
     verbose("\n");
 }
 
-// Store the hashes of the last 10 telegrams here.
-deque<SHA256_HASH> seen_telegrams;
+// A random siphash key makes it impossible to craft telegrams with the same hash.
+static void randomHashKey(uchar key[16])
+{
+    bool ok = false;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd != -1)
+    {
+        ok = read(fd, key, 16) == 16;
+        close(fd);
+    }
+    if (!ok)
+    {
+        uint64_t seed = time(NULL) ^ ((uint64_t)getpid() << 32);
+        for (size_t i = 0; i < 16; ++i)
+        {
+            seed = seed*6364136223846793005ULL+1442695040888963407ULL;
+            key[i] = seed >> 56;
+        }
+    }
+}
+
+DuplicateCache::DuplicateCache(int window_seconds, size_t max_size)
+    : window_(window_seconds), max_size_(max_size)
+{
+    // Otherwise a crafted telegram with the same hash as another telegram
+    // would be dropped as a duplicate.
+    randomHashKey(key_);
+}
+
+bool DuplicateCache::seenBefore(vector<uchar> &frame)
+{
+    return seenBefore(frame, std::chrono::steady_clock::now());
+}
 
-bool seen_this_telegram_before(vector<uchar> &frame)
+bool DuplicateCache::seenBefore(vector<uchar> &frame, std::chrono::steady_clock::time_point now)
 {
-    SHA256_HASH hash;
-    Sha256Calculate(&frame[0], frame.size(), &hash);
+    uint64_t hash = siphash24(key_, frame.size() > 0 ? &frame[0] : NULL, frame.size());
 
-    auto i = std::find(seen_telegrams.begin(), seen_telegrams.end(), hash);
+    LOCK_DUPLICATE_CACHE(seenBefore);
 
-    if (i != seen_telegrams.end())
+    // Forget the frames that are too old.
+    while (seen_.size() > 0 && now - seen_.front().second >= window_)
     {
-        // Found it!
-        return true;
+        hashes_.erase(seen_.front().first);
+        seen_.pop_front();
     }
 
-    if (seen_telegrams.size() >= 10)
+    if (hashes_.count(hash) > 0)
     {
-        seen_telegrams.pop_front();
+        hits_++;
+        return true;
     }
-    seen_telegrams.push_back(hash);
 
+    // Forget the oldest frames to make room for this frame when the cache is full.
+    while (seen_.size() > 0 && seen_.size() >= max_size_)
+    {
+        hashes_.erase(seen_.front().first);
+        seen_.pop_front();
+    }
+    hashes_.insert(hash);
+    seen_.push_back({ hash, now });
+    misses_++;
     return false;
 }
 
+size_t DuplicateCache::size()
+{
+    LOCK_DUPLICATE_CACHE(size);
+    return seen_.size();
+}
+
 string manufacturer(int m_field) {
     for (auto &m : manufacturers_) {
 	if (m.m_field == m_field) return m.name;
@@ -684,21 +733,37 @@ string ciType(int ci_field)
 
 void Telegram::addExplanationAndIncrementPos(vector<uchar>::iterator &pos, int len, const char* fmt, ...)
 {
-    char buf[1024];
-    buf[1023] = 0;
+    if (explaining())
+    {
+        char buf[1024];
+        buf[1023] = 0;
 
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(buf, 1023, fmt, args);
-    va_end(args);
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(buf, 1023, fmt, args);
+        va_end(args);
+
+        explanations.push_back(Explanation(parsed.size(), buf));
+    }
+    parsed.insert(parsed.end(), pos, pos+len);
+    pos += len;
+}
 
-    explanations.push_back({parsed.size(), buf});
+void Telegram::addExplanationAndIncrementPos(vector<uchar>::iterator &pos, int len, ExplanationKind k,
+                                             int a, int b, int c)
+{
+    if (explaining())
+    {
+        explanations.push_back(Explanation(parsed.size(), len, k, a, b, c));
+    }
     parsed.insert(parsed.end(), pos, pos+len);
     pos += len;
 }
 
 void Telegram::addMoreExplanation(int pos, const char* fmt, ...)
 {
+    if (!explaining()) return;
+
     char buf[1024];
 
     buf[1023] = 0;
@@ -710,11 +775,12 @@ void Telegram::addMoreExplanation(int pos, const char* fmt, ...)
 
     bool found = false;
     for (auto& p : explanations) {
-        if (p.first == pos) {
-            if (p.second[0] == '*') {
-                debug("(wmbus) warning: already added more explanations to offset %d!\n");
+        if (p.pos == pos) {
+            if (p.num_more > 0) {
+                debug("(wmbus) warning: already added more explanations to offset %d!\n", pos);
             }
-            p.second = string("* ")+p.second+buf;
+            p.more += buf;
+            p.num_more++;
             found = true;
         }
     }
@@ -879,7 +945,7 @@ bool Telegram::parseELL(vector<uchar>::iterator &pos)
 
         if (ell_sec_mode == ELLSecurityMode::AES_CTR)
         {
-            bool decrypt_ok = decrypt_ELL_AES_CTR(this, frame, pos, meter_keys->confidentiality_key);
+            bool decrypt_ok = decrypt_ELL_AES_CTR(this, frame, pos, meter_keys->confidentialityContext());
             // Actually this ctr decryption always succeeds, if wrong key, it will decrypt to garbage.
             if (!decrypt_ok)
             {
@@ -1152,7 +1218,7 @@ bool Telegram::parseTPLConfig(std::vector<uchar>::iterator &pos)
                 debug("(wmbus) no key, thus cannot execute kdf.\n");
                 return false;
             }
-            AES_CMAC(&meter_keys->confidentiality_key[0], &input[0], 16, &mac[0]);
+            AES_CMAC(meter_keys->confidentialityContext(), &input[0], 16, &mac[0]);
             string s = bin2hex(mac);
             debug("(wmbus) ephemereal Kenc %s\n", s.c_str());
             tpl_generated_key.clear();
@@ -1162,7 +1228,7 @@ bool Telegram::parseTPLConfig(std::vector<uchar>::iterator &pos)
             mac.clear();
             mac.resize(16);
             debugPayload("(wmbus) input to kdf for mac", input);
-            AES_CMAC(&meter_keys->confidentiality_key[0], &input[0], 16, &mac[0]);
+            AES_CMAC(meter_keys->confidentialityContext(), &input[0], 16, &mac[0]);
             s = bin2hex(mac);
             debug("(wmbus) ephemereal Kmac %s\n", s.c_str());
             tpl_generated_mac_key.clear();
@@ -1265,7 +1331,7 @@ bool Telegram::potentiallyDecrypt(vector<uchar>::iterator &pos)
 {
     if (tpl_sec_mode == TPLSecurityMode::AES_CBC_IV)
     {
-        bool ok = decrypt_TPL_AES_CBC_IV(this, frame, pos, meter_keys->confidentiality_key);
+        bool ok = decrypt_TPL_AES_CBC_IV(this, frame, pos, meter_keys->confidentialityContext());
         if (!ok) return false;
         // Now the frame from pos and onwards has been decrypted.
 
@@ -1293,6 +1359,7 @@ bool Telegram::potentiallyDecrypt(vector<uchar>::iterator &pos)
         // Do not attempt to decrypt if the mac has failed!
         if (!mac_ok)
         {
+            mac_failed = true;
             if (parser_warns_)
             {
                 warning("(wmbus) telegram mac check failed, did you use the correct decryption key? Ignoring telegram.\n");
@@ -1300,7 +1367,10 @@ bool Telegram::potentiallyDecrypt(vector<uchar>::iterator &pos)
             return false;
         }
 
-        bool ok = decrypt_TPL_AES_CBC_NO_IV(this, frame, pos, tpl_generated_key);
+        // The ephemereal key is new for every telegram, thus expand it here.
+        AES_ctx ctx;
+        AES_init_ctx(&ctx, &tpl_generated_key[0]);
+        bool ok = decrypt_TPL_AES_CBC_NO_IV(this, frame, pos, &ctx);
         if (!ok) return false;
 
         // Now the frame from pos and onwards has been decrypted.
@@ -1360,6 +1430,22 @@ bool Telegram::parse_TPL_79(vector<uchar>::iterator &pos)
     addExplanationAndIncrementPos(pos, 2, "%02x%02x format signature", ecrc0, ecrc1);
     format_signature = ecrc1<<8 | ecrc0;
 
+    // 2,3 = crc for payload = hash over both DRH and data bytes. Or is it only over the data bytes?
+    CHECK(2);
+    int ecrc2 = *(pos+0);
+    int ecrc3 = *(pos+1);
+    addExplanationAndIncrementPos(pos, 2, "%02x%02x data crc", ecrc2, ecrc3);
+
+    header_size = distance(frame.begin(), pos);
+    int remaining = distance(pos, frame.end());
+    suffix_size = 0;
+
+    if (decode_plans != NULL && decode_plans->apply(this, pos, remaining, &values, true))
+    {
+        // This format signature has been decoded before, the format bytes are not needed.
+        return true;
+    }
+
     vector<uchar> format_bytes;
     bool ok = loadFormatBytesFromSignature(format_signature, &format_bytes);
     if (!ok) {
@@ -1378,16 +1464,6 @@ bool Telegram::parse_TPL_79(vector<uchar>::iterator &pos)
     }
     vector<uchar>::iterator format = format_bytes.begin();
 
-    // 2,3 = crc for payload = hash over both DRH and data bytes. Or is it only over the data bytes?
-    CHECK(2);
-    int ecrc2 = *(pos+0);
-    int ecrc3 = *(pos+1);
-    addExplanationAndIncrementPos(pos, 2, "%02x%02x data crc", ecrc2, ecrc3);
-
-    header_size = distance(frame.begin(), pos);
-    int remaining = distance(pos, frame.end());
-    suffix_size = 0;
-
     parseDV(this, frame, pos, remaining, &values, &format, format_bytes.size());
 
     return true;
@@ -1492,6 +1568,43 @@ bool Telegram::parseHeader(vector<uchar> &input_frame)
     return true;
 }
 
+AES_ctx *MeterKeys::confidentialityContext()
+{
+    if (confidentiality_key.size() != 16) return NULL;
+
+    if (expanded_key_ != confidentiality_key)
+    {
+        AES_init_ctx(&confidentiality_ctx_, &confidentiality_key[0]);
+        expanded_key_ = confidentiality_key;
+    }
+    return &confidentiality_ctx_;
+}
+
+static RecursiveMutex meter_keys_mutex_("meter_keys_mutex");
+static map<string,MeterKeys> decoded_keys_;
+
+void MeterKeys::setConfidentialityKey(string hex)
+{
+    WITH(meter_keys_mutex_, setConfidentialityKey);
+    auto i = decoded_keys_.find(hex);
+    if (i == decoded_keys_.end())
+    {
+        MeterKeys mk;
+        hex2bin(hex, &mk.confidentiality_key);
+        mk.confidentialityContext();
+        i = decoded_keys_.insert({ hex, mk }).first;
+    }
+    confidentiality_key = i->second.confidentiality_key;
+    confidentiality_ctx_ = i->second.confidentiality_ctx_;
+    expanded_key_ = i->second.expanded_key_;
+}
+
+void MeterKeys::forgetDecodedKeys()
+{
+    WITH(meter_keys_mutex_, forgetDecodedKeys);
+    decoded_keys_.clear();
+}
+
 bool Telegram::parse(vector<uchar> &input_frame, MeterKeys *mk)
 {
     explanations.clear();
@@ -1562,10 +1675,46 @@ bool Telegram::parse(vector<uchar> &input_frame, MeterKeys *mk)
     return true;
 }
 
+string Telegram::renderExplanation(Explanation &e)
+{
+    string s;
+    int byte = (e.pos < (int)parsed.size()) ? parsed[e.pos] : 0;
+    switch (e.kind)
+    {
+    case ExplanationKind::Text:
+        s = e.text;
+        break;
+    case ExplanationKind::Hex:
+        s = bin2hex(parsed.begin()+e.pos, parsed.end(), e.len);
+        break;
+    case ExplanationKind::Dif:
+        strprintf(s, "%02X dif (%s)", byte, difType(byte).c_str());
+        break;
+    case ExplanationKind::Dife:
+        strprintf(s, "%02X dife (subunit=%d tariff=%d storagenr=%d)", byte, e.a, e.b, e.c);
+        break;
+    case ExplanationKind::Vif:
+        strprintf(s, "%02X vif (%s)", byte, vifType(byte));
+        break;
+    case ExplanationKind::Vife:
+        strprintf(s, "%02X vife (%s)", byte, vifeType(e.a, e.b, byte).c_str());
+        break;
+    case ExplanationKind::Skip:
+        strprintf(s, "%02X skip", byte);
+        break;
+    case ExplanationKind::VarLen:
+        strprintf(s, "%02X varlen=%d", e.a, e.a);
+        break;
+    }
+    for (int i=0; i<e.num_more; ++i) s = "* "+s;
+    return s+e.more;
+}
+
 void Telegram::explainParse(string intro, int from)
 {
     for (auto& p : explanations) {
-        debug("%s %02x: %s\n", intro.c_str(), p.first, p.second.c_str());
+        string s = renderExplanation(p);
+        debug("%s %02x: %s\n", intro.c_str(), p.pos, s.c_str());
     }
 }
 
@@ -1630,69 +1779,238 @@ string ccType(int cc_field)
 }
 
 
+// The data length and the name of the data field, indexed by dif & 0x0f.
+// A special function (0x0f) has no fixed length, except the skip code 0x2f.
+static constexpr DifInfo dif_table_[16] =
+{
+    { 0x0, 0, "No data" },
+    { 0x1, 1, "8 Bit Integer/Binary" },
+    { 0x2, 2, "16 Bit Integer/Binary" },
+    { 0x3, 3, "24 Bit Integer/Binary" },
+    { 0x4, 4, "32 Bit Integer/Binary" },
+    { 0x5, 4, "32 Bit Real" },
+    { 0x6, 6, "48 Bit Integer/Binary" },
+    { 0x7, 8, "64 Bit Integer/Binary" },
+    { 0x8, 0, "Selection for Readout" },
+    { 0x9, 1, "2 digit BCD" },
+    { 0xA, 2, "4 digit BCD" },
+    { 0xB, 3, "6 digit BCD" },
+    { 0xC, 4, "8 digit BCD" },
+    { 0xD, -1, "variable length" },
+    { 0xE, 6, "12 digit BCD" },
+    { 0xF, -2, "Special Functions" },
+};
+
+// Indexed by (dif & 0x30) >> 4.
+static constexpr MeasurementType dif_measurement_types_[4] =
+{
+    MeasurementType::Instantaneous,
+    MeasurementType::Maximum,
+    MeasurementType::Minimum,
+    MeasurementType::AtError
+};
+
+static constexpr const char *dif_measurement_type_names_[4] =
+{
+    " Instantaneous value",
+    " Maximum value",
+    " Minimum value",
+    " Value during error state"
+};
+
+// The description, the generic key, the unit and the scale of a vif, indexed by vif & 0x7f.
+// The scale is the divisor that gives the value in the unit, -1 if the value cannot be scaled.
+// The key and the unit is NULL when there is no generic key or unit.
+static constexpr VifInfo vif_table_[128] =
+{
+    // wmbusmeters always returns enery as kwh
+    { 0x00, "Energy mWh", "energy", "kwh", 1000000.0 },
+    { 0x01, "Energy 10⁻² Wh", "energy", "kwh", 100000.0 },
+    { 0x02, "Energy 10⁻¹ Wh", "energy", "kwh", 10000.0 },
+    { 0x03, "Energy Wh", "energy", "kwh", 1000.0 },
+    { 0x04, "Energy 10¹ Wh", "energy", "kwh", 100.0 },
+    { 0x05, "Energy 10² Wh", "energy", "kwh", 10.0 },
+    { 0x06, "Energy kWh", "energy", "kwh", 1.0 },
+    { 0x07, "Energy 10⁴ Wh", "energy", "kwh", 0.1 },
+    // or wmbusmeters always returns energy as MJ
+    { 0x08, "Energy J", "energy", "MJ", 1000000.0 },
+    { 0x09, "Energy 10¹ J", "energy", "MJ", 100000.0 },
+    { 0x0A, "Energy 10² J", "energy", "MJ", 10000.0 },
+    { 0x0B, "Energy kJ", "energy", "MJ", 1000.0 },
+    { 0x0C, "Energy 10⁴ J", "energy", "MJ", 100.0 },
+    { 0x0D, "Energy 10⁵ J", "energy", "MJ", 10.0 },
+    { 0x0E, "Energy MJ", "energy", "MJ", 1.0 },
+    { 0x0F, "Energy 10⁷ J", "energy", "MJ", 0.1 },
+    // wmbusmeters always returns volume as m3
+    { 0x10, "Volume cm³", "volume", "m3", 1000000.0 },
+    { 0x11, "Volume 10⁻⁵ m³", "volume", "m3", 100000.0 },
+    { 0x12, "Volume 10⁻⁴ m³", "volume", "m3", 10000.0 },
+    { 0x13, "Volume l", "volume", "m3", 1000.0 },
+    { 0x14, "Volume 10⁻² m³", "volume", "m3", 100.0 },
+    { 0x15, "Volume 10⁻¹ m³", "volume", "m3", 10.0 },
+    { 0x16, "Volume m³", "volume", "m3", 1.0 },
+    { 0x17, "Volume 10¹ m³", "volume", "m3", 0.1 },
+    // wmbusmeters always returns weight in kg
+    { 0x18, "Mass g", "mass", "kg", 1000.0 },
+    { 0x19, "Mass 10⁻² kg", "mass", "kg", 100.0 },
+    { 0x1A, "Mass 10⁻¹ kg", "mass", "kg", 10.0 },
+    { 0x1B, "Mass kg", "mass", "kg", 1.0 },
+    { 0x1C, "Mass 10¹ kg", "mass", "kg", 0.1 },
+    { 0x1D, "Mass 10² kg", "mass", "kg", 0.01 },
+    { 0x1E, "Mass t", "mass", "kg", 0.001 },
+    { 0x1F, "Mass 10⁴ kg", "mass", "kg", 0.0001 },
+    // wmbusmeters always returns time in hours
+    { 0x20, "On time seconds", "on_time", "h", 3600.0 },
+    { 0x21, "On time minutes", "on_time", "h", 60.0 },
+    { 0x22, "On time hours", "on_time", "h", 1.0 },
+    { 0x23, "On time days", "on_time", "h", (1.0/24.0) },
+    { 0x24, "Operating time seconds", "operating_time", "h", 3600.0 },
+    { 0x25, "Operating time minutes", "operating_time", "h", 60.0 },
+    { 0x26, "Operating time hours", "operating_time", "h", 1.0 },
+    { 0x27, "Operating time days", "operating_time", "h", (1.0/24.0) },
+    // wmbusmeters always returns power in kw
+    { 0x28, "Power mW", "power", "kw", 1000000.0 },
+    { 0x29, "Power 10⁻² W", "power", "kw", 100000.0 },
+    { 0x2A, "Power 10⁻¹ W", "power", "kw", 10000.0 },
+    { 0x2B, "Power W", "power", "kw", 1000.0 },
+    { 0x2C, "Power 10¹ W", "power", "kw", 100.0 },
+    { 0x2D, "Power 10² W", "power", "kw", 10.0 },
+    { 0x2E, "Power kW", "power", "kw", 1.0 },
+    { 0x2F, "Power 10⁴ W", "power", "kw", 0.1 },
+    // or wmbusmeters always returns power in MJh
+    { 0x30, "Power J/h", "power", "MJ", 1000000.0 },
+    { 0x31, "Power 10¹ J/h", "power", "MJ", 100000.0 },
+    { 0x32, "Power 10² J/h", "power", "MJ", 10000.0 },
+    { 0x33, "Power kJ/h", "power", "MJ", 1000.0 },
+    { 0x34, "Power 10⁴ J/h", "power", "MJ", 100.0 },
+    { 0x35, "Power 10⁵ J/h", "power", "MJ", 10.0 },
+    { 0x36, "Power MJ/h", "power", "MJ", 1.0 },
+    { 0x37, "Power 10⁷ J/h", "power", "MJ", 0.1 },
+    // wmbusmeters always returns volume flow in m3h
+    { 0x38, "Volume flow cm³/h", "volume_flow", "m3/h", 1000000.0 },
+    { 0x39, "Volume flow 10⁻⁵ m³/h", "volume_flow", "m3/h", 100000.0 },
+    { 0x3A, "Volume flow 10⁻⁴ m³/h", "volume_flow", "m3/h", 10000.0 },
+    { 0x3B, "Volume flow l/h", "volume_flow", "m3/h", 1000.0 },
+    { 0x3C, "Volume flow 10⁻² m³/h", "volume_flow", "m3/h", 100.0 },
+    { 0x3D, "Volume flow 10⁻¹ m³/h", "volume_flow", "m3/h", 10.0 },
+    { 0x3E, "Volume flow m³/h", "volume_flow", "m3/h", 1.0 },
+    { 0x3F, "Volume flow 10¹ m³/h", "volume_flow", "m3/h", 0.1 },
+    // wmbusmeters always returns volume flow in m3h
+    { 0x40, "Volume flow ext. 10⁻⁷ m³/min", "volume_flow_ext", "m3/h", 600000000.0 },
+    { 0x41, "Volume flow ext. cm³/min", "volume_flow_ext", "m3/h", 60000000.0 },
+    { 0x42, "Volume flow ext. 10⁻⁵ m³/min", "volume_flow_ext", "m3/h", 6000000.0 },
+    { 0x43, "Volume flow ext. 10⁻⁴ m³/min", "volume_flow_ext", "m3/h", 600000.0 },
+    { 0x44, "Volume flow ext. l/min", "volume_flow_ext", "m3/h", 60000.0 },
+    { 0x45, "Volume flow ext. 10⁻² m³/min", "volume_flow_ext", "m3/h", 6000.0 },
+    { 0x46, "Volume flow ext. 10⁻¹ m³/min", "volume_flow_ext", "m3/h", 600.0 },
+    { 0x47, "Volume flow ext. m³/min", "volume_flow_ext", "m3/h", 60.0 },
+    // this flow numbers will be small in the m3h unit, but it
+    // does not matter since double stores the scale factor in its exponent.
+    { 0x48, "Volume flow ext. mm³/s", "volume_flow_ext", "m3/h", 1000000000.0*3600 },
+    { 0x49, "Volume flow ext. 10⁻⁸ m³/s", "volume_flow_ext", "m3/h", 100000000.0*3600 },
+    { 0x4A, "Volume flow ext. 10⁻⁷ m³/s", "volume_flow_ext", "m3/h", 10000000.0*3600 },
+    { 0x4B, "Volume flow ext. cm³/s", "volume_flow_ext", "m3/h", 1000000.0*3600 },
+    { 0x4C, "Volume flow ext. 10⁻⁵ m³/s", "volume_flow_ext", "m3/h", 100000.0*3600 },
+    { 0x4D, "Volume flow ext. 10⁻⁴ m³/s", "volume_flow_ext", "m3/h", 10000.0*3600 },
+    { 0x4E, "Volume flow ext. l/s", "volume_flow_ext", "m3/h", 1000.0*3600 },
+    { 0x4F, "Volume flow ext. 10⁻² m³/s", "volume_flow_ext", "m3/h", 100.0*3600 },
+    // wmbusmeters always returns mass flow as kgh
+    { 0x50, "Mass g/h", "mass_flow", "kg/h", 1000.0 },
+    { 0x51, "Mass 10⁻² kg/h", "mass_flow", "kg/h", 100.0 },
+    { 0x52, "Mass 10⁻¹ kg/h", "mass_flow", "kg/h", 10.0 },
+    { 0x53, "Mass kg/h", "mass_flow", "kg/h", 1.0 },
+    { 0x54, "Mass 10¹ kg/h", "mass_flow", "kg/h", 0.1 },
+    { 0x55, "Mass 10² kg/h", "mass_flow", "kg/h", 0.01 },
+    { 0x56, "Mass t/h", "mass_flow", "kg/h", 0.001 },
+    { 0x57, "Mass 10⁴ kg/h", "mass_flow", "kg/h", 0.0001 },
+    // wmbusmeters always returns temperature in c
+    { 0x58, "Flow temperature 10⁻³ °C", "flow_temperature", "c", 1000.0 },
+    { 0x59, "Flow temperature 10⁻² °C", "flow_temperature", "c", 100.0 },
+    { 0x5A, "Flow temperature 10⁻¹ °C", "flow_temperature", "c", 10.0 },
+    { 0x5B, "Flow temperature °C", "flow_temperature", "c", 1.0 },
+    // wmbusmeters always returns temperature in c
+    { 0x5C, "Return temperature 10⁻³ °C", "return_temperature", "c", 1000.0 },
+    { 0x5D, "Return temperature 10⁻² °C", "return_temperature", "c", 100.0 },
+    { 0x5E, "Return temperature 10⁻¹ °C", "return_temperature", "c", 10.0 },
+    { 0x5F, "Return temperature °C", "return_temperature", "c", 1.0 },
+    // or if Kelvin is used as a temperature, in K
+    // what kind of meter cares about -273.15 °C
+    // a flow pump for liquid helium perhaps?
+    { 0x60, "Temperature difference mK", "temperature_difference", "k", 1000.0 },
+    { 0x61, "Temperature difference 10⁻² K", "temperature_difference", "k", 100.0 },
+    { 0x62, "Temperature difference 10⁻¹ K", "temperature_difference", "k", 10.0 },
+    { 0x63, "Temperature difference K", "temperature_difference", "k", 1.0 },
+    // wmbusmeters always returns temperature in c
+    { 0x64, "External temperature 10⁻³ °C", "external_temperature", "c", 1000.0 },
+    { 0x65, "External temperature 10⁻² °C", "external_temperature", "c", 100.0 },
+    { 0x66, "External temperature 10⁻¹ °C", "external_temperature", "c", 10.0 },
+    { 0x67, "External temperature °C", "external_temperature", "c", 1.0 },
+    // wmbusmeters always returns pressure in bar
+    { 0x68, "Pressure mbar", "pressure", "bar", 1000.0 },
+    { 0x69, "Pressure 10⁻² bar", "pressure", "bar", 100.0 },
+    { 0x6A, "Pressure 10⁻1 bar", "pressure", "bar", 10.0 },
+    { 0x6B, "Pressure bar", "pressure", "bar", 1.0 },
+    { 0x6C, "Date type G", "date", "", -1.0 },
+    { 0x6D, "Date and time type", NULL, "", -1.0 },
+    { 0x6E, "Units for H.C.A.", "hca", "", 1.0 },
+    { 0x6F, "Reserved", "reserved", "", -1.0 },
+    // wmbusmeters always returns time in hours
+    { 0x70, "Averaging duration seconds", "average_duration", "h", 3600.0 },
+    { 0x71, "Averaging duration minutes", "average_duration", "h", 60.0 },
+    { 0x72, "Averaging duration hours", "average_duration", "h", 1.0 },
+    { 0x73, "Averaging duration days", "average_duration", "h", (1.0/24.0) },
+    { 0x74, "Actuality duration seconds", "actual_duration", "h", 3600.0 },
+    { 0x75, "Actuality duration minutes", "actual_duration", "h", 60.0 },
+    { 0x76, "Actuality duration hours", "actual_duration", "h", 1.0 },
+    { 0x77, "Actuality duration days", "actual_duration", "h", (1.0/24.0) },
+    { 0x78, "Fabrication no", "fabrication_no", "", -1.0 },
+    { 0x79, "Enhanced identification", "enhanced_identification", "", -1.0 },
+    { 0x7A, "?", NULL, NULL, -1.0 },
+    { 0x7B, "?", NULL, NULL, -1.0 },
+    { 0x7C, "VIF in following string (length in first byte)", NULL, NULL, -1.0 },
+    { 0x7D, "?", NULL, NULL, -1.0 },
+    { 0x7E, "Any VIF", NULL, NULL, -1.0 },
+    { 0x7F, "Manufacturer specific", NULL, NULL, -1.0 },
+};
+
+static constexpr bool difTableInOrder(int i)
+{
+    return i == 16 || (dif_table_[i].dif == i && difTableInOrder(i+1));
+}
+
+static constexpr bool vifTableInOrder(int i)
+{
+    return i == 128 || (vif_table_[i].vif == i && vifTableInOrder(i+1));
+}
+
+static_assert(difTableInOrder(0), "The dif table must be indexed by dif & 0x0f.");
+static_assert(vifTableInOrder(0), "The vif table must be indexed by vif & 0x7f.");
+
+const DifInfo &difInfo(int dif)
+{
+    return dif_table_[dif & 0x0f];
+}
+
+const VifInfo &vifInfo(int vif)
+{
+    return vif_table_[vif & 0x7f];
+}
+
 int difLenBytes(int dif)
 {
-    int t = dif & 0x0f;
-    switch (t) {
-    case 0x0: return 0; // No data
-    case 0x1: return 1; // 8 Bit Integer/Binary
-    case 0x2: return 2; // 16 Bit Integer/Binary
-    case 0x3: return 3; // 24 Bit Integer/Binary
-    case 0x4: return 4; // 32 Bit Integer/Binary
-    case 0x5: return 4; // 32 Bit Real
-    case 0x6: return 6; // 48 Bit Integer/Binary
-    case 0x7: return 8; // 64 Bit Integer/Binary
-    case 0x8: return 0; // Selection for Readout
-    case 0x9: return 1; // 2 digit BCD
-    case 0xA: return 2; // 4 digit BCD
-    case 0xB: return 3; // 6 digit BCD
-    case 0xC: return 4; // 8 digit BCD
-    case 0xD: return -1; // variable length
-    case 0xE: return 6; // 12 digit BCD
-    case 0xF: // Special Functions
-        if (dif == 0x2f) return 1; // The skip code 0x2f, used for padding.
-        return -2;
-    }
-    // Bad!
-    return -2;
+    if (dif == 0x2f) return 1; // The skip code 0x2f, used for padding.
+    return dif_table_[dif & 0x0f].len;
 }
 
 string difType(int dif)
 {
-    string s;
     int t = dif & 0x0f;
-    switch (t) {
-    case 0x0: s+= "No data"; break;
-    case 0x1: s+= "8 Bit Integer/Binary"; break;
-    case 0x2: s+= "16 Bit Integer/Binary"; break;
-    case 0x3: s+= "24 Bit Integer/Binary"; break;
-    case 0x4: s+= "32 Bit Integer/Binary"; break;
-    case 0x5: s+= "32 Bit Real"; break;
-    case 0x6: s+= "48 Bit Integer/Binary"; break;
-    case 0x7: s+= "64 Bit Integer/Binary"; break;
-    case 0x8: s+= "Selection for Readout"; break;
-    case 0x9: s+= "2 digit BCD"; break;
-    case 0xA: s+= "4 digit BCD"; break;
-    case 0xB: s+= "6 digit BCD"; break;
-    case 0xC: s+= "8 digit BCD"; break;
-    case 0xD: s+= "variable length"; break;
-    case 0xE: s+= "12 digit BCD"; break;
-    case 0xF: s+= "Special Functions"; break;
-    default: s+= "?"; break;
-    }
+    string s = dif_table_[t].name;
 
     if (t != 0xf)
     {
         // Only print these suffixes when we have actual values.
-        t = dif & 0x30;
-
-        switch (t) {
-        case 0x00: s += " Instantaneous value"; break;
-        case 0x10: s += " Maximum value"; break;
-        case 0x20: s += " Minimum value"; break;
-        case 0x30: s+= " Value during error state"; break;
-        default: s += "?"; break;
-        }
+        s += dif_measurement_type_names_[(dif & 0x30) >> 4];
     }
     if (dif & 0x40) {
         // This is the lsb of the storage nr.
@@ -1703,20 +2021,12 @@ string difType(int dif)
 
 MeasurementType difMeasurementType(int dif)
 {
-    int t = dif & 0x30;
-    switch (t) {
-    case 0x00: return MeasurementType::Instantaneous;
-    case 0x10: return MeasurementType::Maximum;
-    case 0x20: return MeasurementType::Minimum;
-    case 0x30: return MeasurementType::AtError;
-    }
-    assert(0);
+    return dif_measurement_types_[(dif & 0x30) >> 4];
 }
 
-string vifType(int vif)
+const char *vifType(int vif)
 {
     int extension = vif & 0x80;
-    int t = vif & 0x7f;
 
     if (extension) {
         switch(vif) {
@@ -1727,647 +2037,47 @@ string vifType(int vif)
         }
     }
 
-    switch (t) {
-    case 0x00: return "Energy mWh";
-    case 0x01: return "Energy 10⁻² Wh";
-    case 0x02: return "Energy 10⁻¹ Wh";
-    case 0x03: return "Energy Wh";
-    case 0x04: return "Energy 10¹ Wh";
-    case 0x05: return "Energy 10² Wh";
-    case 0x06: return "Energy kWh";
-    case 0x07: return "Energy 10⁴ Wh";
-
-    case 0x08: return "Energy J";
-    case 0x09: return "Energy 10¹ J";
-    case 0x0A: return "Energy 10² J";
-    case 0x0B: return "Energy kJ";
-    case 0x0C: return "Energy 10⁴ J";
-    case 0x0D: return "Energy 10⁵ J";
-    case 0x0E: return "Energy MJ";
-    case 0x0F: return "Energy 10⁷ J";
-
-    case 0x10: return "Volume cm³";
-    case 0x11: return "Volume 10⁻⁵ m³";
-    case 0x12: return "Volume 10⁻⁴ m³";
-    case 0x13: return "Volume l";
-    case 0x14: return "Volume 10⁻² m³";
-    case 0x15: return "Volume 10⁻¹ m³";
-    case 0x16: return "Volume m³";
-    case 0x17: return "Volume 10¹ m³";
-
-    case 0x18: return "Mass g";
-    case 0x19: return "Mass 10⁻² kg";
-    case 0x1A: return "Mass 10⁻¹ kg";
-    case 0x1B: return "Mass kg";
-    case 0x1C: return "Mass 10¹ kg";
-    case 0x1D: return "Mass 10² kg";
-    case 0x1E: return "Mass t";
-    case 0x1F: return "Mass 10⁴ kg";
-
-    case 0x20: return "On time seconds";
-    case 0x21: return "On time minutes";
-    case 0x22: return "On time hours";
-    case 0x23: return "On time days";
-
-    case 0x24: return "Operating time seconds";
-    case 0x25: return "Operating time minutes";
-    case 0x26: return "Operating time hours";
-    case 0x27: return "Operating time days";
-
-    case 0x28: return "Power mW";
-    case 0x29: return "Power 10⁻² W";
-    case 0x2A: return "Power 10⁻¹ W";
-    case 0x2B: return "Power W";
-    case 0x2C: return "Power 10¹ W";
-    case 0x2D: return "Power 10² W";
-    case 0x2E: return "Power kW";
-    case 0x2F: return "Power 10⁴ W";
-
-    case 0x30: return "Power J/h";
-    case 0x31: return "Power 10¹ J/h";
-    case 0x32: return "Power 10² J/h";
-    case 0x33: return "Power kJ/h";
-    case 0x34: return "Power 10⁴ J/h";
-    case 0x35: return "Power 10⁵ J/h";
-    case 0x36: return "Power MJ/h";
-    case 0x37: return "Power 10⁷ J/h";
-
-    case 0x38: return "Volume flow cm³/h";
-    case 0x39: return "Volume flow 10⁻⁵ m³/h";
-    case 0x3A: return "Volume flow 10⁻⁴ m³/h";
-    case 0x3B: return "Volume flow l/h";
-    case 0x3C: return "Volume flow 10⁻² m³/h";
-    case 0x3D: return "Volume flow 10⁻¹ m³/h";
-    case 0x3E: return "Volume flow m³/h";
-    case 0x3F: return "Volume flow 10¹ m³/h";
-
-    case 0x40: return "Volume flow ext. 10⁻⁷ m³/min";
-    case 0x41: return "Volume flow ext. cm³/min";
-    case 0x42: return "Volume flow ext. 10⁻⁵ m³/min";
-    case 0x43: return "Volume flow ext. 10⁻⁴ m³/min";
-    case 0x44: return "Volume flow ext. l/min";
-    case 0x45: return "Volume flow ext. 10⁻² m³/min";
-    case 0x46: return "Volume flow ext. 10⁻¹ m³/min";
-    case 0x47: return "Volume flow ext. m³/min";
-
-    case 0x48: return "Volume flow ext. mm³/s";
-    case 0x49: return "Volume flow ext. 10⁻⁸ m³/s";
-    case 0x4A: return "Volume flow ext. 10⁻⁷ m³/s";
-    case 0x4B: return "Volume flow ext. cm³/s";
-    case 0x4C: return "Volume flow ext. 10⁻⁵ m³/s";
-    case 0x4D: return "Volume flow ext. 10⁻⁴ m³/s";
-    case 0x4E: return "Volume flow ext. l/s";
-    case 0x4F: return "Volume flow ext. 10⁻² m³/s";
-
-    case 0x50: return "Mass g/h";
-    case 0x51: return "Mass 10⁻² kg/h";
-    case 0x52: return "Mass 10⁻¹ kg/h";
-    case 0x53: return "Mass kg/h";
-    case 0x54: return "Mass 10¹ kg/h";
-    case 0x55: return "Mass 10² kg/h";
-    case 0x56: return "Mass t/h";
-    case 0x57: return "Mass 10⁴ kg/h";
-
-    case 0x58: return "Flow temperature 10⁻³ °C";
-    case 0x59: return "Flow temperature 10⁻² °C";
-    case 0x5A: return "Flow temperature 10⁻¹ °C";
-    case 0x5B: return "Flow temperature °C";
-
-    case 0x5C: return "Return temperature 10⁻³ °C";
-    case 0x5D: return "Return temperature 10⁻² °C";
-    case 0x5E: return "Return temperature 10⁻¹ °C";
-    case 0x5F: return "Return temperature °C";
-
-    case 0x60: return "Temperature difference mK";
-    case 0x61: return "Temperature difference 10⁻² K";
-    case 0x62: return "Temperature difference 10⁻¹ K";
-    case 0x63: return "Temperature difference K";
-
-    case 0x64: return "External temperature 10⁻³ °C";
-    case 0x65: return "External temperature 10⁻² °C";
-    case 0x66: return "External temperature 10⁻¹ °C";
-    case 0x67: return "External temperature °C";
-
-    case 0x68: return "Pressure mbar";
-    case 0x69: return "Pressure 10⁻² bar";
-    case 0x6A: return "Pressure 10⁻1 bar";
-    case 0x6B: return "Pressure bar";
-
-    case 0x6C: return "Date type G";
-    case 0x6D: return "Date and time type";
-
-    case 0x6E: return "Units for H.C.A.";
-    case 0x6F: return "Reserved";
-
-    case 0x70: return "Averaging duration seconds";
-    case 0x71: return "Averaging duration minutes";
-    case 0x72: return "Averaging duration hours";
-    case 0x73: return "Averaging duration days";
-
-    case 0x74: return "Actuality duration seconds";
-    case 0x75: return "Actuality duration minutes";
-    case 0x76: return "Actuality duration hours";
-    case 0x77: return "Actuality duration days";
-
-    case 0x78: return "Fabrication no";
-    case 0x79: return "Enhanced identification";
-
-    case 0x7C: return "VIF in following string (length in first byte)";
-    case 0x7E: return "Any VIF";
-    case 0x7F: return "Manufacturer specific";
-    default: return "?";
-    }
+    return vif_table_[vif & 0x7f].type;
 }
 
 double vifScale(int vif)
 {
     int t = vif & 0x7f;
+    double scale = vif_table_[t].scale;
+
+    if (scale < 0)
+    {
+        if (t == 0x6C) warning("(wmbus) warning: do not scale a date type!\n");
+        else if (t == 0x6F) warning("(wmbus) warning: do not scale a reserved type!\n");
+        else warning("(wmbus) warning: type %d cannot be scaled!\n", t);
+    }
+    return scale;
+}
 
-    switch (t) {
-        // wmbusmeters always returns enery as kwh
-    case 0x00: return 1000000.0; // Energy mWh
-    case 0x01: return 100000.0;  // Energy 10⁻² Wh
-    case 0x02: return 10000.0;   // Energy 10⁻¹ Wh
-    case 0x03: return 1000.0;    // Energy Wh
-    case 0x04: return 100.0;     // Energy 10¹ Wh
-    case 0x05: return 10.0;      // Energy 10² Wh
-    case 0x06: return 1.0;       // Energy kWh
-    case 0x07: return 0.1;       // Energy 10⁴ Wh
-
-        // or wmbusmeters always returns energy as MJ
-    case 0x08: return 1000000.0; // Energy J
-    case 0x09: return 100000.0;  // Energy 10¹ J
-    case 0x0A: return 10000.0;   // Energy 10² J
-    case 0x0B: return 1000.0;    // Energy kJ
-    case 0x0C: return 100.0;     // Energy 10⁴ J
-    case 0x0D: return 10.0;      // Energy 10⁵ J
-    case 0x0E: return 1.0;       // Energy MJ
-    case 0x0F: return 0.1;       // Energy 10⁷ J
-
-        // wmbusmeters always returns volume as m3
-    case 0x10: return 1000000.0; // Volume cm³
-    case 0x11: return 100000.0; // Volume 10⁻⁵ m³
-    case 0x12: return 10000.0; // Volume 10⁻⁴ m³
-    case 0x13: return 1000.0; // Volume l
-    case 0x14: return 100.0; // Volume 10⁻² m³
-    case 0x15: return 10.0; // Volume 10⁻¹ m³
-    case 0x16: return 1.0; // Volume m³
-    case 0x17: return 0.1; // Volume 10¹ m³
-
-        // wmbusmeters always returns weight in kg
-    case 0x18: return 1000.0; // Mass g
-    case 0x19: return 100.0;  // Mass 10⁻² kg
-    case 0x1A: return 10.0;   // Mass 10⁻¹ kg
-    case 0x1B: return 1.0;    // Mass kg
-    case 0x1C: return 0.1;    // Mass 10¹ kg
-    case 0x1D: return 0.01;   // Mass 10² kg
-    case 0x1E: return 0.001;  // Mass t
-    case 0x1F: return 0.0001; // Mass 10⁴ kg
-
-        // wmbusmeters always returns time in hours
-    case 0x20: return 3600.0;     // On time seconds
-    case 0x21: return 60.0;       // On time minutes
-    case 0x22: return 1.0;        // On time hours
-    case 0x23: return (1.0/24.0); // On time days
-
-    case 0x24: return 3600.0;     // Operating time seconds
-    case 0x25: return 60.0;       // Operating time minutes
-    case 0x26: return 1.0;        // Operating time hours
-    case 0x27: return (1.0/24.0); // Operating time days
-
-        // wmbusmeters always returns power in kw
-    case 0x28: return 1000000.0; // Power mW
-    case 0x29: return 100000.0; // Power 10⁻² W
-    case 0x2A: return 10000.0; // Power 10⁻¹ W
-    case 0x2B: return 1000.0; // Power W
-    case 0x2C: return 100.0; // Power 10¹ W
-    case 0x2D: return 10.0; // Power 10² W
-    case 0x2E: return 1.0; // Power kW
-    case 0x2F: return 0.1; // Power 10⁴ W
-
-        // or wmbusmeters always returns power in MJh
-    case 0x30: return 1000000.0; // Power J/h
-    case 0x31: return 100000.0; // Power 10¹ J/h
-    case 0x32: return 10000.0; // Power 10² J/h
-    case 0x33: return 1000.0; // Power kJ/h
-    case 0x34: return 100.0; // Power 10⁴ J/h
-    case 0x35: return 10.0; // Power 10⁵ J/h
-    case 0x36: return 1.0; // Power MJ/h
-    case 0x37: return 0.1; // Power 10⁷ J/h
-
-        // wmbusmeters always returns volume flow in m3h
-    case 0x38: return 1000000.0; // Volume flow cm³/h
-    case 0x39: return 100000.0; // Volume flow 10⁻⁵ m³/h
-    case 0x3A: return 10000.0; // Volume flow 10⁻⁴ m³/h
-    case 0x3B: return 1000.0; // Volume flow l/h
-    case 0x3C: return 100.0; // Volume flow 10⁻² m³/h
-    case 0x3D: return 10.0; // Volume flow 10⁻¹ m³/h
-    case 0x3E: return 1.0; // Volume flow m³/h
-    case 0x3F: return 0.1; // Volume flow 10¹ m³/h
-
-        // wmbusmeters always returns volume flow in m3h
-    case 0x40: return 600000000.0; // Volume flow ext. 10⁻⁷ m³/min
-    case 0x41: return 60000000.0; // Volume flow ext. cm³/min
-    case 0x42: return 6000000.0; // Volume flow ext. 10⁻⁵ m³/min
-    case 0x43: return 600000.0; // Volume flow ext. 10⁻⁴ m³/min
-    case 0x44: return 60000.0; // Volume flow ext. l/min
-    case 0x45: return 6000.0; // Volume flow ext. 10⁻² m³/min
-    case 0x46: return 600.0; // Volume flow ext. 10⁻¹ m³/min
-    case 0x47: return 60.0; // Volume flow ext. m³/min
-
-        // this flow numbers will be small in the m3h unit, but it
-        // does not matter since double stores the scale factor in its exponent.
-    case 0x48: return 1000000000.0*3600; // Volume flow ext. mm³/s
-    case 0x49: return 100000000.0*3600; // Volume flow ext. 10⁻⁸ m³/s
-    case 0x4A: return 10000000.0*3600; // Volume flow ext. 10⁻⁷ m³/s
-    case 0x4B: return 1000000.0*3600; // Volume flow ext. cm³/s
-    case 0x4C: return 100000.0*3600; // Volume flow ext. 10⁻⁵ m³/s
-    case 0x4D: return 10000.0*3600; // Volume flow ext. 10⁻⁴ m³/s
-    case 0x4E: return 1000.0*3600; // Volume flow ext. l/s
-    case 0x4F: return 100.0*3600; // Volume flow ext. 10⁻² m³/s
-
-        // wmbusmeters always returns mass flow as kgh
-    case 0x50: return 1000.0; // Mass g/h
-    case 0x51: return 100.0; // Mass 10⁻² kg/h
-    case 0x52: return 10.0; // Mass 10⁻¹ kg/h
-    case 0x53: return 1.0; // Mass kg/h
-    case 0x54: return 0.1; // Mass 10¹ kg/h
-    case 0x55: return 0.01; // Mass 10² kg/h
-    case 0x56: return 0.001; // Mass t/h
-    case 0x57: return 0.0001; // Mass 10⁴ kg/h
-
-        // wmbusmeters always returns temperature in °C
-    case 0x58: return 1000.0; // Flow temperature 10⁻³ °C
-    case 0x59: return 100.0; // Flow temperature 10⁻² °C
-    case 0x5A: return 10.0; // Flow temperature 10⁻¹ °C
-    case 0x5B: return 1.0; // Flow temperature °C
-
-        // wmbusmeters always returns temperature in c
-    case 0x5C: return 1000.0;  // Return temperature 10⁻³ °C
-    case 0x5D: return 100.0; // Return temperature 10⁻² °C
-    case 0x5E: return 10.0; // Return temperature 10⁻¹ °C
-    case 0x5F: return 1.0; // Return temperature °C
-
-        // or if Kelvin is used as a temperature, in K
-        // what kind of meter cares about -273.15 °C
-        // a flow pump for liquid helium perhaps?
-    case 0x60: return 1000.0; // Temperature difference mK
-    case 0x61: return 100.0; // Temperature difference 10⁻² K
-    case 0x62: return 10.0; // Temperature difference 10⁻¹ K
-    case 0x63: return 1.0; // Temperature difference K
-
-        // wmbusmeters always returns temperature in c
-    case 0x64: return 1000.0; // External temperature 10⁻³ °C
-    case 0x65: return 100.0; // External temperature 10⁻² °C
-    case 0x66: return 10.0; // External temperature 10⁻¹ °C
-    case 0x67: return 1.0; // External temperature °C
-
-        // wmbusmeters always returns pressure in bar
-    case 0x68: return 1000.0; // Pressure mbar
-    case 0x69: return 100.0; // Pressure 10⁻² bar
-    case 0x6A: return 10.0; // Pressure 10⁻1 bar
-    case 0x6B: return 1.0; // Pressure bar
-
-    case 0x6C: warning("(wmbus) warning: do not scale a date type!\n"); return -1.0; // Date type G
-    case 0x6E: return 1.0; // Units for H.C.A. are never scaled
-    case 0x6F: warning("(wmbus) warning: do not scale a reserved type!\n"); return -1.0; // Reserved
-
-        // wmbusmeters always returns time in hours
-    case 0x70: return 3600.0; // Averaging duration seconds
-    case 0x71: return 60.0; // Averaging duration minutes
-    case 0x72: return 1.0; // Averaging duration hours
-    case 0x73: return (1.0/24.0); // Averaging duration days
-
-    case 0x74: return 3600.0; // Actuality duration seconds
-    case 0x75: return 60.0; // Actuality duration minutes
-    case 0x76: return 1.0; // Actuality duration hours
-    case 0x77: return (1.0/24.0); // Actuality duration days
-
-    case 0x78: // Fabrication no
-    case 0x79: // Enhanced identification
-    case 0x80: // Address
-
-    case 0x7C: // VIF in following string (length in first byte)
-    case 0x7E: // Any VIF
-    case 0x7F: // Manufacturer specific
-
-    default: warning("(wmbus) warning: type %d cannot be scaled!\n", t);
-        return -1;
-    }
-}
-
-string vifKey(int vif)
+const char *vifKey(int vif)
 {
     int t = vif & 0x7f;
+    const char *key = vif_table_[t].key;
 
-    switch (t) {
-
-    case 0x00:
-    case 0x01:
-    case 0x02:
-    case 0x03:
-    case 0x04:
-    case 0x05:
-    case 0x06:
-    case 0x07: return "energy";
-
-    case 0x08:
-    case 0x09:
-    case 0x0A:
-    case 0x0B:
-    case 0x0C:
-    case 0x0D:
-    case 0x0E:
-    case 0x0F: return "energy";
-
-    case 0x10:
-    case 0x11:
-    case 0x12:
-    case 0x13:
-    case 0x14:
-    case 0x15:
-    case 0x16:
-    case 0x17: return "volume";
-
-    case 0x18:
-    case 0x19:
-    case 0x1A:
-    case 0x1B:
-    case 0x1C:
-    case 0x1D:
-    case 0x1E:
-    case 0x1F: return "mass";
-
-    case 0x20:
-    case 0x21:
-    case 0x22:
-    case 0x23: return "on_time";
-
-    case 0x24:
-    case 0x25:
-    case 0x26:
-    case 0x27: return "operating_time";
-
-    case 0x28:
-    case 0x29:
-    case 0x2A:
-    case 0x2B:
-    case 0x2C:
-    case 0x2D:
-    case 0x2E:
-    case 0x2F: return "power";
-
-    case 0x30:
-    case 0x31:
-    case 0x32:
-    case 0x33:
-    case 0x34:
-    case 0x35:
-    case 0x36:
-    case 0x37: return "power";
-
-    case 0x38:
-    case 0x39:
-    case 0x3A:
-    case 0x3B:
-    case 0x3C:
-    case 0x3D:
-    case 0x3E:
-    case 0x3F: return "volume_flow";
-
-    case 0x40:
-    case 0x41:
-    case 0x42:
-    case 0x43:
-    case 0x44:
-    case 0x45:
-    case 0x46:
-    case 0x47: return "volume_flow_ext";
-
-    case 0x48:
-    case 0x49:
-    case 0x4A:
-    case 0x4B:
-    case 0x4C:
-    case 0x4D:
-    case 0x4E:
-    case 0x4F: return "volume_flow_ext";
-
-    case 0x50:
-    case 0x51:
-    case 0x52:
-    case 0x53:
-    case 0x54:
-    case 0x55:
-    case 0x56:
-    case 0x57: return "mass_flow";
-
-    case 0x58:
-    case 0x59:
-    case 0x5A:
-    case 0x5B: return "flow_temperature";
-
-    case 0x5C:
-    case 0x5D:
-    case 0x5E:
-    case 0x5F: return "return_temperature";
-
-    case 0x60:
-    case 0x61:
-    case 0x62:
-    case 0x63: return "temperature_difference";
-
-    case 0x64:
-    case 0x65:
-    case 0x66:
-    case 0x67: return "external_temperature";
-
-    case 0x68:
-    case 0x69:
-    case 0x6A:
-    case 0x6B: return "pressure";
-
-    case 0x6C: return "date"; // Date type G
-    case 0x6E: return "hca"; // Units for H.C.A.
-    case 0x6F: return "reserved"; // Reserved
-
-    case 0x70:
-    case 0x71:
-    case 0x72:
-    case 0x73: return "average_duration";
-
-    case 0x74:
-    case 0x75:
-    case 0x76:
-    case 0x77: return "actual_duration";
-
-    case 0x78: return "fabrication_no"; // Fabrication no
-    case 0x79: return "enhanced_identification"; // Enhanced identification
-
-    case 0x7C: // VIF in following string (length in first byte)
-    case 0x7E: // Any VIF
-    case 0x7F: // Manufacturer specific
-
-    default: warning("(wmbus) warning: generic type %d cannot be scaled!\n", t);
+    if (key == NULL)
+    {
+        warning("(wmbus) warning: generic type %d cannot be scaled!\n", t);
         return "unknown";
     }
+    return key;
 }
 
-string vifUnit(int vif)
+const char *vifUnit(int vif)
 {
     int t = vif & 0x7f;
+    const char *unit = vif_table_[t].unit;
 
-    switch (t) {
-
-    case 0x00:
-    case 0x01:
-    case 0x02:
-    case 0x03:
-    case 0x04:
-    case 0x05:
-    case 0x06:
-    case 0x07: return "kwh";
-
-    case 0x08:
-    case 0x09:
-    case 0x0A:
-    case 0x0B:
-    case 0x0C:
-    case 0x0D:
-    case 0x0E:
-    case 0x0F: return "MJ";
-
-    case 0x10:
-    case 0x11:
-    case 0x12:
-    case 0x13:
-    case 0x14:
-    case 0x15:
-    case 0x16:
-    case 0x17: return "m3";
-
-    case 0x18:
-    case 0x19:
-    case 0x1A:
-    case 0x1B:
-    case 0x1C:
-    case 0x1D:
-    case 0x1E:
-    case 0x1F: return "kg";
-
-    case 0x20:
-    case 0x21:
-    case 0x22:
-    case 0x23:
-    case 0x24:
-    case 0x25:
-    case 0x26:
-    case 0x27: return "h";
-
-    case 0x28:
-    case 0x29:
-    case 0x2A:
-    case 0x2B:
-    case 0x2C:
-    case 0x2D:
-    case 0x2E:
-    case 0x2F: return "kw";
-
-    case 0x30:
-    case 0x31:
-    case 0x32:
-    case 0x33:
-    case 0x34:
-    case 0x35:
-    case 0x36:
-    case 0x37: return "MJ";
-
-    case 0x38:
-    case 0x39:
-    case 0x3A:
-    case 0x3B:
-    case 0x3C:
-    case 0x3D:
-    case 0x3E:
-    case 0x3F: return "m3/h";
-
-    case 0x40:
-    case 0x41:
-    case 0x42:
-    case 0x43:
-    case 0x44:
-    case 0x45:
-    case 0x46:
-    case 0x47: return "m3/h";
-
-    case 0x48:
-    case 0x49:
-    case 0x4A:
-    case 0x4B:
-    case 0x4C:
-    case 0x4D:
-    case 0x4E:
-    case 0x4F: return "m3/h";
-
-    case 0x50:
-    case 0x51:
-    case 0x52:
-    case 0x53:
-    case 0x54:
-    case 0x55:
-    case 0x56:
-    case 0x57: return "kg/h";
-
-    case 0x58:
-    case 0x59:
-    case 0x5A:
-    case 0x5B: return "c";
-
-    case 0x5C:
-    case 0x5D:
-    case 0x5E:
-    case 0x5F: return "c";
-
-    case 0x60:
-    case 0x61:
-    case 0x62:
-    case 0x63: return "k";
-
-    case 0x64:
-    case 0x65:
-    case 0x66:
-    case 0x67: return "c";
-
-    case 0x68:
-    case 0x69:
-    case 0x6A:
-    case 0x6B: return "bar";
-
-    case 0x6C: return ""; // Date type G
-    case 0x6D: return ""; // ??
-    case 0x6E: return ""; // Units for H.C.A.
-    case 0x6F: return ""; // Reserved
-
-    case 0x70:
-    case 0x71:
-    case 0x72:
-    case 0x73: return "h";
-
-    case 0x74:
-    case 0x75:
-    case 0x76:
-    case 0x77: return "h";
-
-    case 0x78: return ""; // Fabrication no
-    case 0x79: return ""; // Enhanced identification
-
-    case 0x7C: // VIF in following string (length in first byte)
-    case 0x7E: // Any VIF
-    case 0x7F: // Manufacturer specific
-
-    default: warning("(wmbus) warning: generic type %d cannot be scaled!\n", t);
+    if (unit == NULL)
+    {
+        warning("(wmbus) warning: generic type %d cannot be scaled!\n", t);
         return "unknown";
     }
+    return unit;
 }
 
 const char *timeNN(int nn) {
@@ -3029,54 +2739,14 @@ string vifeType(int dif, int vif, int vife)
     return "?";
 }
 
-double toDoubleFromBytes(vector<uchar> &bytes, int len) {
-    double d = 0;
-    for (int i=0; i<len; ++i) {
-        double x = bytes[i];
-        d += x*(256^i);
-    }
-    return d;
-}
-
-double toDoubleFromBCD(vector<uchar> &bytes, int len) {
-    double d = 0;
-    for (int i=0; i<len; ++i) {
-        double x = bytes[i]&0xf;
-        d += x*(10^(i*2));
-        double xx = bytes[i]>>4;
-        d += xx*(10^(1+i*2));
-    }
-    return d;
-}
-
 double dataAsDouble(int dif, int vif, int vife, string data)
 {
     vector<uchar> bytes;
     hex2bin(data, &bytes);
 
-    int t = dif & 0x0f;
-    switch (t) {
-    case 0x0: return 0.0;
-    case 0x1: return toDoubleFromBytes(bytes, 1);
-    case 0x2: return toDoubleFromBytes(bytes, 2);
-    case 0x3: return toDoubleFromBytes(bytes, 3);
-    case 0x4: return toDoubleFromBytes(bytes, 4);
-    case 0x5: return -1;  //  How is REAL stored?
-    case 0x6: return toDoubleFromBytes(bytes, 6);
-        // Note that for 64 bit data, storing it into a double might lose precision
-        // since the mantissa is less than 64 bit. It is unlikely that anyone
-        // really needs true 64 bit precision in their measurements from a physical meter though.
-    case 0x7: return toDoubleFromBytes(bytes, 8);
-    case 0x8: return -1; // Selection for Readout?
-    case 0x9: return toDoubleFromBCD(bytes, 1);
-    case 0xA: return toDoubleFromBCD(bytes, 2);
-    case 0xB: return toDoubleFromBCD(bytes, 3);
-    case 0xC: return toDoubleFromBCD(bytes, 4);
-    case 0xD: return -1; // variable length
-    case 0xE: return toDoubleFromBCD(bytes, 6);
-    case 0xF: return -1; // Special Functions
-    }
-    return -1;
+    double v;
+    if (!decodeDVValue(dif, bytes.size() ? &bytes[0] : NULL, bytes.size(), &v)) return -1;
+    return v;
 }
 
 uint64_t dataAsUint64(int dif, int vif, int vife, string data)
@@ -3085,28 +2755,10 @@ uint64_t dataAsUint64(int dif, int vif, int vife, string data)
     hex2bin(data, &bytes);
 
     int t = dif & 0x0f;
-    switch (t) {
-    case 0x0: return 0.0;
-    case 0x1: return toDoubleFromBytes(bytes, 1);
-    case 0x2: return toDoubleFromBytes(bytes, 2);
-    case 0x3: return toDoubleFromBytes(bytes, 3);
-    case 0x4: return toDoubleFromBytes(bytes, 4);
-    case 0x5: return -1;  //  How is REAL stored?
-    case 0x6: return toDoubleFromBytes(bytes, 6);
-        // Note that for 64 bit data, storing it into a double might lose precision
-        // since the mantissa is less than 64 bit. It is unlikely that anyone
-        // really needs true 64 bit precision in their measurements from a physical meter though.
-    case 0x7: return toDoubleFromBytes(bytes, 8);
-    case 0x8: return -1; // Selection for Readout?
-    case 0x9: return toDoubleFromBCD(bytes, 1);
-    case 0xA: return toDoubleFromBCD(bytes, 2);
-    case 0xB: return toDoubleFromBCD(bytes, 3);
-    case 0xC: return toDoubleFromBCD(bytes, 4);
-    case 0xD: return -1; // variable length
-    case 0xE: return toDoubleFromBCD(bytes, 6);
-    case 0xF: return -1; // Special Functions
-    }
-    return -1;
+    int len = difLenBytes(dif);
+    if (len < 0 || t == 0x5 || t == 0x8 || (size_t)len > bytes.size()) return -1;
+    if (t >= 0x9) return decodeDVBCD(&bytes[0], len);
+    return decodeDVUint(len ? &bytes[0] : NULL, len);
 }
 
 string formatData(int dif, int vif, int vife, string data)
@@ -3117,7 +2769,7 @@ string formatData(int dif, int vif, int vife, string data)
     if (t >= 0 && t <= 0x77 && !(t >= 0x6c && t<=0x6f)) {
         // These are vif codes with an understandable key and unit.
         double val = dataAsDouble(dif, vif, vife, data);
-        strprintf(r, "%d", val);
+        strprintf(r, "%g", val);
         return r;
     }
 
@@ -3150,39 +2802,35 @@ string measurementTypeName(MeasurementType mt)
 WMBus::~WMBus() {
 }
 
+// The formats of some meters are known before a full length telegram has been received.
+struct KnownFormat
+{
+    uint16_t signature;
+    size_t len;
+    uchar bytes[16];
+};
+
+static const KnownFormat known_formats_[] =
+{
+    { 0xa8ed, 11, { 0x02,0xFF,0x20,0x04,0x13,0x44,0x13,0x61,0x5B,0x61,0x67 } },
+    { 0xc412, 16, { 0x02,0xFF,0x20,0x04,0x13,0x92,0x01,0x3B,0xA1,0x01,0x5B,0x81,0x01,0xE7,0xFF,0x0F } },
+    { 0x61eb, 15, { 0x02,0xFF,0x20,0x04,0x13,0x44,0x13,0xA1,0x01,0x5B,0x81,0x01,0xE7,0xFF,0x0F } },
+    { 0xd2f7, 11, { 0x02,0xFF,0x20,0x04,0x13,0x44,0x13,0x61,0x5B,0x51,0x67 } },
+    { 0xdd34,  7, { 0x02,0xFF,0x20,0x04,0x13,0x44,0x13 } },
+};
+
 bool Telegram::findFormatBytesFromKnownMeterSignatures(vector<uchar> *format_bytes)
 {
-    bool ok = true;
-    if (format_signature == 0xa8ed)
+    for (auto &f : known_formats_)
     {
-        hex2bin("02FF2004134413615B6167", format_bytes);
-        debug("(wmbus) using hard coded format for hash a8ed\n");
-    }
-    else if (format_signature == 0xc412)
-    {
-        hex2bin("02FF20041392013BA1015B8101E7FF0F", format_bytes);
-        debug("(wmbus) using hard coded format for hash c412\n");
-    }
-    else if (format_signature == 0x61eb)
-    {
-        hex2bin("02FF2004134413A1015B8101E7FF0F", format_bytes);
-        debug("(wmbus) using hard coded format for hash 61eb\n");
-    }
-    else if (format_signature == 0xd2f7)
-    {
-        hex2bin("02FF2004134413615B5167", format_bytes);
-        debug("(wmbus) using hard coded format for hash d2f7\n");
-    }
-    else if (format_signature == 0xdd34)
-    {
-        hex2bin("02FF2004134413", format_bytes);
-        debug("(wmbus) using hard coded format for hash dd34\n");
-    }
-    else
-    {
-        ok = false;
+        if (f.signature == format_signature)
+        {
+            format_bytes->assign(f.bytes, f.bytes+f.len);
+            debug("(wmbus) using hard coded format for hash %04x\n", format_signature);
+            return true;
+        }
     }
-    return ok;
+    return false;
 }
 
 WMBusCommonImplementation::~WMBusCommonImplementation()
@@ -3240,31 +2888,201 @@ WMBusDeviceType WMBusCommonImplementation::type()
     return type_;
 }
 
-void WMBusCommonImplementation::onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb)
+void WMBusCommonImplementation::onTelegram(function<bool(AboutTelegram&,vector<uchar>&)> cb)
 {
     telegram_listeners_.push_back(cb);
 }
 
 
-static bool ignore_duplicate_telegrams_ = false;
+static unique_ptr<DuplicateCache> duplicate_cache_;
 
-void setIgnoreDuplicateTelegrams(bool idt)
+void setIgnoreDuplicateTelegrams(int window_seconds, int max_size)
 {
-    ignore_duplicate_telegrams_ = idt;
+    if (window_seconds > 0)
+    {
+        if (max_size <= 0) max_size = DEFAULT_DUPLICATE_CACHE_SIZE;
+        duplicate_cache_ = unique_ptr<DuplicateCache>(new DuplicateCache(window_seconds, max_size));
+    }
+    else
+    {
+        duplicate_cache_.reset();
+    }
+}
+
+DuplicateCache *duplicateCache()
+{
+    return duplicate_cache_.get();
 }
 
-bool WMBusCommonImplementation::handleTelegram(AboutTelegram &about, vector<uchar> frame)
+TelegramCombiner::TelegramCombiner(int window_ms) : window_(window_ms)
+{
+    // Otherwise crafted telegrams with the same hash would all be compared.
+    randomHashKey(key_);
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&changed_, NULL);
+    loop_ = [this]() { loop(); };
+    thread_ = startWorkerThread(&loop_);
+}
+
+TelegramCombiner::~TelegramCombiner()
+{
+    stop();
+    pthread_cond_destroy(&changed_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void TelegramCombiner::add(AboutTelegram &about, vector<uchar> &frame, TelegramListeners &listeners)
+{
+    pthread_mutex_lock(&mutex_);
+    if (stopped_)
+    {
+        pthread_mutex_unlock(&mutex_);
+        dispatchTelegram(about, frame, listeners);
+        return;
+    }
+    receivers_[about.device].received++;
+
+    uint64_t hash = siphash24(key_, frame.size() > 0 ? &frame[0] : NULL, frame.size());
+    Pending *found = NULL;
+    auto range = pending_by_hash_.equal_range(hash);
+    for (auto i = range.first; i != range.second; ++i)
+    {
+        if (i->second->frame == frame)
+        {
+            found = i->second;
+            break;
+        }
+    }
+
+    if (found)
+    {
+        found->about.received_by.push_back(ReceivedBy(about.device, about.rssi_dbm));
+        if (about.rssi_dbm > found->about.rssi_dbm)
+        {
+            found->about.device = about.device;
+            found->about.rssi_dbm = about.rssi_dbm;
+            found->listeners = listeners;
+        }
+        debug("(wmbus) combined telegram copy from %s rssi %d dbm\n", about.device.c_str(), about.rssi_dbm);
+    }
+    else
+    {
+        Pending p;
+        p.frame = frame;
+        p.about = about;
+        p.about.received_by.push_back(ReceivedBy(about.device, about.rssi_dbm));
+        p.listeners = listeners;
+        p.deadline = chrono::steady_clock::now() + window_;
+        p.hash = hash;
+        pending_.push_back(std::move(p));
+        pending_by_hash_.insert({ hash, &pending_.back() });
+        pthread_cond_signal(&changed_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+void TelegramCombiner::loop()
+{
+    pthread_mutex_lock(&mutex_);
+    for (;;)
+    {
+        if (pending_.size() == 0)
+        {
+            if (stopped_) break;
+            pthread_cond_wait(&changed_, &mutex_);
+            continue;
+        }
+        auto now = chrono::steady_clock::now();
+        if (!stopped_ && pending_.front().deadline > now)
+        {
+            // The condition wait uses the realtime clock, the deadline is rechecked
+            // against the steady clock when woken up.
+            auto wait = chrono::duration_cast<chrono::nanoseconds>(pending_.front().deadline - now);
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            uint64_t ns = ts.tv_nsec + wait.count();
+            ts.tv_sec += ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&changed_, &mutex_, &ts);
+            continue;
+        }
+        auto range = pending_by_hash_.equal_range(pending_.front().hash);
+        for (auto i = range.first; i != range.second; ++i)
+        {
+            if (i->second == &pending_.front())
+            {
+                pending_by_hash_.erase(i);
+                break;
+            }
+        }
+        Pending p = std::move(pending_.front());
+        pending_.pop_front();
+        receivers_[p.about.device].best++;
+        pthread_mutex_unlock(&mutex_);
+        dispatch(p);
+        pthread_mutex_lock(&mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+void TelegramCombiner::dispatch(Pending &p)
+{
+    if (p.about.received_by.size() > 1)
+    {
+        verbose("(wmbus) telegram received by %zu devices, using %s with rssi %d dbm\n",
+                p.about.received_by.size(), p.about.device.c_str(), p.about.rssi_dbm);
+    }
+    dispatchTelegram(p.about, p.frame, p.listeners);
+}
+
+void TelegramCombiner::stop()
+{
+    pthread_mutex_lock(&mutex_);
+    bool running = !stopped_;
+    stopped_ = true;
+    pthread_cond_signal(&changed_);
+    pthread_mutex_unlock(&mutex_);
+    if (running) pthread_join(thread_, NULL);
+}
+
+map<string,ReceiverStatistics> TelegramCombiner::receiverStatistics()
+{
+    pthread_mutex_lock(&mutex_);
+    map<string,ReceiverStatistics> rs = receivers_;
+    pthread_mutex_unlock(&mutex_);
+    return rs;
+}
+
+static unique_ptr<TelegramCombiner> telegram_combiner_;
+
+void setCombineTelegrams(int window_ms)
+{
+    if (window_ms > 0)
+    {
+        telegram_combiner_ = unique_ptr<TelegramCombiner>(new TelegramCombiner(window_ms));
+    }
+    else
+    {
+        telegram_combiner_.reset();
+    }
+}
+
+TelegramCombiner *telegramCombiner()
+{
+    return telegram_combiner_.get();
+}
+
+bool dispatchTelegram(AboutTelegram &about, vector<uchar> &frame, TelegramListeners &listeners)
 {
     bool handled = false;
-    last_received_ = time(NULL);
 
-    if (ignore_duplicate_telegrams_ && seen_this_telegram_before(frame))
+    if (duplicate_cache_ && duplicate_cache_->seenBefore(frame))
     {
         verbose("(wmbus) skipping already handled telegram.\n");
         return true;
     }
 
-    for (auto f : telegram_listeners_)
+    for (auto &f : listeners)
     {
         if (f)
         {
@@ -3276,9 +3094,48 @@ bool WMBusCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
     return handled;
 }
 
+bool WMBusCommonImplementation::handleTelegram(AboutTelegram &about, vector<uchar> &frame)
+{
+    last_received_ = time(NULL);
+    increment(counters()->frames);
+
+    CaptureWriter *cw = captureWriter();
+    if (cw) cw->write(about, link_modes_.asBits(), frame);
+
+    if (telegram_combiner_)
+    {
+        telegram_combiner_->add(about, frame, telegram_listeners_);
+        return true;
+    }
+    return dispatchTelegram(about, frame, telegram_listeners_);
+}
+
 void WMBusCommonImplementation::protocolErrorDetected()
 {
     protocol_error_count_++;
+    increment(counters()->protocol_errors);
+}
+
+void WMBusCommonImplementation::crcErrorDetected()
+{
+    increment(counters()->crc_errors);
+}
+
+void WMBusCommonImplementation::bytesReceived(int n)
+{
+    if (n > 0) increment(counters()->bytes, n);
+}
+
+ReceiverCounters *WMBusCommonImplementation::counters()
+{
+    ReceiverCounters *rc = counters_.load();
+    if (rc == NULL)
+    {
+        // Not hr(), since it might have to ask the dongle for its id.
+        rc = receiverCounters(device()+":"+toLowerCaseString(type()));
+        counters_.store(rc);
+    }
+    return rc;
 }
 
 void WMBusCommonImplementation::resetProtocolErrorCount()
@@ -3335,6 +3192,7 @@ bool WMBusCommonImplementation::reset()
         {
             // This is a reset, not an init. Close the serial device.
             resetting = true;
+            increment(counters()->resets);
             serial()->resetInitiated();
             serial()->close();
             // Give the device 3 seconds to shut down properly.
@@ -3720,58 +3578,65 @@ bool trimCRCsFrameFormatA(std::vector<uchar> &payload)
     size_t len = payload.size();
     debugPayload("(wmbus) trimming frame A", payload);
 
-    vector<uchar> out;
-
-    uint16_t calc_crc = crc16_EN13757(&payload[0], 10);
-    uint16_t check_crc = payload[10] << 8 | payload[11];
+    uchar *data = &payload[0];
+    uint16_t calc_crc = crc16_EN13757(data, 10);
+    uint16_t check_crc = data[10] << 8 | data[11];
 
     if (calc_crc != check_crc)
     {
         debug("(wmbus) ff a dll crc first (calculated %04x) did not match (expected %04x) for bytes 0-%zu!\n", calc_crc, check_crc, 10);
         return false;
     }
-    out.insert(out.end(), payload.begin(), payload.begin()+10);
     debug("(wmbus) ff a dll crc 0-%zu %04x ok\n", 10-1, calc_crc);
 
+    // The crcs are checked and the blocks are then moved down in place
+    // over the crcs. The payload is left untouched if a crc fails.
     size_t pos = 12;
     for (pos = 12; pos+18 <= len; pos += 18)
     {
         size_t to = pos+16;
-        calc_crc = crc16_EN13757(&payload[pos], 16);
-        check_crc = payload[to] << 8 | payload[to+1];
+        calc_crc = crc16_EN13757(data+pos, 16);
+        check_crc = data[to] << 8 | data[to+1];
         if (calc_crc != check_crc)
         {
             debug("(wmbus) ff a dll crc mid (calculated %04x) did not match (expected %04x) for bytes %zu-%zu!\n",
                   calc_crc, check_crc, pos, to-1);
             return false;
         }
-        out.insert(out.end(), payload.begin()+pos, payload.begin()+pos+16);
         debug("(wmbus) ff a dll crc mid %zu-%zu %04x ok\n", pos, to-1, calc_crc);
     }
 
+    size_t final_pos = pos;
+    size_t final_len = 0;
     if (pos < len-2)
     {
         size_t tto = len-2;
         size_t blen = (tto-pos);
-        calc_crc = crc16_EN13757(&payload[pos], blen);
-        check_crc = payload[tto] << 8 | payload[tto+1];
+        calc_crc = crc16_EN13757(data+pos, blen);
+        check_crc = data[tto] << 8 | data[tto+1];
         if (calc_crc != check_crc)
         {
             debug("(wmbus) ff a dll crc final (calculated %04x) did not match (expected %04x) for bytes %zu-%zu!\n",
                   calc_crc, check_crc, pos, tto-1);
             return false;
         }
-        out.insert(out.end(), payload.begin()+pos, payload.begin()+tto);
+        final_len = blen;
         debug("(wmbus) ff a dll crc final %zu-%zu %04x ok\n", pos, tto-1, calc_crc);
     }
 
-    out[0] = out.size()-1;
-    size_t new_len = out[0]+1;
-    size_t old_size = payload.size();
-    payload = out;
-    size_t new_size = payload.size();
+    size_t out = 10;
+    for (pos = 12; pos < final_pos; pos += 18)
+    {
+        memmove(data+out, data+pos, 16);
+        out += 16;
+    }
+    memmove(data+out, data+final_pos, final_len);
+    out += final_len;
+
+    data[0] = out-1;
+    payload.resize(out);
 
-    debug("(wmbus) trimmed %zu crc bytes from frame a and ignored %zu suffix bytes.\n", (len-new_len), (old_size-new_size)-(len-new_len));
+    debug("(wmbus) trimmed %zu crc bytes from frame a.\n", len-out);
     debugPayload("(wmbus) trimmed  frame A", payload);
 
     return true;
@@ -3786,7 +3651,7 @@ bool trimCRCsFrameFormatB(std::vector<uchar> &payload)
     size_t len = payload.size();
     debugPayload("(wmbus) trimming frame B", payload);
 
-    vector<uchar> out;
+    uchar *data = &payload[0];
     size_t crc1_pos, crc2_pos;
     if (len <= 128)
     {
@@ -3799,22 +3664,23 @@ bool trimCRCsFrameFormatB(std::vector<uchar> &payload)
         crc2_pos = len-2;
     }
 
-    uint16_t calc_crc = crc16_EN13757(&payload[0], crc1_pos);
-    uint16_t check_crc = payload[crc1_pos] << 8 | payload[crc1_pos+1];
+    uint16_t calc_crc = crc16_EN13757(data, crc1_pos);
+    uint16_t check_crc = data[crc1_pos] << 8 | data[crc1_pos+1];
 
     if (calc_crc != check_crc)
     {
         debug("(wmbus) ff b dll crc (calculated %04x) did not match (expected %04x) for bytes 0-%zu!\n", calc_crc, check_crc, crc1_pos);
         return false;
     }
-
-    out.insert(out.end(), payload.begin(), payload.begin()+crc1_pos);
     debug("(wmbus) ff b dll crc first 0-%zu %04x ok\n", crc1_pos, calc_crc);
 
+    size_t out = crc1_pos;
     if (crc2_pos > 0)
     {
-        calc_crc = crc16_EN13757(&payload[crc1_pos+2], crc2_pos);
-        check_crc = payload[crc2_pos] << 8 | payload[crc2_pos+1];
+        // The second block starts after the first crc and ends before the last crc.
+        size_t blen = crc2_pos-(crc1_pos+2);
+        calc_crc = crc16_EN13757(data+crc1_pos+2, blen);
+        check_crc = data[crc2_pos] << 8 | data[crc2_pos+1];
 
         if (calc_crc != check_crc)
         {
@@ -3823,23 +3689,21 @@ bool trimCRCsFrameFormatB(std::vector<uchar> &payload)
             return false;
         }
 
-        out.insert(out.end(), payload.begin()+crc1_pos+2, payload.begin()+crc2_pos);
+        memmove(data+out, data+crc1_pos+2, blen);
+        out += blen;
         debug("(wmbus) ff b dll crc final %zu-%zu %04x ok\n", crc1_pos+2, crc2_pos, calc_crc);
     }
 
-    out[0] = out.size()-1;
-    size_t new_len = out[0]+1;
-    size_t old_size = payload.size();
-    payload = out;
-    size_t new_size = payload.size();
+    data[0] = out-1;
+    payload.resize(out);
 
-    debug("(wmbus) trimmed %zu crc bytes from frame b and ignored %zu suffix bytes.\n", (len-new_len), (old_size-new_size)-(len-new_len));
+    debug("(wmbus) trimmed %zu crc bytes from frame b.\n", len-out);
     debugPayload("(wmbus) trimmed  frame B", payload);
 
     return true;
 }
 
-FrameStatus checkWMBusFrame(vector<uchar> &data,
+FrameStatus checkWMBusFrame(ReceiveBuffer &data,
                             size_t *frame_length,
                             int *payload_len_out,
                             int *payload_offset)
@@ -3848,7 +3712,7 @@ FrameStatus checkWMBusFrame(vector<uchar> &data,
     // Ugly: 00615B2A442D2C998734761B168D2021D0871921|58387802FF2071000413F81800004413F8180000615B
     // Here the frame is prefixed with some random data.
 
-    debugPayload("(wmbus) checkWMBUSFrame\n", data);
+    debugPayload("(wmbus) checkWMBUSFrame\n", data.data(), data.size());
 
     if (data.size() < 11)
     {
@@ -4004,7 +3868,7 @@ bool check_file(string f, bool *is_tty, bool *is_stdin, bool *is_file, bool *is_
         *is_stdin = true;
         return true;
     }
-    if (checkIfSimulationFile(f.c_str()))
+    if (checkIfSimulationFile(f.c_str()) || isCaptureFile(f.c_str()))
     {
         *is_simulation = true;
         return true;
@@ -18,12 +18,18 @@
 #ifndef WMBUS_H
 #define WMBUS_H
 
+#include"aes.h"
 #include"manufacturers.h"
 #include"serial.h"
+#include"threads.h"
 #include"util.h"
 
+#include<chrono>
+#include<deque>
 #include<inttypes.h>
 #include<map>
+#include<unordered_map>
+#include<unordered_set>
 
 // Check and remove the data link layer CRCs from a wmbus telegram.
 // If the CRCs do not pass the test, return false.
@@ -54,7 +60,43 @@ const char *toString(WMBusDeviceType t);
 const char *toLowerCaseString(WMBusDeviceType t);
 WMBusDeviceType toWMBusDeviceType(string &t);
 
-void setIgnoreDuplicateTelegrams(bool idt);
+// Remembers the frames seen within the last window seconds, but at most max_size frames.
+// A frame is identified by its keyed 64 bit siphash, the rssi and the receiving
+// device are not part of the frame, thus the same telegram received by several
+// dongles is a duplicate.
+struct DuplicateCache
+{
+    DuplicateCache(int window_seconds, size_t max_size);
+    // Returns true if the frame has been seen before within the window,
+    // otherwise the frame is remembered.
+    bool seenBefore(vector<uchar> &frame);
+    bool seenBefore(vector<uchar> &frame, std::chrono::steady_clock::time_point now);
+    uint64_t hits() { WITH(mutex_, hits); return hits_; }
+    uint64_t misses() { WITH(mutex_, misses); return misses_; }
+    size_t size();
+
+private:
+
+    std::chrono::seconds window_;
+    size_t max_size_;
+    uchar key_[16];
+    std::unordered_set<uint64_t> hashes_;
+    // The hashes in the order they were first seen, the oldest are evicted first.
+    std::deque<std::pair<uint64_t,std::chrono::steady_clock::time_point>> seen_;
+    uint64_t hits_ {};
+    uint64_t misses_ {};
+    RecursiveMutex mutex_ = { "duplicate_cache_mutex" };
+#define LOCK_DUPLICATE_CACHE(where) WITH(mutex_, where)
+};
+
+// The default window when only ignoreduplicates=true is given.
+#define DEFAULT_DUPLICATE_WINDOW_SECONDS 10
+// The default number of frames remembered, when duplicatecachesize is not given.
+#define DEFAULT_DUPLICATE_CACHE_SIZE 100000
+
+// A window of 0 seconds turns off the duplicate check. A max_size of 0 uses the default size.
+void setIgnoreDuplicateTelegrams(int window_seconds, int max_size);
+DuplicateCache *duplicateCache();
 
 // In link mode S1, is used when both the transmitter and receiver are stationary.
 // It can be transmitted relatively seldom.
@@ -307,15 +349,53 @@ struct DVEntry
     int storagenr {};
     int tariff {};
     int subunit {};
-    string value;
+    int offset {}; // Offset of the data bytes in the parsed telegram.
+    int count {}; // 1 for the first record with this difvif, 2 for the second etc.
+    int key_start {}, key_len {}; // The difvif bytes inside the DVEntries byte store.
+    int value_start {}, value_len {}; // The data bytes inside the DVEntries byte store.
+};
+
+// The dif/vif records found in a telegram. A record is identified by the hex
+// of its difvif bytes, eg 0C13, or 0C13_2 for the second record with the same
+// difvif. The records are kept in a flat vector, sorted in the same order as
+// their hex keys, and all difvif and data bytes are stored in a single byte vector.
+// The parser appends the records and they are sorted once, when the telegram is parsed.
+struct DVEntries
+{
+    // Append the next record for these difvif bytes, unsorted.
+    void add(uchar *difvif, int difvif_len, uchar *data, int data_len, int offset,
+             MeasurementType mt, int vi, int storagenr, int tariff, int subunit);
+    // Sort the appended records and count the records with the same difvif.
+    // Done by find and begin as well, if the records are unsorted.
+    void sort();
+    // Add or replace the record with this hex key, used for manufacturer specific values.
+    void set(string key, int offset, MeasurementType mt, int vi, int storagenr, int tariff, int subunit,
+             string hex_value);
+    // Returns NULL if there is no record with this hex key.
+    DVEntry *find(const string &key);
+    string key(DVEntry &e);
+    uchar *difvif(DVEntry &e) { return bytes_.data()+e.key_start; }
+    uchar *value(DVEntry &e) { return bytes_.data()+e.value_start; }
+    string valueHex(DVEntry &e);
+
+    size_t size() { return entries_.size(); }
+    void clear() { entries_.clear(); bytes_.clear(); sorted_ = true; }
+    vector<DVEntry>::iterator begin() { if (!sorted_) sort(); return entries_.begin(); }
+    vector<DVEntry>::iterator end() { if (!sorted_) sort(); return entries_.end(); }
+
+private:
+
+    int compare(uchar *a, int alen, int acount, uchar *b, int blen, int bcount);
 
-    DVEntry() {}
-    DVEntry(MeasurementType mt, int vi, int st, int ta, int su, string &val) :
-    type(mt), value_information(vi), storagenr(st), tariff(ta), subunit(su), value(val) {}
+    vector<DVEntry> entries_;
+    vector<uchar> bytes_;
+    bool sorted_ { true };
 };
 
 using namespace std;
 
+struct DecodePlans;
+
 struct MeterKeys
 {
     vector<uchar> confidentiality_key;
@@ -323,6 +403,32 @@ struct MeterKeys
 
     bool hasConfidentialityKey() { return confidentiality_key.size() > 0; }
     bool hasAuthenticationKey() { return authentication_key.size() > 0; }
+
+    // The confidentiality key expanded into an aes key schedule. The key is expanded
+    // on first use and then reused for all telegrams, until the key is changed.
+    // Returns NULL if there is no 16 byte confidentiality key.
+    AES_ctx *confidentialityContext();
+
+    // Set the confidentiality key from hex, with the key schedule already expanded.
+    // The meters of a large installation often share a few keys, thus every distinct
+    // key is decoded and expanded once and then copied into the meters using it.
+    void setConfidentialityKey(string hex);
+    // The meters keep their own copies of the keys, thus the decoded keys are
+    // forgotten when the meters have been created, to not keep removed keys in memory.
+    static void forgetDecodedKeys();
+
+private:
+
+    AES_ctx confidentiality_ctx_ {};
+    vector<uchar> expanded_key_;
+};
+
+struct ReceivedBy
+{
+    string device;
+    int rssi_dbm {};
+
+    ReceivedBy(string dv, int rs) : device(dv), rssi_dbm(rs) {}
 };
 
 struct AboutTelegram
@@ -333,11 +439,106 @@ struct AboutTelegram
     // -100 dbm = 0.1 pico Watt to -20 dbm = 10 micro W
     // Measurements smaller than -100 and larger than -10 are unlikely.
     int rssi_dbm {};
+    // When combining telegrams, all devices that received this telegram,
+    // the device above is the one with the best rssi.
+    vector<ReceivedBy> received_by;
+    // When the telegram was received, 0 means now. Set when decoding old captures.
+    time_t timestamp {};
 
     AboutTelegram(string dv, int rs) : device(dv), rssi_dbm(rs) {}
     AboutTelegram() {}
 };
 
+typedef vector<function<bool(AboutTelegram&,vector<uchar>&)>> TelegramListeners;
+
+// The number of telegrams a device has received, and how many of these had the best rssi.
+struct ReceiverStatistics
+{
+    size_t received {};
+    size_t best {};
+};
+
+// Several dongles listening to the same meters receive the same telegram at almost
+// the same time. The combiner holds on to a telegram for window milliseconds
+// and collects the copies received by other devices. Then only the copy with
+// the best rssi is handed to the listeners, annotated with all devices that
+// received it. The telegrams are handed over in a separate combiner thread.
+struct TelegramCombiner
+{
+    TelegramCombiner(int window_ms);
+    ~TelegramCombiner();
+
+    void add(AboutTelegram &about, vector<uchar> &frame, TelegramListeners &listeners);
+    // Hand over the telegrams still waiting, then stop the combiner thread.
+    void stop();
+    std::map<string,ReceiverStatistics> receiverStatistics();
+
+private:
+
+    struct Pending
+    {
+        vector<uchar> frame;
+        AboutTelegram about;
+        TelegramListeners listeners;
+        std::chrono::steady_clock::time_point deadline;
+        uint64_t hash {};
+    };
+
+    void loop();
+    void dispatch(Pending &p);
+
+    std::chrono::milliseconds window_;
+    // In arrival order, thus also in deadline order.
+    std::deque<Pending> pending_;
+    // The pending telegrams by the hash of their frames, the frames are only
+    // compared when the hashes match. A deque does not move its elements.
+    std::unordered_multimap<uint64_t,Pending*> pending_by_hash_;
+    uchar key_[16];
+    std::map<string,ReceiverStatistics> receivers_;
+    bool stopped_ {};
+    pthread_mutex_t mutex_;
+    pthread_cond_t changed_;
+    function<void()> loop_;
+    pthread_t thread_ {};
+};
+
+// A window of 0 milliseconds turns off the combining.
+void setCombineTelegrams(int window_ms);
+TelegramCombiner *telegramCombiner();
+// Invoked for the telegram copy chosen by the combiner, or directly for every
+// telegram when not combining. Skips duplicates, then invokes the listeners.
+bool dispatchTelegram(AboutTelegram &about, vector<uchar> &frame, TelegramListeners &listeners);
+
+// Explanations of the well known kinds of bytes are not rendered into text
+// while parsing. The values needed are stored and the text is generated
+// by explainParse, when (if ever) the explanation is printed.
+enum class ExplanationKind
+{
+    Text,   // Already rendered text.
+    Hex,    // The explained bytes printed as hex.
+    Dif,    // The dif byte.
+    Dife,   // The dife byte, a=subunit b=tariff c=storagenr
+    Vif,    // The vif byte.
+    Vife,   // The vife byte, a=dif b=vif
+    Skip,   // A 2f skip byte.
+    VarLen, // The length byte of variable length data, a=datalen
+};
+
+struct Explanation
+{
+    Explanation(int p, string t) : pos(p), kind(ExplanationKind::Text), text(t) {}
+    Explanation(int p, int l, ExplanationKind k, int va, int vb, int vc) :
+        pos(p), len(l), kind(k), a(va), b(vb), c(vc) {}
+
+    int pos {}; // Offset into the parsed bytes.
+    int len {};
+    ExplanationKind kind {};
+    int a {}, b {}, c {};
+    string text;
+    string more; // Added by addMoreExplanation.
+    int num_more {};
+};
+
 struct Telegram
 {
     AboutTelegram about;
@@ -346,6 +547,8 @@ struct Telegram
     string id;
     // If decryption failed, set this to true, to prevent further processing.
     bool decryption_failed {};
+    // The mac did not match, then decryption is not attempted.
+    bool mac_failed {};
 
     // DLL
     int dll_len {}; // The length of the telegram, 1 byte.
@@ -446,16 +649,24 @@ struct Telegram
 
     // A vector of indentations and explanations, to be printed
     // below the raw data bytes to explain the telegram content.
-    vector<pair<int,string>> explanations;
+    // They are only collected when debug is enabled, since they
+    // are only printed as debug output.
+    vector<Explanation> explanations;
+    bool explaining() { return isDebugEnabled(); }
     void addExplanationAndIncrementPos(vector<uchar>::iterator &pos, int len, const char* fmt, ...);
+    void addExplanationAndIncrementPos(vector<uchar>::iterator &pos, int len, ExplanationKind k,
+                                       int a = 0, int b = 0, int c = 0);
     void addMoreExplanation(int pos, const char* fmt, ...);
+    string renderExplanation(Explanation &e);
     void explainParse(string intro, int from);
 
     bool isSimulated() { return is_simulated_; }
     void markAsSimulated() { is_simulated_ = true; }
 
     // Extracted mbus values.
-    std::map<std::string,std::pair<int,DVEntry>> values;
+    DVEntries values;
+    // The layouts already seen by the meter driver, NULL parses every telegram fully.
+    DecodePlans *decode_plans {};
 
     string autoDetectPossibleDrivers();
 
@@ -526,7 +737,7 @@ struct WMBus
     virtual int numConcurrentLinkModes() = 0;
     virtual bool canSetLinkModes(LinkModeSet lms) = 0;
     virtual void setLinkModes(LinkModeSet lms) = 0;
-    virtual void onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb) = 0;
+    virtual void onTelegram(function<bool(AboutTelegram&,vector<uchar>&)> cb) = 0;
     virtual SerialDevice *serial() = 0;
     // Return true of the serial has been overridden, usually with stdin or a file.
     virtual bool serialOverride() = 0;
@@ -593,9 +804,9 @@ string cType(int c_field);
 string ccType(int cc_field);
 string difType(int dif);
 double vifScale(int vif);
-string vifKey(int vif); // E.g. temperature energy power mass_flow volume_flow
-string vifUnit(int vif); // E.g. m3 c kwh kw MJ MJh
-string vifType(int vif); // Long description
+const char *vifKey(int vif); // E.g. temperature energy power mass_flow volume_flow
+const char *vifUnit(int vif); // E.g. m3 c kwh kw MJ MJh
+const char *vifType(int vif); // Long description
 string vifeType(int dif, int vif, int vife); // Long description
 string formatData(int dif, int vif, int vife, string data);
 
@@ -607,6 +818,27 @@ double extract8bitAsDouble(int dif, int vif, int vife, string data);
 double extract16bitAsDouble(int dif, int vif, int vife, string data);
 double extract32bitAsDouble(int dif, int vif, int vife, string data);
 
+// What the standard says about a dif and a vif. The tables are constant
+// initialized, thus looking up a record does not allocate anything.
+struct DifInfo
+{
+    int dif; // dif & 0x0f
+    int len; // Number of data bytes, -1 for variable length, -2 for special functions.
+    const char *name;
+};
+
+struct VifInfo
+{
+    int vif; // vif & 0x7f
+    const char *type; // Long description
+    const char *key;
+    const char *unit;
+    double scale;
+};
+
+const DifInfo &difInfo(int dif);
+const VifInfo &vifInfo(int vif);
+
 int difLenBytes(int dif);
 MeasurementType difMeasurementType(int dif);
 
@@ -627,7 +859,7 @@ AccessCheck checkAccessAndDetect(shared_ptr<SerialCommunicationManager> manager,
 enum FrameStatus { PartialFrame, FullFrame, ErrorInFrame, TextAndNotFrame };
 
 
-FrameStatus checkWMBusFrame(vector<uchar> &data,
+FrameStatus checkWMBusFrame(ReceiveBuffer &data,
                             size_t *frame_length,
                             int *payload_len_out,
                             int *payload_offset);
@@ -120,7 +120,7 @@ struct WMBusAmber : public virtual WMBusCommonImplementation
     }
 
 private:
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> request_;
     vector<uchar> response_;
 
@@ -130,7 +130,7 @@ private:
 
     ConfigAMB8465 device_config_;
 
-    FrameStatus checkAMB8465Frame(vector<uchar> &data,
+    FrameStatus checkAMB8465Frame(ReceiveBuffer &data,
                                   size_t *frame_length,
                                   int *msgid_out,
                                   int *payload_len_out,
@@ -167,9 +167,8 @@ void WMBusAmber::deviceReset()
     timerclear(&timestamp_last_rx_);
 }
 
-uchar xorChecksum(vector<uchar> &msg, size_t len)
+uchar xorChecksum(const uchar *msg, size_t len)
 {
-    assert(msg.size() >= len);
     uchar c = 0;
     for (size_t i=0; i<len; ++i) {
         c ^= msg[i];
@@ -177,6 +176,12 @@ uchar xorChecksum(vector<uchar> &msg, size_t len)
     return c;
 }
 
+uchar xorChecksum(vector<uchar> &msg, size_t len)
+{
+    assert(msg.size() >= len);
+    return xorChecksum(msg.data(), len);
+}
+
 bool WMBusAmber::ping()
 {
     if (serial()->readonly()) return true; // Feeding from stdin or file.
@@ -320,7 +325,7 @@ void WMBusAmber::deviceSetLinkModes(LinkModeSet lms)
     link_modes_ = lms;
 }
 
-FrameStatus WMBusAmber::checkAMB8465Frame(vector<uchar> &data,
+FrameStatus WMBusAmber::checkAMB8465Frame(ReceiveBuffer &data,
                                           size_t *frame_length,
                                           int *msgid_out,
                                           int *payload_len_out,
@@ -328,7 +333,7 @@ FrameStatus WMBusAmber::checkAMB8465Frame(vector<uchar> &data,
                                           int *rssi_dbm)
 {
     if (data.size() < 2) return PartialFrame;
-    debugPayload("(amb8465) checkAMB8465Frame", data);
+    debugPayload("(amb8465) checkAMB8465Frame", data.data(), data.size());
     int payload_len = 0;
     if (data[0] == 0xff)
     {
@@ -356,7 +361,7 @@ FrameStatus WMBusAmber::checkAMB8465Frame(vector<uchar> &data,
 
         debug("(amb8465) received full command frame\n");
 
-        uchar cs = xorChecksum(data, *frame_length-1);
+        uchar cs = xorChecksum(data.data(), *frame_length-1);
         if (data[*frame_length-1] != cs) {
             verbose("(amb8465) checksum error %02x (should %02x)\n", data[*frame_length-1], cs);
         }
@@ -384,9 +389,7 @@ FrameStatus WMBusAmber::checkAMB8465Frame(vector<uchar> &data,
             // No sensible telegram in the buffer. Flush it!
             // But not the last char, because the next char could be a 0x44
             verbose("(amb8465) no sensible telegram found, clearing buffer.\n");
-            uchar last = data[data.size()-1];
-            data.clear();
-            data.insert(data.end(), &last, &last+1); // Re-insert the last byte.
+            data.consume(data.size()-1);
             return PartialFrame;
         }
     }
@@ -418,11 +421,6 @@ FrameStatus WMBusAmber::checkAMB8465Frame(vector<uchar> &data,
 
 void WMBusAmber::processSerialData()
 {
-    vector<uchar> data;
-
-    // Receive and accumulated serial data until a full frame has been received.
-    serial()->receive(&data);
-
     struct timeval timestamp;
 
     // Check long delay beetween rx chunks
@@ -444,7 +442,8 @@ void WMBusAmber::processSerialData()
         }
     }
 
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    // Receive and accumulated serial data until a full frame has been received.
+    bytesReceived(serial()->receive(&read_buffer_));
 
     size_t frame_length;
     int msgid;
@@ -471,7 +470,7 @@ void WMBusAmber::processSerialData()
         if (status == ErrorInFrame)
         {
             verbose("(amb8465) protocol error in message received!\n");
-            string msg = bin2hex(read_buffer_);
+            string msg = bin2hex(read_buffer_.data(), read_buffer_.size());
             debug("(amb8465) protocol error \"%s\"\n", msg.c_str());
             read_buffer_.clear();
             protocolErrorDetected();
@@ -487,7 +486,7 @@ void WMBusAmber::processSerialData()
                 payload.insert(payload.end(), read_buffer_.begin()+payload_offset, read_buffer_.begin()+payload_offset+payload_len);
             }
 
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
 
             handleMessage(msgid, payload, rssi_dbm);
         }
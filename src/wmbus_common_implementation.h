@@ -18,10 +18,13 @@
 #ifndef WMBUS_COMMON_H
 #define WMBUS_COMMON_H
 
+#include "statistics.h"
 #include "util.h"
 #include "threads.h"
 #include "wmbus.h"
 
+#include <atomic>
+
 struct WMBusCommonImplementation : public virtual WMBus
 {
     WMBusCommonImplementation(WMBusDeviceType t,
@@ -33,8 +36,8 @@ struct WMBusCommonImplementation : public virtual WMBus
     string hr();
     bool isSerial();
     WMBusDeviceType type();
-    void onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb);
-    bool handleTelegram(AboutTelegram &about, vector<uchar> frame);
+    void onTelegram(function<bool(AboutTelegram&,vector<uchar>&)> cb);
+    bool handleTelegram(AboutTelegram &about, vector<uchar> &frame);
     void checkStatus();
     bool isWorking();
     string dongleId();
@@ -57,12 +60,16 @@ struct WMBusCommonImplementation : public virtual WMBus
     void setDetected(Detected detected) { detected_ = detected; }
     Detected *getDetected() { return &detected_; }
     void markAsNoLongerSerial();
+    // The statistics of this receiver.
+    ReceiverCounters *counters();
 
     protected:
 
     shared_ptr<SerialCommunicationManager> manager_;
     void protocolErrorDetected();
     void resetProtocolErrorCount();
+    void crcErrorDetected();
+    void bytesReceived(int n);
     bool areLinkModesConfigured();
     // Device specific set link modes implementation.
     virtual void deviceSetLinkModes(LinkModeSet lms) = 0;
@@ -76,7 +83,7 @@ struct WMBusCommonImplementation : public virtual WMBus
     // Uses a serial tty?
     bool is_serial_ {};
     bool is_working_ {};
-    vector<function<bool(AboutTelegram&,vector<uchar>)>> telegram_listeners_;
+    vector<function<bool(AboutTelegram&,vector<uchar>&)>> telegram_listeners_;
     WMBusDeviceType type_ {};
     int protocol_error_count_ {};
     time_t timeout_ {}; // If longer silence than timeout, then reset dongle! It might have hanged!
@@ -87,6 +94,7 @@ struct WMBusCommonImplementation : public virtual WMBus
     bool link_modes_configured_ {};
     LinkModeSet link_modes_ {};
     Detected detected_ {}; // Used to remember how this device was setup.
+    std::atomic<ReceiverCounters*> counters_ {}; // Looked up on first use.
 
     shared_ptr<SerialDevice> serial_;
 
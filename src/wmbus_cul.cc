@@ -69,12 +69,12 @@ struct WMBusCUL : public virtual WMBusCommonImplementation
 private:
 
     LinkModeSet link_modes_ {};
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> received_payload_;
     string sent_command_;
     string received_response_;
 
-    FrameStatus checkCULFrame(vector<uchar> &data,
+    FrameStatus checkCULFrame(ReceiveBuffer &data,
                               size_t *hex_frame_length,
                               vector<uchar> &payload);
 
@@ -196,9 +196,9 @@ void WMBusCUL::simulate()
 {
 }
 
-string expectedResponses(vector<uchar> &data)
+string expectedResponses(ReceiveBuffer &data)
 {
-    string safe = safeString(data);
+    string safe = safeString(data.data(), data.size());
     if (safe.find("CMODE") != string::npos) return "CMODE";
     if (safe.find("TMODE") != string::npos) return "TMODE";
     if (safe.find("SMODE") != string::npos) return "SMODE";
@@ -207,11 +207,8 @@ string expectedResponses(vector<uchar> &data)
 
 void WMBusCUL::processSerialData()
 {
-    vector<uchar> data;
-
     // Receive and accumulated serial data until a full frame has been received.
-    serial()->receive(&data);
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    bytesReceived(serial()->receive(&read_buffer_));
 
     size_t frame_length;
     vector<uchar> payload;
@@ -242,13 +239,13 @@ void WMBusCUL::processSerialData()
         if (status == ErrorInFrame)
         {
             debug("(cul) error in received message.\n");
-            string msg = bin2hex(read_buffer_);
+            string msg = bin2hex(read_buffer_.data(), read_buffer_.size());
             read_buffer_.clear();
             break;
         }
         if (status == FullFrame)
         {
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
 
             // We do not currently know how to get the rssi out of the cul dongle.
             AboutTelegram about("cul", 0);
@@ -257,7 +254,7 @@ void WMBusCUL::processSerialData()
     }
 }
 
-FrameStatus WMBusCUL::checkCULFrame(vector<uchar> &data,
+FrameStatus WMBusCUL::checkCULFrame(ReceiveBuffer &data,
                                     size_t *hex_frame_length,
                                     vector<uchar> &payload)
 {
@@ -265,7 +262,7 @@ FrameStatus WMBusCUL::checkCULFrame(vector<uchar> &data,
 
     if (isDebugEnabled())
     {
-        string s  = safeString(data);
+        string s  = safeString(data.data(), data.size());
         debug("(cul) checkCULFrame \"%s\"\n", s.c_str());
     }
 
@@ -313,6 +310,7 @@ FrameStatus WMBusCUL::checkCULFrame(vector<uchar> &data,
         if (!ok)
         {
             warning("(cul) dll C1 (frame b) crcs failed check! Ignoring telegram!\n");
+            crcErrorDetected();
             return ErrorInFrame;
         }
         debug("(cul) received full C1 frame\n");
@@ -341,6 +339,7 @@ FrameStatus WMBusCUL::checkCULFrame(vector<uchar> &data,
         if (!ok)
         {
             warning("(cul) dll T1 (frame a) crcs failed check! Ignoring telegram!\n");
+            crcErrorDetected();
             return ErrorInFrame;
         }
         debug("(cul) received full T1 frame\n");
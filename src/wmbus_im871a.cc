@@ -189,7 +189,7 @@ struct WMBusIM871A : public virtual WMBusCommonImplementation
     ~WMBusIM871A() {
     }
 
-    static FrameStatus checkIM871AFrame(vector<uchar> &data,
+    static FrameStatus checkIM871AFrame(ReceiveBuffer &data,
                                         size_t *frame_length, int *endpoint_out, int *msgid_out,
                                         int *payload_len_out, int *payload_offset,
                                         int *rssi_dbm);
@@ -199,7 +199,7 @@ private:
     DeviceInfo device_info_ {};
     Config     device_config_ {};
 
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> request_;
     vector<uchar> response_;
 
@@ -529,24 +529,24 @@ void WMBusIM871A::deviceSetLinkModes(LinkModeSet lms)
     }
 }
 
-FrameStatus WMBusIM871A::checkIM871AFrame(vector<uchar> &data,
+FrameStatus WMBusIM871A::checkIM871AFrame(ReceiveBuffer &data,
                                           size_t *frame_length, int *endpoint_out, int *msgid_out,
                                           int *payload_len_out, int *payload_offset,
                                           int *rssi_dbm)
 {
     if (data.size() == 0) return PartialFrame;
 
-    debugPayload("(im871a) checkIM871AFrame", data);
+    debugPayload("(im871a) checkIM871AFrame", data.data(), data.size());
     if (data[0] != 0xa5)
     {
-        debugPayload("(im871a) frame does not start with a5", data);
+        debugPayload("(im871a) frame does not start with a5", data.data(), data.size());
         bool found_a5 = false;
         for (size_t i = 0; i < data.size(); ++i)
         {
             if (data[i] == 0xa5)
             {
                 debug("(im871a) found a5 at pos %d\n", i);
-                data.erase(data.begin(), data.begin()+i);
+                data.consume(i);
                 found_a5 = true;;
                 break;
             }
@@ -657,12 +657,8 @@ FrameStatus WMBusIM871A::checkIM871AFrame(vector<uchar> &data,
 
 void WMBusIM871A::processSerialData()
 {
-    vector<uchar> data;
-
     // Receive and accumulated serial data until a full frame has been received.
-    serial()->receive(&data);
-
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    bytesReceived(serial()->receive(&read_buffer_));
 
     size_t frame_length;
     int endpoint;
@@ -678,13 +674,13 @@ void WMBusIM871A::processSerialData()
         {
             if (read_buffer_.size() > 0)
             {
-                debugPayload("(im871a) partial frame, expecting more.", read_buffer_);
+                debugPayload("(im871a) partial frame, expecting more.", read_buffer_.data(), read_buffer_.size());
             }
             break;
         }
         if (status == ErrorInFrame)
         {
-            debugPayload("(im871a) bad frame, clearing.", read_buffer_);
+            debugPayload("(im871a) bad frame, clearing.", read_buffer_.data(), read_buffer_.size());
             read_buffer_.clear();
             break;
         }
@@ -704,7 +700,7 @@ void WMBusIM871A::processSerialData()
                                read_buffer_.begin()+payload_offset,
                                read_buffer_.begin()+payload_offset+payload_len);
             }
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
 
             // We now have a proper message in payload. Let us trigger actions based on it.
             // It can be wmbus receiver-dongle messages or wmbus remote meter messages received over the radio.
@@ -779,7 +775,7 @@ void WMBusIM871A::handleHWTest(int msgid, vector<uchar> &payload)
     }
 }
 
-bool extract_response(vector<uchar> &data, vector<uchar> &response, int expected_endpoint, int expected_msgid)
+bool extract_response(ReceiveBuffer &data, vector<uchar> &response, int expected_endpoint, int expected_msgid)
 {
     size_t frame_length;
     int endpoint, msgid, payload_len, payload_offset, rssi_dbm;
@@ -794,7 +790,7 @@ bool extract_response(vector<uchar> &data, vector<uchar> &response, int expected
     }
 
     response.clear();
-    response.insert(data.end(), data.begin()+payload_offset, data.begin()+payload_offset+payload_len);
+    response.insert(response.end(), data.begin()+payload_offset, data.begin()+payload_offset+payload_len);
     return true;
 }
 
@@ -868,7 +864,7 @@ AccessCheck detectIM871A(Detected *detected, shared_ptr<SerialCommunicationManag
     AccessCheck rc = serial->open(false);
     if (rc != AccessCheck::AccessOK) return AccessCheck::NotThere;
 
-    vector<uchar> response;
+    ReceiveBuffer response;
     // First clear out any data in the queue.
     serial->receive(&response);
     response.clear();
@@ -48,7 +48,7 @@ struct WMBusRawTTY : public virtual WMBusCommonImplementation
 
 private:
 
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     LinkModeSet link_modes_;
     vector<uchar> received_payload_;
 };
@@ -103,12 +103,8 @@ void WMBusRawTTY::deviceSetLinkModes(LinkModeSet lms)
 
 void WMBusRawTTY::processSerialData()
 {
-    vector<uchar> data;
-
     // Receive and accumulated serial data until a full frame has been received.
-    serial()->receive(&data);
-
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    bytesReceived(serial()->receive(&read_buffer_));
 
     size_t frame_length;
     int payload_len, payload_offset;
@@ -125,7 +121,7 @@ void WMBusRawTTY::processSerialData()
         if (status == ErrorInFrame)
         {
             verbose("(rawtty) protocol error in message received!\n");
-            string msg = bin2hex(read_buffer_);
+            string msg = bin2hex(read_buffer_.data(), read_buffer_.size());
             debug("(rawtty) protocol error \"%s\"\n", msg.c_str());
             read_buffer_.clear();
             break;
@@ -139,7 +135,7 @@ void WMBusRawTTY::processSerialData()
                 payload.insert(payload.end(), &l, &l+1); // Re-insert the len byte.
                 payload.insert(payload.end(), read_buffer_.begin()+payload_offset, read_buffer_.begin()+payload_offset+payload_len);
             }
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
             AboutTelegram about("", 0);
             handleTelegram(about, payload);
         }
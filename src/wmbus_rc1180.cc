@@ -146,7 +146,7 @@ struct WMBusRC1180 : public virtual WMBusCommonImplementation
 private:
     ConfigRC1180 device_config_;
 
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> request_;
     vector<uchar> response_;
 
@@ -154,7 +154,7 @@ private:
     string sent_command_;
     string received_response_;
 
-    FrameStatus checkRC1180Frame(vector<uchar> &data,
+    FrameStatus checkRC1180Frame(ReceiveBuffer &data,
                               size_t *hex_frame_length,
                               vector<uchar> &payload);
 
@@ -290,12 +290,8 @@ void WMBusRC1180::simulate()
 
 void WMBusRC1180::processSerialData()
 {
-    vector<uchar> data;
-
     // Receive and accumulated serial data until a full frame has been received.
-    serial()->receive(&data);
-
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    bytesReceived(serial()->receive(&read_buffer_));
 
     size_t frame_length;
     int payload_len, payload_offset;
@@ -312,7 +308,7 @@ void WMBusRC1180::processSerialData()
         if (status == ErrorInFrame)
         {
             verbose("(rawtty) protocol error in message received!\n");
-            string msg = bin2hex(read_buffer_);
+            string msg = bin2hex(read_buffer_.data(), read_buffer_.size());
             debug("(rawtty) protocol error \"%s\"\n", msg.c_str());
             read_buffer_.clear();
             break;
@@ -326,7 +322,7 @@ void WMBusRC1180::processSerialData()
                 payload.insert(payload.end(), &l, &l+1); // Re-insert the len byte.
                 payload.insert(payload.end(), read_buffer_.begin()+payload_offset, read_buffer_.begin()+payload_offset+payload_len);
             }
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
             // It should be possible to get the rssi from the dongle.
             AboutTelegram about("rc1180["+cached_device_id_+"]", 0);
             handleTelegram(about, payload);
@@ -61,11 +61,11 @@ struct WMBusRTL433 : public virtual WMBusCommonImplementation
 
 private:
     shared_ptr<SerialDevice> serial_;
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> received_payload_;
     bool warning_dll_len_printed_ {};
 
-    FrameStatus checkRTL433Frame(vector<uchar> &data,
+    FrameStatus checkRTL433Frame(ReceiveBuffer &data,
                                    size_t *hex_frame_length,
                                    int *hex_payload_len_out,
                                    int *hex_payload_offset);
@@ -132,11 +132,8 @@ void WMBusRTL433::simulate()
 
 void WMBusRTL433::processSerialData()
 {
-    vector<uchar> data;
-
     // Receive and accumulated serial data until a full frame has been received.
-    serial()->receive(&data);
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    bytesReceived(serial()->receive(&read_buffer_));
 
     size_t frame_length;
     int hex_payload_len, hex_payload_offset;
@@ -152,7 +149,7 @@ void WMBusRTL433::processSerialData()
         if (status == TextAndNotFrame)
         {
             // The buffer has already been printed by serial cmd.
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
             if (read_buffer_.size() == 0)
             {
                 break;
@@ -166,7 +163,7 @@ void WMBusRTL433::processSerialData()
         if (status == ErrorInFrame)
         {
             debug("(rtl433) error in received message.\n");
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
             if (read_buffer_.size() == 0)
             {
                 break;
@@ -201,7 +198,7 @@ void WMBusRTL433::processSerialData()
                 }
             }
 
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
             if (payload.size() > 0)
             {
                 if (payload[0] != payload.size()-1)
@@ -220,7 +217,7 @@ void WMBusRTL433::processSerialData()
     }
 }
 
-FrameStatus WMBusRTL433::checkRTL433Frame(vector<uchar> &data,
+FrameStatus WMBusRTL433::checkRTL433Frame(ReceiveBuffer &data,
                                           size_t *hex_frame_length,
                                           int *hex_payload_len_out,
                                           int *hex_payload_offset)
@@ -231,7 +228,7 @@ FrameStatus WMBusRTL433::checkRTL433Frame(vector<uchar> &data,
 
     if (isDebugEnabled())
     {
-        string msg = safeString(data);
+        string msg = safeString(data.data(), data.size());
         debug("(rtl433) checkRTL433Frame \"%s\"\n", msg.c_str());
     }
 
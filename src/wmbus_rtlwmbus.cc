@@ -63,13 +63,13 @@ struct WMBusRTLWMBUS : public virtual WMBusCommonImplementation
 private:
 
     string serialnr_;
-    vector<uchar> read_buffer_;
+    ReceiveBuffer read_buffer_;
     vector<uchar> received_payload_;
     bool warning_dll_len_printed_ {};
 
     LinkModeSet device_link_modes_;
 
-    FrameStatus checkRTLWMBUSFrame(vector<uchar> &data,
+    FrameStatus checkRTLWMBUSFrame(ReceiveBuffer &data,
                                    size_t *hex_frame_length,
                                    int *hex_payload_len_out,
                                    int *hex_payload_offset,
@@ -143,11 +143,8 @@ void WMBusRTLWMBUS::simulate()
 
 void WMBusRTLWMBUS::processSerialData()
 {
-    vector<uchar> data;
-
     // Receive and accumulated serial data until a full frame has been received.
-    serial()->receive(&data);
-    read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    bytesReceived(serial()->receive(&read_buffer_));
 
     size_t frame_length;
     int hex_payload_len, hex_payload_offset;
@@ -197,7 +194,7 @@ void WMBusRTLWMBUS::processSerialData()
                 }
             }
 
-            read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            read_buffer_.consume(frame_length);
             if (payload.size() > 0)
             {
                 if (payload[0] != payload.size()-1)
@@ -218,7 +215,7 @@ void WMBusRTLWMBUS::processSerialData()
     }
 }
 
-FrameStatus WMBusRTLWMBUS::checkRTLWMBUSFrame(vector<uchar> &data,
+FrameStatus WMBusRTLWMBUS::checkRTLWMBUSFrame(ReceiveBuffer &data,
                                               size_t *hex_frame_length,
                                               int *hex_payload_len_out,
                                               int *hex_payload_offset,
@@ -230,7 +227,7 @@ FrameStatus WMBusRTLWMBUS::checkRTLWMBUSFrame(vector<uchar> &data,
 
     if (isDebugEnabled())
     {
-        string msg = safeString(data);
+        string msg = safeString(data.data(), data.size());
         debug("(rtlwmbus) checkRTLWMBusFrame \"%s\"\n", msg.c_str());
     }
 
@@ -275,6 +272,7 @@ FrameStatus WMBusRTLWMBUS::checkRTLWMBUSFrame(vector<uchar> &data,
             // 3OUTOF6OK makes sense only with mode T1 and no sense with mode C1 (always set to 1).
             if (!strncmp((const char*)&data[1], "1;0", 3)) {
                 verbose("(rtlwmbus) telegram received but incomplete or with errors, since rtl_wmbus reports that CRC checks failed.\n");
+                crcErrorDetected();
             }
             return ErrorInFrame;
         }
@@ -15,6 +15,8 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include"capture.h"
+#include"replay.h"
 #include"serial.h"
 #include"util.h"
 #include"wmbus.h"
@@ -26,6 +28,9 @@
 #include<fcntl.h>
 #include<pthread.h>
 #include<semaphore.h>
+#include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
 #include<sys/types.h>
 #include<unistd.h>
 
@@ -48,14 +53,24 @@ struct WMBusSimulator : public WMBusCommonImplementation
     string device() { return file_; }
 
     WMBusSimulator(string file, shared_ptr<SerialCommunicationManager> manager);
+    ~WMBusSimulator();
 
 private:
+
+    void waitUntil(time_t start_time, chrono::steady_clock::time_point start, time_t rel_time);
+    void waitUntilScaled(chrono::steady_clock::time_point start, double rel_seconds, double speed);
+    void simulateCapture(CaptureReader &capture);
+
     vector<uchar> received_payload_;
     vector<function<void(Telegram*)>> telegram_listeners_;
 
     string file_;
     LinkModeSet link_modes_;
-    vector<string> lines_;
+    // The simulation file is memory mapped, since a replayed capture can be large.
+    const char *data_ {};
+    size_t size_ {};
+    bool mapped_ {};
+    vector<char> buffer_;
 };
 
 shared_ptr<WMBus> openSimulator(string device, shared_ptr<SerialCommunicationManager> manager, shared_ptr<SerialDevice> serial_override)
@@ -68,7 +83,37 @@ WMBusSimulator::WMBusSimulator(string file, shared_ptr<SerialCommunicationManage
     : WMBusCommonImplementation(DEVICE_SIMULATION, manager, NULL, false), file_(file)
 {
     assert(file != "");
-    loadFile(file, &lines_);
+
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd == -1) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED)
+        {
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            data_ = (const char*)m;
+            size_ = st.st_size;
+            mapped_ = true;
+        }
+    }
+    ::close(fd);
+
+    if (!mapped_)
+    {
+        // Not a regular file or an empty file, read it instead.
+        loadFile(file, &buffer_);
+        if (buffer_.empty()) return;
+        data_ = &buffer_[0];
+        size_ = buffer_.size();
+    }
+}
+
+WMBusSimulator::~WMBusSimulator()
+{
+    if (mapped_) munmap((void*)data_, size_);
 }
 
 bool WMBusSimulator::ping()
@@ -106,66 +151,143 @@ void WMBusSimulator::processSerialData()
     assert(0);
 }
 
-void WMBusSimulator::simulate()
+void WMBusSimulator::waitUntil(time_t start_time, chrono::steady_clock::time_point start, time_t rel_time)
 {
-    time_t start_time = time(NULL);
+    ReplayStatistics *rs = replayStatistics();
 
-    for (auto l : lines_)
+    if (rs == NULL)
     {
-        string hex = "";
-        int found_time = 0;
-        time_t rel_time = 0;
-        if (l.substr(0,9) == "telegram=")
+        time_t curr = time(NULL);
+        if (curr < start_time+rel_time)
         {
-            for (size_t i=9; i<l.length(); ++i)
+            debug("(simulation) waiting %d seconds before simulating telegram.\n", (start_time+rel_time)-curr);
+            for (;;)
             {
-                if (l[i] == '|') continue;
-                if (l[i] == '+')
+                curr = time(NULL);
+                if (curr > start_time + rel_time) break;
+                usleep(1000*1000);
+                if (!manager_->isRunning())
                 {
-                    found_time = i;
-                    rel_time = atoi(&l[i+1]);
+                    debug("(simulation) exiting early\n");
                     break;
                 }
-                hex += l[i];
             }
-            if (found_time)
+        }
+        return;
+    }
+
+    // Replay ignores the offsets, or scales them with the replay speed.
+    if (rs->speed() > 0) waitUntilScaled(start, rel_time, rs->speed());
+}
+
+void WMBusSimulator::waitUntilScaled(chrono::steady_clock::time_point start, double rel_seconds, double speed)
+{
+    auto at = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(rel_seconds/speed));
+    for (;;)
+    {
+        auto now = chrono::steady_clock::now();
+        if (now >= at || !manager_->isRunning()) break;
+        int64_t us = chrono::duration_cast<chrono::microseconds>(at-now).count();
+        usleep(min(us, (int64_t)100*1000));
+    }
+}
+
+void WMBusSimulator::simulateCapture(CaptureReader &capture)
+{
+    auto start = chrono::steady_clock::now();
+    ReplayStatistics *rs = replayStatistics();
+    double speed = rs ? rs->speed() : 1;
+    uint64_t first_us = 0;
+    vector<uchar> payload;
+
+    bool ok = capture.forEach([&](CaptureRecord &rec)
+        {
+            if (first_us == 0) first_us = rec.timestamp_us;
+            if (speed > 0 && rec.timestamp_us > first_us)
+            {
+                waitUntilScaled(start, (rec.timestamp_us-first_us)/1000000.0, speed);
+            }
+            payload.assign(rec.frame, rec.frame+rec.len);
+            if (isDebugEnabled()) debugPayload("(simulation) from capture", payload);
+            AboutTelegram about(rec.receiver, rec.rssi_dbm);
+            handleTelegram(about, payload);
+            if (rs) rs->telegramReplayed();
+            return true;
+        });
+    if (!ok)
+    {
+        warning("(simulation) the capture %s is truncated or broken.\n", file_.c_str());
+    }
+}
+
+void WMBusSimulator::simulate()
+{
+    time_t start_time = time(NULL);
+    auto start = chrono::steady_clock::now();
+
+    ReplayStatistics *rs = replayStatistics();
+    if (rs) rs->begin();
+
+    CaptureReader capture(data_, size_);
+    if (capture.isCapture())
+    {
+        simulateCapture(capture);
+        manager_->stop();
+        return;
+    }
+
+    string hex;
+    vector<uchar> payload;
+    const char *end = data_+size_;
+    const char *next = data_;
+
+    while (next < end)
+    {
+        const char *l = next;
+        const char *eol = (const char*)memchr(l, '\n', end-l);
+        if (eol == NULL) eol = end;
+        next = eol+1;
+
+        size_t len = eol-l;
+        if (len < 9 || strncmp(l, "telegram=", 9)) continue;
+
+        hex.clear();
+        bool found_time = false;
+        time_t rel_time = 0;
+        for (size_t i=9; i<len; ++i)
+        {
+            if (l[i] == '|') continue;
+            if (l[i] == '+')
             {
-                debug("(simulation) from file \"%s\" to trigger at relative time %ld\n", hex.c_str(), rel_time);
-                time_t curr = time(NULL);
-                if (curr < start_time+rel_time)
+                found_time = true;
+                // The line is not nul terminated in the mapped file.
+                for (size_t j=i+1; j<len && l[j] >= '0' && l[j] <= '9'; ++j)
                 {
-                    debug("(simulation) waiting %d seconds before simulating telegram.\n", (start_time+rel_time)-curr);
-                    for (;;)
-                    {
-                        curr = time(NULL);
-                        if (curr > start_time + rel_time) break;
-                        usleep(1000*1000);
-                        if (!manager_->isRunning())
-                        {
-                            debug("(simulation) exiting early\n");
-                            break;
-                        }
-                    }
+                    rel_time = rel_time*10 + (l[j]-'0');
                 }
+                break;
             }
-            else
-            {
-                debug("(simulation) from file \"%s\"\n", hex.c_str());
-            }
+            hex += l[i];
+        }
+        if (found_time)
+        {
+            debug("(simulation) from file \"%s\" to trigger at relative time %ld\n", hex.c_str(), rel_time);
+            waitUntil(start_time, start, rel_time);
         }
         else
         {
-            continue;
+            debug("(simulation) from file \"%s\"\n", hex.c_str());
         }
 
-        vector<uchar> payload;
+        payload.clear();
         bool ok = hex2bin(hex.c_str(), &payload);
         if (!ok)
         {
-            error("Not a valid string of hex bytes! \"%s\"\n", l.c_str());
+            error("Not a valid string of hex bytes! \"%s\"\n", string(l, len).c_str());
         }
         AboutTelegram about("", 0);
         handleTelegram(about, payload);
+        if (rs) rs->telegramReplayed();
     }
     manager_->stop();
 }
@@ -23,9 +23,9 @@
 #include<assert.h>
 #include<memory.h>
 
-bool decrypt_ELL_AES_CTR(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey)
+bool decrypt_ELL_AES_CTR(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, AES_ctx *aes)
 {
-    if (aeskey.size() == 0) return true;
+    if (aes == NULL) return true;
 
     vector<uchar> encrypted_bytes;
     vector<uchar> decrypted_bytes;
@@ -65,7 +65,8 @@ bool decrypt_ELL_AES_CTR(Telegram *t, vector<uchar> &frame, vector<uchar>::itera
 
         // Generate the pseudo-random bits from the IV and the key.
         uchar xordata[16];
-        AES_ECB_encrypt(iv, &aeskey[0], xordata, 16);
+        memcpy(xordata, iv, 16);
+        AES_ECB_encrypt(aes, xordata);
 
         // Xor the data with the pseudo-random bits to decrypt into tmp.
         uchar tmp[block_size];
@@ -92,9 +93,9 @@ string frameTypeKamstrupC1(int ft) {
     return "?";
 }
 
-bool decrypt_TPL_AES_CBC_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey)
+bool decrypt_TPL_AES_CBC_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, AES_ctx *aes)
 {
-    if (aeskey.size() == 0) return true;
+    if (aes == NULL) return true;
 
     vector<uchar> buffer;
     buffer.insert(buffer.end(), pos, frame.end());
@@ -137,7 +138,8 @@ bool decrypt_TPL_AES_CBC_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::it
     uchar buffer_data[buffer.size()];
     memcpy(buffer_data, &buffer[0], buffer.size());
     uchar decrypted_data[buffer.size()];
-    AES_CBC_decrypt_buffer(decrypted_data, buffer_data, len, &aeskey[0], iv);
+    memcpy(decrypted_data, buffer_data, len);
+    AES_CBC_decrypt_buffer(aes, iv, decrypted_data, len);
 
     frame.insert(frame.end(), decrypted_data, decrypted_data+len);
     debugPayload("(TPL) decrypted ", frame, pos);
@@ -150,9 +152,9 @@ bool decrypt_TPL_AES_CBC_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::it
     return true;
 }
 
-bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey)
+bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, AES_ctx *aes)
 {
-    if (aeskey.size() == 0) return true;
+    if (aes == NULL) return true;
 
     vector<uchar> buffer;
     buffer.insert(buffer.end(), pos, frame.end());
@@ -189,9 +191,10 @@ bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>:
     uchar buffer_data[buffer.size()];
     memcpy(buffer_data, &buffer[0], buffer.size());
     uchar decrypted_data[buffer.size()];
-    AES_CBC_decrypt_buffer(decrypted_data, buffer_data, buffer.size(), &aeskey[0], iv);
+    memcpy(decrypted_data, buffer_data, len);
+    AES_CBC_decrypt_buffer(aes, iv, decrypted_data, len);
 
-    frame.insert(frame.end(), decrypted_data, decrypted_data+buffer.size());
+    frame.insert(frame.end(), decrypted_data, decrypted_data+len);
     debugPayload("(TPL) decrypted ", frame, pos);
 
     if (len < buffer.size())
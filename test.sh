@@ -93,6 +93,30 @@ if [ "$?" != "0" ]; then RC="1"; fi
 tests/test_pipe.sh $PROG
 if [ "$?" != "0" ]; then RC="1"; fi
 
+tests/test_decodethreads.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_replay.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_capture.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_bulk.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_timeseries.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_stats.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_config_snapshot.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_reload.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
 if [ "$(uname)" = "Linux" ]
 then
     tests/test_alarm.sh $PROG
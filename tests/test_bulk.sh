@@ -0,0 +1,65 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+
+TEST=testoutput
+
+TESTNAME="Test bulk decoding of capture files"
+TESTRESULT="ERROR"
+
+rm -f $TEST/bulk.wmb
+# Capture the telegrams without decoding them.
+$PROG --capture=$TEST/bulk.wmb simulations/simulation_c1.txt > /dev/null 2> $TEST/test_stderr.txt
+
+# The same capture twice gives every reading twice.
+cat simulations/simulation_c1.txt | grep '^{' | grep -e MyTapWater -e MyHeater -e Vadden -e '"Heat"' > $TEST/test_expected.txt
+cat $TEST/test_expected.txt $TEST/test_expected.txt | sort > $TEST/test_expected_sorted.txt
+
+$PROG --bulk=3 --format=json $TEST/bulk.wmb $TEST/bulk.wmb \
+      MyHeater multical302 67676767 "" \
+      MyTapWater multical21 76348799 "" \
+      Vadden multical21 44556677 "" \
+      Heat multical603 36363636 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    cat $TEST/test_output.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' | sort > $TEST/test_responses.txt
+    diff $TEST/test_expected_sorted.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        TESTRESULT="OK"
+    fi
+else
+    echo "wmbusmeters returned error code: $?"
+    cat $TEST/test_output.txt
+    cat $TEST/test_stderr.txt
+fi
+
+# The meters and keys can come from the config files.
+rm -rf $TEST/bulk_config
+mkdir -p $TEST/bulk_config/etc/wmbusmeters.d
+printf "loglevel=normal\nformat=json\n" > $TEST/bulk_config/etc/wmbusmeters.conf
+printf "name=MyTapWater\ntype=multical21\nid=76348799\nkey=\n" > $TEST/bulk_config/etc/wmbusmeters.d/MyTapWater
+
+$PROG --bulk=2 --useconfig=$TEST/bulk_config $TEST/bulk.wmb > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+if [ "$?" = "0" ] && [ "$TESTRESULT" = "OK" ]
+then
+    TESTRESULT="ERROR"
+    cat $TEST/test_output.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_responses.txt
+    grep MyTapWater $TEST/test_expected.txt > $TEST/test_expected_config.txt
+    diff $TEST/test_expected_config.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        echo OK: $TESTNAME
+        TESTRESULT="OK"
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
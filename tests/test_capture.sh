@@ -0,0 +1,60 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+
+TEST=testoutput
+
+TESTNAME="Test capture and replay of the capture"
+TESTRESULT="ERROR"
+
+rm -f $TEST/capture.wmb
+cat simulations/simulation_c1.txt | grep '^{' | grep -e MyTapWater -e MyHeater > $TEST/test_expected.txt
+$PROG --capture=$TEST/capture.wmb --format=json simulations/simulation_c1.txt \
+      MyHeater multical302 67676767 "" \
+      MyTapWater multical21 76348799 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+# The capture is a device, just like a simulation file.
+$PROG --format=json $TEST/capture.wmb \
+      MyHeater multical302 67676767 "" \
+      MyTapWater multical21 76348799 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    cat $TEST/test_output.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        # The capture can be converted back into a simulation file.
+        $PROG --dumpcapture=$TEST/capture.wmb | sed 's/|+[0-9]*$//' > $TEST/test_responses.txt
+        grep '^telegram' simulations/simulation_c1.txt | tr -d '|' | sed 's/^telegram=//' | tr 'a-f' 'A-F' | sed 's/^/telegram=|/' > $TEST/test_expected.txt
+        diff $TEST/test_expected.txt $TEST/test_responses.txt
+        if [ "$?" = "0" ]
+        then
+            # The index of the capture finds the telegrams from one meter and within a time.
+            grep '^telegram=|.\{8\}99873476' $TEST/test_expected.txt > $TEST/test_expected_id.txt
+            $PROG --dumpcapture=$TEST/capture.wmb --dumpid=76348799 --dumpfrom=2020-01-01 \
+                | sed 's/|+[0-9]*$//' > $TEST/test_responses.txt
+            BEFORE=$($PROG --dumpcapture=$TEST/capture.wmb --dumpto=2020-01-01T00:00:00 | wc -l)
+            diff $TEST/test_expected_id.txt $TEST/test_responses.txt
+            if [ "$?" = "0" ] && [ -s $TEST/test_expected_id.txt ] && [ "$BEFORE" = "0" ]
+            then
+                echo OK: $TESTNAME
+                TESTRESULT="OK"
+            fi
+        fi
+    fi
+else
+    echo "wmbusmeters returned error code: $?"
+    cat $TEST/test_output.txt
+    cat $TEST/test_stderr.txt
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
@@ -0,0 +1,49 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+
+TEST=testoutput
+
+TESTNAME="Test config snapshot"
+TESTRESULT="ERROR"
+
+rm -rf $TEST/config_snapshot
+mkdir -p $TEST/config_snapshot
+cp -r tests/config1/etc $TEST/config_snapshot/
+echo "loglevel=debug" >> $TEST/config_snapshot/etc/wmbusmeters.conf
+echo "configsnapshot=$TEST/config_snapshot/meters.snapshot" >> $TEST/config_snapshot/etc/wmbusmeters.conf
+
+cat simulations/simulation_c1.txt | grep '^{' > $TEST/test_expected.txt
+
+# The first run parses the meter files and writes the snapshot, the second run loads the snapshot.
+SAME=""
+for RUN in write load
+do
+    # The debug output is printed on stdout as well.
+    $PROG --useconfig=$TEST/config_snapshot > $TEST/test_log_$RUN.txt 2>&1
+    if [ "$?" != "0" ]; then echo "wmbusmeters returned error code: $?"; cat $TEST/test_log_$RUN.txt; break; fi
+    grep '^{' $TEST/test_log_$RUN.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt || break
+    SAME="$SAME$RUN "
+done
+
+LOADED=$(grep -c "loaded 8 meters from config snapshot" $TEST/test_log_write.txt $TEST/test_log_load.txt | tr '\n' ' ')
+
+# A changed meter file invalidates the snapshot.
+sed -i.bak 's/name=MyTapWater/name=MyKitchenTap/' $TEST/config_snapshot/etc/wmbusmeters.d/MyTapWater
+rm $TEST/config_snapshot/etc/wmbusmeters.d/MyTapWater.bak
+$PROG --useconfig=$TEST/config_snapshot > $TEST/test_log_changed.txt 2>&1
+CHANGED=$(grep -c '"name":"MyKitchenTap"' $TEST/test_log_changed.txt)
+
+if [ "$SAME" = "write load " ] && \
+   [ "$LOADED" = "$TEST/test_log_write.txt:0 $TEST/test_log_load.txt:1 " ] && \
+   [ "$CHANGED" = "2" ] && \
+   ! grep -q "from config snapshot" $TEST/test_log_changed.txt
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME; exit 1; fi
@@ -0,0 +1,59 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+
+TEST=testoutput
+
+TESTNAME="Test decode threads"
+TESTRESULT="ERROR"
+
+# The meters are decoded in parallel, thus only the order between
+# telegrams from the same meter is kept. Compare sorted outputs.
+cat simulations/simulation_c1.txt | grep '^{' | sort > $TEST/test_expected.txt
+$PROG --decodethreads=3 --format=json simulations/simulation_c1.txt \
+      MyHeater multical302 67676767 "" \
+      MyTapWater multical21 76348799 "" \
+      MyWater flowiq2200 52525252 "" \
+      Vadden multical21 44556677 "" \
+      MyElement qcaloric 78563412 "" \
+      Rum cma12w 66666666 "" \
+      My403Cooling multical403 78780102 "" \
+      Heat multical603 36363636 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    cat $TEST/test_output.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' | sort > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        TESTRESULT="OK"
+    fi
+else
+    echo "wmbusmeters returned error code: $?"
+    cat $TEST/test_output.txt
+    cat $TEST/test_stderr.txt
+fi
+
+# The shells are invoked from the output thread.
+$PROG --decodethreads=2 --shell='echo "$METER_JSON"' simulations/simulation_shell.txt MWW supercom587 12345678 "" > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+if [ "$?" = "0" ] && [ "$TESTRESULT" = "OK" ]
+then
+    TESTRESULT="ERROR"
+    cat $TEST/test_output.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_responses.txt
+    echo '{"media":"warm water","meter":"supercom587","name":"MWW","id":"12345678","total_m3":5.548,"timestamp":"1111-11-11T11:11:11Z"}' > $TEST/test_expected.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        echo OK: $TESTNAME
+        TESTRESULT="OK"
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
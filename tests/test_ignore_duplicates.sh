@@ -59,3 +59,86 @@ then
 fi
 
 if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME;  exit 1; fi
+
+####################################################
+TESTNAME="Test duplicates are accepted again after the time window"
+TESTRESULT="ERROR"
+
+# The second copy arrives within the 1s window and is ignored,
+# the third copy arrives after the window and is printed again.
+cat > $TEST/simulation_window.txt <<EOF
+telegram=|2E44333073020001031A7AC40020052F2F|02FD971D000004FD084C02000004FD3A467500002F2F2F2F2F2F2F2F2F2F|+0
+telegram=|2E44333073020001031A7AC40020052F2F|02FD971D000004FD084C02000004FD3A467500002F2F2F2F2F2F2F2F2F2F|+0
+telegram=|2E44333073020001031A7AC40020052F2F|02FD971D000004FD084C02000004FD3A467500002F2F2F2F2F2F2F2F2F2F|+2
+EOF
+
+cat > $TEST/test_expected.txt <<EOF
+{"media":"smoke detector","meter":"lansensm","name":"Rummet","id":"01000273","status":"OK","timestamp":"1111-11-11T11:11:11Z"}
+{"media":"smoke detector","meter":"lansensm","name":"Rummet","id":"01000273","status":"OK","timestamp":"1111-11-11T11:11:11Z"}
+EOF
+
+$PROG --format=json --ignoreduplicates=1s $TEST/simulation_window.txt \
+          Rummet lansensm 01000273 "" \
+    | grep Rummet > $TEST/test_output.txt
+
+if [ "$?" = "0" ]
+then
+    cat $TEST/test_output.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        echo "OK: $TESTNAME"
+        TESTRESULT="OK"
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME;  exit 1; fi
+
+####################################################
+TESTNAME="Test duplicates are accepted again when evicted from a small cache"
+TESTRESULT="ERROR"
+
+# With room for one telegram, the other telegram evicts the first copy,
+# thus the second copy is printed again although it is within the window.
+cat > $TEST/simulation_cachesize.txt <<EOF
+telegram=|2E44333073020001031A7AC40020052F2F|02FD971D000004FD084C02000004FD3A467500002F2F2F2F2F2F2F2F2F2F|+0
+telegram=|2E44333073020001031A7AC40020052F2F|02FD971D000004FD084D02000004FD3A467500002F2F2F2F2F2F2F2F2F2F|+0
+telegram=|2E44333073020001031A7AC40020052F2F|02FD971D000004FD084C02000004FD3A467500002F2F2F2F2F2F2F2F2F2F|+0
+EOF
+
+$PROG --format=json --ignoreduplicates=60s --duplicatecachesize=1 $TEST/simulation_cachesize.txt \
+          Rummet lansensm 01000273 "" \
+    | grep -c Rummet > $TEST/test_output.txt
+
+if [ "$(cat $TEST/test_output.txt)" = "3" ]
+then
+    echo "OK: $TESTNAME"
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME;  exit 1; fi
+
+####################################################
+TESTNAME="Test copies received within the combine window are combined"
+TESTRESULT="ERROR"
+
+cat > $TEST/test_expected.txt <<EOF
+{"media":"smoke detector","meter":"lansensm","name":"Rummet","id":"01000273","status":"OK","timestamp":"1111-11-11T11:11:11Z","received_by":[{"device":"","rssi_dbm":0},{"device":"","rssi_dbm":0},{"device":"","rssi_dbm":0},{"device":"","rssi_dbm":0},{"device":"","rssi_dbm":0}]}
+EOF
+
+$PROG --format=json --combinetelegrams=200ms simulations/simulation_duplicates.txt \
+          Rummet lansensm 01000273 "" \
+    | grep Rummet > $TEST/test_output.txt
+
+if [ "$?" = "0" ]
+then
+    cat $TEST/test_output.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        echo "OK: $TESTNAME"
+        TESTRESULT="OK"
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME;  exit 1; fi
@@ -91,3 +91,79 @@ then
 fi
 
 if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME; exit 1; fi
+
+TESTNAME="Test that appended meterfiles are flushed at exit"
+TESTRESULT="ERROR"
+
+rm -rf /tmp/testmeters
+mkdir /tmp/testmeters
+cat simulations/simulation_c1.txt | grep '^{' | grep 76348799 > $TEST/test_expected.txt
+$PROG --meterfiles=/tmp/testmeters --meterfilesaction=append --flushfiles=64kb --format=json simulations/simulation_c1.txt MyTapWater multical21 76348799 "" 2> $TEST/test_stderr.txt
+cat /tmp/testmeters/MyTapWater | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_response.txt
+diff $TEST/test_expected.txt $TEST/test_response.txt
+if [ "$?" = "0" ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+    rm -rf /tmp/testmeters
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME; exit 1; fi
+
+TESTNAME="Test that appended meterfiles are flushed by time without an exit"
+TESTRESULT="ERROR"
+
+rm -rf /tmp/testmeters
+mkdir /tmp/testmeters
+rm -f $TEST/meterfiles_fifo
+mkfifo $TEST/meterfiles_fifo
+
+# Still running when killed, thus only the regular flush after 1s can have written the line.
+$PROG --meterfiles=/tmp/testmeters --meterfilesaction=append --flushfiles=1s --format=json stdin:rtlwmbus \
+      Tempoo lansenth 00010203 "" < $TEST/meterfiles_fifo > /dev/null 2> $TEST/test_stderr.txt &
+PID=$!
+exec 3> $TEST/meterfiles_fifo
+echo "T1;1;1;2019-04-03 19:00:42.000;97;148;00010203;0x2e44333003020100071b7a634820252f2f0265840842658308820165950802fb1aae0142fb1aae018201fb1aa9012f" >&3
+
+ROWS=0
+i=0
+while [ $i -lt 100 ]
+do
+    if [ -s /tmp/testmeters/Tempoo ]
+    then
+        ROWS=$(grep -c '"current_temperature_c":21.8' /tmp/testmeters/Tempoo)
+        break
+    fi
+    sleep 0.1
+    i=$((i+1))
+done
+kill -9 $PID
+exec 3>&-
+wait $PID 2> /dev/null
+
+if [ "$ROWS" = "1" ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+    rm -rf /tmp/testmeters
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME; cat $TEST/test_stderr.txt; exit 1; fi
+
+TESTNAME="Test that overwritten meterfiles leave no temporary files"
+TESTRESULT="ERROR"
+
+rm -rf /tmp/testmeters
+mkdir /tmp/testmeters
+$PROG --meterfiles=/tmp/testmeters --format=json simulations/simulation_c1.txt MyTapWater multical21 76348799 "" > /dev/null 2> $TEST/test_stderr.txt
+echo MyTapWater > $TEST/test_expected.txt
+ls /tmp/testmeters > $TEST/test_response.txt
+diff $TEST/test_expected.txt $TEST/test_response.txt
+if [ "$?" = "0" ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+    rm -rf /tmp/testmeters
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME; exit 1; fi
@@ -0,0 +1,93 @@
+#!/bin/bash
+
+PROG="$1"
+
+mkdir -p testoutput
+
+TEST=testoutput
+
+TESTNAME="Test reload of meters on HUP"
+TESTRESULT="ERROR"
+
+LOG=$TEST/test_log_reload.txt
+
+# Wait until the log contains the pattern, give up after 20 seconds.
+wait_for_log()
+{
+    for ((i=0;i<200;i++))
+    do
+        grep -q "$1" $LOG && return 0
+        sleep 0.1
+    done
+    echo "Timeout waiting for: $1"
+    return 1
+}
+
+rm -rf $TEST/reload
+mkdir -p $TEST/reload/etc/wmbusmeters.d
+
+# A pseudo tty, opened as a rawtty, is the device that is removed by the reload.
+script -qfc "tty; sleep 60" /dev/null < /dev/null > $TEST/reload/pty.txt 2>&1 &
+PTYPID=$!
+for ((i=0;i<50;i++)); do [ -s $TEST/reload/pty.txt ] && break; sleep 0.1; done
+PTY=$(head -n 1 $TEST/reload/pty.txt | tr -d '\r')
+
+cat > $TEST/reload/etc/wmbusmeters.conf <<EOF
+loglevel=normal
+device=stdin:rtlwmbus
+device=$PTY:9600
+logtelegrams=false
+format=json
+EOF
+printf "name=Tempoo\ntype=lansenth\nid=00010203\nkey=\n" > $TEST/reload/etc/wmbusmeters.d/Tempoo
+
+# The telegrams are fed through a fifo, which stays open over the reload.
+rm -f $TEST/reload/fifo
+mkfifo $TEST/reload/fifo
+$PROG --useconfig=$TEST/reload < $TEST/reload/fifo > $LOG 2>&1 &
+PID=$!
+exec 3> $TEST/reload/fifo
+
+echo "T1;1;1;2019-04-03 19:00:42.000;97;148;00010203;0x2e44333003020100071b7a634820252f2f0265840842658308820165950802fb1aae0142fb1aae018201fb1aa9012f" >&3
+wait_for_log '"name":"Tempoo"'
+wait_for_log "Started config rawtty"
+
+# Add a meter and remove the pseudo tty.
+printf "name=Countero\ntype=lansenpu\nid=00010206\nkey=\n" > $TEST/reload/etc/wmbusmeters.d/Countero
+grep -v "device=$PTY" $TEST/reload/etc/wmbusmeters.conf > $TEST/reload/wmbusmeters.conf
+mv $TEST/reload/wmbusmeters.conf $TEST/reload/etc/wmbusmeters.conf
+kill -HUP $PID
+wait_for_log "reloaded config"
+wait_for_log "no longer in config"
+
+# A meter file with an unknown type is skipped, the process stays alive.
+printf "name=Typo\ntype=lansenthh\nid=00010207\nkey=\n" > $TEST/reload/etc/wmbusmeters.d/Typo
+kill -HUP $PID
+wait_for_log "reloaded config, 0 meters added 0 removed 2 kept"
+kill -0 $PID 2> /dev/null && ALIVE=1
+rm $TEST/reload/etc/wmbusmeters.d/Typo
+
+echo "T1;1;1;2019-04-03 19:00:43.000;97;148;00010206;0x234433300602010014007a8e0000002f2f0efd3a1147000000008e40fd3a341200000000" >&3
+# This telegram lacks the averages, the kept meter still prints the averages from the first telegram.
+echo "T1;1;1;2019-04-03 19:00:44.000;97;148;00010203;0x2e44333003020100071b7a634820252f2f026584082f2f2f2f2f2f2f2f2f02fb1aae012f2f2f2f2f2f2f2f2f2f2f2f" >&3
+exec 3>&-
+wait $PID
+RC=$?
+kill $PTYPID
+
+TEMPOO=$(grep -c '"name":"Tempoo".*"average_temperature_24h_c":21.97' $LOG)
+COUNTERO=$(grep -c '"name":"Countero"' $LOG)
+RELOADED=$(grep -c "reloaded config, 1 meters added 0 removed 1 kept" $LOG)
+STARTED=$(grep -c "Started config rtlwmbus on stdin" $LOG)
+CLOSED=$(grep -c "closing $PTY:rawtty.* no longer in config" $LOG)
+TYPO=$(grep -c 'Not a valid meter type "lansenthh"' $LOG)
+
+if [ "$RC" = "0" ] && [ "$TEMPOO" = "2" ] && [ "$COUNTERO" = "1" ] && \
+   [ "$RELOADED" = "1" ] && [ "$STARTED" = "1" ] && [ "$CLOSED" = "1" ] && \
+   [ "$TYPO" = "1" ] && [ "$ALIVE" = "1" ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME; cat $LOG; exit 1; fi
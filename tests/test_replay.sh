@@ -0,0 +1,79 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+
+TEST=testoutput
+
+TESTNAME="Test replay ignoring the time offsets"
+TESTRESULT="ERROR"
+
+# The second telegram is recorded at +5 seconds, a replay does not wait for it.
+cat simulations/simulation_alarm.txt | grep '^{' > $TEST/test_expected.txt
+START=$(date +%s)
+$PROG --replay --format=json simulations/simulation_alarm.txt MyTapWater multical21 76348799 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+RC="$?"
+STOP=$(date +%s)
+
+if [ "$RC" = "0" ] && [ $((STOP-START)) -lt 3 ]
+then
+    cat $TEST/test_output.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        grep -q '^(replay) 2 telegrams in .* telegrams/s, .* allocations/telegram, heap grew .* bytes/telegram$' $TEST/test_stderr.txt && \
+        grep -q '^(replay) multical21 *2 telegrams, decode latency p50 .* us p99 .* us$' $TEST/test_stderr.txt
+        if [ "$?" = "0" ]
+        then
+            echo OK: $TESTNAME
+            TESTRESULT="OK"
+        else
+            cat $TEST/test_stderr.txt
+        fi
+    fi
+else
+    echo "wmbusmeters returned error code $RC or took $((STOP-START)) seconds"
+    cat $TEST/test_stderr.txt
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
+
+TESTNAME="Test replay with scaled time offsets"
+TESTRESULT="ERROR"
+
+$PROG --replay=5x --format=json simulations/simulation_alarm.txt MyTapWater multical21 76348799 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+RC="$?"
+
+if [ "$RC" = "0" ]
+then
+    cat $TEST/test_output.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        # The +5 offset becomes one second.
+        grep -q '^(replay) 2 telegrams in 1\.' $TEST/test_stderr.txt
+        if [ "$?" = "0" ]
+        then
+            echo OK: $TESTNAME
+            TESTRESULT="OK"
+        else
+            cat $TEST/test_stderr.txt
+        fi
+    fi
+else
+    echo "wmbusmeters returned error code: $RC"
+    cat $TEST/test_stderr.txt
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
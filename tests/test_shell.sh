@@ -26,3 +26,25 @@ then
     echo ERROR: $TESTNAME
     exit 1
 fi
+
+TESTNAME="Test shell pipe receives all telegrams in one process"
+TESTRESULT="ERROR"
+
+$PROG --shellpipe='wc -l' simulations/simulation_c1.txt MyTapWater multical21 76348799 "" > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+if [ "$?" = "0" ]
+then
+    cat $TEST/test_output.txt | tr -d ' ' > $TEST/test_responses.txt
+    echo 2 > $TEST/test_expected.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        echo OK: $TESTNAME
+        TESTRESULT="OK"
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
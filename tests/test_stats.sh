@@ -0,0 +1,51 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+
+TEST=testoutput
+
+TESTNAME="Test statistics json and prometheus files"
+TESTRESULT="ERROR"
+
+rm -rf $TEST/stats
+mkdir -p $TEST/stats
+
+$PROG --stats=$TEST/stats simulations/simulation_c1.txt \
+      MyHeater multical302 67676767 "" \
+      MyTapWater multical21 76348799 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    cat > $TEST/test_expected.txt <<EOF
+wmbusmeters_receiver_frames_total{receiver="simulations/simulation_c1.txt:simulation"} 12
+wmbusmeters_driver_telegrams_total{driver="multical21"} 2
+wmbusmeters_driver_telegrams_total{driver="multical302"} 2
+wmbusmeters_driver_parse_seconds_bucket{driver="multical21",le="+Inf"} 2
+wmbusmeters_driver_parse_seconds_count{driver="multical21"} 2
+EOF
+    grep -e '_frames_total{' -e '_telegrams_total{' -e 'parse_seconds_count{driver="multical21"' \
+         -e 'parse_seconds_bucket{driver="multical21",le="+Inf"' $TEST/stats/wmbusmeters.prom > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        grep -q '"multical21":{"telegrams":2,"decrypt_failures":0,"mac_failures":0,"parse":{"count":2,' $TEST/stats/wmbusmeters_stats.json
+        if [ "$?" = "0" ]
+        then
+            echo OK: $TESTNAME
+            TESTRESULT="OK"
+        fi
+    fi
+else
+    echo "wmbusmeters returned error code: $?"
+    cat $TEST/test_output.txt
+    cat $TEST/test_stderr.txt
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
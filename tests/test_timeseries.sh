@@ -0,0 +1,89 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+
+TEST=testoutput
+
+TESTNAME="Test time series of meter readings"
+TESTRESULT="ERROR"
+
+rm -rf $TEST/timeseries
+mkdir -p $TEST/timeseries
+
+cat > $TEST/test_expected.txt <<EOF
+timestamp;meter;total_m3;target_m3;max_flow_m3h;flow_temperature_c;external_temperature_c;current_status;time_dry;time_reversed;time_leaking;time_bursting
+TS;multical21;6.408;6.408;0;127;19;DRY;22-31 days;;;
+TS;multical21;6.408;6.408;0;127;19;DRY;22-31 days;;;
+EOF
+
+$PROG --timeseries=$TEST/timeseries simulations/simulation_c1.txt \
+      MyHeater multical302 67676767 "" \
+      MyTapWater multical21 76348799 "" \
+      > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    $PROG --dumptimeseries=$TEST/timeseries/76348799.wmts | sed 's/^[0-9]*;/TS;/' > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ] && [ -f $TEST/timeseries/67676767.wmts ]
+    then
+        echo OK: $TESTNAME
+        TESTRESULT="OK"
+    fi
+else
+    echo "wmbusmeters returned error code: $?"
+    cat $TEST/test_output.txt
+    cat $TEST/test_stderr.txt
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
+
+TESTNAME="Test time series chunks are written by the flush without an exit"
+TESTRESULT="ERROR"
+
+rm -rf $TEST/timeseries
+mkdir -p $TEST/timeseries
+rm -f $TEST/timeseries_fifo
+mkfifo $TEST/timeseries_fifo
+
+# Still running when killed, thus only the flush after 1s can have written the reading.
+$PROG --timeseries=$TEST/timeseries --flushfiles=1s stdin:rtlwmbus \
+      Tempoo lansenth 00010203 "" < $TEST/timeseries_fifo > $TEST/test_output.txt 2> $TEST/test_stderr.txt &
+PID=$!
+exec 3> $TEST/timeseries_fifo
+echo "T1;1;1;2019-04-03 19:00:42.000;97;148;00010203;0x2e44333003020100071b7a634820252f2f0265840842658308820165950802fb1aae0142fb1aae018201fb1aa9012f" >&3
+
+ROWS=0
+i=0
+while [ $i -lt 100 ]
+do
+    if [ -s $TEST/timeseries/00010203.wmts ]
+    then
+        ROWS=$($PROG --dumptimeseries=$TEST/timeseries/00010203.wmts | grep -c ';lansenth;21.8;')
+        break
+    fi
+    sleep 0.1
+    i=$((i+1))
+done
+kill -9 $PID
+exec 3>&-
+wait $PID 2> /dev/null
+
+if [ "$ROWS" = "1" ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    cat $TEST/test_stderr.txt
+    exit 1
+fi